@@ -15,6 +15,7 @@
 #include "block.h"
 #include "qemu-queue.h"
 #include "qemu_socket.h"
+#include "qemu-poll.h"
 
 typedef struct AioHandler AioHandler;
 
@@ -23,10 +24,25 @@ static QLIST_HEAD(, AioHandler) aio_handlers;
 
 /* This is a simple lock used to protect the aio_handlers list.  Specifically,
  * it's used to ensure that no callbacks are removed while we're walking and
- * dispatching callbacks.
+ * dispatching callbacks.  It counts nesting, as callbacks may wait too.
  */
 static int walking_handlers;
 
+/* The fds of aio_handlers, kept registered between waits */
+static QEMUPoll *aio_poll_set;
+
+static QEMUPoll *aio_get_poll_set(void)
+{
+    if (!aio_poll_set) {
+        aio_poll_set = qemu_poll_new();
+        if (!aio_poll_set) {
+            perror("qemu_poll_new");
+            exit(1);
+        }
+    }
+    return aio_poll_set;
+}
+
 struct AioHandler
 {
     int fd;
@@ -35,10 +51,35 @@ struct AioHandler
     AioFlushHandler *io_flush;
     AioProcessQueue *io_process_queue;
     int deleted;
+    /* the fd fired while io_flush said no request was pending */
+    int disabled;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+/*
+ * Only handlers with requests pending are waited for.  Rather than
+ * registering and unregistering fds as requests come and go, a handler's
+ * fd stays in aio_poll_set and is filtered when it fires; it is taken out
+ * (disabled) only if it fires while the handler is idle, as it would be
+ * reported again on every wait, and put back once a request is pending.
+ */
+static void aio_update_poll_set(AioHandler *node)
+{
+    int events = 0;
+
+    if (!node->deleted && !node->disabled) {
+        events = (node->io_read ? QEMU_POLL_IN : 0) |
+                 (node->io_write ? QEMU_POLL_OUT : 0);
+    }
+    qemu_poll_set(aio_get_poll_set(), node->fd, events, node);
+}
+
+static bool aio_node_busy(AioHandler *node)
+{
+    return !node->io_flush || node->io_flush(node->opaque) != 0;
+}
+
 static AioHandler *find_aio_handler(int fd)
 {
     AioHandler *node;
@@ -66,6 +107,7 @@ int qemu_aio_set_fd_handler(int fd,
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
         if (node) {
+            qemu_poll_set(aio_get_poll_set(), fd, 0, NULL);
             /* If the lock is held, just mark the node as deleted */
             if (walking_handlers)
                 node->deleted = 1;
@@ -91,6 +133,8 @@ int qemu_aio_set_fd_handler(int fd,
         node->io_flush = io_flush;
         node->io_process_queue = io_process_queue;
         node->opaque = opaque;
+        node->disabled = 0;
+        aio_update_poll_set(node);
     }
 
     qemu_set_fd_handler2(fd, NULL, io_read, io_write, opaque);
@@ -123,7 +167,7 @@ int qemu_aio_process_queue(void)
     AioHandler *node;
     int ret = 0;
 
-    walking_handlers = 1;
+    walking_handlers++;
 
     QLIST_FOREACH(node, &aio_handlers, node) {
         if (node->io_process_queue) {
@@ -133,7 +177,7 @@ int qemu_aio_process_queue(void)
         }
     }
 
-    walking_handlers = 0;
+    walking_handlers--;
 
     return ret;
 }
@@ -153,76 +197,81 @@ void qemu_aio_wait(void)
         return;
 
     do {
-        AioHandler *node;
-        fd_set rdfds, wrfds;
-        int max_fd = -1;
-
-        walking_handlers = 1;
+        AioHandler *node, *tmp;
+        QEMUPollEvent events[QEMU_POLL_MAX_EVENTS];
+        bool busy = false;
+        int i, n;
 
-        FD_ZERO(&rdfds);
-        FD_ZERO(&wrfds);
+        walking_handlers++;
 
-        /* fill fd sets */
         QLIST_FOREACH(node, &aio_handlers, node) {
             /* If there aren't pending AIO operations, don't invoke callbacks.
              * Otherwise, if there are no AIO requests, qemu_aio_wait() would
              * wait indefinitely.
              */
-            if (node->io_flush && node->io_flush(node->opaque) == 0)
+            if (node->deleted || !aio_node_busy(node)) {
                 continue;
-
-            if (!node->deleted && node->io_read) {
-                FD_SET(node->fd, &rdfds);
-                max_fd = MAX(max_fd, node->fd + 1);
             }
-            if (!node->deleted && node->io_write) {
-                FD_SET(node->fd, &wrfds);
-                max_fd = MAX(max_fd, node->fd + 1);
+            busy = true;
+            if (node->disabled) {
+                node->disabled = 0;
+                aio_update_poll_set(node);
             }
         }
 
-        walking_handlers = 0;
+        walking_handlers--;
 
         /* No AIO operations?  Get us out of here */
-        if (max_fd == -1)
+        if (!busy)
             break;
 
         /* wait until next event */
-        ret = select(max_fd, &rdfds, &wrfds, NULL, NULL);
+        ret = qemu_poll_wait(aio_get_poll_set(), 0, NULL, NULL, NULL, -1);
         if (ret == -1 && errno == EINTR)
             continue;
 
         /* if we have any readable fds, dispatch event */
         if (ret > 0) {
-            walking_handlers = 1;
+            walking_handlers++;
 
-            /* we have to walk very carefully in case
-             * qemu_aio_set_fd_handler is called while we're walking */
-            node = QLIST_FIRST(&aio_handlers);
-            while (node) {
-                AioHandler *tmp;
+            /* the events are a copy, so it is fine for the callbacks to
+             * call qemu_aio_set_fd_handler or even qemu_aio_wait */
+            n = qemu_poll_get_events(aio_poll_set, events, ARRAY_SIZE(events));
+            for (i = 0; i < n; i++) {
+                node = events[i].opaque;
 
+                if (node->deleted) {
+                    continue;
+                }
+                if (!aio_node_busy(node)) {
+                    node->disabled = 1;
+                    aio_update_poll_set(node);
+                    continue;
+                }
                 if (!node->deleted &&
-                    FD_ISSET(node->fd, &rdfds) &&
+                    (events[i].revents & QEMU_POLL_IN) &&
                     node->io_read) {
                     node->io_read(node->opaque);
                 }
                 if (!node->deleted &&
-                    FD_ISSET(node->fd, &wrfds) &&
+                    (events[i].revents & QEMU_POLL_OUT) &&
                     node->io_write) {
                     node->io_write(node->opaque);
                 }
+            }
 
-                tmp = node;
-                node = QLIST_NEXT(node, node);
-
-                if (tmp->deleted) {
-                    QLIST_REMOVE(tmp, node);
-                    qemu_free(tmp);
+            /* a nested wait leaves deleted nodes to the outermost one,
+             * whose events may still point to them */
+            if (walking_handlers == 1) {
+                QLIST_FOREACH_SAFE(node, &aio_handlers, node, tmp) {
+                    if (node->deleted) {
+                        QLIST_REMOVE(node, node);
+                        qemu_free(node);
+                    }
                 }
             }
 
-            walking_handlers = 0;
+            walking_handlers--;
         }
     } while (ret == 0);
 }
@@ -24,6 +24,7 @@
 
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "qemu-prof.h"
 
 /* Anchor of the list of Bottom Halves belonging to the context */
 static struct QEMUBH *first_bh;
@@ -54,6 +55,7 @@ QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
 int qemu_bh_poll(void)
 {
     QEMUBH *bh, **bhp, *next;
+    int64_t start;
     int ret;
     static int nesting = 0;
 
@@ -67,7 +69,9 @@ int qemu_bh_poll(void)
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
+            start = qemu_prof_now();
             bh->cb(bh->opaque);
+            qemu_prof_handler(QEMU_PROF_BH, bh->cb, start);
         }
     }
 
@@ -1374,6 +1374,32 @@ static void dump_refcounts(BlockDriverState *bs)
 }
 #endif
 
+/* Live savevm writes from coroutines while the guest does I/O, so aligned
+ * requests from there bypass bs->growable instead of toggling it */
+static bool qcow2_vmstate_direct(int64_t pos, int size)
+{
+    return qemu_in_coroutine() && !((pos | size) & (BDRV_SECTOR_SIZE - 1));
+}
+
+static int coroutine_fn qcow2_co_rw_vmstate(BlockDriverState *bs,
+                                            uint8_t *buf, int64_t pos,
+                                            int size, bool is_write)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t sector_num = (qcow2_vm_state_offset(s) + pos) >> BDRV_SECTOR_BITS;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    if (is_write) {
+        ret = qcow2_co_writev(bs, sector_num, size >> BDRV_SECTOR_BITS, &qiov);
+    } else {
+        ret = qcow2_co_readv(bs, sector_num, size >> BDRV_SECTOR_BITS, &qiov);
+    }
+    return ret < 0 ? ret : size;
+}
+
 static int qcow2_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                               int64_t pos, int size)
 {
@@ -1382,6 +1408,9 @@ static int qcow2_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
+    if (qcow2_vmstate_direct(pos, size)) {
+        return qcow2_co_rw_vmstate(bs, (uint8_t *)buf, pos, size, true);
+    }
     bs->growable = 1;
     ret = bdrv_pwrite(bs, qcow2_vm_state_offset(s) + pos, buf, size);
     bs->growable = growable;
@@ -1397,6 +1426,9 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_LOAD);
+    if (qcow2_vmstate_direct(pos, size)) {
+        return qcow2_co_rw_vmstate(bs, buf, pos, size, false);
+    }
     bs->growable = 1;
     ret = bdrv_pread(bs, qcow2_vm_state_offset(s) + pos, buf, size);
     bs->growable = growable;
@@ -123,6 +123,8 @@ struct TextConsole {
     vga_hw_screen_dump_ptr hw_screen_dump;
     vga_hw_text_update_ptr hw_text_update;
     void *hw;
+    vga_hw_idle_ptr hw_idle;
+    void *hw_idle_opaque;
 
     int g_width, g_height;
     int width;
@@ -1294,6 +1296,40 @@ DisplayState *graphic_console_init(vga_hw_update_ptr update,
     return ds;
 }
 
+void graphic_console_set_idle_handler(DisplayState *ds, vga_hw_idle_ptr idle,
+                                      void *opaque)
+{
+    TextConsole *s = get_graphic_console(ds);
+    if (!s) return;
+
+    s->hw_idle = idle;
+    s->hw_idle_opaque = opaque;
+}
+
+/* Listeners report here whether anybody is looking at them.  When the
+   display as a whole goes idle or comes back, the graphic console is told
+   so that it can stop or restart rendering and dirty tracking. */
+void dpy_set_idle(DisplayState *ds, DisplayChangeListener *dcl, int idle)
+{
+    TextConsole *s;
+    int was_idle = dpy_is_idle(ds);
+
+    dcl->idle = idle;
+    idle = dpy_is_idle(ds);
+    if (idle == was_idle) {
+        return;
+    }
+
+    s = get_graphic_console(ds);
+    if (s && s->hw_idle) {
+        s->hw_idle(s->hw_idle_opaque, idle);
+    }
+    if (!idle && ds->gui_timer) {
+        /* gui_update() stops rescheduling itself while idle */
+        qemu_mod_timer(ds->gui_timer, qemu_get_clock(rt_clock));
+    }
+}
+
 int is_graphic_console(void)
 {
     return active_console && active_console->console_type == GRAPHIC_CONSOLE;
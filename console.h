@@ -299,6 +299,18 @@ static inline void dpy_cursor(struct DisplayState *s, int x, int y) {
     }
 }
 
+/* true if no listener is currently showing the display */
+static inline int dpy_is_idle(DisplayState *s)
+{
+    struct DisplayChangeListener *dcl = s->listeners;
+    while (dcl != NULL) {
+        if (!dcl->idle)
+            return 0;
+        dcl = dcl->next;
+    }
+    return 1;
+}
+
 static inline int ds_get_linesize(DisplayState *ds)
 {
     return ds->surface->linesize;
@@ -339,6 +351,7 @@ typedef void (*vga_hw_update_ptr)(void *);
 typedef void (*vga_hw_invalidate_ptr)(void *);
 typedef void (*vga_hw_screen_dump_ptr)(void *, const char *);
 typedef void (*vga_hw_text_update_ptr)(void *, console_ch_t *);
+typedef void (*vga_hw_idle_ptr)(void *, int);
 
 DisplayState *graphic_console_init(vga_hw_update_ptr update,
                                    vga_hw_invalidate_ptr invalidate,
@@ -346,6 +359,10 @@ DisplayState *graphic_console_init(vga_hw_update_ptr update,
                                    vga_hw_text_update_ptr text_update,
                                    void *opaque);
 
+void graphic_console_set_idle_handler(DisplayState *ds, vga_hw_idle_ptr idle,
+                                      void *opaque);
+void dpy_set_idle(DisplayState *ds, DisplayChangeListener *dcl, int idle);
+
 void vga_hw_update(void);
 void vga_hw_invalidate(void);
 void vga_hw_screen_dump(const char *filename);
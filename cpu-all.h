@@ -853,6 +853,10 @@ extern uint8_t *bios_mem;
 
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
+/* Mapped MAP_SHARED from block->fd, so other processes can map it too. */
+#define RAM_SHARED_MASK     (1 << 1)
+/* Guest main memory, as opposed to device memory such as VRAM or ROMs */
+#define RAM_SYSTEM_MASK     (1 << 2)
 
 typedef struct RAMBlock {
     uint8_t *host;
@@ -899,6 +903,7 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define DUMP_DIRTY_FLAG      0x10
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -922,6 +927,9 @@ static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_get_dirty_bitmap(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flags,
+                                          unsigned long *bitmap);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -943,6 +951,12 @@ void qemu_register_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
 
 void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size);
 
+/* The same for I/O ports, where the host supports it.  Writes that are not
+ * buffered are simply dispatched as usual. */
+void qemu_register_coalesced_pio(pio_addr_t addr, pio_addr_t size);
+
+void qemu_unregister_coalesced_pio(pio_addr_t addr, pio_addr_t size);
+
 void qemu_flush_coalesced_mmio_buffer(void);
 
 /*******************************************/
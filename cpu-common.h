@@ -33,13 +33,18 @@ ram_addr_t cpu_get_physical_page_desc(target_phys_addr_t addr);
 ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                         ram_addr_t size, void *host);
 ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name, ram_addr_t size);
+/* Guest RAM made of the -numa nodes, bound to their host nodes if asked */
+ram_addr_t qemu_ram_alloc_numa(DeviceState *dev, const char *name,
+                               ram_addr_t size);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
 /* This should only be used for ram local to a device.  */
 void *qemu_get_ram_ptr(ram_addr_t addr);
+bool qemu_ram_range_in_block(ram_addr_t addr, ram_addr_t size);
 /* This should not be used by devices.  */
 int do_qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset, ram_addr_t *length);
 
 int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
@@ -31,6 +31,7 @@
 #include "osdep.h"
 #include "qemu-queue.h"
 #include "targphys.h"
+#include "qemu-prof.h"
 
 #ifndef TARGET_LONG_BITS
 #error TARGET_LONG_BITS must be defined before including this header
@@ -138,11 +139,44 @@ typedef struct CPUWatchpoint {
 /* forward decleration */
 struct qemu_work_item;
 
+/* qemu_mutex use by one thread */
+struct KVMLockStats {
+    uint64_t contended;
+    int64_t locked_at;
+    QEMUProfHist wait;          /* every acquisition, 0 if uncontended */
+    QEMUProfHist hold;
+};
+
+/* Exit reasons counted separately; the last entry takes unknown ones */
+#define KVM_EXIT_STATS  20
+
+struct KVMCPUStats {
+    uint64_t exits[KVM_EXIT_STATS];
+    uint64_t guest_ns;          /* in KVM_RUN, with -kvm-exit-timing */
+    uint64_t user_ns;           /* handling exits, likewise */
+    uint64_t halt_polls;
+    uint64_t halt_poll_wakeups; /* kicks that arrived while polling */
+    QEMUProfHist halt;          /* sleeps waiting for a kick */
+    QEMUProfHist wakeup;        /* from a kick until a sleeping vcpu runs */
+} __attribute__((aligned(64)));  /* no false sharing in the stats file */
+
 struct KVMCPUState {
     pthread_t thread;
     int signalled;
+    volatile int kicked;        /* SIG_IPI sent since the last wait */
+    int64_t kicked_at;
     struct qemu_work_item *queued_work_first, *queued_work_last;
     int regs_modified;
+    /* odd while the vcpu runs an exit handler without qemu_mutex */
+    volatile unsigned int unlocked_io_seq;
+    uint64_t exits;
+    uint64_t unlocked_exits;
+    /* kvm_run state seen by the last post_kvm_run() */
+    uint8_t post_run_if_flag;
+    uint64_t post_run_cr8;
+    uint64_t post_run_apic_base;
+    struct KVMLockStats lock_stats;
+    struct KVMCPUStats *stats;
 };
 
 #define CPU_TEMP_BUF_NLONGS 128
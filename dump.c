@@ -28,8 +28,49 @@
 #include "error.h"
 #include "qmp-commands.h"
 #include "gdbstub.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "qemu-objects.h"
+#include "bitops.h"
+#include "bitmap.h"
+#include "migration.h"
+#include <signal.h>
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
 
 #if defined(CONFIG_HAVE_CORE_DUMP)
+/* Bytes of guest memory per write in the ELF format */
+#define DUMP_ELF_CHUNK          (1024 * 1024)
+
+/* Pages a compression thread takes at a time */
+#define DUMP_CHUNK_PAGES        256
+
+#define DUMP_DEFAULT_THREADS    8
+#define DUMP_MAX_THREADS        64
+
+/* A live dump stops the guest after this many passes, even if the guest
+ * dirties memory faster than it can be dumped */
+#define DUMP_LIVE_MAX_PASSES    30
+
+enum {
+    DUMP_STATUS_NONE,
+    DUMP_STATUS_ACTIVE,
+    DUMP_STATUS_COMPLETED,
+    DUMP_STATUS_FAILED,
+};
+
+static const char *dump_status_names[] = {
+    [DUMP_STATUS_NONE] = "none",
+    [DUMP_STATUS_ACTIVE] = "active",
+    [DUMP_STATUS_COMPLETED] = "completed",
+    [DUMP_STATUS_FAILED] = "failed",
+};
+
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
     if (endian == ELFDATA2LSB) {
@@ -63,7 +104,25 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+/* A run of guest-physical pages backed by consecutive pages of one RAM block */
+typedef struct DumpBlock {
+    uint64_t pfn;               /* guest page frame number of its first page */
+    ram_addr_t offset;          /* ram address of its first page */
+    uint8_t *host;
+    uint64_t first_page;        /* index of its first page descriptor */
+    uint64_t nr_pages;
+} DumpBlock;
+
 typedef struct DumpState {
+    int status;
+    DumpGuestMemoryFormat format;
+    bool live;
+    bool detach;
+    uint64_t total;             /* bytes of guest memory to dump */
+    uint64_t completed;         /* under lock while threads run */
+    uint64_t written;           /* ELF only, kdump uses offset_data */
+    int passes;
+
     ArchDumpInfo dump_info;
     MemoryMappingList list;
     uint16_t phdr_num;
@@ -80,18 +139,79 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+    int nr_cpus;
+
+    /* kdump-compressed format */
+    uint32_t flag_compress;
+    uint64_t max_mapnr;
+    size_t len_dump_bitmap;     /* of each of the two bitmaps */
+    size_t sub_hdr_size;        /* in blocks */
+    off_t offset_dump_bitmap;
+    off_t offset_page;
+    off_t offset_data;          /* end of the page data, under lock */
+    PageDescriptor pd_zero;     /* shared by all zero pages */
+    DumpBlock *blocks;          /* sorted by pfn */
+    int nr_blocks;
+    uint64_t nr_pages;
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+    bool tracking;
+    unsigned long *dirty_map;   /* pages written again during a live pass */
+
+    /* compression threads and the pass they work on, under lock */
+    QemuMutex lock;
+    QemuCond cond;
+    int nr_threads;
+    int threads_running;
+    bool quit;
+    const unsigned long *dirty; /* pages of the pass, NULL for all */
+    uint64_t next_chunk;
+    uint64_t nr_chunks;
+    uint64_t chunks_done;
+    uint64_t pass_pages;
+    int64_t pass_start_ns;
+    int64_t pass_ns;
+    bool pass_notify;
+    int io_error;
+    int notify[2];
 } DumpState;
 
+/* The running dump, or the last one for query-dump */
+static DumpState *dump_state;
+
+static void dump_stop_threads(DumpState *s);
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
 
     memory_mapping_list_free(&s->list);
+    if (s->nr_threads) {
+        dump_stop_threads(s);
+    }
+    if (s->tracking) {
+        cpu_physical_memory_set_dirty_tracking(0);
+        s->tracking = false;
+    }
+    if (s->notify[0] > 0) {
+        qemu_set_fd_handler(s->notify[0], NULL, NULL, NULL);
+        close(s->notify[0]);
+        close(s->notify[1]);
+        s->notify[0] = s->notify[1] = 0;
+    }
+    g_free(s->blocks);
+    s->blocks = NULL;
+    g_free(s->note_buf);
+    s->note_buf = NULL;
+    g_free(s->dirty_map);
+    s->dirty_map = NULL;
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
     }
     if (s->resume) {
         vm_start();
+        s->resume = false;
     }
 
     return ret;
@@ -111,6 +231,7 @@ static int fd_write_vmcore(void *buf, size_t size, void *opaque)
     if (written_size != size) {
         return -1;
     }
+    s->written += size;
 
     return 0;
 }
@@ -392,27 +513,20 @@ static int write_data(DumpState *s, void *buf, int length)
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
+/* write the memroy to vmcore. DUMP_ELF_CHUNK bytes per I/O. */
 static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
                         int64_t size)
 {
-    int64_t i;
+    int64_t done, len;
     int ret;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_ELF_CHUNK);
+        ret = write_data(s, block->host + start + done, len);
         if (ret < 0) {
             return ret;
         }
+        s->completed += len;
     }
 
     return 0;
@@ -698,6 +812,905 @@ static ram_addr_t get_start_block(DumpState *s)
     return -1;
 }
 
+static int dump_pwrite(DumpState *s, const void *buf, size_t size,
+                       off_t offset)
+{
+    ssize_t len;
+
+    while (size) {
+        len = pwrite(s->fd, buf, size, offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf = (const uint8_t *)buf + len;
+        size -= len;
+        offset += len;
+    }
+
+    return 0;
+}
+
+static const char *dump_machine_name(DumpState *s)
+{
+    switch (s->dump_info.d_machine) {
+    case EM_X86_64:
+        return "x86_64";
+    case EM_386:
+        return "i386";
+    default:
+        return "";
+    }
+}
+
+/* collect the elf notes for the kdump sub header */
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+static int get_kdump_notes(DumpState *s)
+{
+    CPUArchState *env;
+    int ret;
+
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_synchronize_state(env);
+    }
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (s->dump_info.d_class == ELFCLASS64) {
+            ret = cpu_write_elf64_note(buf_write_note, env, cpu_index(env), s);
+        } else {
+            ret = cpu_write_elf32_note(buf_write_note, env, cpu_index(env), s);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (s->dump_info.d_class == ELFCLASS64) {
+            ret = cpu_write_elf64_qemunote(buf_write_note, env, s);
+        } else {
+            ret = cpu_write_elf32_qemunote(buf_write_note, env, s);
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* write the disk dump header to block 0, and the sub header followed by the
+ * elf notes to the blocks after it */
+static int write_kdump_headers(DumpState *s, void *dh, size_t dh_size,
+                               void *kh, size_t kh_size)
+{
+    size_t size = s->sub_hdr_size * TARGET_PAGE_SIZE;
+    uint8_t *buf;
+    int ret;
+
+    ret = dump_pwrite(s, dh, dh_size, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = g_malloc0(size);
+    memcpy(buf, kh, kh_size);
+    memcpy(buf + kh_size, s->note_buf, s->note_size);
+    ret = dump_pwrite(s, buf, size, DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE);
+    g_free(buf);
+
+    return ret;
+}
+
+static int write_kdump_header32(DumpState *s)
+{
+    DiskDumpHeader32 dh;
+    KdumpSubHeader32 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t bitmap_blocks = s->len_dump_bitmap * 2 / TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            dump_machine_name(s));
+    dh.status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    memset(&kh, 0, sizeof(kh));
+    kh.phys_base = cpu_convert_to_target32(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(DISKDUMP_HEADER_BLOCKS *
+                                             TARGET_PAGE_SIZE + sizeof(kh),
+                                             endian);
+    kh.note_size = cpu_convert_to_target32(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    return write_kdump_headers(s, &dh, sizeof(dh), &kh, sizeof(kh));
+}
+
+static int write_kdump_header64(DumpState *s)
+{
+    DiskDumpHeader64 dh;
+    KdumpSubHeader64 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t bitmap_blocks = s->len_dump_bitmap * 2 / TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(KDUMP_HEADER_VERSION, endian);
+    pstrcpy(dh.utsname.machine, sizeof(dh.utsname.machine),
+            dump_machine_name(s));
+    dh.status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh.block_size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->sub_hdr_size, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(bitmap_blocks, endian);
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT32_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    memset(&kh, 0, sizeof(kh));
+    kh.phys_base = cpu_convert_to_target64(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(DISKDUMP_HEADER_BLOCKS *
+                                             TARGET_PAGE_SIZE + sizeof(kh),
+                                             endian);
+    kh.note_size = cpu_convert_to_target64(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    return write_kdump_headers(s, &dh, sizeof(dh), &kh, sizeof(kh));
+}
+
+/*
+ * Both bitmaps mark every dumped page of guest RAM, so the descriptor of a
+ * page sits at a fixed place and can be rewritten when a live dump writes
+ * the page again.  Zero pages are left out of the data: their descriptors
+ * point at one shared zero page.
+ */
+static int write_kdump_bitmaps(DumpState *s)
+{
+    uint8_t *bitmap;
+    uint64_t pfn, end;
+    int i, ret;
+
+    bitmap = g_malloc0(s->len_dump_bitmap);
+    for (i = 0; i < s->nr_blocks; i++) {
+        pfn = s->blocks[i].pfn;
+        for (end = pfn + s->blocks[i].nr_pages; pfn < end; pfn++) {
+            bitmap[pfn / CHAR_BIT] |= 1 << (pfn % CHAR_BIT);
+        }
+    }
+
+    ret = dump_pwrite(s, bitmap, s->len_dump_bitmap, s->offset_dump_bitmap);
+    if (ret == 0) {
+        ret = dump_pwrite(s, bitmap, s->len_dump_bitmap,
+                          s->offset_dump_bitmap + s->len_dump_bitmap);
+    }
+    g_free(bitmap);
+
+    return ret;
+}
+
+static int write_kdump_zero_page(DumpState *s)
+{
+    uint8_t *page = g_malloc0(TARGET_PAGE_SIZE);
+    int ret;
+
+    ret = dump_pwrite(s, page, TARGET_PAGE_SIZE,
+                      s->offset_data - TARGET_PAGE_SIZE);
+    g_free(page);
+
+    return ret;
+}
+
+/*
+ * Page frame numbers are guest-physical, so the pages are collected from
+ * the guest-physical map rather than from the RAM blocks: main memory is
+ * not mapped at its ram address (on pc, RAM above 4G follows the PCI hole),
+ * and device memory such as VRAM and ROMs is not dumped when the machine
+ * tells main memory apart.  Runs are reported in address order.
+ */
+typedef struct DumpRamCollector {
+    CPUPhysMemoryClient client;
+    DumpState *s;
+    bool system_only;
+    int max_blocks;
+} DumpRamCollector;
+
+static void dump_collect_set_memory(CPUPhysMemoryClient *client,
+                                    target_phys_addr_t start_addr,
+                                    ram_addr_t size, ram_addr_t phys_offset)
+{
+    DumpRamCollector *c = container_of(client, DumpRamCollector, client);
+    DumpState *s = c->s;
+    RAMBlock *block;
+    DumpBlock *b;
+
+    if ((phys_offset & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+        return;
+    }
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (phys_offset - block->offset < block->length) {
+            break;
+        }
+    }
+    if (!block || (c->system_only && !(block->flags & RAM_SYSTEM_MASK))) {
+        return;
+    }
+    size = MIN(size, block->length - (phys_offset - block->offset));
+
+    if (s->nr_blocks == c->max_blocks) {
+        c->max_blocks = MAX(16, 2 * c->max_blocks);
+        s->blocks = g_realloc(s->blocks, c->max_blocks * sizeof(DumpBlock));
+    }
+    b = &s->blocks[s->nr_blocks++];
+    b->pfn = start_addr >> TARGET_PAGE_BITS;
+    b->offset = phys_offset;
+    b->host = block->host + (phys_offset - block->offset);
+    b->nr_pages = size >> TARGET_PAGE_BITS;
+}
+
+static int dump_collect_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                          target_phys_addr_t start_addr,
+                                          target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int dump_collect_migration_log(CPUPhysMemoryClient *client,
+                                      int enable)
+{
+    return 0;
+}
+
+static void dump_collect_ram(DumpState *s)
+{
+    DumpRamCollector c = {
+        .client.set_memory = dump_collect_set_memory,
+        .client.sync_dirty_bitmap = dump_collect_sync_dirty_bitmap,
+        .client.migration_log = dump_collect_migration_log,
+        .s = s,
+    };
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->flags & RAM_SYSTEM_MASK) {
+            c.system_only = true;
+        }
+    }
+
+    /* registering walks the whole map */
+    cpu_register_phys_memory_client(&c.client);
+    cpu_unregister_phys_memory_client(&c.client);
+}
+
+/* compute where everything goes; the page data starts with the zero page */
+static void dump_init_kdump(DumpState *s)
+{
+    int endian = s->dump_info.d_endian;
+    size_t kh_size;
+    off_t offset_zero;
+    uint64_t end;
+    int i;
+
+    switch (s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+        s->flag_compress = DUMP_DH_COMPRESSED_LZO;
+        break;
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+        s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
+        break;
+    default:
+        s->flag_compress = DUMP_DH_COMPRESSED_ZLIB;
+        break;
+    }
+
+    dump_collect_ram(s);
+    for (i = 0; i < s->nr_blocks; i++) {
+        s->blocks[i].first_page = s->nr_pages;
+        s->nr_pages += s->blocks[i].nr_pages;
+        end = s->blocks[i].pfn + s->blocks[i].nr_pages;
+        s->max_mapnr = MAX(s->max_mapnr, end);
+    }
+    s->total = s->nr_pages * TARGET_PAGE_SIZE;
+
+    s->len_dump_bitmap = DIV_ROUND_UP(DIV_ROUND_UP(s->max_mapnr, CHAR_BIT),
+                                      TARGET_PAGE_SIZE) * TARGET_PAGE_SIZE;
+    if (s->dump_info.d_class == ELFCLASS64) {
+        kh_size = sizeof(KdumpSubHeader64);
+    } else {
+        kh_size = sizeof(KdumpSubHeader32);
+    }
+    s->sub_hdr_size = DIV_ROUND_UP(kh_size + s->note_size, TARGET_PAGE_SIZE);
+    s->offset_dump_bitmap = (DISKDUMP_HEADER_BLOCKS + s->sub_hdr_size) *
+                            TARGET_PAGE_SIZE;
+    s->offset_page = s->offset_dump_bitmap + 2 * s->len_dump_bitmap;
+
+    offset_zero = s->offset_page + s->nr_pages * sizeof(PageDescriptor);
+    s->pd_zero.offset = cpu_convert_to_target64(offset_zero, endian);
+    s->pd_zero.size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    s->offset_data = offset_zero + TARGET_PAGE_SIZE;
+
+    if (s->live) {
+        s->dirty_map = bitmap_new(s->nr_pages);
+    }
+}
+
+typedef struct DumpWorker {
+    DumpState *s;
+    uint8_t *buf;               /* data of the pages of a chunk */
+    PageDescriptor desc[DUMP_CHUNK_PAGES];
+    uint8_t state[DUMP_CHUNK_PAGES];
+    z_stream zstream;
+#if defined(CONFIG_LZO) || defined(CONFIG_SNAPPY)
+    uint8_t *cbuf;
+#endif
+#ifdef CONFIG_LZO
+    uint8_t *wrkmem;
+#endif
+} DumpWorker;
+
+enum {
+    DUMP_PAGE_SKIP,             /* not part of this pass */
+    DUMP_PAGE_ZERO,
+    DUMP_PAGE_DATA,
+};
+
+/* Return the compressed size, or 0 if the page does not get smaller */
+static size_t dump_compress_page(DumpWorker *w, uint8_t *page, uint8_t *out)
+{
+    switch (w->s->format) {
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB:
+        if (deflateReset(&w->zstream) != Z_OK) {
+            return 0;
+        }
+        w->zstream.next_in = page;
+        w->zstream.avail_in = TARGET_PAGE_SIZE;
+        w->zstream.next_out = out;
+        w->zstream.avail_out = TARGET_PAGE_SIZE - 1;
+        if (deflate(&w->zstream, Z_FINISH) != Z_STREAM_END) {
+            return 0;
+        }
+        return w->zstream.total_out;
+#ifdef CONFIG_LZO
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO: {
+        lzo_uint len;
+
+        if (lzo1x_1_compress(page, TARGET_PAGE_SIZE, w->cbuf, &len,
+                             w->wrkmem) != LZO_E_OK ||
+            len >= TARGET_PAGE_SIZE) {
+            return 0;
+        }
+        memcpy(out, w->cbuf, len);
+        return len;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY: {
+        size_t len = snappy_max_compressed_length(TARGET_PAGE_SIZE);
+
+        if (snappy_compress((char *)page, TARGET_PAGE_SIZE, (char *)w->cbuf,
+                            &len) != SNAPPY_OK ||
+            len >= TARGET_PAGE_SIZE) {
+            return 0;
+        }
+        memcpy(out, w->cbuf, len);
+        return len;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Compress the pages of @chunk that belong to the current pass, append
+ * their data to the file, then write their descriptors.  Threads reserve
+ * room for the data under the lock and write it in parallel.  @pages is
+ * set to the number of pages dumped.
+ */
+static int dump_chunk(DumpWorker *w, uint64_t chunk, uint64_t *pages)
+{
+    DumpState *s = w->s;
+    int endian = s->dump_info.d_endian;
+    uint64_t first = chunk * DUMP_CHUNK_PAGES;
+    uint64_t end = MIN(first + DUMP_CHUNK_PAGES, s->nr_pages);
+    uint64_t i, j, n = 0;
+    DumpBlock *b = s->blocks;
+    size_t len = 0, size;
+    off_t offset;
+    uint8_t *page;
+    int ret;
+
+    *pages = 0;
+    if (s->dirty && find_next_bit(s->dirty, end, first) >= end) {
+        return 0;
+    }
+
+    for (i = 0; i < end - first; i++) {
+        PageDescriptor *pd = &w->desc[i];
+
+        if (s->dirty && !test_bit(first + i, s->dirty)) {
+            w->state[i] = DUMP_PAGE_SKIP;
+            continue;
+        }
+        while (first + i >= b->first_page + b->nr_pages) {
+            b++;
+        }
+        page = b->host + ((first + i - b->first_page) << TARGET_PAGE_BITS);
+        n++;
+
+        if (buffer_is_zero(page, TARGET_PAGE_SIZE)) {
+            w->state[i] = DUMP_PAGE_ZERO;
+            *pd = s->pd_zero;
+            continue;
+        }
+
+        size = dump_compress_page(w, page, w->buf + len);
+        if (size) {
+            pd->flags = cpu_convert_to_target32(s->flag_compress, endian);
+        } else {
+            memcpy(w->buf + len, page, TARGET_PAGE_SIZE);
+            size = TARGET_PAGE_SIZE;
+            pd->flags = 0;
+        }
+        w->state[i] = DUMP_PAGE_DATA;
+        pd->offset = len;
+        pd->size = cpu_convert_to_target32(size, endian);
+        pd->page_flags = 0;
+        len += size;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    offset = s->offset_data;
+    s->offset_data += len;
+    qemu_mutex_unlock(&s->lock);
+
+    ret = dump_pwrite(s, w->buf, len, offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < end - first; i++) {
+        if (w->state[i] == DUMP_PAGE_DATA) {
+            w->desc[i].offset = cpu_convert_to_target64(offset +
+                                                        w->desc[i].offset,
+                                                        endian);
+        }
+    }
+
+    /* descriptors go out in runs of consecutive pages of the pass */
+    for (i = 0; i < end - first; i = j) {
+        if (w->state[i] == DUMP_PAGE_SKIP) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < end - first && w->state[j] != DUMP_PAGE_SKIP;
+             j++) {
+        }
+        ret = dump_pwrite(s, &w->desc[i], (j - i) * sizeof(PageDescriptor),
+                          s->offset_page + (first + i) *
+                          sizeof(PageDescriptor));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    *pages = n;
+    return 0;
+}
+
+static void dump_worker_free(DumpWorker *w)
+{
+    deflateEnd(&w->zstream);
+    g_free(w->buf);
+#if defined(CONFIG_LZO) || defined(CONFIG_SNAPPY)
+    g_free(w->cbuf);
+#endif
+#ifdef CONFIG_LZO
+    g_free(w->wrkmem);
+#endif
+    g_free(w);
+}
+
+/* called with s->lock held by the thread that finished the last chunk */
+static void dump_pass_done(DumpState *s)
+{
+    char c = 0;
+
+    s->pass_ns = get_clock() - s->pass_start_ns;
+    qemu_cond_broadcast(&s->cond);
+    if (s->pass_notify && write(s->notify[1], &c, 1) < 0 && errno != EAGAIN) {
+        perror("dump: notify");
+    }
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpWorker *w = opaque;
+    DumpState *s = w->s;
+    uint64_t chunk, pages;
+    sigset_t set;
+    int ret;
+
+    pthread_detach(pthread_self());
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        if (s->next_chunk < s->nr_chunks) {
+            chunk = s->next_chunk++;
+            if (!s->io_error) {
+                qemu_mutex_unlock(&s->lock);
+                ret = dump_chunk(w, chunk, &pages);
+                qemu_mutex_lock(&s->lock);
+                if (ret < 0 && !s->io_error) {
+                    s->io_error = ret;
+                }
+                s->completed += pages * TARGET_PAGE_SIZE;
+            }
+            if (++s->chunks_done == s->nr_chunks) {
+                dump_pass_done(s);
+            }
+        } else if (s->quit) {
+            break;
+        } else {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+    }
+    s->threads_running--;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+
+    dump_worker_free(w);
+    return NULL;
+}
+
+static int dump_start_threads(DumpState *s, int nr_threads)
+{
+    QemuThread thread;
+    DumpWorker *w;
+    int i;
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    s->nr_threads = nr_threads;
+
+    for (i = 0; i < nr_threads; i++) {
+        w = g_malloc0(sizeof(*w));
+        w->s = s;
+        w->buf = g_malloc(DUMP_CHUNK_PAGES * TARGET_PAGE_SIZE);
+        if (deflateInit(&w->zstream, Z_BEST_SPEED) != Z_OK) {
+            g_free(w->buf);
+            g_free(w);
+            return -1;
+        }
+#ifdef CONFIG_LZO
+        if (s->format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
+            w->cbuf = g_malloc(TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 16 + 64 +
+                               3);
+            w->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+        }
+#endif
+#ifdef CONFIG_SNAPPY
+        if (s->format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY) {
+            w->cbuf = g_malloc(snappy_max_compressed_length(TARGET_PAGE_SIZE));
+        }
+#endif
+        qemu_mutex_lock(&s->lock);
+        s->threads_running++;
+        qemu_mutex_unlock(&s->lock);
+        qemu_thread_create(&thread, dump_thread, w);
+    }
+
+    return 0;
+}
+
+static void dump_stop_threads(DumpState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_broadcast(&s->cond);
+    while (s->threads_running) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_mutex_destroy(&s->lock);
+    qemu_cond_destroy(&s->cond);
+    s->nr_threads = 0;
+}
+
+/* Hand @pages pages, those set in @dirty or all if it is NULL, to the
+ * compression threads.  If @notify, the end of the pass is signalled to
+ * dump_live_iterate(), otherwise use dump_wait_pass(). */
+static void dump_start_pass(DumpState *s, const unsigned long *dirty,
+                            uint64_t pages, bool notify)
+{
+    qemu_mutex_lock(&s->lock);
+    s->dirty = dirty;
+    s->next_chunk = 0;
+    s->chunks_done = 0;
+    s->nr_chunks = DIV_ROUND_UP(s->nr_pages, DUMP_CHUNK_PAGES);
+    s->pass_pages = pages;
+    s->pass_notify = notify;
+    s->pass_start_ns = get_clock();
+    if (dirty) {
+        s->total += pages * TARGET_PAGE_SIZE;
+    }
+    s->passes++;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static int dump_wait_pass(DumpState *s)
+{
+    int ret;
+
+    qemu_mutex_lock(&s->lock);
+    while (s->chunks_done < s->nr_chunks) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    ret = s->io_error;
+    qemu_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/* Set in @dirty the pages the guest wrote since the last call, or only
+ * forget about them if @dirty is NULL.  Returns the number of pages newly
+ * set, or -1 if the dirty log could not be read. */
+static int64_t dump_collect_dirty(DumpState *s, unsigned long *dirty)
+{
+    unsigned long *bitmap;
+    uint64_t max = 0;
+    int64_t count = 0;
+    unsigned long page;
+    ram_addr_t start, end;
+    DumpBlock *b;
+    int i;
+
+    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        max = MAX(max, s->blocks[i].nr_pages);
+    }
+    bitmap = bitmap_new(max);
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        b = &s->blocks[i];
+        start = b->offset;
+        end = start + (b->nr_pages << TARGET_PAGE_BITS);
+        if (dirty) {
+            cpu_physical_memory_get_dirty_bitmap(start, end, DUMP_DIRTY_FLAG,
+                                                 bitmap);
+            for (page = find_first_bit(bitmap, b->nr_pages);
+                 page < b->nr_pages;
+                 page = find_next_bit(bitmap, b->nr_pages, page + 1)) {
+                if (!test_and_set_bit(b->first_page + page, dirty)) {
+                    count++;
+                }
+            }
+        }
+        cpu_physical_memory_reset_dirty(start, end, DUMP_DIRTY_FLAG);
+    }
+
+    qemu_free(bitmap);
+    return count;
+}
+
+static QObject *dump_get_info(DumpState *s)
+{
+    uint64_t total, completed, written;
+
+    if (!s) {
+        return qobject_from_jsonf("{ 'status': 'none' }");
+    }
+
+    if (s->nr_threads) {
+        qemu_mutex_lock(&s->lock);
+    }
+    total = s->total;
+    completed = s->completed;
+    if (s->format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        written = s->written;
+    } else {
+        written = s->offset_data;
+    }
+    if (s->nr_threads) {
+        qemu_mutex_unlock(&s->lock);
+    }
+
+    return qobject_from_jsonf("{ 'status': %s, 'format': %s, 'live': %i, "
+                              "'passes': %d, 'total': %" PRId64 ", "
+                              "'completed': %" PRId64 ", "
+                              "'written': %" PRId64 " }",
+                              dump_status_names[s->status],
+                              DumpGuestMemoryFormat_lookup[s->format],
+                              s->live, s->passes, total, completed, written);
+}
+
+static void dump_finish(DumpState *s, int ret)
+{
+    QObject *data;
+
+    if (ret == 0) {
+        if (get_kdump_notes(s) < 0) {
+            ret = -1;
+        } else if (s->dump_info.d_class == ELFCLASS64) {
+            ret = write_kdump_header64(s);
+        } else {
+            ret = write_kdump_header32(s);
+        }
+    }
+
+    dump_cleanup(s);
+    s->status = ret < 0 ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED;
+
+    if (s->live || s->detach) {
+        data = dump_get_info(s);
+        monitor_protocol_event(QEVENT_DUMP_COMPLETED, data);
+        qobject_decref(data);
+    }
+}
+
+/*
+ * Runs in the main loop when a pass of a live or detached dump is over.
+ * A live dump goes on with the pages the guest wrote meanwhile, until
+ * writing those is expected to take no longer than the migration downtime
+ * limit; then the guest is stopped for the last pass.
+ */
+static void dump_live_iterate(void *opaque)
+{
+    DumpState *s = opaque;
+    int64_t dirty, more, expected_ns;
+    char buf[16];
+    int ret;
+
+    while (read(s->notify[0], buf, sizeof(buf)) > 0) {
+    }
+
+    qemu_mutex_lock(&s->lock);
+    if (s->chunks_done < s->nr_chunks) {
+        qemu_mutex_unlock(&s->lock);
+        return;
+    }
+    ret = s->io_error;
+    qemu_mutex_unlock(&s->lock);
+
+    if (ret < 0 || !s->live) {
+        dump_finish(s, ret);
+        return;
+    }
+
+    bitmap_zero(s->dirty_map, s->nr_pages);
+    dirty = dump_collect_dirty(s, s->dirty_map);
+    if (dirty < 0) {
+        dump_finish(s, -1);
+        return;
+    }
+
+    expected_ns = s->pass_pages ? dirty * s->pass_ns / s->pass_pages : 0;
+    if (s->passes < DUMP_LIVE_MAX_PASSES &&
+        expected_ns > migrate_max_downtime()) {
+        dump_start_pass(s, s->dirty_map, dirty, true);
+        return;
+    }
+
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        s->resume = true;
+    }
+    more = dump_collect_dirty(s, s->dirty_map);
+    if (more < 0) {
+        dump_finish(s, -1);
+        return;
+    }
+    cpu_physical_memory_set_dirty_tracking(0);
+    s->tracking = false;
+
+    dump_start_pass(s, s->dirty_map, dirty + more, false);
+    dump_finish(s, dump_wait_pass(s));
+}
+
+static int create_kdump(DumpState *s, int nr_threads)
+{
+    int ret;
+
+    dump_init_kdump(s);
+
+    ret = write_kdump_bitmaps(s);
+    if (ret == 0) {
+        ret = write_kdump_zero_page(s);
+    }
+    if (ret < 0) {
+        dump_cleanup(s);
+        return ret;
+    }
+
+    if (dump_start_threads(s, nr_threads) < 0) {
+        dump_cleanup(s);
+        return -1;
+    }
+
+    if (s->live) {
+        /* from here on, every page the guest writes is dumped again */
+        if (cpu_physical_memory_set_dirty_tracking(1) < 0) {
+            dump_cleanup(s);
+            return -1;
+        }
+        s->tracking = true;
+        if (dump_collect_dirty(s, NULL) < 0) {
+            dump_cleanup(s);
+            return -1;
+        }
+    }
+
+    if (!s->live && !s->detach) {
+        dump_start_pass(s, NULL, s->nr_pages, false);
+        ret = dump_wait_pass(s);
+        dump_finish(s, ret);
+        return ret;
+    }
+
+    if (qemu_pipe(s->notify) < 0) {
+        dump_cleanup(s);
+        return -1;
+    }
+    fcntl(s->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->notify[1], F_SETFL, O_NONBLOCK);
+    qemu_set_fd_handler(s->notify[0], dump_live_iterate, NULL, s);
+    dump_start_pass(s, NULL, s->nr_pages, true);
+
+    return 0;
+}
+
+/* the size of the guest memory that goes to the vmcore */
+static int64_t get_memory_size(DumpState *s)
+{
+    RAMBlock *block;
+    int64_t start, end, size = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        start = block->offset;
+        end = block->offset + block->length;
+        if (s->has_filter) {
+            start = MAX(start, s->begin);
+            end = MIN(end, s->begin + s->length);
+        }
+        if (end > start) {
+            size += end - start;
+        }
+    }
+
+    return size;
+}
+
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
                      int64_t begin, int64_t length, Error **errp)
 {
@@ -705,7 +1718,8 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
     int nr_cpus;
     int ret;
 
-    if (runstate_is_running()) {
+    /* a live dump stops the guest only for its last pass */
+    if (!s->live && runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -729,13 +1743,16 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
      * return -1.
      *
      * if we use kvm, we should synchronize the register before we get dump
-     * info.
+     * info.  A live dump does so once the guest is stopped.
      */
     nr_cpus = 0;
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        cpu_synchronize_state(env);
+        if (!s->live) {
+            cpu_synchronize_state(env);
+        }
         nr_cpus++;
     }
+    s->nr_cpus = nr_cpus;
 
     ret = cpu_get_dump_info(&s->dump_info);
     if (ret < 0) {
@@ -798,6 +1815,7 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
                                sizeof(Elf32_Phdr) * s->phdr_num + s->note_size;
         }
     }
+    s->total = get_memory_size(s);
 
     return 0;
 
@@ -811,11 +1829,15 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, bool has_detach,
+                           bool detach, bool has_threads, int64_t threads,
                            Error **errp)
 {
     const char *p;
     int fd = -1;
     DumpState *s;
+    long nr_cpus;
     int ret;
 
     if (has_begin && !has_length) {
@@ -827,6 +1849,50 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        if (live || detach) {
+            error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+            return;
+        }
+    } else if (paging || has_begin) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+#ifndef CONFIG_LZO
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+#endif
+#ifndef CONFIG_SNAPPY
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+#endif
+
+    if (!has_threads) {
+        nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = nr_cpus > 0 ? MIN(nr_cpus, DUMP_DEFAULT_THREADS) : 1;
+    } else if (threads < 1 || threads > DUMP_MAX_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "a number between 1 and 64");
+        return;
+    }
+
+    if (dump_in_progress()) {
+        error_set(errp, QERR_DUMP_IN_PROGRESS);
+        return;
+    }
+    /* the dirty log is shared with migration and savevm */
+    if (live && cpu_physical_memory_get_dirty_tracking()) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
         fd = monitor_get_fd(cur_mon, p);
@@ -850,27 +1916,100 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    /* kdump page data is appended as it is compressed, and the page
+     * descriptors are written into place afterwards */
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF &&
+        lseek(fd, 0, SEEK_CUR) == (off_t)-1) {
+        close(fd);
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "protocol",
+                  "a seekable file for the kdump formats");
+        return;
+    }
+
+    g_free(dump_state);
+    s = dump_state = g_malloc0(sizeof(DumpState));
+    s->status = DUMP_STATUS_ACTIVE;
+    s->format = format;
+    s->live = live;
+    s->detach = detach;
 
     ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
     if (ret < 0) {
-        g_free(s);
+        close(fd);
+        s->status = DUMP_STATUS_FAILED;
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
-        error_set(errp, QERR_IO_ERROR);
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        s->errp = NULL;
+        if (create_kdump(s, threads) < 0) {
+            s->status = DUMP_STATUS_FAILED;
+            error_set(errp, QERR_IO_ERROR);
+        }
+        return;
     }
 
-    g_free(s);
+    s->passes = 1;
+    if (create_vmcore(s) < 0) {
+        s->status = DUMP_STATUS_FAILED;
+        if (!error_is_set(s->errp)) {
+            error_set(errp, QERR_IO_ERROR);
+        }
+    } else {
+        s->status = DUMP_STATUS_COMPLETED;
+    }
+    s->errp = NULL;
+}
+
+bool dump_in_progress(void)
+{
+    return dump_state && dump_state->status == DUMP_STATUS_ACTIVE;
+}
+
+void do_info_dump(Monitor *mon, QObject **ret_data)
+{
+    *ret_data = dump_get_info(dump_state);
 }
 
 #else
 /* we need this function in hmp.c */
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, bool has_detach,
+                           bool detach, bool has_threads, int64_t threads,
                            Error **errp)
 {
     error_set(errp, QERR_UNSUPPORTED);
 }
+
+bool dump_in_progress(void)
+{
+    return false;
+}
+
+void do_info_dump(Monitor *mon, QObject **ret_data)
+{
+    *ret_data = qobject_from_jsonf("{ 'status': 'none' }");
+}
 #endif
+
+void do_info_dump_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    const char *status = qdict_get_str(qdict, "status");
+
+    monitor_printf(mon, "Dump status: %s\n", status);
+    if (!strcmp(status, "none")) {
+        return;
+    }
+    monitor_printf(mon, "format: %s%s, pass %" PRId64 "\n",
+                   qdict_get_str(qdict, "format"),
+                   qdict_get_bool(qdict, "live") ? " (live)" : "",
+                   qdict_get_int(qdict, "passes"));
+    monitor_printf(mon, "dumped: %" PRId64 " of %" PRId64 " kbytes\n",
+                   qdict_get_int(qdict, "completed") >> 10,
+                   qdict_get_int(qdict, "total") >> 10);
+    monitor_printf(mon, "written: %" PRId64 " kbytes\n",
+                   qdict_get_int(qdict, "written") >> 10);
+}
@@ -20,4 +20,109 @@ typedef struct ArchDumpInfo {
     int d_class;    /* ELFCLASS32 or ELFCLASS64 */
 } ArchDumpInfo;
 
+/*
+ * kdump-compressed format, as written by makedumpfile and read by crash.
+ * Block 0 holds the disk dump header, the next sub_hdr_size blocks the
+ * kdump sub header followed by the ELF notes, then come the two page
+ * bitmaps, one page descriptor per dumpable page and the page data.
+ * Integers are in the guest's byte order.
+ */
+#define KDUMP_SIGNATURE             "KDUMP   "
+#define SIG_LEN                     (sizeof(KDUMP_SIGNATURE) - 1)
+#define KDUMP_HEADER_VERSION        6
+#define DISKDUMP_HEADER_BLOCKS      1
+#define PHYS_BASE                   0
+#define DUMP_LEVEL                  1
+
+/* status in the disk dump header, flags in the page descriptors */
+#define DUMP_DH_COMPRESSED_ZLIB     0x1
+#define DUMP_DH_COMPRESSED_LZO      0x2
+#define DUMP_DH_COMPRESSED_SNAPPY   0x4
+
+typedef struct NewUtsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+    char domainname[65];
+} __attribute__((packed)) NewUtsname;
+
+/* timestamp stands for a struct timeval and its alignment padding */
+typedef struct DiskDumpHeader32 {
+    char signature[SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[10];
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;          /* in blocks */
+    uint32_t bitmap_blocks;         /* both bitmaps */
+    uint32_t max_mapnr;             /* obsoleted by max_mapnr_64 */
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} __attribute__((packed)) DiskDumpHeader32;
+
+typedef struct DiskDumpHeader64 {
+    char signature[SIG_LEN];
+    uint32_t header_version;
+    NewUtsname utsname;
+    char timestamp[22];
+    uint32_t status;
+    uint32_t block_size;
+    uint32_t sub_hdr_size;
+    uint32_t bitmap_blocks;
+    uint32_t max_mapnr;
+    uint32_t total_ram_blocks;
+    uint32_t device_blocks;
+    uint32_t written_blocks;
+    uint32_t current_cpu;
+    uint32_t nr_cpus;
+} __attribute__((packed)) DiskDumpHeader64;
+
+typedef struct KdumpSubHeader32 {
+    uint32_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint32_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint32_t note_size;
+    uint64_t offset_eraseinfo;
+    uint32_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} __attribute__((packed)) KdumpSubHeader32;
+
+typedef struct KdumpSubHeader64 {
+    uint64_t phys_base;
+    uint32_t dump_level;
+    uint32_t split;
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    uint64_t offset_vmcoreinfo;
+    uint64_t size_vmcoreinfo;
+    uint64_t offset_note;
+    uint64_t note_size;
+    uint64_t offset_eraseinfo;
+    uint64_t size_eraseinfo;
+    uint64_t start_pfn_64;
+    uint64_t end_pfn_64;
+    uint64_t max_mapnr_64;
+} __attribute__((packed)) KdumpSubHeader64;
+
+typedef struct PageDescriptor {
+    uint64_t offset;                /* of the page data in the file */
+    uint32_t size;                  /* of the page data */
+    uint32_t flags;                 /* DUMP_DH_COMPRESSED_*, 0 if raw */
+    uint64_t page_flags;
+} __attribute__((packed)) PageDescriptor;
+
+
 #endif
@@ -45,6 +45,9 @@
 #include "hw/qdev.h"
 #include "osdep.h"
 #include "kvm.h"
+#include "sysemu.h"
+#include "qemu-prealloc.h"
+#include "bitmap.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #endif
@@ -1666,8 +1669,48 @@ static int cpu_notify_migration_log(int enable)
     return 0;
 }
 
+/* Pages are reported to a newly registered client in runs: consecutive
+ * RAM or ROM pages whose ram addresses are contiguous within one RAM
+ * block are passed in a single set_memory call, instead of one call per
+ * page.  Clients take the host address of the whole run from its first
+ * page, so a run never crosses into the next block. */
+typedef struct PhysPageRun {
+    target_phys_addr_t start_addr;
+    ram_addr_t size;
+    ram_addr_t phys_offset;
+} PhysPageRun;
+
+static void phys_page_run_flush(CPUPhysMemoryClient *client, PhysPageRun *run)
+{
+    if (run->size) {
+        client->set_memory(client, run->start_addr, run->size,
+                           run->phys_offset);
+        run->size = 0;
+    }
+}
+
+static void phys_page_run_add(CPUPhysMemoryClient *client, PhysPageRun *run,
+                              target_phys_addr_t addr, ram_addr_t phys_offset)
+{
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    if (run->size && (flags == IO_MEM_RAM || flags == IO_MEM_ROM) &&
+        addr == run->start_addr + run->size &&
+        phys_offset == run->phys_offset + run->size &&
+        qemu_ram_range_in_block(run->phys_offset & TARGET_PAGE_MASK,
+                                run->size + TARGET_PAGE_SIZE)) {
+        run->size += TARGET_PAGE_SIZE;
+        return;
+    }
+    phys_page_run_flush(client, run);
+    run->start_addr = addr;
+    run->size = TARGET_PAGE_SIZE;
+    run->phys_offset = phys_offset;
+}
+
 static void phys_page_for_each_in_l1_map(PhysPageDesc **phys_map,
                                          CPUPhysMemoryClient *client,
+                                         PhysPageRun *run,
                                          target_phys_addr_t o)
 {
     PhysPageDesc *pd;
@@ -1682,15 +1725,16 @@ static void phys_page_for_each_in_l1_map(PhysPageDesc **phys_map,
             if (pd[l2].phys_offset == IO_MEM_UNASSIGNED) {
                 continue;
             }
-            client->set_memory(client,
-                               (((o + l1) << L2_BITS) + l2) << TARGET_PAGE_BITS,
-                               TARGET_PAGE_SIZE, pd[l2].phys_offset);
+            phys_page_run_add(client, run,
+                              (((o + l1) << L2_BITS) + l2) << TARGET_PAGE_BITS,
+                              pd[l2].phys_offset);
         }
     }
 }
 
 static void phys_page_for_each(CPUPhysMemoryClient *client)
 {
+    PhysPageRun run = { .size = 0 };
 #if TARGET_PHYS_ADDR_SPACE_BITS > 32
 
 #if TARGET_PHYS_ADDR_SPACE_BITS > (32 + L1_BITS)
@@ -1703,15 +1747,17 @@ static void phys_page_for_each(CPUPhysMemoryClient *client)
     }
     for (l1 = 0; l1 < L1_SIZE; ++l1) {
         if (phys_map[l1]) {
-            phys_page_for_each_in_l1_map(phys_map[l1], client, l1 << L1_BITS);
+            phys_page_for_each_in_l1_map(phys_map[l1], client, &run,
+                                         l1 << L1_BITS);
         }
     }
 #else
     if (!l1_phys_map) {
         return;
     }
-    phys_page_for_each_in_l1_map(l1_phys_map, client, 0);
+    phys_page_for_each_in_l1_map(l1_phys_map, client, &run, 0);
 #endif
+    phys_page_run_flush(client, &run);
 }
 
 void cpu_register_phys_memory_client(CPUPhysMemoryClient *client)
@@ -1990,6 +2036,41 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Set bit N of 'bitmap' if any of 'dirty_flags' is set for the Nth page
+   of [start, end).  Clean stretches are skipped eight pages at a time, so
+   asking once for a whole framebuffer is cheaper than testing each page. */
+void cpu_physical_memory_get_dirty_bitmap(ram_addr_t start, ram_addr_t end,
+                                          int dirty_flags,
+                                          unsigned long *bitmap)
+{
+    uint64_t mask = 0x0101010101010101ULL * (uint8_t)dirty_flags;
+    const uint8_t *p;
+    long i, n, len;
+
+    start &= TARGET_PAGE_MASK;
+    end = TARGET_PAGE_ALIGN(end);
+    len = (end - start) >> TARGET_PAGE_BITS;
+    p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
+
+    bitmap_zero(bitmap, len);
+    for (i = 0; i < len; i = n) {
+        n = MIN(i + 8, len);
+        if (n - i == 8) {
+            uint64_t v;
+
+            memcpy(&v, p + i, sizeof(v));
+            if (!(v & mask)) {
+                continue;
+            }
+        }
+        for (; i < n; i++) {
+            if (p[i] & dirty_flags) {
+                set_bit(i, bitmap);
+            }
+        }
+    }
+}
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -2000,6 +2081,9 @@ int cpu_physical_memory_set_dirty_tracking(int enable)
         return ret;
     }
     ret = cpu_notify_migration_log(!!enable);
+    if (ret == 0) {
+        in_migration = !!enable;
+    }
     return ret;
 }
 
@@ -2527,12 +2611,81 @@ void qemu_unregister_coalesced_mmio(target_phys_addr_t addr, ram_addr_t size)
         kvm_uncoalesce_mmio_region(addr, size);
 }
 
+void qemu_register_coalesced_pio(pio_addr_t addr, pio_addr_t size)
+{
+    if (kvm_enabled()) {
+        kvm_coalesce_pio_region(addr, size);
+    }
+}
+
+void qemu_unregister_coalesced_pio(pio_addr_t addr, pio_addr_t size)
+{
+    if (kvm_enabled()) {
+        kvm_uncoalesce_pio_region(addr, size);
+    }
+}
+
 #ifdef __linux__
 
 #include <sys/vfs.h>
+#include <sys/syscall.h>
 
 #define HUGETLBFS_MAGIC       0x958458f6
 
+static bool ram_numa_has_policy(void)
+{
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (node_mem_policy[i] != NUMA_POLICY_DEFAULT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Apply the -numa host-nodes/policy of each guest node to its part of
+ * @host.  Guest nodes take consecutive ranges of RAM, in the order in which
+ * the BIOS describes them to the guest.  The memory must not have been
+ * touched yet; if @prealloc, it is faulted in afterwards so that it comes
+ * from the chosen nodes, by threads running on those nodes.
+ */
+static void ram_numa_setup(void *host, ram_addr_t size,
+                           unsigned long pagesize, bool prealloc)
+{
+    int threads = qemu_prealloc_threads();
+    uint64_t node_start = 0;
+    ram_addr_t start, end;
+    int i;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        start = MIN(node_start & ~(uint64_t)(pagesize - 1), size);
+        node_start += node_mem[i];
+        end = i == nb_numa_nodes - 1 ? size :
+              MIN(node_start & ~(uint64_t)(pagesize - 1), size);
+        if (end <= start) {
+            continue;
+        }
+        if (node_mem_policy[i] != NUMA_POLICY_DEFAULT &&
+            syscall(__NR_mbind, (char *)host + start, end - start,
+                    node_mem_policy[i], node_host_nodes[i],
+                    MAX_HOST_NODES + 1, 0) < 0) {
+            fprintf(stderr, "qemu: cannot bind memory of NUMA node %d: %s\n",
+                    i, strerror(errno));
+            exit(1);
+        }
+        if (prealloc) {
+            bool local = node_mem_policy[i] == NUMA_POLICY_BIND ||
+                         node_mem_policy[i] == NUMA_POLICY_PREFERRED;
+
+            qemu_prealloc((char *)host + start, end - start, pagesize,
+                          MAX(1, (uint64_t)threads * (end - start) / size),
+                          local ? node_host_nodes[i] : NULL, MAX_HOST_NODES);
+        }
+    }
+}
+
 static long gethugepagesize(const char *path)
 {
     struct statfs fs;
@@ -2555,14 +2708,13 @@ static long gethugepagesize(const char *path)
 
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            bool numa)
 {
     char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     if (!path) {
@@ -2608,28 +2760,36 @@ static void *file_ram_alloc(RAMBlock *block,
         perror("ftruncate");
     }
 
-#ifdef MAP_POPULATE
-    /* NB: MAP_POPULATE won't exhaustively alloc all phys pages in the case
-     * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
-     * to sidestep this quirk.
+    /* NB: touching a MAP_PRIVATE mapping would not allocate all the pages
+     * a later write needs, so for mem_prealloc we mmap as MAP_SHARED.
+     * Rather than MAP_POPULATE, which faults in one page at a time from
+     * this thread, the pages are touched by qemu_prealloc() threads until
+     * the VM starts.
      */
-    flags = mem_prealloc ? MAP_POPULATE|MAP_SHARED : MAP_PRIVATE;
+    flags = mem_prealloc ? MAP_SHARED : MAP_PRIVATE;
     area = mmap(0, memory, PROT_READ|PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-#endif
     if (area == MAP_FAILED) {
 	perror("alloc_mem_area: can't mmap hugetlbfs pages");
 	close(fd);
 	return (NULL);
     }
     block->fd = fd;
+    if (flags & MAP_SHARED) {
+        block->flags |= RAM_SHARED_MASK;
+    }
+    if (numa) {
+        ram_numa_setup(area, memory, hpagesize, mem_prealloc);
+    } else if (mem_prealloc) {
+        qemu_prealloc(area, memory, hpagesize, qemu_prealloc_threads(),
+                      NULL, 0);
+    }
     return area;
 }
 
 #else
 
-static void *file_ram_alloc(ram_addr_t memory, const char *path)
+static void *file_ram_alloc(RAMBlock *block, ram_addr_t memory,
+                            const char *path, bool numa)
 {
     return NULL;
 }
@@ -2720,8 +2880,8 @@ static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
     }
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
-                                   ram_addr_t size, void *host)
+static ram_addr_t ram_block_alloc(DeviceState *dev, const char *name,
+                                  ram_addr_t size, void *host, bool numa)
 {
     RAMBlock *new_block, *block;
 
@@ -2745,6 +2905,10 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
         }
     }
     pstrcat(new_block->idstr, sizeof(new_block->idstr), name);
+    /* Main memory is what gets a NUMA policy */
+    if (numa) {
+        new_block->flags |= RAM_SYSTEM_MASK;
+    }
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (!strcmp(block->idstr, new_block->idstr)) {
@@ -2758,7 +2922,12 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
     } else {
-        new_block->host = file_ram_alloc(new_block, size, mem_path);
+#ifdef __linux__
+        numa = numa && ram_numa_has_policy();
+#else
+        numa = false;
+#endif
+        new_block->host = file_ram_alloc(new_block, size, mem_path, numa);
         if (!new_block->host) {
 #if defined(TARGET_S390X) && defined(CONFIG_KVM)
             /* XXX S390 KVM requires the topmost vma of the RAM to be < 256GB */
@@ -2794,6 +2963,11 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
 #endif
 #ifdef MADV_HUGEPAGE
             madvise(new_block->host, size, MADV_HUGEPAGE);
+#endif
+#ifdef __linux__
+            if (numa) {
+                ram_numa_setup(new_block->host, size, getpagesize(), false);
+            }
 #endif
         }
     }
@@ -2818,9 +2992,21 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
     return new_block->offset;
 }
 
+ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
+                                   ram_addr_t size, void *host)
+{
+    return ram_block_alloc(dev, name, size, host, false);
+}
+
 ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name, ram_addr_t size)
 {
-    return qemu_ram_alloc_from_ptr(dev, name, size, NULL);
+    return ram_block_alloc(dev, name, size, NULL, false);
+}
+
+ram_addr_t qemu_ram_alloc_numa(DeviceState *dev, const char *name,
+                               ram_addr_t size)
+{
+    return ram_block_alloc(dev, name, size, NULL, true);
 }
 
 void qemu_ram_free(ram_addr_t addr)
@@ -2956,6 +3142,20 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
     return NULL;
 }
 
+/* Whether [addr, addr + size) lies within a single RAM block, so that its
+ * host addresses are contiguous too */
+bool qemu_ram_range_in_block(ram_addr_t addr, ram_addr_t size)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            return size <= block->length - (addr - block->offset);
+        }
+    }
+    return false;
+}
+
 int do_qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
 {
     RAMBlock *block;
@@ -2970,6 +3170,32 @@ int do_qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
     return -1;
 }
 
+/* Return an fd through which another process can map the shared guest
+ * RAM at ptr, or -1 if that memory is private to this process.  *offset is
+ * set to the position of ptr in the fd and *length to the number of bytes
+ * from ptr to the end of its block, private or not; *length is 0 if ptr
+ * is not guest RAM at all. */
+int qemu_ram_get_fd(void *ptr, ram_addr_t *offset, ram_addr_t *length)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (host - block->host < block->length) {
+            *offset = host - block->host;
+            *length = block->length - *offset;
+            if (!block->fd || !(block->flags & RAM_SHARED_MASK)) {
+                return -1;
+            }
+            return block->fd;
+        }
+    }
+#endif
+    *length = 0;
+    return -1;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr)
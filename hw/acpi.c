@@ -78,6 +78,7 @@ typedef struct PIIX4PMState {
     qemu_irq irq;
 
     uint32_t smb_io_base;
+    uint32_t pmtmr_unlocked_port;   /* 0 if the vcpus read PM_TMR locked */
     Notifier machine_ready;
     Notifier wakeup;
 
@@ -481,10 +482,29 @@ static uint32_t smb_ioport_readb(void *opaque, uint32_t addr)
     return val;
 }
 
+/* PM_TMR only reads vm_clock, so vcpus polling it need not serialize on
+ * qemu_mutex: they read it from the lock-free snapshot of its state */
+static int pm_tmr_read_unlocked(void *opaque, uint64_t addr, uint64_t *data,
+                                unsigned size, bool is_write)
+{
+    int64_t now;
+
+    if (is_write || size != 4 || qemu_get_vm_clock_unlocked(&now) < 0) {
+        return -1;
+    }
+    *data = muldiv64(now, PM_FREQ, get_ticks_per_sec()) & 0xffffff;
+    return 0;
+}
+
 static void pm_io_space_update(PIIX4PMState *s)
 {
     uint32_t pm_io_base;
 
+    if (s->pmtmr_unlocked_port) {
+        kvm_unregister_unlocked_io(true, s->pmtmr_unlocked_port, s);
+        s->pmtmr_unlocked_port = 0;
+    }
+
     if (s->dev.config[0x80] & 1) {
         pm_io_base = le32_to_cpu(*(uint32_t *)(s->dev.config + 0x40));
         pm_io_base &= 0xffc0;
@@ -497,6 +517,12 @@ static void pm_io_space_update(PIIX4PMState *s)
         register_ioport_read(pm_io_base, 64, 2, pm_ioport_readw, s);
         register_ioport_write(pm_io_base, 64, 4, pm_ioport_writel, s);
         register_ioport_read(pm_io_base, 64, 4, pm_ioport_readl, s);
+
+        if (pm_io_base &&
+            kvm_register_unlocked_io(true, pm_io_base + 0x08, 4,
+                                     pm_tmr_read_unlocked, s) == 0) {
+            s->pmtmr_unlocked_port = pm_io_base + 0x08;
+        }
     }
 }
 
@@ -296,6 +296,7 @@ static void cirrus_bitblt_fill_nop(CirrusVGAState *s,
 
 #define ROP_NAME src
 #define ROP_OP(d, s) d = s
+#define ROP_COPY
 #include "cirrus_vga_rop.h"
 
 #define ROP_NAME 1
@@ -3091,7 +3092,7 @@ static void cirrus_init_common(CirrusVGAState * s, int device_id, int is_pci)
                                                   cirrus_vga_mem_write, s);
     cpu_register_physical_memory(isa_mem_base + 0x000a0000, 0x20000,
                                  s->vga.vga_io_memory);
-    qemu_register_coalesced_mmio(isa_mem_base + 0x000a0000, 0x20000);
+    vga_register_coalesced_io();
 
     /* I/O handler for LFB */
     s->cirrus_linear_io_addr =
@@ -3140,6 +3141,7 @@ void isa_cirrus_vga_init(void)
     s->vga.ds = graphic_console_init(s->vga.update, s->vga.invalidate,
                                      s->vga.screen_dump, s->vga.text_update,
                                      &s->vga);
+    vga_init_idle(&s->vga);
     vmstate_register(NULL, 0, &vmstate_cirrus_vga, s);
     rom_add_vga(VGABIOS_CIRRUS_FILENAME);
     /* XXX ISA-LFB support */
@@ -3212,6 +3214,7 @@ static int pci_cirrus_vga_initfn(PCIDevice *dev)
      s->vga.ds = graphic_console_init(s->vga.update, s->vga.invalidate,
                                       s->vga.screen_dump, s->vga.text_update,
                                       &s->vga);
+     vga_init_idle(&s->vga);
 
      /* setup PCI */
      pci_config_set_vendor_id(pci_conf, PCI_VENDOR_ID_CIRRUS);
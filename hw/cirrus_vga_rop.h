@@ -22,6 +22,17 @@
  * THE SOFTWARE.
  */
 
+/*
+ * ROP_COPY is defined for the plain source copy.  It gets fast paths for
+ * the blits that dominate scrolling, window moves and text drawing; every
+ * other combination uses the byte loops below.
+ */
+
+#if defined(ROP_COPY) && defined(__SSE2__)
+#include <emmintrin.h>
+#define ROP_SSE2
+#endif
+
 static void
 glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
                              uint8_t *dst,const uint8_t *src,
@@ -38,6 +49,16 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     }
 
     for (y = 0; y < bltheight; y++) {
+#ifdef ROP_COPY
+        /* an ascending byte copy is a memmove, unless the destination
+           starts inside the source and repeats its first bytes */
+        if (dst - src <= 0 || dst - src >= bltwidth) {
+            memmove(dst, src, bltwidth);
+            dst += bltwidth + dstpitch;
+            src += bltwidth + srcpitch;
+            continue;
+        }
+#endif
         for (x = 0; x < bltwidth; x++) {
             ROP_OP(*dst, *src);
             dst++;
@@ -58,6 +79,15 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
+#ifdef ROP_COPY
+        /* dst and src point at the last byte of the row */
+        if (dst - src >= 0 || dst - src <= -bltwidth) {
+            memmove(dst - bltwidth + 1, src - bltwidth + 1, bltwidth);
+            dst += dstpitch - bltwidth;
+            src += srcpitch - bltwidth;
+            continue;
+        }
+#endif
         for (x = 0; x < bltwidth; x++) {
             ROP_OP(*dst, *src);
             dst--;
@@ -182,5 +212,7 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 #define DEPTH 32
 #include "cirrus_vga_rop2.h"
 
+#undef ROP_SSE2
+#undef ROP_COPY
 #undef ROP_NAME
 #undef ROP_OP
@@ -36,6 +36,49 @@
 #error unsupported DEPTH
 #endif
 
+#if defined(ROP_SSE2) && DEPTH != 24
+/* Store col to the pixels of d whose bit is set in bits, msb first: eight
+   pixels, i.e. 8, 16 or 32 bytes */
+static inline void
+glue(glue(glue(cirrus_expand8_, ROP_NAME), _),DEPTH)(uint8_t *d, unsigned bits,
+                                                     __m128i col)
+{
+#if DEPTH == 8
+    const __m128i bit = _mm_set_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                     0x01, 0x02, 0x04, 0x08,
+                                     0x10, 0x20, 0x40, 0x80);
+    __m128i mask = _mm_and_si128(_mm_set1_epi8(bits), bit);
+    __m128i v = _mm_loadl_epi64((__m128i *)d);
+
+    mask = _mm_cmpeq_epi8(mask, bit);
+    v = _mm_or_si128(_mm_andnot_si128(mask, v), _mm_and_si128(mask, col));
+    _mm_storel_epi64((__m128i *)d, v);
+#elif DEPTH == 16
+    const __m128i bit = _mm_set_epi16(0x01, 0x02, 0x04, 0x08,
+                                      0x10, 0x20, 0x40, 0x80);
+    __m128i mask = _mm_and_si128(_mm_set1_epi16(bits), bit);
+    __m128i v = _mm_loadu_si128((__m128i *)d);
+
+    mask = _mm_cmpeq_epi16(mask, bit);
+    v = _mm_or_si128(_mm_andnot_si128(mask, v), _mm_and_si128(mask, col));
+    _mm_storeu_si128((__m128i *)d, v);
+#else
+    const __m128i bit_hi = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i bit_lo = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+    __m128i b = _mm_set1_epi32(bits);
+    __m128i mask0 = _mm_cmpeq_epi32(_mm_and_si128(b, bit_hi), bit_hi);
+    __m128i mask1 = _mm_cmpeq_epi32(_mm_and_si128(b, bit_lo), bit_lo);
+    __m128i v0 = _mm_loadu_si128((__m128i *)d);
+    __m128i v1 = _mm_loadu_si128((__m128i *)(d + 16));
+
+    v0 = _mm_or_si128(_mm_andnot_si128(mask0, v0), _mm_and_si128(mask0, col));
+    v1 = _mm_or_si128(_mm_andnot_si128(mask1, v1), _mm_and_si128(mask1, col));
+    _mm_storeu_si128((__m128i *)d, v0);
+    _mm_storeu_si128((__m128i *)(d + 16), v1);
+#endif
+}
+#endif
+
 static void
 glue(glue(glue(cirrus_patternfill_, ROP_NAME), _),DEPTH)
      (CirrusVGAState * s, uint8_t * dst,
@@ -111,6 +154,9 @@ glue(glue(glue(cirrus_colorexpand_transp_, ROP_NAME), _),DEPTH)
     int srcskipleft = s->vga.gr[0x2f] & 0x07;
     int dstskipleft = srcskipleft * (DEPTH / 8);
 #endif
+#if defined(ROP_SSE2) && DEPTH != 24
+    __m128i colv;
+#endif
 
     if (s->cirrus_blt_modeext & CIRRUS_BLTMODEEXT_COLOREXPINV) {
         bits_xor = 0xff;
@@ -119,6 +165,13 @@ glue(glue(glue(cirrus_colorexpand_transp_, ROP_NAME), _),DEPTH)
         bits_xor = 0x00;
         col = s->cirrus_blt_fgcol;
     }
+#if defined(ROP_SSE2) && DEPTH == 8
+    colv = _mm_set1_epi8(col);
+#elif defined(ROP_SSE2) && DEPTH == 16
+    colv = _mm_set1_epi16(col);
+#elif defined(ROP_SSE2) && DEPTH == 32
+    colv = _mm_set1_epi32(col);
+#endif
 
     for(y = 0; y < bltheight; y++) {
         bitmask = 0x80 >> srcskipleft;
@@ -129,6 +182,18 @@ glue(glue(glue(cirrus_colorexpand_transp_, ROP_NAME), _),DEPTH)
                 bitmask = 0x80;
                 bits = *src++ ^ bits_xor;
             }
+#if defined(ROP_SSE2) && DEPTH != 24
+            /* a whole source byte at once; glyphs are mostly drawn from
+               byte aligned bitmaps */
+            if (bitmask == 0x80 && bltwidth - x >= 8 * (DEPTH / 8)) {
+                glue(glue(glue(cirrus_expand8_, ROP_NAME), _),DEPTH)(d, bits,
+                                                                     colv);
+                d += 8 * (DEPTH / 8);
+                x += 7 * (DEPTH / 8);
+                bitmask = 0;
+                continue;
+            }
+#endif
             index = (bits & bitmask);
             if (index) {
                 PUTPIXEL();
@@ -263,9 +328,34 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
     uint8_t *d, *d1;
     uint32_t col;
     int x, y;
+#ifdef ROP_COPY
+    /* 48 bytes are a whole number of pixels at every depth */
+    uint8_t pattern[48];
+    int len;
+#endif
 
     col = s->cirrus_blt_fgcol;
 
+#ifdef ROP_COPY
+    /* every row is the same run of pixels: build a piece of it once and
+       copy that, which the compiler turns into wide stores */
+    d = pattern;
+    for (x = 0; x < sizeof(pattern); x += (DEPTH / 8)) {
+        PUTPIXEL();
+        d += (DEPTH / 8);
+    }
+    /* like the loop below, finish the last pixel */
+    len = (width + (DEPTH / 8) - 1) / (DEPTH / 8) * (DEPTH / 8);
+
+    d1 = dst;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x + (int)sizeof(pattern) <= len; x += sizeof(pattern)) {
+            memcpy(d1 + x, pattern, sizeof(pattern));
+        }
+        memcpy(d1 + x, pattern, len - x);
+        d1 += dst_pitch;
+    }
+#else
     d1 = dst;
     for(y = 0; y < height; y++) {
         d = d1;
@@ -275,6 +365,7 @@ glue(glue(glue(cirrus_fill_, ROP_NAME), _),DEPTH)
         }
         d1 += dst_pitch;
     }
+#endif
 }
 
 #undef DEPTH
@@ -22,24 +22,14 @@
 void *hostmem_lookup(HostMem *hostmem, uint64_t phys, uint64_t len,
                      bool is_write)
 {
-    struct vhost_memory_region *found = NULL;
+    struct vhost_memory_region *found;
     void *host_addr = NULL;
     uint64_t offset_within_region;
-    unsigned int i;
 
     is_write = is_write; /*r/w information is currently not tracked */
 
     qemu_mutex_lock(&hostmem->mem_lock);
-    for (i = 0; i < hostmem->mem->nregions; i++) {
-        struct vhost_memory_region *region = &hostmem->mem->regions[i];
-
-        if (range_covers_byte(region->guest_phys_addr,
-                              region->memory_size,
-                              phys)) {
-            found = region;
-            break;
-        }
-    }
+    found = vhost_mem_find_region(hostmem->mem, phys);
     if (!found) {
         goto out;
     }
@@ -62,7 +52,7 @@ static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
     HostMem *hostmem = container_of(client, HostMem, client);
     ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
     size_t s = offsetof(struct vhost_memory, regions) +
-               (hostmem->mem->nregions + 1) * sizeof hostmem->mem->regions[0];
+               (hostmem->mem->nregions + 2) * sizeof hostmem->mem->regions[0];
 
     /* TODO: this is a hack.
      * At least one vga card (cirrus) changes the gpa to hva
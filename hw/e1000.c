@@ -1219,28 +1219,23 @@ static CPUReadMemoryFunc * const e1000_mmio_read[] = {
     e1000_mmio_readb,	e1000_mmio_readw,	e1000_mmio_readl
 };
 
+/* Writes to these raise interrupts or start transmission, so they must reach
+ * the device at once; everything else in the BAR is coalesced */
+static const uint32_t e1000_excluded_regs[] = {
+    E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
+    E1000_IMC, E1000_TCTL, E1000_TDT, PNPMMIO_SIZE
+};
+
 static void
 e1000_mmio_map(PCIDevice *pci_dev, int region_num,
                 pcibus_t addr, pcibus_t size, int type)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, pci_dev);
-    int i;
-    const uint32_t excluded_regs[] = {
-        E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
-        E1000_IMC, E1000_TCTL, E1000_TDT, PNPMMIO_SIZE
-    };
-
 
     DBGOUT(MMIO, "e1000_mmio_map addr=0x%08"FMT_PCIBUS" 0x%08"FMT_PCIBUS"\n",
            addr, size);
 
     cpu_register_physical_memory(addr, PNPMMIO_SIZE, d->mmio_index);
-    qemu_register_coalesced_mmio(addr, excluded_regs[0]);
-
-    for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
-        qemu_register_coalesced_mmio(addr + excluded_regs[i] + 4,
-                                     excluded_regs[i + 1] -
-                                     excluded_regs[i] - 4);
 }
 
 static void
@@ -1303,6 +1298,12 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     pci_register_bar((PCIDevice *)d, 0, PNPMMIO_SIZE,
                            PCI_BASE_ADDRESS_SPACE_MEMORY, e1000_mmio_map);
+    pci_register_bar_coalesced(&d->dev, 0, 0, e1000_excluded_regs[0]);
+    for (i = 0; e1000_excluded_regs[i] != PNPMMIO_SIZE; i++) {
+        pci_register_bar_coalesced(&d->dev, 0, e1000_excluded_regs[i] + 4,
+                                   e1000_excluded_regs[i + 1] -
+                                   e1000_excluded_regs[i] - 4);
+    }
 
     pci_register_bar((PCIDevice *)d, 1, IOPORT_SIZE,
                            PCI_BASE_ADDRESS_SPACE_IO, ioport_map);
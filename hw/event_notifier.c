@@ -53,6 +53,15 @@ int event_notifier_test_and_clear(EventNotifier *e)
 	return r == sizeof(value);
 }
 
+/* Like event_notifier_test_and_clear(), but return how many times the
+ * notifier was set since it was last cleared */
+uint64_t event_notifier_test_and_clear_count(EventNotifier *e)
+{
+    uint64_t value;
+    int r = read(e->fd, &value, sizeof(value));
+    return r == sizeof(value) ? value : 0;
+}
+
 int event_notifier_test(EventNotifier *e)
 {
 	uint64_t value;
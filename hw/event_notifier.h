@@ -12,6 +12,7 @@ void event_notifier_cleanup(EventNotifier *);
 int event_notifier_get_fd(EventNotifier *);
 int event_notifier_set(EventNotifier *);
 int event_notifier_test_and_clear(EventNotifier *);
+uint64_t event_notifier_test_and_clear_count(EventNotifier *);
 int event_notifier_test(EventNotifier *);
 
 #endif
@@ -1181,8 +1181,8 @@ static void pc_init1(ram_addr_t ram_size,
          */
         ram_addr = qemu_ram_alloc(NULL, "pc.ram", 1);
     } else {
-    ram_addr = qemu_ram_alloc(NULL, "pc.ram",
-                              below_4g_mem_size + above_4g_mem_size);
+    ram_addr = qemu_ram_alloc_numa(NULL, "pc.ram",
+                                   below_4g_mem_size + above_4g_mem_size);
     cpu_register_physical_memory(0, 0xa0000, ram_addr);
     cpu_register_physical_memory(0x100000,
                  below_4g_mem_size - 0x100000,
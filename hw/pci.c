@@ -763,6 +763,39 @@ static target_phys_addr_t pci_to_cpu_addr(target_phys_addr_t addr)
     return addr + pci_mem_base;
 }
 
+static void pci_coalesce_range(PCIIORegion *r, PCICoalescedRange *range,
+                               bool coalesce)
+{
+    pcibus_t size;
+
+    if (range->offset >= r->filtered_size) {
+        return;
+    }
+    size = MIN(range->size, r->filtered_size - range->offset);
+    if (r->type & PCI_BASE_ADDRESS_SPACE_IO) {
+        if (coalesce) {
+            qemu_register_coalesced_pio(r->addr + range->offset, size);
+        } else {
+            qemu_unregister_coalesced_pio(r->addr + range->offset, size);
+        }
+    } else {
+        if (coalesce) {
+            qemu_register_coalesced_mmio(r->addr + range->offset, size);
+        } else {
+            qemu_unregister_coalesced_mmio(r->addr + range->offset, size);
+        }
+    }
+}
+
+static void pci_coalesce_region(PCIIORegion *r, bool coalesce)
+{
+    int i;
+
+    for (i = 0; i < r->nb_coalesced; i++) {
+        pci_coalesce_range(r, &r->coalesced[i], coalesce);
+    }
+}
+
 static void pci_unregister_io_regions(PCIDevice *pci_dev)
 {
     PCIIORegion *r;
@@ -770,6 +803,12 @@ static void pci_unregister_io_regions(PCIDevice *pci_dev)
 
     for(i = 0; i < PCI_NUM_REGIONS; i++) {
         r = &pci_dev->io_regions[i];
+        if (r->addr != PCI_BAR_UNMAPPED) {
+            pci_coalesce_region(r, false);
+        }
+        qemu_free(r->coalesced);
+        r->coalesced = NULL;
+        r->nb_coalesced = 0;
         if (!r->size || r->addr == PCI_BAR_UNMAPPED)
             continue;
         if (r->type == PCI_BASE_ADDRESS_SPACE_IO) {
@@ -841,6 +880,25 @@ void pci_register_bar(PCIDevice *pci_dev, int region_num,
     }
 }
 
+void pci_register_bar_coalesced(PCIDevice *pci_dev, int region_num,
+                                pcibus_t offset, pcibus_t size)
+{
+    PCIIORegion *r = &pci_dev->io_regions[region_num];
+    PCICoalescedRange *range;
+
+    assert(region_num < PCI_NUM_REGIONS && offset + size <= r->size);
+
+    r->coalesced = qemu_realloc(r->coalesced,
+                                (r->nb_coalesced + 1) * sizeof(*r->coalesced));
+    range = &r->coalesced[r->nb_coalesced++];
+    range->offset = offset;
+    range->size = size;
+
+    if (r->addr != PCI_BAR_UNMAPPED) {
+        pci_coalesce_range(r, range, true);
+    }
+}
+
 static uint32_t pci_config_get_io_base(PCIDevice *d,
                                        uint32_t base, uint32_t base_upper16)
 {
@@ -1037,6 +1095,7 @@ static void pci_update_mappings(PCIDevice *d)
 
         /* now do the real mapping */
         if (r->addr != PCI_BAR_UNMAPPED) {
+            pci_coalesce_region(r, false);
             if (r->type & PCI_BASE_ADDRESS_SPACE_IO) {
                 int class;
                 /* NOTE: specific hack for IDE in PC case:
@@ -1065,6 +1124,7 @@ static void pci_update_mappings(PCIDevice *d)
              * addr & (size - 1) != 0.
              */
             r->map_func(d, i, r->addr, r->filtered_size, r->type);
+            pci_coalesce_region(r, true);
         }
     }
 }
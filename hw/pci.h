@@ -89,6 +89,11 @@ typedef void PCIMapIORegionFunc(PCIDevice *pci_dev, int region_num,
                                 pcibus_t addr, pcibus_t size, int type);
 typedef int PCIUnregisterFunc(PCIDevice *pci_dev);
 
+typedef struct PCICoalescedRange {
+    pcibus_t offset;
+    pcibus_t size;
+} PCICoalescedRange;
+
 typedef struct PCIIORegion {
     pcibus_t addr; /* current PCI mapping address. -1 means not mapped */
 #define PCI_BAR_UNMAPPED (~(pcibus_t)0)
@@ -96,6 +101,8 @@ typedef struct PCIIORegion {
     pcibus_t filtered_size;
     uint8_t type;
     PCIMapIORegionFunc *map_func;
+    PCICoalescedRange *coalesced;
+    int nb_coalesced;
 } PCIIORegion;
 
 #define PCI_ROM_SLOT 6
@@ -215,6 +222,12 @@ PCIDevice *pci_register_device(PCIBus *bus, const char *name,
 void pci_register_bar(PCIDevice *pci_dev, int region_num,
                             pcibus_t size, int type,
                             PCIMapIORegionFunc *map_func);
+/* Let writes to [offset, offset + size) of a BAR be buffered and replayed in
+ * order at the next exit, see qemu_register_coalesced_mmio().  Only for
+ * registers whose writes the device need not see until it is next accessed
+ * outside such ranges.  The ranges follow the BAR as it is remapped. */
+void pci_register_bar_coalesced(PCIDevice *pci_dev, int region_num,
+                                pcibus_t offset, pcibus_t size);
 
 void pci_map_option_rom(PCIDevice *pdev, int region_num, pcibus_t addr,
                         pcibus_t size, int type);
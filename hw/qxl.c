@@ -137,6 +137,8 @@ static QXLMode qxl_modes[] = {
 };
 
 static PCIQXLDevice *qxl0;
+static QLIST_HEAD(, PCIQXLDevice) qxl_devices =
+    QLIST_HEAD_INITIALIZER(qxl_devices);
 
 static void qxl_send_events(PCIQXLDevice *d, uint32_t events);
 static int qxl_destroy_primary(PCIQXLDevice *d, qxl_async_io async);
@@ -445,9 +447,43 @@ static void qxl_ring_set_dirty(PCIQXLDevice *qxl)
 {
     ram_addr_t addr = qxl->vga.vram_offset + qxl->shadow_rom.ram_header_offset;
     ram_addr_t end  = qxl->vga.vram_offset + qxl->vga.vram_size;
+    qxl->ring_dirty = 0;
     qxl_set_dirty(addr, end);
 }
 
+/*
+ * The spice server takes commands and returns resources one at a time.
+ * Its ring updates only record that the ring pages changed; they are
+ * marked once the server runs out of commands, and before the vm stops
+ * for migration or savevm.
+ */
+static void qxl_ring_defer_dirty(PCIQXLDevice *qxl)
+{
+    qxl->ring_dirty = 1;
+}
+
+static void qxl_ring_flush_dirty(PCIQXLDevice *qxl)
+{
+    if (qxl->ring_dirty) {
+        qxl_ring_set_dirty(qxl);
+    }
+}
+
+/* called from spice server thread context only */
+static void qxl_ring_batch_end(PCIQXLDevice *qxl)
+{
+    if (qxl->ring_batch_open) {
+        qxl->ring_batch_open = 0;
+        qxl->ring_batches++;
+    }
+}
+
+static void qxl_ring_command(PCIQXLDevice *qxl)
+{
+    qxl->ring_batch_open = 1;
+    qxl->ring_commands++;
+}
+
 /*
  * keep track of some command state, for savevm/loadvm.
  * called from spice server thread context only
@@ -628,6 +664,8 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
     case QXL_MODE_UNDEFINED:
         ring = &qxl->ram->cmd_ring;
         if (qxl->guest_bug || SPICE_RING_IS_EMPTY(ring)) {
+            qxl_ring_batch_end(qxl);
+            qxl_ring_flush_dirty(qxl);
             return false;
         }
         SPICE_RING_CONS_ITEM(qxl, ring, cmd);
@@ -638,10 +676,11 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        qxl_ring_defer_dirty(qxl);
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
+        qxl_ring_command(qxl);
         qxl->guest_primary.commands++;
         qxl_track_command(qxl, ext);
         qxl_log_command(qxl, "cmd", ext);
@@ -711,7 +750,7 @@ static inline void qxl_push_free_res(PCIQXLDevice *d, int flush)
     *item = 0;
     d->num_free_res = 0;
     d->last_release = NULL;
-    qxl_ring_set_dirty(d);
+    qxl_ring_defer_dirty(d);
 }
 
 /* called from spice server thread context only */
@@ -743,7 +782,7 @@ static void interface_release_resource(QXLInstance *sin,
         ext.info->next = 0;
         qxl_ram_set_dirty(qxl, &ext.info->next);
         *item = id;
-        qxl_ring_set_dirty(qxl);
+        qxl_ring_defer_dirty(qxl);
     } else {
         /* append item to the list */
         qxl->last_release->next = ext.info->id;
@@ -773,6 +812,7 @@ static int interface_get_cursor_command(QXLInstance *sin, struct QXLCommandExt *
     case QXL_MODE_UNDEFINED:
         ring = &qxl->ram->cursor_ring;
         if (SPICE_RING_IS_EMPTY(ring)) {
+            qxl_ring_flush_dirty(qxl);
             return false;
         }
         SPICE_RING_CONS_ITEM(qxl, ring, cmd);
@@ -783,7 +823,7 @@ static int interface_get_cursor_command(QXLInstance *sin, struct QXLCommandExt *
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        qxl_ring_defer_dirty(qxl);
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_CURSOR);
         }
@@ -843,6 +883,15 @@ static int interface_flush_resources(QXLInstance *sin)
 
 static void qxl_create_guest_primary_complete(PCIQXLDevice *d);
 
+static void qxl_io_stat_add(QXLIOStat *stat, int64_t ns)
+{
+    stat->count++;
+    stat->total_ns += ns;
+    if (stat->max_ns < ns) {
+        stat->max_ns = ns;
+    }
+}
+
 /* called from spice server thread context only */
 static void interface_async_complete_io(PCIQXLDevice *qxl, QXLCookie *cookie)
 {
@@ -853,6 +902,10 @@ static void interface_async_complete_io(PCIQXLDevice *qxl, QXLCookie *cookie)
     qxl->current_async = QXL_UNDEFINED_IO;
     qemu_mutex_unlock(&qxl->async_lock);
 
+    if (current_async < QXL_IO_STATS_SIZE) {
+        qxl_io_stat_add(&qxl->io_stats[current_async].complete,
+                        get_clock() - qxl->async_start);
+    }
     trace_qxl_interface_async_complete_io(qxl->id, current_async, cookie);
     if (!cookie) {
         fprintf(stderr, "qxl: %s: error, cookie is NULL\n", __func__);
@@ -1375,9 +1428,8 @@ static void qxl_set_mode(PCIQXLDevice *d, int modenr, int loadvm)
     qxl_rom_set_dirty(d);
 }
 
-static void ioport_write(void *opaque, uint32_t addr, uint32_t val)
+static void qxl_io_write(PCIQXLDevice *d, uint32_t addr, uint32_t val)
 {
-    PCIQXLDevice *d = opaque;
     uint32_t io_port = addr - d->io_base;
     qxl_async_io async = QXL_SYNC;
     uint32_t orig_io_port = io_port;
@@ -1451,6 +1503,7 @@ async_common:
             return;
         }
         d->current_async = orig_io_port;
+        d->async_start = get_clock();
         qemu_mutex_unlock(&d->async_lock);
         break;
     default:
@@ -1601,6 +1654,22 @@ cancel_async:
     }
 }
 
+/*
+ * Synchronous io waits for the spice worker on the vcpu thread.  The time
+ * shows in "info qxl", next to the completion time of the async forms.
+ */
+static void ioport_write(void *opaque, uint32_t addr, uint32_t val)
+{
+    PCIQXLDevice *d = opaque;
+    uint32_t io_port = addr - d->io_base;
+    int64_t start = get_clock();
+
+    qxl_io_write(d, addr, val);
+    if (io_port < QXL_IO_STATS_SIZE) {
+        qxl_io_stat_add(&d->io_stats[io_port].write, get_clock() - start);
+    }
+}
+
 static uint32_t ioport_read(void *opaque, uint32_t addr)
 {
     PCIQXLDevice *d = opaque;
@@ -1816,6 +1885,8 @@ static void qxl_vm_change_state_handler(void *opaque, int running,
     } else {
         /* make sure surfaces are saved before migration */
         qxl_dirty_surfaces(qxl);
+        /* the worker is stopped, catch up with its last ring updates */
+        qxl_ring_flush_dirty(qxl);
     }
 }
 
@@ -1936,6 +2007,7 @@ static int qxl_init_common(PCIQXLDevice *qxl)
     qxl_reset_state(qxl);
 
     qxl->update_area_bh = qemu_bh_new(qxl_render_update_area_bh, qxl);
+    QLIST_INSERT_HEAD(&qxl_devices, qxl, next);
 
     return 0;
 }
@@ -2227,6 +2299,40 @@ static void qxl_register(void)
     pci_qdev_register(&qxl_info_secondary);
 }
 
+static void qxl_io_stat_print(Monitor *mon, const char *what,
+                              const QXLIOStat *stat)
+{
+    monitor_printf(mon, " %s %" PRIu64 " avg %" PRId64 " us max %" PRId64
+                   " us", what, stat->count,
+                   stat->total_ns / 1000 / stat->count, stat->max_ns / 1000);
+}
+
+void qxl_io_info(Monitor *mon)
+{
+    PCIQXLDevice *d;
+    int i;
+
+    QLIST_FOREACH(d, &qxl_devices, next) {
+        monitor_printf(mon, "qxl-%d \"%s\" %s: commands %" PRIu64
+                       " in %" PRIu64 " batches\n", d->id,
+                       d->pci.qdev.id ? d->pci.qdev.id : "",
+                       qxl_mode_to_string(d->mode), d->ring_commands,
+                       d->ring_batches);
+        for (i = 0; i < QXL_IO_STATS_SIZE; i++) {
+            if (!d->io_stats[i].write.count) {
+                continue;
+            }
+            monitor_printf(mon, "  %s:", io_port_to_string(i));
+            qxl_io_stat_print(mon, "writes", &d->io_stats[i].write);
+            if (d->io_stats[i].complete.count) {
+                qxl_io_stat_print(mon, "completed",
+                                  &d->io_stats[i].complete);
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+}
+
 int rhel6_qxl_screendump(const char *id, const char *filename)
 {
     DeviceState *dev;
@@ -19,6 +19,16 @@ enum qxl_mode {
 
 #define QXL_NUM_DIRTY_RECTS 64
 
+/* ports up to QXL_IO_MONITORS_CONFIG_ASYNC, which may be past the range of
+ * older spice-protocol headers */
+#define QXL_IO_STATS_SIZE (QXL_IO_RANGE_SIZE + 1)
+
+typedef struct QXLIOStat {
+    uint64_t           count;
+    int64_t            total_ns;
+    int64_t            max_ns;
+} QXLIOStat;
+
 typedef struct PCIQXLDevice {
     PCIDevice          pci;
     SimpleSpiceDisplay ssd;
@@ -39,6 +49,21 @@ typedef struct PCIQXLDevice {
 
     uint32_t           current_async;
     QemuMutex          async_lock;
+    int64_t            async_start;
+
+    /* time the vcpu spent in each io port write, and for async io until
+     * the completion interrupt */
+    struct {
+        QXLIOStat      write;
+        QXLIOStat      complete;
+    } io_stats[QXL_IO_STATS_SIZE];
+
+    /* commands taken from the rings, and the runs they were taken in */
+    uint64_t           ring_commands;
+    uint64_t           ring_batches;
+    int                ring_batch_open;
+    /* the spice thread changed the rings since they were last marked */
+    int                ring_dirty;
 
     struct guest_slots {
         QXLMemSlot     slot;
@@ -101,6 +126,8 @@ typedef struct PCIQXLDevice {
     int                num_dirty_rects;
     QXLRect            dirty[QXL_NUM_DIRTY_RECTS];
     QEMUBH            *update_area_bh;
+
+    QLIST_ENTRY(PCIQXLDevice) next;
 } PCIQXLDevice;
 
 #define PANIC_ON(x) if ((x)) {                         \
@@ -134,6 +161,7 @@ void qxl_spice_oom(PCIQXLDevice *qxl);
 void qxl_spice_reset_memslots(PCIQXLDevice *qxl);
 void qxl_spice_reset_image_cache(PCIQXLDevice *qxl);
 void qxl_spice_reset_cursor(PCIQXLDevice *qxl);
+void qxl_io_info(Monitor *mon);
 
 /* qxl-logger.c */
 int qxl_log_cmd_cursor(PCIQXLDevice *qxl, QXLCursorCmd *cmd, int group_id);
@@ -3442,6 +3442,7 @@ static int pci_rtl8139_init(PCIDevice *dev)
 {
     RTL8139State * s = DO_UPCAST(RTL8139State, dev, dev);
     uint8_t *pci_conf;
+    int i;
 
     pci_conf = s->dev.config;
     pci_config_set_vendor_id(pci_conf, PCI_VENDOR_ID_REALTEK);
@@ -3462,6 +3463,14 @@ static int pci_rtl8139_init(PCIDevice *dev)
     pci_register_bar(&s->dev, 1, 0x100,
                            PCI_BASE_ADDRESS_SPACE_MEMORY, rtl8139_mmio_map);
 
+    /* Addresses and filters only matter once a command or transmit status
+     * register, which is not coalesced, is written */
+    for (i = 0; i < 2; i++) {
+        pci_register_bar_coalesced(&s->dev, i, MAC0, MAR0 + 8 - MAC0);
+        pci_register_bar_coalesced(&s->dev, i, TxAddr0, RxBuf + 4 - TxAddr0);
+        pci_register_bar_coalesced(&s->dev, i, RxRingAddrLO, 8);
+    }
+
     qemu_macaddr_default_if_unset(&s->conf.macaddr);
 
     s->nic = qemu_new_nic(&net_rtl8139_info, &s->conf,
@@ -334,6 +334,8 @@ static VirtIOS390DeviceInfo s390_virtio_net = {
         DEFINE_PROP_INT32("x-txburst", VirtIOS390Device,
                           net.txburst, TX_BURST),
         DEFINE_PROP_STRING("tx", VirtIOS390Device, net.tx),
+        DEFINE_PROP_BIT("x-txadaptive", VirtIOS390Device,
+                        net.txadaptive, 0, false),
         DEFINE_PROP_END_OF_LIST(),
     },
 };
@@ -303,6 +303,8 @@ static SysBusDeviceInfo syborg_virtio_net_info = {
         DEFINE_PROP_INT32("x-txburst", SyborgVirtIOProxy,
                           net.txburst, TX_BURST),
         DEFINE_PROP_STRING("tx", SyborgVirtIOProxy, net.tx),
+        DEFINE_PROP_BIT("x-txadaptive", SyborgVirtIOProxy,
+                        net.txadaptive, 0, false),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
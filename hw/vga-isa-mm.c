@@ -120,6 +120,7 @@ int isa_vga_mm_init(target_phys_addr_t vram_base,
 
     s->vga.ds = graphic_console_init(s->vga.update, s->vga.invalidate,
                                      s->vga.screen_dump, s->vga.text_update, s);
+    vga_init_idle(&s->vga);
 
 #ifdef CONFIG_BOCHS_VBE
     /* XXX: use optimized standard vga accesses */
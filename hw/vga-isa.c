@@ -41,6 +41,7 @@ int isa_vga_init(void)
 
     s->ds = graphic_console_init(s->update, s->invalidate,
                                  s->screen_dump, s->text_update, s);
+    vga_init_idle(s);
 
     vga_init_vbe(s);
     /* ROM BIOS */
@@ -87,6 +87,7 @@ static int pci_vga_initfn(PCIDevice *dev)
 
      s->ds = graphic_console_init(s->update, s->invalidate,
                                   s->screen_dump, s->text_update, s);
+     vga_init_idle(s);
 
      // dummy VGA (same as Bochs ID)
      pci_config_set_vendor_id(pci_conf, PCI_VENDOR_ID_QEMU);
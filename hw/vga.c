@@ -29,6 +29,11 @@
 #include "pixel_ops.h"
 #include "qemu-timer.h"
 #include "kvm.h"
+#include "bitmap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //#define DEBUG_VGA
 //#define DEBUG_VGA_MEM
@@ -1613,6 +1618,10 @@ static void mark_dirty(target_phys_addr_t start, target_phys_addr_t len)
 
 void vga_dirty_log_start(VGACommonState *s)
 {
+    /* vga_display_idle() starts it once somebody looks */
+    if (s->ds && dpy_is_idle(s->ds))
+        return;
+
     if (kvm_enabled() && s->map_addr)
         if (!s1) {
             kvm_log_start(s->map_addr, s->map_end - s->map_addr);
@@ -1663,6 +1672,21 @@ void vga_dirty_log_restart(VGACommonState *s)
     vga_dirty_log_start(s);
 }
 
+/* return true if a page from page0 to page1 (vram offsets) was dirty when
+   the frame was started */
+static inline int vga_pages_dirty(VGACommonState *s, ram_addr_t page0,
+                                  ram_addr_t page1)
+{
+    unsigned long first, last;
+
+    if (page0 >= s->vram_size) {
+        return 0;
+    }
+    first = page0 >> TARGET_PAGE_BITS;
+    last = MIN(page1, s->vram_size - 1) >> TARGET_PAGE_BITS;
+    return find_next_bit(s->vram_dirty, last + 1, first) <= last;
+}
+
 /*
  * graphic modes
  */
@@ -1678,8 +1702,9 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 
     full_update |= update_basic_params(s);
 
-    if (!full_update)
-        vga_sync_dirty_bitmap(s);
+    /* also on full updates, so that the dirty log is running again when
+       drawing resumes after the display was blank or idle */
+    vga_sync_dirty_bitmap(s);
 
     s->get_resolution(s, &width, &height);
     disp_width = width;
@@ -1812,6 +1837,12 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     page_max = 0;
     d = ds_get_data(s->ds);
     linesize = ds_get_linesize(s->ds);
+    if (!full_update) {
+        /* one pass over the dirty flags instead of a lookup per line */
+        cpu_physical_memory_get_dirty_bitmap(s->vram_offset,
+                                             s->vram_offset + s->vram_size,
+                                             VGA_DIRTY_FLAG, s->vram_dirty);
+    }
     y1 = 0;
     for(y = 0; y < height; y++) {
         addr = addr1;
@@ -1824,16 +1855,9 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         if (!(s->cr[0x17] & 2)) {
             addr = (addr & ~0x8000) | ((y1 & 2) << 14);
         }
-        page0 = s->vram_offset + (addr & TARGET_PAGE_MASK);
-        page1 = s->vram_offset + ((addr + bwidth - 1) & TARGET_PAGE_MASK);
-        update = full_update |
-            cpu_physical_memory_get_dirty(page0, VGA_DIRTY_FLAG) |
-            cpu_physical_memory_get_dirty(page1, VGA_DIRTY_FLAG);
-        if ((page1 - page0) > TARGET_PAGE_SIZE) {
-            /* if wide line, can use another page */
-            update |= cpu_physical_memory_get_dirty(page0 + TARGET_PAGE_SIZE,
-                                                    VGA_DIRTY_FLAG);
-        }
+        page0 = addr & TARGET_PAGE_MASK;
+        page1 = (addr + bwidth - 1) & TARGET_PAGE_MASK;
+        update = full_update || vga_pages_dirty(s, page0, page1);
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
         if (update) {
@@ -1877,7 +1901,9 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
     /* reset modified pages */
     if (page_max >= page_min) {
-        cpu_physical_memory_reset_dirty(page_min, page_max + TARGET_PAGE_SIZE,
+        cpu_physical_memory_reset_dirty(s->vram_offset + page_min,
+                                        s->vram_offset + page_max +
+                                        TARGET_PAGE_SIZE,
                                         VGA_DIRTY_FLAG);
     }
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
@@ -1923,6 +1949,9 @@ static void vga_update_display(void *opaque)
 
     if (ds_get_bits_per_pixel(s->ds) == 0) {
         /* nothing to do */
+    } else if (dpy_is_idle(s->ds)) {
+        /* nobody is looking; vga_display_idle() forces a full redraw
+           once somebody is */
     } else {
         full_update = 0;
         if (!(s->ar_index & 0x20)) {
@@ -1952,6 +1981,26 @@ static void vga_update_display(void *opaque)
     }
 }
 
+/* Called when the first display listener becomes active or the last one
+   goes idle.  Nothing is drawn in between, so stop dirty logging and
+   start over with a full update. */
+static void vga_display_idle(void *opaque, int idle)
+{
+    VGACommonState *s = opaque;
+
+    if (idle) {
+        vga_dirty_log_stop(s);
+    } else {
+        vga_dirty_log_start(s);
+    }
+    s->graphic_mode = -1;
+}
+
+void vga_init_idle(VGACommonState *s)
+{
+    graphic_console_set_idle_handler(s->ds, vga_display_idle, s);
+}
+
 /* force a full display refresh */
 static void vga_invalidate_display(void *opaque)
 {
@@ -2300,6 +2349,8 @@ void vga_common_init(VGACommonState *s, int vga_ram_size)
     s->vram_offset = qemu_ram_alloc(NULL, "vga.vram", vga_ram_size);
     s->vram_ptr = qemu_get_ram_ptr(s->vram_offset);
     s->vram_size = vga_ram_size;
+    s->vram_dirty = qemu_mallocz(BITS_TO_LONGS(vga_ram_size >> TARGET_PAGE_BITS)
+                                 * sizeof(unsigned long));
     s->get_bpp = vga_get_bpp;
     s->get_offsets = vga_get_offsets;
     s->get_resolution = vga_get_resolution;
@@ -2320,6 +2371,20 @@ void vga_common_init(VGACommonState *s, int vga_ram_size)
     }
 }
 
+/* Index registers and the DAC ports only latch state that matters when a
+ * data port is accessed or the display is refreshed, which both flush
+ * coalesced writes first; the same holds for the planar memory window. */
+void vga_register_coalesced_io(void)
+{
+    qemu_register_coalesced_mmio(isa_mem_base + 0x000a0000, 0x20000);
+
+    qemu_register_coalesced_pio(0x3b4, 1);
+    qemu_register_coalesced_pio(0x3c4, 1);
+    qemu_register_coalesced_pio(0x3c7, 3);
+    qemu_register_coalesced_pio(0x3ce, 1);
+    qemu_register_coalesced_pio(0x3d4, 1);
+}
+
 /* used by both ISA and PCI */
 void vga_init(VGACommonState *s)
 {
@@ -2353,12 +2418,13 @@ void vga_init(VGACommonState *s)
 
     register_ioport_read(0x1d0, 1, 2, vbe_ioport_read_data, s);
     register_ioport_write(0x1d0, 1, 2, vbe_ioport_write_data, s);
+    qemu_register_coalesced_pio(0x1ce, 2);
 #endif /* CONFIG_BOCHS_VBE */
 
     vga_io_memory = cpu_register_io_memory(vga_mem_read, vga_mem_write, s);
     cpu_register_physical_memory(isa_mem_base + 0x000a0000, 0x20000,
                                  vga_io_memory);
-    qemu_register_coalesced_mmio(isa_mem_base + 0x000a0000, 0x20000);
+    vga_register_coalesced_io();
 }
 
 void vga_init_vbe(VGACommonState *s)
@@ -2436,6 +2502,7 @@ static DisplayChangeListener* vga_screen_dump_init(DisplayState *ds)
     dcl->dpy_update = vga_save_dpy_update;
     dcl->dpy_resize = vga_save_dpy_resize;
     dcl->dpy_refresh = vga_save_dpy_refresh;
+    dcl->idle = 1;
     register_displaychangelistener(ds, dcl);
     return dcl;
 }
@@ -2450,7 +2517,9 @@ static void vga_screen_dump(void *opaque, const char *filename)
         screen_dump_dcl = vga_screen_dump_init(s->ds);
 
     screen_dump_filename = (char *)filename;
+    dpy_set_idle(s->ds, screen_dump_dcl, 0);
     vga_invalidate_display(s);
     vga_hw_update();
+    dpy_set_idle(s->ds, screen_dump_dcl, 1);
 }
 
@@ -41,6 +41,54 @@
 #define PIXEL_NAME DEPTH
 #endif /* BGR_FORMAT */
 
+#if DEPTH == 32 && defined(__SSE2__) && !defined(TARGET_WORDS_BIGENDIAN)
+#define VGA_SSE2
+
+/* Four pixels from 8 bit components, one per 32 bit lane */
+static inline __m128i glue(vga_pack_sse2_, PIXEL_NAME)(__m128i r, __m128i g,
+                                                       __m128i b)
+{
+#ifdef BGR_FORMAT
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(b, 16),
+                                     _mm_slli_epi32(g, 8)), r);
+#else
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16),
+                                     _mm_slli_epi32(g, 8)), b);
+#endif
+}
+
+static inline __m128i glue(vga_rgb15_sse2_, PIXEL_NAME)(__m128i v)
+{
+    const __m128i m = _mm_set1_epi32(0xf8);
+
+    return glue(vga_pack_sse2_, PIXEL_NAME)(
+        _mm_and_si128(_mm_srli_epi32(v, 7), m),
+        _mm_and_si128(_mm_srli_epi32(v, 2), m),
+        _mm_and_si128(_mm_slli_epi32(v, 3), m));
+}
+
+static inline __m128i glue(vga_rgb16_sse2_, PIXEL_NAME)(__m128i v)
+{
+    const __m128i m = _mm_set1_epi32(0xf8);
+
+    return glue(vga_pack_sse2_, PIXEL_NAME)(
+        _mm_and_si128(_mm_srli_epi32(v, 8), m),
+        _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0xfc)),
+        _mm_and_si128(_mm_slli_epi32(v, 3), m));
+}
+
+/* Four little endian 0x??RRGGBB pixels */
+static inline __m128i glue(vga_rgb32_sse2_, PIXEL_NAME)(__m128i v)
+{
+    const __m128i m = _mm_set1_epi32(0xff);
+
+    return glue(vga_pack_sse2_, PIXEL_NAME)(
+        _mm_and_si128(_mm_srli_epi32(v, 16), m),
+        _mm_and_si128(_mm_srli_epi32(v, 8), m),
+        _mm_and_si128(v, m));
+}
+#endif
+
 #if DEPTH != 15 && !defined(BGR_FORMAT)
 
 static inline void glue(vga_draw_glyph_line_, DEPTH)(uint8_t *d,
@@ -424,6 +472,22 @@ static void glue(vga_draw_line15_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
+#ifdef VGA_SSE2
+    for (; w >= 8; w -= 8) {
+        __m128i v8 = _mm_loadu_si128((const __m128i *)s);
+        __m128i lo = _mm_unpacklo_epi16(v8, _mm_setzero_si128());
+        __m128i hi = _mm_unpackhi_epi16(v8, _mm_setzero_si128());
+
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb15_sse2_, PIXEL_NAME)(lo));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         glue(vga_rgb15_sse2_, PIXEL_NAME)(hi));
+        s += 16;
+        d += 32;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
         v = lduw_raw((void *)s);
         r = (v >> 7) & 0xf8;
@@ -449,6 +513,22 @@ static void glue(vga_draw_line16_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t v, r, g, b;
 
     w = width;
+#ifdef VGA_SSE2
+    for (; w >= 8; w -= 8) {
+        __m128i v8 = _mm_loadu_si128((const __m128i *)s);
+        __m128i lo = _mm_unpacklo_epi16(v8, _mm_setzero_si128());
+        __m128i hi = _mm_unpackhi_epi16(v8, _mm_setzero_si128());
+
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb16_sse2_, PIXEL_NAME)(lo));
+        _mm_storeu_si128((__m128i *)(d + 16),
+                         glue(vga_rgb16_sse2_, PIXEL_NAME)(hi));
+        s += 16;
+        d += 32;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
         v = lduw_raw((void *)s);
         r = (v >> 8) & 0xf8;
@@ -471,6 +551,20 @@ static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t r, g, b;
 
     w = width;
+#ifdef VGA_SSE2
+    /* four pixels per 16 byte load; stop while 16 bytes are still left */
+    for (; w >= 6; w -= 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        __m128i v01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+        __m128i v23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6),
+                                         _mm_srli_si128(v, 9));
+
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb32_sse2_, PIXEL_NAME)(
+                             _mm_unpacklo_epi64(v01, v23)));
+        s += 12;
+        d += 16;
+    }
+#endif
     do {
 #if defined(TARGET_WORDS_BIGENDIAN)
         r = s[0];
@@ -500,6 +594,17 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t r, g, b;
 
     w = width;
+#ifdef VGA_SSE2
+    for (; w >= 4; w -= 4) {
+        _mm_storeu_si128((__m128i *)d, glue(vga_rgb32_sse2_, PIXEL_NAME)(
+                             _mm_loadu_si128((const __m128i *)s)));
+        s += 16;
+        d += 16;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
 #if defined(TARGET_WORDS_BIGENDIAN)
         r = s[1];
@@ -518,6 +623,7 @@ static void glue(vga_draw_line32_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
 }
 
 #undef PUT_PIXEL2
+#undef VGA_SSE2
 #undef DEPTH
 #undef BPP
 #undef PIXEL_TYPE
@@ -15,9 +15,40 @@
 #include <sys/eventfd.h>
 #include "vhost.h"
 #include "hw/hw.h"
+#include "host-utils.h"
+#include "qemu_socket.h"
 /* For range_get_last */
 #include "pci.h"
 
+/* Mark a run of dirty pages.  Within a vhost region guest physical and
+ * host virtual addresses are contiguous, so the ram addresses usually
+ * are too: look up both ends of the run and only fall back to a lookup
+ * per page if they do not line up or lie in different RAM blocks. */
+static void vhost_dev_set_dirty_pages(uint64_t addr, int npages)
+{
+    ram_addr_t first, last;
+    int i;
+
+    first = cpu_get_physical_page_desc(addr);
+    last = first;
+    if (npages > 1) {
+        last = cpu_get_physical_page_desc(addr + (npages - 1) *
+                                          VHOST_LOG_PAGE);
+    }
+    if (last - first == (ram_addr_t)(npages - 1) * VHOST_LOG_PAGE &&
+        qemu_ram_range_in_block(first & TARGET_PAGE_MASK,
+                                (ram_addr_t)npages * VHOST_LOG_PAGE)) {
+        for (i = 0; i < npages; ++i) {
+            cpu_physical_memory_set_dirty(first + i * VHOST_LOG_PAGE);
+        }
+        return;
+    }
+    for (i = 0; i < npages; ++i) {
+        cpu_physical_memory_set_dirty(
+            cpu_get_physical_page_desc(addr + i * VHOST_LOG_PAGE));
+    }
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   uint64_t mfirst, uint64_t mlast,
                                   uint64_t rfirst, uint64_t rlast)
@@ -35,7 +66,6 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
 
     for (;from < to; ++from) {
         vhost_log_chunk_t log;
-        int bit;
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
@@ -47,13 +77,16 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
          * builtins, but it's easier to use them than
          * roll our own. */
         log = __sync_fetch_and_and(from, 0);
-        while ((bit = sizeof(log) > sizeof(int) ?
-                ffsll(log) : ffs(log))) {
-            ram_addr_t ram_addr;
-            bit -= 1;
-            ram_addr = cpu_get_physical_page_desc(addr + bit * VHOST_LOG_PAGE);
-            cpu_physical_memory_set_dirty(ram_addr);
-            log &= ~(0x1ull << bit);
+        /* Handle each run of set bits at once. */
+        while (log) {
+            int bit = ctz64(log);
+            int run = MIN(cto64((uint64_t)log >> bit), VHOST_LOG_BITS - bit);
+
+            vhost_dev_set_dirty_pages(addr + bit * VHOST_LOG_PAGE, run);
+            if (bit + run >= VHOST_LOG_BITS) {
+                break;
+            }
+            log &= ~(vhost_log_chunk_t)0 << (bit + run);
         }
         addr += VHOST_LOG_CHUNK;
     }
@@ -83,151 +116,144 @@ static int vhost_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
     return 0;
 }
 
-/* Assign/unassign. Keep an unsorted array of non-overlapping
- * memory regions. */
+/* Assign/unassign.  Keep an array of non-overlapping memory regions,
+ * sorted by guest physical address, so that lookups and updates can
+ * use binary search.  Since regions do not overlap, their last bytes
+ * are sorted as well. */
+
+/* Index of the first region whose last byte is at or above addr. */
+static int vhost_mem_find_index(struct vhost_memory *mem, uint64_t addr)
+{
+    int lo = 0, hi = mem->nregions;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct vhost_memory_region *reg = mem->regions + mid;
+
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+struct vhost_memory_region *vhost_mem_find_region(struct vhost_memory *mem,
+                                                  uint64_t addr)
+{
+    int i = vhost_mem_find_index(mem, addr);
+
+    if (i < mem->nregions && mem->regions[i].guest_phys_addr <= addr) {
+        return mem->regions + i;
+    }
+    return NULL;
+}
+
+/* The caller must have room for two more regions than are in use:
+ * one may be created by splitting an existing region here, and one
+ * by the vhost_mem_assign_memory() that usually follows. */
 void vhost_mem_unassign_memory(struct vhost_memory *mem,
                                uint64_t start_addr,
                                uint64_t size)
 {
-    int from, to, n = mem->nregions;
-    /* Track overlapping/split regions for sanity checking. */
-    int overlap_start = 0, overlap_end = 0, overlap_middle = 0, split = 0;
-
-    for (from = 0, to = 0; from < n; ++from, ++to) {
-        struct vhost_memory_region *reg = mem->regions + to;
-        uint64_t reglast;
-        uint64_t memlast;
-        uint64_t change;
+    uint64_t memlast = range_get_last(start_addr, size);
+    int i = vhost_mem_find_index(mem, start_addr);
 
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, mem->regions + from, sizeof *reg);
-        }
+    while (i < mem->nregions) {
+        struct vhost_memory_region *reg = mem->regions + i;
+        uint64_t reglast = range_get_last(reg->guest_phys_addr,
+                                          reg->memory_size);
+        uint64_t change;
 
-        /* No overlap is simple */
-        if (!ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                            start_addr, size)) {
-            continue;
+        if (reg->guest_phys_addr > memlast) {
+            break;
         }
 
-        /* Split only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!split);
-
-        reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        memlast = range_get_last(start_addr, size);
-
-        /* Remove whole region */
-        if (start_addr <= reg->guest_phys_addr && memlast >= reglast) {
-            --mem->nregions;
-            --to;
-            ++overlap_middle;
-            continue;
+        /* Split region: shrink first part, shift second part.  This only
+         * happens if the supplied range is in the middle of an existing
+         * region, so it can not overlap any other region. */
+        if (reg->guest_phys_addr < start_addr && reglast > memlast) {
+            memmove(reg + 2, reg + 1,
+                    (mem->nregions - i - 1) * sizeof *reg);
+            memcpy(reg + 1, reg, sizeof *reg);
+            reg->memory_size = start_addr - reg->guest_phys_addr;
+            ++reg;
+            change = memlast + 1 - reg->guest_phys_addr;
+            reg->memory_size -= change;
+            reg->guest_phys_addr += change;
+            reg->userspace_addr += change;
+            ++mem->nregions;
+            break;
         }
 
         /* Shrink region */
-        if (memlast >= reglast) {
+        if (reg->guest_phys_addr < start_addr) {
             reg->memory_size = start_addr - reg->guest_phys_addr;
-            assert(reg->memory_size);
-            assert(!overlap_end);
-            ++overlap_end;
+            ++i;
             continue;
         }
 
         /* Shift region */
-        if (start_addr <= reg->guest_phys_addr) {
+        if (reglast > memlast) {
             change = memlast + 1 - reg->guest_phys_addr;
             reg->memory_size -= change;
             reg->guest_phys_addr += change;
             reg->userspace_addr += change;
-            assert(reg->memory_size);
-            assert(!overlap_start);
-            ++overlap_start;
-            continue;
+            break;
         }
 
-        /* This only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!overlap_start);
-        assert(!overlap_end);
-        assert(!overlap_middle);
-        /* Split region: shrink first part, shift second part. */
-        memcpy(mem->regions + n, reg, sizeof *reg);
-        reg->memory_size = start_addr - reg->guest_phys_addr;
-        assert(reg->memory_size);
-        change = memlast + 1 - reg->guest_phys_addr;
-        reg = mem->regions + n;
-        reg->memory_size -= change;
-        assert(reg->memory_size);
-        reg->guest_phys_addr += change;
-        reg->userspace_addr += change;
-        /* Never add more than 1 region */
-        assert(mem->nregions == n);
-        ++mem->nregions;
-        ++split;
+        /* Remove whole region */
+        memmove(reg, reg + 1, (mem->nregions - i - 1) * sizeof *reg);
+        --mem->nregions;
     }
 }
 
-/* Called after unassign, so no regions overlap the given range. */
+/* Called after unassign, so no regions overlap the given range.
+ * Merges with the neighbouring regions if they are contiguous in both
+ * guest physical and host virtual address space. */
 void vhost_mem_assign_memory(struct vhost_memory *mem,
                              uint64_t start_addr,
                              uint64_t size,
                              uint64_t uaddr)
 {
-    int from, to;
-    struct vhost_memory_region *merged = NULL;
-    for (from = 0, to = 0; from < mem->nregions; ++from, ++to) {
-        struct vhost_memory_region *reg = mem->regions + to;
-        uint64_t prlast, urlast;
-        uint64_t pmlast, umlast;
-        uint64_t s, e, u;
-
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, mem->regions + from, sizeof *reg);
-        }
-        prlast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        pmlast = range_get_last(start_addr, size);
-        urlast = range_get_last(reg->userspace_addr, reg->memory_size);
-        umlast = range_get_last(uaddr, size);
-
-        /* check for overlapping regions: should never happen. */
-        assert(prlast < start_addr || pmlast < reg->guest_phys_addr);
-        /* Not an adjacent or overlapping region - do not merge. */
-        if ((prlast + 1 != start_addr || urlast + 1 != uaddr) &&
-            (pmlast + 1 != reg->guest_phys_addr ||
-             umlast + 1 != reg->userspace_addr)) {
-            continue;
-        }
+    int i = vhost_mem_find_index(mem, start_addr);
+    struct vhost_memory_region *prev = i > 0 ? mem->regions + i - 1 : NULL;
+    struct vhost_memory_region *next = i < mem->nregions ?
+                                       mem->regions + i : NULL;
+    bool merge_prev, merge_next;
 
-        if (merged) {
-            --to;
-            assert(to >= 0);
-        } else {
-            merged = reg;
-        }
-        u = MIN(uaddr, reg->userspace_addr);
-        s = MIN(start_addr, reg->guest_phys_addr);
-        e = MAX(pmlast, prlast);
-        uaddr = merged->userspace_addr = u;
-        start_addr = merged->guest_phys_addr = s;
-        size = merged->memory_size = e - s + 1;
-        assert(merged->memory_size);
-    }
+    assert(size);
+    /* check for overlapping regions: should never happen. */
+    assert(!next || next->guest_phys_addr > range_get_last(start_addr, size));
+
+    merge_prev = prev &&
+        prev->guest_phys_addr + prev->memory_size == start_addr &&
+        prev->userspace_addr + prev->memory_size == uaddr;
+    merge_next = next &&
+        start_addr + size == next->guest_phys_addr &&
+        uaddr + size == next->userspace_addr;
+
+    if (merge_prev && merge_next) {
+        prev->memory_size += size + next->memory_size;
+        memmove(next, next + 1, (mem->nregions - i - 1) * sizeof *next);
+        --mem->nregions;
+    } else if (merge_prev) {
+        prev->memory_size += size;
+    } else if (merge_next) {
+        next->guest_phys_addr = start_addr;
+        next->userspace_addr = uaddr;
+        next->memory_size += size;
+    } else {
+        struct vhost_memory_region *reg = mem->regions + i;
 
-    if (!merged) {
-        struct vhost_memory_region *reg = mem->regions + to;
+        memmove(reg + 1, reg, (mem->nregions - i) * sizeof *reg);
         memset(reg, 0, sizeof *reg);
         reg->memory_size = size;
-        assert(reg->memory_size);
         reg->guest_phys_addr = start_addr;
         reg->userspace_addr = uaddr;
-        ++to;
+        ++mem->nregions;
     }
-    assert(to <= mem->nregions + 1);
-    mem->nregions = to;
 }
 
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
@@ -248,27 +274,37 @@ static uint64_t vhost_get_log_size(struct vhost_dev *dev)
     return log_size;
 }
 
+static void vhost_dev_log_free(struct vhost_dev *dev)
+{
+    if (dev->log) {
+        dev->vhost_ops->vhost_log_free(dev, dev->log, dev->log_size,
+                                       dev->log_fd);
+    }
+    dev->log = NULL;
+    dev->log_size = 0;
+    dev->log_fd = -1;
+}
+
 static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
 {
     vhost_log_chunk_t *log;
-    uint64_t log_base;
+    int log_fd = -1;
     int r;
     if (size) {
-        log = qemu_mallocz(size * sizeof *log);
+        log = dev->vhost_ops->vhost_log_alloc(dev, size, &log_fd);
+        assert(log);
     } else {
         log = NULL;
     }
-    log_base = (uint64_t)(unsigned long)log;
-    r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
+    r = dev->vhost_ops->vhost_set_log_base(dev, log, size, log_fd);
     assert(r >= 0);
     /* Sync only the range covered by the old log */
     vhost_client_sync_dirty_bitmap(&dev->client, 0,
                                    dev->log_size * VHOST_LOG_CHUNK - 1);
-    if (dev->log) {
-        qemu_free(dev->log);
-    }
+    vhost_dev_log_free(dev);
     dev->log = log;
     dev->log_size = size;
+    dev->log_fd = log_fd;
 }
 
 static int vhost_verify_ring_mappings(struct vhost_dev *dev,
@@ -306,8 +342,9 @@ static void vhost_client_set_memory(CPUPhysMemoryClient *client,
 {
     struct vhost_dev *dev = container_of(client, struct vhost_dev, client);
     ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
-    int s = offsetof(struct vhost_memory, regions) +
-        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
+    int old = offsetof(struct vhost_memory, regions) +
+        dev->mem->nregions * sizeof dev->mem->regions[0];
+    int s = old + 2 * sizeof dev->mem->regions[0];
     uint64_t log_size;
     int r;
 
@@ -321,6 +358,10 @@ static void vhost_client_set_memory(CPUPhysMemoryClient *client,
     }
 
     dev->mem = qemu_realloc(dev->mem, s);
+    if (dev->started) {
+        dev->mem_shadow = qemu_realloc(dev->mem_shadow, old);
+        memcpy(dev->mem_shadow, dev->mem, old);
+    }
 
     assert(size);
 
@@ -338,13 +379,21 @@ static void vhost_client_set_memory(CPUPhysMemoryClient *client,
         return;
     }
 
+    /* Most updates are for MMIO ranges that were never in the table;
+     * do not push an unchanged table to the kernel. */
+    if (offsetof(struct vhost_memory, regions) +
+        dev->mem->nregions * sizeof dev->mem->regions[0] == old &&
+        !memcmp(dev->mem_shadow, dev->mem, old)) {
+        return;
+    }
+
     if (dev->started) {
         r = vhost_verify_ring_mappings(dev, start_addr, size);
         assert(r >= 0);
     }
 
     if (!dev->log_enabled) {
-        r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
         assert(r >= 0);
         return;
     }
@@ -356,7 +405,7 @@ static void vhost_client_set_memory(CPUPhysMemoryClient *client,
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -376,11 +425,8 @@ static int vhost_virtqueue_set_addr(struct vhost_dev *dev,
         .log_guest_addr = vq->used_phys,
         .flags = enable_log ? (1 << VHOST_VRING_F_LOG) : 0,
     };
-    int r = ioctl(dev->control, VHOST_SET_VRING_ADDR, &addr);
-    if (r < 0) {
-        return -errno;
-    }
-    return 0;
+    int r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_ADDR, &addr);
+    return r < 0 ? r : 0;
 }
 
 static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
@@ -390,8 +436,8 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
     if (enable_log) {
         features |= 0x1 << VHOST_F_LOG_ALL;
     }
-    r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
-    return r < 0 ? -errno : 0;
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_FEATURES, &features);
+    return r < 0 ? r : 0;
 }
 
 static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
@@ -438,11 +484,7 @@ static int vhost_client_migration_log(CPUPhysMemoryClient *client,
         if (r < 0) {
             return r;
         }
-        if (dev->log) {
-            qemu_free(dev->log);
-        }
-        dev->log = NULL;
-        dev->log_size = 0;
+        vhost_dev_log_free(dev);
     } else {
         vhost_dev_log_resize(dev, vhost_get_log_size(dev));
         r = vhost_dev_set_log(dev, true);
@@ -470,15 +512,15 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
     struct VirtQueue *vvq = virtio_get_queue(vdev, idx);
 
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
-        return -errno;
+        return r;
     }
 
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_BASE, &state);
     if (r) {
-        return -errno;
+        return r;
     }
 
     s = l = virtio_queue_get_desc_size(vdev, idx);
@@ -513,20 +555,17 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
 
     r = vhost_virtqueue_set_addr(dev, vq, idx, dev->log_enabled);
     if (r < 0) {
-        r = -errno;
         goto fail_alloc;
     }
     file.fd = event_notifier_get_fd(virtio_queue_get_host_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_KICK, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_KICK, &file);
     if (r) {
-        r = -errno;
         goto fail_kick;
     }
 
     file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_CALL, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_CALL, &file);
     if (r) {
-        r = -errno;
         goto fail_call;
     }
 
@@ -559,7 +598,7 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
         .index = idx,
     };
     int r;
-    r = ioctl(dev->control, VHOST_GET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
@@ -576,24 +615,80 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
                               0, virtio_queue_get_desc_size(vdev, idx));
 }
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
+static int vhost_kernel_call(struct vhost_dev *dev, unsigned long request,
+                             void *arg)
+{
+    int r = ioctl(dev->control, request, arg);
+    return r < 0 ? -errno : r;
+}
+
+static vhost_log_chunk_t *vhost_kernel_log_alloc(struct vhost_dev *dev,
+                                                 uint64_t size, int *fd)
+{
+    *fd = -1;
+    return qemu_mallocz(size * sizeof(vhost_log_chunk_t));
+}
+
+static void vhost_kernel_log_free(struct vhost_dev *dev,
+                                  vhost_log_chunk_t *log,
+                                  uint64_t size, int fd)
+{
+    qemu_free(log);
+}
+
+static int vhost_kernel_set_log_base(struct vhost_dev *dev,
+                                     vhost_log_chunk_t *log,
+                                     uint64_t size, int fd)
+{
+    uint64_t log_base = (uint64_t)(unsigned long)log;
+    return vhost_kernel_call(dev, VHOST_SET_LOG_BASE, &log_base);
+}
+
+static const VhostOps vhost_kernel_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_KERNEL,
+    .vhost_call = vhost_kernel_call,
+    .vhost_log_alloc = vhost_kernel_log_alloc,
+    .vhost_log_free = vhost_kernel_log_free,
+    .vhost_set_log_base = vhost_kernel_set_log_base,
+};
+
+/* devfd, if not -1, is an already open /dev/vhost-* fd or a connected
+ * unix socket, depending on backend_type; otherwise devpath is opened. */
+int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
+                   VhostBackendType backend_type, bool force)
 {
     uint64_t features;
     int r;
+
+    switch (backend_type) {
+    case VHOST_BACKEND_TYPE_KERNEL:
+        hdev->vhost_ops = &vhost_kernel_ops;
+        break;
+    case VHOST_BACKEND_TYPE_USER:
+        hdev->vhost_ops = &vhost_user_ops;
+        break;
+    default:
+        return -EINVAL;
+    }
     if (devfd >= 0) {
         hdev->control = devfd;
+    } else if (backend_type == VHOST_BACKEND_TYPE_USER) {
+        hdev->control = unix_connect(devpath);
+        if (hdev->control < 0) {
+            return -ECONNREFUSED;
+        }
     } else {
-        hdev->control = open("/dev/vhost-net", O_RDWR);
+        hdev->control = open(devpath, O_RDWR);
         if (hdev->control < 0) {
             return -errno;
         }
     }
-    r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
     if (r < 0) {
         goto fail;
     }
 
-    r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_GET_FEATURES, &features);
     if (r < 0) {
         goto fail;
     }
@@ -603,15 +698,16 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force)
     hdev->client.sync_dirty_bitmap = vhost_client_sync_dirty_bitmap;
     hdev->client.migration_log = vhost_client_migration_log;
     hdev->mem = qemu_mallocz(offsetof(struct vhost_memory, regions));
+    hdev->mem_shadow = NULL;
     hdev->log = NULL;
     hdev->log_size = 0;
+    hdev->log_fd = -1;
     hdev->log_enabled = false;
     hdev->started = false;
     cpu_register_phys_memory_client(&hdev->client);
     hdev->force = force;
     return 0;
 fail:
-    r = -errno;
     close(hdev->control);
     return r;
 }
@@ -620,6 +716,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
 {
     cpu_unregister_phys_memory_client(&hdev->client);
     qemu_free(hdev->mem);
+    qemu_free(hdev->mem_shadow);
     close(hdev->control);
 }
 
@@ -703,9 +800,8 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = ioctl(hdev->control, VHOST_SET_MEM_TABLE, hdev->mem);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
     if (r < 0) {
-        r = -errno;
         goto fail_mem;
     }
     for (i = 0; i < hdev->nvqs; ++i) {
@@ -721,11 +817,16 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (hdev->log_enabled) {
         hdev->log_size = vhost_get_log_size(hdev);
         hdev->log = hdev->log_size ?
-            qemu_mallocz(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+            hdev->vhost_ops->vhost_log_alloc(hdev, hdev->log_size,
+                                             &hdev->log_fd) : NULL;
+        if (hdev->log_size && !hdev->log) {
+            r = -ENOMEM;
+            goto fail_log;
+        }
+        r = hdev->vhost_ops->vhost_set_log_base(hdev, hdev->log,
+                                                hdev->log_size,
+                                                hdev->log_fd);
         if (r < 0) {
-            r = -errno;
             goto fail_log;
         }
     }
@@ -734,6 +835,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 
     return 0;
 fail_log:
+    vhost_dev_log_free(hdev);
 fail_vq:
     while (--i >= 0) {
         vhost_virtqueue_cleanup(hdev,
@@ -770,7 +872,5 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     assert (r >= 0);
 
     hdev->started = false;
-    qemu_free(hdev->log);
-    hdev->log = NULL;
-    hdev->log_size = 0;
+    vhost_dev_log_free(hdev);
 }
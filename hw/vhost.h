@@ -24,11 +24,37 @@ typedef unsigned long vhost_log_chunk_t;
 #define VHOST_LOG_BITS (8 * sizeof(vhost_log_chunk_t))
 #define VHOST_LOG_CHUNK (VHOST_LOG_PAGE * VHOST_LOG_BITS)
 
+/* How requests reach the vhost backend: ioctls on a /dev/vhost-* fd, or
+ * messages to a separate process over a unix socket (see vhost_user.h). */
+typedef enum VhostBackendType {
+    VHOST_BACKEND_TYPE_KERNEL = 0,
+    VHOST_BACKEND_TYPE_USER = 1,
+} VhostBackendType;
+
+struct vhost_dev;
+typedef struct VhostOps {
+    VhostBackendType backend_type;
+    /* Issue a VHOST_* request; arg is as for the kernel ioctl. */
+    int (*vhost_call)(struct vhost_dev *dev, unsigned long request, void *arg);
+    /* Allocate a dirty log the backend can write; *fd is -1 if the log is
+     * plain process memory. */
+    vhost_log_chunk_t *(*vhost_log_alloc)(struct vhost_dev *dev,
+                                          uint64_t size, int *fd);
+    void (*vhost_log_free)(struct vhost_dev *dev, vhost_log_chunk_t *log,
+                           uint64_t size, int fd);
+    int (*vhost_set_log_base)(struct vhost_dev *dev, vhost_log_chunk_t *log,
+                              uint64_t size, int fd);
+} VhostOps;
+
+extern const VhostOps vhost_user_ops;
+
 struct vhost_memory;
 struct vhost_dev {
     CPUPhysMemoryClient client;
+    const VhostOps *vhost_ops;
     int control;
     struct vhost_memory *mem;
+    struct vhost_memory *mem_shadow;
     struct vhost_virtqueue *vqs;
     int nvqs;
     unsigned long long features;
@@ -38,10 +64,12 @@ struct vhost_dev {
     bool log_enabled;
     vhost_log_chunk_t *log;
     unsigned long long log_size;
+    int log_fd;
     bool force;
 };
 
-int vhost_dev_init(struct vhost_dev *hdev, int devfd, bool force);
+int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
+                   VhostBackendType backend_type, bool force);
 void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
@@ -56,4 +84,6 @@ void vhost_mem_assign_memory(struct vhost_memory *mem,
                              uint64_t start_addr,
                              uint64_t size,
                              uint64_t uaddr);
+struct vhost_memory_region *vhost_mem_find_region(struct vhost_memory *mem,
+                                                  uint64_t addr);
 #endif
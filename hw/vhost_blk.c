@@ -0,0 +1,129 @@
+/*
+ * vhost-blk support: virtio-blk rings served by a vhost-user backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "virtio-blk.h"
+#include "vhost_blk.h"
+
+#include "config.h"
+
+#ifdef CONFIG_VHOST_BLK
+#include <linux/vhost.h>
+#include <linux/virtio_ring.h>
+
+#include "vhost.h"
+
+struct vhost_blk {
+    struct vhost_dev dev;
+    struct vhost_virtqueue vqs[1];
+};
+
+/* Features that only describe the config space, which qemu keeps serving
+ * itself; everything else must be implemented by the backend. */
+#define VHOST_BLK_CONFIG_FEATURES ((1 << VIRTIO_BLK_F_SEG_MAX) | \
+                                   (1 << VIRTIO_BLK_F_GEOMETRY) | \
+                                   (1 << VIRTIO_BLK_F_TOPOLOGY) | \
+                                   (1 << VIRTIO_BLK_F_BLK_SIZE) | \
+                                   (1 << VIRTIO_BLK_F_RO))
+
+unsigned vhost_blk_get_features(struct vhost_blk *blk, unsigned features)
+{
+    return features & (blk->dev.features | VHOST_BLK_CONFIG_FEATURES |
+                       (1 << VIRTIO_F_BAD_FEATURE));
+}
+
+void vhost_blk_ack_features(struct vhost_blk *blk, unsigned features)
+{
+    blk->dev.acked_features = blk->dev.backend_features |
+        (features & blk->dev.features);
+}
+
+struct vhost_blk *vhost_blk_init(const char *path)
+{
+    int r;
+    struct vhost_blk *blk = qemu_mallocz(sizeof *blk);
+
+    blk->dev.backend_features = 0;
+    r = vhost_dev_init(&blk->dev, -1, path, VHOST_BACKEND_TYPE_USER, true);
+    if (r < 0) {
+        fprintf(stderr, "vhost-blk: cannot connect to backend %s: %s\n",
+                path, strerror(-r));
+        qemu_free(blk);
+        return NULL;
+    }
+    blk->dev.nvqs = 1;
+    blk->dev.vqs = blk->vqs;
+
+    /* Set sane init value. Override when guest acks. */
+    vhost_blk_ack_features(blk, 0);
+    return blk;
+}
+
+bool vhost_blk_query(VHostBlkState *blk, VirtIODevice *dev)
+{
+    return vhost_dev_query(&blk->dev, dev);
+}
+
+int vhost_blk_start(struct vhost_blk *blk, VirtIODevice *dev)
+{
+    int r;
+
+    r = vhost_dev_enable_notifiers(&blk->dev, dev);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_dev_start(&blk->dev, dev);
+    if (r < 0) {
+        vhost_dev_disable_notifiers(&blk->dev, dev);
+    }
+    return r;
+}
+
+void vhost_blk_stop(struct vhost_blk *blk, VirtIODevice *dev)
+{
+    vhost_dev_stop(&blk->dev, dev);
+    vhost_dev_disable_notifiers(&blk->dev, dev);
+}
+
+void vhost_blk_cleanup(struct vhost_blk *blk)
+{
+    vhost_dev_cleanup(&blk->dev);
+    qemu_free(blk);
+}
+#else
+struct vhost_blk *vhost_blk_init(const char *path)
+{
+    fprintf(stderr, "vhost-blk support is not compiled in\n");
+    return NULL;
+}
+
+bool vhost_blk_query(VHostBlkState *blk, VirtIODevice *dev)
+{
+    return false;
+}
+
+int vhost_blk_start(struct vhost_blk *blk, VirtIODevice *dev)
+{
+    return -ENOSYS;
+}
+
+void vhost_blk_stop(struct vhost_blk *blk, VirtIODevice *dev)
+{
+}
+
+void vhost_blk_cleanup(struct vhost_blk *blk)
+{
+}
+
+unsigned vhost_blk_get_features(struct vhost_blk *blk, unsigned features)
+{
+    return features;
+}
+
+void vhost_blk_ack_features(struct vhost_blk *blk, unsigned features)
+{
+}
+#endif
@@ -0,0 +1,20 @@
+#ifndef VHOST_BLK_H
+#define VHOST_BLK_H
+
+#include "virtio.h"
+
+struct vhost_blk;
+typedef struct vhost_blk VHostBlkState;
+
+VHostBlkState *vhost_blk_init(const char *path);
+
+bool vhost_blk_query(VHostBlkState *blk, VirtIODevice *dev);
+int vhost_blk_start(VHostBlkState *blk, VirtIODevice *dev);
+void vhost_blk_stop(VHostBlkState *blk, VirtIODevice *dev);
+
+void vhost_blk_cleanup(VHostBlkState *blk);
+
+unsigned vhost_blk_get_features(VHostBlkState *blk, unsigned features);
+void vhost_blk_ack_features(VHostBlkState *blk, unsigned features);
+
+#endif
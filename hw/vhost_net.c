@@ -106,7 +106,8 @@ struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
         (1 << VHOST_NET_F_VIRTIO_NET_HDR);
     net->backend = r;
 
-    r = vhost_dev_init(&net->dev, devfd, force);
+    r = vhost_dev_init(&net->dev, devfd, "/dev/vhost-net",
+                       VHOST_BACKEND_TYPE_KERNEL, force);
     if (r < 0) {
         goto fail;
     }
@@ -0,0 +1,337 @@
+/*
+ * vhost-user: vhost requests forwarded to a backend process
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/vhost.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "vhost.h"
+#include "vhost_user.h"
+#include "qemu_socket.h"
+
+static const unsigned long vhost_user_requests[] = {
+    [VHOST_USER_GET_FEATURES] = VHOST_GET_FEATURES,
+    [VHOST_USER_SET_FEATURES] = VHOST_SET_FEATURES,
+    [VHOST_USER_SET_OWNER] = VHOST_SET_OWNER,
+    [VHOST_USER_RESET_OWNER] = VHOST_RESET_OWNER,
+    [VHOST_USER_SET_MEM_TABLE] = VHOST_SET_MEM_TABLE,
+    [VHOST_USER_SET_LOG_BASE] = VHOST_SET_LOG_BASE,
+    [VHOST_USER_SET_VRING_NUM] = VHOST_SET_VRING_NUM,
+    [VHOST_USER_SET_VRING_ADDR] = VHOST_SET_VRING_ADDR,
+    [VHOST_USER_SET_VRING_BASE] = VHOST_SET_VRING_BASE,
+    [VHOST_USER_GET_VRING_BASE] = VHOST_GET_VRING_BASE,
+    [VHOST_USER_SET_VRING_KICK] = VHOST_SET_VRING_KICK,
+    [VHOST_USER_SET_VRING_CALL] = VHOST_SET_VRING_CALL,
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long request)
+{
+    VhostUserRequest i;
+
+    for (i = VHOST_USER_NONE + 1; i < VHOST_USER_MAX; i++) {
+        if (vhost_user_requests[i] == request) {
+            return i;
+        }
+    }
+    return VHOST_USER_NONE;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    union {
+        struct cmsghdr cmsg;
+        char buf[CMSG_SPACE(sizeof(int) * VHOST_USER_MEMORY_MAX_NREGIONS)];
+    } control;
+    struct msghdr msgh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    size_t size = VHOST_USER_HDR_SIZE + msg->size;
+    ssize_t r;
+
+    assert(fd_num <= VHOST_USER_MEMORY_MAX_NREGIONS);
+
+    iov.iov_base = msg;
+    iov.iov_len = size;
+    memset(&msgh, 0, sizeof msgh);
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    if (fd_num) {
+        msgh.msg_control = control.buf;
+        msgh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_num);
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_num);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_num);
+    }
+
+    do {
+        r = sendmsg(dev->control, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -errno;
+    }
+    return r == size ? 0 : -EIO;
+}
+
+static int vhost_user_read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t r;
+
+    while (len) {
+        r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return r < 0 ? -errno : -EPIPE;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg,
+                           VhostUserRequest request)
+{
+    int r;
+
+    r = vhost_user_read_all(dev->control, msg, VHOST_USER_HDR_SIZE);
+    if (r < 0) {
+        return r;
+    }
+    if (msg->request != request ||
+        msg->flags != (VHOST_USER_REPLY | VHOST_USER_VERSION) ||
+        msg->size > sizeof msg->payload) {
+        fprintf(stderr, "vhost-user: bad reply %u flags 0x%x size %u "
+                "to request %u\n", msg->request, msg->flags, msg->size,
+                request);
+        return -EPROTO;
+    }
+    return vhost_user_read_all(dev->control, &msg->payload, msg->size);
+}
+
+/* Describe the table in terms of the fds backing guest RAM.  A vhost
+ * region may cover more than one RAM block; memory that is not shared
+ * (small ROMs and the like) cannot be mapped by the backend and is left
+ * out, so rings and buffers must live in -mem-path RAM. */
+static int vhost_user_set_mem_table(struct vhost_memory *mem,
+                                    VhostUserMemory *umem, int *fds)
+{
+    int i, n = 0;
+
+    for (i = 0; i < mem->nregions; ++i) {
+        struct vhost_memory_region *reg = mem->regions + i;
+        uint64_t done = 0;
+
+        while (done < reg->memory_size) {
+            ram_addr_t offset, length;
+            int fd;
+
+            fd = qemu_ram_get_fd((void *)(unsigned long)
+                                 (reg->userspace_addr + done),
+                                 &offset, &length);
+            /* skip private blocks whole; stray pages one at a time */
+            length = MIN(length ? length : TARGET_PAGE_SIZE,
+                         reg->memory_size - done);
+            if (fd < 0) {
+                done += length;
+                continue;
+            }
+            if (n == VHOST_USER_MEMORY_MAX_NREGIONS) {
+                fprintf(stderr, "vhost-user: too many memory regions\n");
+                return -E2BIG;
+            }
+            umem->regions[n].guest_phys_addr = reg->guest_phys_addr + done;
+            umem->regions[n].memory_size = length;
+            umem->regions[n].userspace_addr = reg->userspace_addr + done;
+            umem->regions[n].mmap_offset = offset;
+            fds[n++] = fd;
+            done += length;
+        }
+    }
+    umem->nregions = n;
+    return n;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file;
+    int fds[VHOST_USER_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+    bool need_reply = false;
+    int r;
+
+    msg_request = vhost_user_request_translate(request);
+    if (msg_request == VHOST_USER_NONE) {
+        return -ENOSYS;
+    }
+    memset(&msg, 0, sizeof msg);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        need_reply = true;
+        break;
+    case VHOST_USER_SET_FEATURES:
+        msg.payload.u64 = *(uint64_t *)arg;
+        msg.size = sizeof msg.payload.u64;
+        break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        break;
+    case VHOST_USER_SET_MEM_TABLE:
+        r = vhost_user_set_mem_table(arg, &msg.payload.memory, fds);
+        if (r < 0) {
+            return r;
+        }
+        fd_num = r;
+        msg.size = offsetof(VhostUserMemory, regions) +
+            fd_num * sizeof msg.payload.memory.regions[0];
+        need_reply = true;
+        break;
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof msg.payload.state);
+        msg.size = sizeof msg.payload.state;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(&msg.payload.state, arg, sizeof msg.payload.state);
+        msg.size = sizeof msg.payload.state;
+        need_reply = true;
+        break;
+    case VHOST_USER_SET_VRING_ADDR: {
+        struct vhost_vring_addr *addr = arg;
+
+        msg.payload.addr.index = addr->index;
+        msg.payload.addr.flags = addr->flags;
+        msg.payload.addr.desc_user_addr = addr->desc_user_addr;
+        msg.payload.addr.used_user_addr = addr->used_user_addr;
+        msg.payload.addr.avail_user_addr = addr->avail_user_addr;
+        msg.payload.addr.log_guest_addr = addr->log_guest_addr;
+        msg.size = sizeof msg.payload.addr;
+        break;
+    }
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+        file = arg;
+        msg.payload.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD;
+        }
+        msg.size = sizeof msg.payload.u64;
+        break;
+    default:
+        return -ENOSYS;
+    }
+
+    r = vhost_user_write(dev, &msg, fds, fd_num);
+    if (r < 0 || !need_reply) {
+        return r;
+    }
+    r = vhost_user_read(dev, &msg, msg_request);
+    if (r < 0) {
+        return r;
+    }
+
+    switch (msg_request) {
+    case VHOST_USER_GET_FEATURES:
+        *(uint64_t *)arg = msg.payload.u64;
+        break;
+    case VHOST_USER_GET_VRING_BASE:
+        memcpy(arg, &msg.payload.state, sizeof msg.payload.state);
+        break;
+    default:
+        return (int64_t)msg.payload.u64;
+    }
+    return 0;
+}
+
+/* The backend writes the log directly, so it lives in a shared mapping
+ * whose fd is handed over with SET_LOG_BASE. */
+static vhost_log_chunk_t *vhost_user_log_alloc(struct vhost_dev *dev,
+                                               uint64_t size, int *fd)
+{
+    static const char *const dirs[] = { "/dev/shm", "/tmp" };
+    size_t len = size * sizeof(vhost_log_chunk_t);
+    char path[64];
+    void *log;
+    int i;
+
+    *fd = -1;
+    for (i = 0; i < ARRAY_SIZE(dirs) && *fd < 0; i++) {
+        snprintf(path, sizeof path, "%s/qemu-vhost-log.XXXXXX", dirs[i]);
+        *fd = mkstemp(path);
+    }
+    if (*fd < 0) {
+        perror("vhost-user: cannot create dirty log");
+        return NULL;
+    }
+    unlink(path);
+    if (ftruncate(*fd, len) < 0) {
+        goto fail;
+    }
+    log = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (log == MAP_FAILED) {
+        goto fail;
+    }
+    return log;
+fail:
+    perror("vhost-user: cannot map dirty log");
+    close(*fd);
+    *fd = -1;
+    return NULL;
+}
+
+static void vhost_user_log_free(struct vhost_dev *dev, vhost_log_chunk_t *log,
+                                uint64_t size, int fd)
+{
+    munmap(log, size * sizeof(vhost_log_chunk_t));
+    close(fd);
+}
+
+static int vhost_user_set_log_base(struct vhost_dev *dev,
+                                   vhost_log_chunk_t *log,
+                                   uint64_t size, int fd)
+{
+    VhostUserMsg msg;
+    int r;
+
+    memset(&msg, 0, sizeof msg);
+    msg.request = VHOST_USER_SET_LOG_BASE;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = sizeof msg.payload.log;
+    msg.payload.log.size = log ? size * sizeof(vhost_log_chunk_t) : 0;
+    msg.payload.log.offset = 0;
+
+    r = vhost_user_write(dev, &msg, &fd, log ? 1 : 0);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_user_read(dev, &msg, VHOST_USER_SET_LOG_BASE);
+    if (r < 0) {
+        return r;
+    }
+    return (int64_t)msg.payload.u64;
+}
+
+const VhostOps vhost_user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_log_alloc = vhost_user_log_alloc,
+    .vhost_log_free = vhost_user_log_free,
+    .vhost_set_log_base = vhost_user_set_log_base,
+};
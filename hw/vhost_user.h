@@ -0,0 +1,108 @@
+/*
+ * vhost-user protocol: serving vhost rings from a separate process
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each vhost ioctl becomes one message on a unix stream socket.  A message
+ * is a fixed header followed by "size" bytes of payload.  File descriptors
+ * (guest memory, dirty log, kick and call eventfds) travel as SCM_RIGHTS
+ * ancillary data on the same message.
+ *
+ * GET_FEATURES and GET_VRING_BASE are answered with the requested value.
+ * SET_MEM_TABLE and SET_LOG_BASE are answered with a u64 status (0 or a
+ * negative errno) once the backend has switched to the new mapping, so
+ * qemu may then release or read back the old one.  Replies carry the same
+ * request code with VHOST_USER_REPLY set in flags.  No other request is
+ * answered.
+ *
+ * Addresses in SET_VRING_ADDR and userspace_addr in SET_MEM_TABLE are
+ * virtual addresses in the qemu process.  The backend maps each region fd
+ * and translates both qemu virtual and guest physical addresses through
+ * the table.
+ */
+
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_VERSION_MASK     0xff
+#define VHOST_USER_REPLY            (0x1 << 8)
+
+#define VHOST_USER_MEMORY_MAX_NREGIONS 8
+
+/* SET_VRING_KICK/CALL: u64 is the ring index, plus this if no fd is sent */
+#define VHOST_USER_VRING_IDX_MASK   0xff
+#define VHOST_USER_VRING_NOFD       (0x1 << 8)
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,   /* one fd per region */
+    VHOST_USER_SET_LOG_BASE = 6,    /* log fd, or none to stop logging */
+    VHOST_USER_SET_VRING_NUM = 7,
+    VHOST_USER_SET_VRING_ADDR = 8,
+    VHOST_USER_SET_VRING_BASE = 9,
+    VHOST_USER_GET_VRING_BASE = 10, /* also stops the ring */
+    VHOST_USER_SET_VRING_KICK = 11, /* eventfd, or none to stop the ring */
+    VHOST_USER_SET_VRING_CALL = 12, /* eventfd, or none */
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;           /* of guest_phys_addr within the fd */
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_USER_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserLog {
+    uint64_t size;                  /* in bytes */
+    uint64_t offset;
+} VhostUserLog;
+
+typedef struct VhostUserVringState {
+    uint32_t index;
+    uint32_t num;
+} VhostUserVringState;
+
+typedef struct VhostUserVringAddr {
+    uint32_t index;
+    uint32_t flags;                 /* VHOST_VRING_F_LOG */
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} VhostUserVringAddr;
+
+typedef struct VhostUserMsg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    uint32_t padding;
+    union {
+        uint64_t u64;
+        VhostUserVringState state;
+        VhostUserVringAddr addr;
+        VhostUserMemory memory;
+        VhostUserLog log;
+    } payload;
+} VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload)
+
+#endif
@@ -15,6 +15,7 @@
 #include "qemu-error.h"
 #include "trace.h"
 #include "virtio-blk.h"
+#include "vhost_blk.h"
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
 #include "hw/dataplane/virtio-blk.h"
 #endif
@@ -37,6 +38,8 @@ typedef struct VirtIOBlock
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     VirtIOBlockDataPlane *dataplane;
 #endif
+    VHostBlkState *vhost;
+    uint8_t vhost_started;
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -548,20 +551,61 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (bdrv_is_read_only(s->bs))
         features |= 1 << VIRTIO_BLK_F_RO;
 
+    if (s->vhost) {
+        features = vhost_blk_get_features(s->vhost, features);
+    }
     return features;
 }
 
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_features(VirtIODevice *vdev, uint32_t features)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->vhost) {
+        vhost_blk_ack_features(s->vhost, features);
+    }
+}
+
+static void virtio_blk_vhost_status(VirtIOBlock *s, uint8_t status)
+{
+    int r;
+
+    if (!s->vhost) {
+        return;
+    }
+    if (!!s->vhost_started == ((status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+                               s->vdev.vm_running)) {
+        return;
+    }
+    if (!s->vhost_started) {
+        if (!vhost_blk_query(s->vhost, &s->vdev)) {
+            return;
+        }
+        r = vhost_blk_start(s->vhost, &s->vdev);
+        if (r < 0) {
+            error_report("unable to start vhost-blk: %d: "
+                         "falling back on userspace virtio", -r);
+        } else {
+            s->vhost_started = 1;
+        }
+    } else {
+        vhost_blk_stop(s->vhost, &s->vdev);
+        s->vhost_started = 0;
+    }
+}
+
 static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
                                     VIRTIO_CONFIG_S_DRIVER_OK))) {
         virtio_blk_data_plane_stop(s->dataplane);
     }
-}
 #endif
+    virtio_blk_vhost_status(s, status);
+}
 
 static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
@@ -657,9 +701,8 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
-#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    s->vdev.set_features = virtio_blk_set_features;
     s->vdev.set_status = virtio_blk_set_status;
-#endif
     s->vdev.reset = virtio_blk_reset;
     s->bs = blk->conf.bs;
     s->conf = &blk->conf;
@@ -676,6 +719,21 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
         return NULL;
     }
 #endif
+    if (blk->vhost) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        if (blk->data_plane) {
+            error_report("x-vhost-user and x-data-plane are exclusive");
+            virtio_blk_data_plane_destroy(s->dataplane);
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+#endif
+        s->vhost = vhost_blk_init(blk->vhost);
+        if (!s->vhost) {
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+    }
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -703,6 +761,12 @@ void virtio_blk_exit(VirtIODevice *vdev)
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
 #endif
+    if (s->vhost) {
+        /* This will stop vhost backend if appropriate. */
+        virtio_blk_vhost_status(s, 0);
+        vhost_blk_cleanup(s->vhost);
+        s->vhost = NULL;
+    }
     unregister_savevm(s->qdev, "virtio-blk", s);
     virtio_cleanup(vdev);
 }
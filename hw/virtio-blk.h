@@ -103,6 +103,7 @@ struct VirtIOBlkConf
     char *serial;
     uint32_t scsi;
     uint32_t data_plane;
+    char *vhost;
 };
 
 #ifdef __linux__
@@ -18,6 +18,7 @@
 #include "net/tap.h"
 #include "qemu-error.h"
 #include "qemu-timer.h"
+#include "monitor.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
@@ -26,6 +27,18 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* Minimum sampling period for the TX packet rate estimate */
+#define TX_RATE_WINDOW  1000000 /* 1 ms */
+
+/* Most receive buffers a packet may be scattered over when the backend
+ * reads it directly into guest memory.  Guests using mergeable buffers
+ * post one page per buffer, and a 64k GSO packet needs 17 of them. */
+#define RX_DIRECT_MAX_ELEMS 24
+
+/* Most transmitted packets whose buffers are held until the backend has
+ * sent them together, see virtio_net_flush_tx() */
+#define TX_BATCH_MAX 16
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
@@ -39,7 +52,23 @@ typedef struct VirtIONet
     QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    uint32_t tx_timeout_max;
+    int32_t tx_burst_max;
+    uint32_t tx_adaptive;
     int tx_waiting;
+    struct {
+        int64_t start;
+        uint64_t packets;
+        uint64_t rate;          /* packets per second, smoothed */
+    } tx_window;
+    struct {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t kicks;
+        uint64_t flushes;
+        uint64_t full_bursts;
+        uint64_t async_stalls;
+    } tx_stats;
     uint32_t has_vnet_hdr;
     uint8_t has_ufo;
     struct {
@@ -63,6 +92,15 @@ typedef struct VirtIONet
         uint8_t *macs;
     } mac_table;
     uint32_t *vlans;
+    struct {
+        VirtQueueElement *elems;
+        struct iovec iov[VIRTQUEUE_MAX_SIZE];
+        size_t len[RX_DIRECT_MAX_ELEMS];
+    } *rx_direct;
+    struct {
+        VirtQueueElement elems[TX_BATCH_MAX];
+        size_t len[TX_BATCH_MAX];
+    } *tx_batch;
     DeviceState *qdev;
 } VirtIONet;
 
@@ -660,8 +698,197 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
     return size;
 }
 
+/* Return rx_direct->elems[first..num-1] to the queue, last one first */
+static void virtio_net_rx_discard(VirtIONet *n, int first, int num)
+{
+    while (num-- > first) {
+        virtqueue_discard(n->rx_vq, &n->rx_direct->elems[num]);
+    }
+}
+
+/* Read the next packet from fd directly into buffers popped from the
+ * receive queue, saving the copy through the backend's bounce buffer.
+ * Enough buffers for a maximal packet must be available; otherwise
+ * nothing is read and the backend falls back to virtio_net_receive().
+ * A packet cannot be filtered before it is read, so this is only done
+ * in promiscuous mode: frames the guest did not ask for must never reach
+ * its memory. */
+static ssize_t virtio_net_receive_fd(VLANClientState *nc, int fd)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    struct virtio_net_hdr_mrg_rxbuf *mhdr;
+    size_t guest_hdr_len, host_hdr_len, need, avail, offset;
+    struct iovec *iov;
+    ssize_t size;
+    int i, j, num_elems, iovcnt, used;
+
+    if (!virtio_net_can_receive(&n->nic->nc) || !n->promisc) {
+        return 0;
+    }
+
+    /* Without mergeable buffers, only guests that accept GSO packets post
+     * buffers large enough for any packet */
+    if (!n->mergeable_rx_bufs &&
+        !(n->vdev.guest_features & ((1 << VIRTIO_NET_F_GUEST_TSO4) |
+                                    (1 << VIRTIO_NET_F_GUEST_TSO6) |
+                                    (1 << VIRTIO_NET_F_GUEST_UFO)))) {
+        return 0;
+    }
+
+    guest_hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+    host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+    need = VIRTIO_NET_MAX_BUFSIZE + guest_hdr_len - host_hdr_len;
+
+    if (!virtio_net_has_buffers(n, need) ||
+        !virtqueue_avail_bytes(n->rx_vq, need, 0)) {
+        return 0;
+    }
+
+    if (!n->rx_direct) {
+        n->rx_direct = qemu_mallocz(sizeof(*n->rx_direct));
+        n->rx_direct->elems = qemu_malloc(RX_DIRECT_MAX_ELEMS *
+                                          sizeof(VirtQueueElement));
+    }
+    iov = n->rx_direct->iov;
+
+    /* Collect buffers for a maximal packet.  The first one starts with
+     * the guest header, of which the backend only fills the part that
+     * it knows about. */
+    avail = iovcnt = num_elems = 0;
+    while (avail < VIRTIO_NET_MAX_BUFSIZE) {
+        VirtQueueElement *elem = &n->rx_direct->elems[num_elems];
+        size_t start = avail;
+
+        if (num_elems == RX_DIRECT_MAX_ELEMS ||
+            (num_elems && !n->mergeable_rx_bufs) ||
+            !virtqueue_pop(n->rx_vq, elem)) {
+            virtio_net_rx_discard(n, 0, num_elems);
+            return 0;
+        }
+        num_elems++;
+
+        if (elem->in_num < 1 ||
+            iovcnt + elem->in_num + 1 > ARRAY_SIZE(n->rx_direct->iov) ||
+            (num_elems == 1 && elem->in_sg[0].iov_len < guest_hdr_len) ||
+            (!n->mergeable_rx_bufs &&
+             elem->in_sg[0].iov_len != guest_hdr_len)) {
+            virtio_net_rx_discard(n, 0, num_elems);
+            return 0;
+        }
+
+        for (i = 0; i < elem->in_num; i++) {
+            iov[iovcnt] = elem->in_sg[i];
+            if (num_elems == 1 && i == 0) {
+                if (host_hdr_len) {
+                    iov[iovcnt++].iov_len = host_hdr_len;
+                    avail += host_hdr_len;
+                    iov[iovcnt] = elem->in_sg[0];
+                }
+                iov[iovcnt].iov_base += guest_hdr_len;
+                iov[iovcnt].iov_len -= guest_hdr_len;
+                if (!iov[iovcnt].iov_len) {
+                    continue;
+                }
+            }
+            avail += iov[iovcnt++].iov_len;
+        }
+        n->rx_direct->len[num_elems - 1] = avail - start;
+    }
+
+    do {
+        size = readv(fd, iov, iovcnt);
+    } while (size < 0 && errno == EINTR);
+
+    if (size <= 0) {
+        virtio_net_rx_discard(n, 0, num_elems);
+        return -1;
+    }
+
+    mhdr = n->rx_direct->elems[0].in_sg[0].iov_base;
+    if (!host_hdr_len) {
+        memset(mhdr, 0, guest_hdr_len);
+        mhdr->hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    } else if ((mhdr->hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+               size - host_hdr_len < 1500) {
+        uint8_t buf[1500];
+
+        iov_to_buf(iov, iovcnt, buf, host_hdr_len, size - host_hdr_len);
+        work_around_broken_dhclient(&mhdr->hdr, buf, size - host_hdr_len);
+        iov_from_buf(iov + 1, iovcnt - 1, buf, size - host_hdr_len);
+    }
+
+    /* Hand back the buffers that were filled, return the others */
+    offset = 0;
+    for (used = 0; used < num_elems && offset < size; used++) {
+        size_t len = MIN(n->rx_direct->len[used], size - offset);
+
+        offset += len;
+        if (used == 0) {
+            len += guest_hdr_len - host_hdr_len;
+        }
+        n->rx_direct->len[used] = len;
+    }
+    virtio_net_rx_discard(n, used, num_elems);
+    for (j = 0; j < used; j++) {
+        virtqueue_fill(n->rx_vq, &n->rx_direct->elems[j],
+                       n->rx_direct->len[j], j);
+    }
+
+    if (n->mergeable_rx_bufs) {
+        mhdr->num_buffers = used;
+    }
+
+    virtqueue_flush(n->rx_vq, used);
+    virtio_notify(&n->vdev, n->rx_vq);
+
+    return size;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
 
+/* Rescale the TX mitigation parameters from the guest packet rate.
+ * The number of packets expected within one maximal timer window
+ * bounds the burst; the timer is shortened to the time it takes the
+ * guest to fill a burst, and disabled entirely when there is nothing
+ * to coalesce. */
+static void virtio_net_tx_adapt(VirtIONet *n, int32_t num_packets)
+{
+    int64_t now, delta;
+    uint64_t rate, expected;
+
+    now = qemu_get_clock(vm_clock);
+    n->tx_window.packets += num_packets;
+    delta = now - n->tx_window.start;
+    if (delta < TX_RATE_WINDOW) {
+        return;
+    }
+
+    rate = n->tx_window.packets * get_ticks_per_sec() / delta;
+    n->tx_window.rate = (3 * n->tx_window.rate + rate) / 4;
+    n->tx_window.start = now;
+    n->tx_window.packets = 0;
+
+    expected = n->tx_window.rate * n->tx_timeout_max / get_ticks_per_sec();
+
+    if (n->tx_timer) {
+        if (expected < 2) {
+            n->tx_timeout = 0;
+        } else {
+            uint64_t timeout;
+
+            timeout = n->tx_burst_max * get_ticks_per_sec();
+            timeout /= n->tx_window.rate;
+            timeout = MAX(timeout, TX_TIMER_INTERVAL_MIN);
+            n->tx_timeout = MIN(timeout, n->tx_timeout_max);
+        }
+    } else {
+        /* x-txburst is the upper bound even when it is below the floor */
+        n->tx_burst = MAX(MIN(expected, n->tx_burst_max),
+                          MIN(TX_BURST_MIN, n->tx_burst_max));
+    }
+}
+
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
@@ -675,11 +902,34 @@ static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
     virtio_net_flush_tx(n, n->tx_vq);
 }
 
+/* End the backend's batch, then give the packets it took back to the
+ * guest with a single notification */
+static void virtio_net_tx_release(VirtIONet *n, VirtQueue *vq, int num)
+{
+    int i;
+
+    qemu_net_batch_end(&n->nic->nc);
+    if (!num) {
+        return;
+    }
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(vq, &n->tx_batch->elems[i], n->tx_batch->len[i], i);
+    }
+    virtqueue_flush(vq, num);
+    virtio_notify(&n->vdev, vq);
+}
+
 /* TX */
+/* Packets are sent within a backend batch, so that e.g. a socket netdev
+ * writes the whole burst with one syscall.  The backend refers to the
+ * guest buffers until the batch ends, so up to TX_BATCH_MAX elements are
+ * held before they are pushed back. */
 static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
+    int num_held = 0;
+    bool busy = false;
 
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -690,12 +940,29 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
+    if (!n->tx_batch) {
+        n->tx_batch = qemu_malloc(sizeof(*n->tx_batch));
+    }
+    qemu_net_batch_begin(&n->nic->nc);
+
+    for (;;) {
         ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num;
+        struct iovec *out_sg;
         unsigned hdr_len;
 
+        if (num_held == TX_BATCH_MAX) {
+            virtio_net_tx_release(n, vq, num_held);
+            num_held = 0;
+            qemu_net_batch_begin(&n->nic->nc);
+        }
+        elem = &n->tx_batch->elems[num_held];
+        if (!virtqueue_pop(vq, elem)) {
+            break;
+        }
+        out_num = elem->out_num;
+        out_sg = &elem->out_sg[0];
+
         /* hdr_len refers to the header received from the guest */
         hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -722,27 +989,46 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
                                       virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
+            n->async_tx.elem = *elem;
             n->async_tx.len  = len;
-            return -EBUSY;
+            n->tx_stats.async_stalls++;
+            busy = true;
+            break;
         }
 
         len += ret;
-
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
+        n->tx_stats.bytes += ret;
+        n->tx_batch->len[num_held++] = len;
 
         if (++num_packets >= n->tx_burst) {
+            n->tx_stats.full_bursts++;
             break;
         }
     }
-    return num_packets;
+    virtio_net_tx_release(n, vq, num_held);
+
+    n->tx_stats.flushes++;
+    if (num_packets > 0) {
+        n->tx_stats.packets += num_packets;
+        if (n->tx_adaptive) {
+            virtio_net_tx_adapt(n, num_packets);
+        }
+    }
+    return busy ? -EBUSY : num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
+    n->tx_stats.kicks++;
+
+    /* Adaptive mitigation found nothing worth waiting for */
+    if (!n->tx_waiting && !n->tx_timeout) {
+        virtio_net_flush_tx(n, vq);
+        return;
+    }
+
     if (n->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
         qemu_del_timer(n->tx_timer);
@@ -760,6 +1046,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
+    n->tx_stats.kicks++;
+
     if (unlikely(n->tx_waiting)) {
         return;
     }
@@ -785,6 +1073,7 @@ static void virtio_net_tx_timer(void *opaque)
 static void virtio_net_tx_bh(void *opaque)
 {
     VirtIONet *n = opaque;
+    int32_t burst = n->tx_burst;
     int32_t ret;
 
     n->tx_waiting = 0;
@@ -800,7 +1089,7 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= burst) {
         qemu_bh_schedule(n->tx_bh);
         n->tx_waiting = 1;
         return;
@@ -952,6 +1241,28 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+static void virtio_net_print_info(VLANClientState *nc, Monitor *mon)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    monitor_printf(mon, "    tx: packets=%" PRIu64 " bytes=%" PRIu64
+                   " kicks=%" PRIu64 " flushes=%" PRIu64
+                   " full_bursts=%" PRIu64 " async_stalls=%" PRIu64 "\n",
+                   n->tx_stats.packets, n->tx_stats.bytes,
+                   n->tx_stats.kicks, n->tx_stats.flushes,
+                   n->tx_stats.full_bursts, n->tx_stats.async_stalls);
+    monitor_printf(mon, "    tx: mitigation=%s%s burst=%d",
+                   n->tx_timer ? "timer" : "bh",
+                   n->tx_adaptive ? ",adaptive" : "", n->tx_burst);
+    if (n->tx_timer) {
+        monitor_printf(mon, " timeout=%u", n->tx_timeout);
+    }
+    if (n->tx_adaptive) {
+        monitor_printf(mon, " rate=%" PRIu64 "pps", n->tx_window.rate);
+    }
+    monitor_printf(mon, "\n");
+}
+
 static void virtio_net_cleanup(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
@@ -964,8 +1275,10 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_fd = virtio_net_receive_fd,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .print_info = virtio_net_print_info,
 };
 
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
@@ -997,6 +1310,7 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
         n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
         n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
         n->tx_timeout = net->txtimer;
+        n->tx_timeout_max = net->txtimer;
     } else {
         n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
         n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
@@ -1013,6 +1327,9 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 
     n->tx_waiting = 0;
     n->tx_burst = net->txburst;
+    n->tx_burst_max = net->txburst;
+    n->tx_adaptive = net->txadaptive;
+    n->tx_window.start = qemu_get_clock(vm_clock);
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
@@ -1042,6 +1359,11 @@ void virtio_net_exit(VirtIODevice *vdev)
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
+    if (n->rx_direct) {
+        qemu_free(n->rx_direct->elems);
+        qemu_free(n->rx_direct);
+    }
+    qemu_free(n->tx_batch);
 
     if (n->tx_timer) {
         qemu_del_timer(n->tx_timer);
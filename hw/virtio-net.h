@@ -56,10 +56,17 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Bounds for adaptive TX mitigation.  When enabled, the timer interval
+ * and burst size are rescaled from the observed guest packet rate,
+ * using txtimer and txburst as upper limits. */
+#define TX_TIMER_INTERVAL_MIN 10000 /* 10 us */
+#define TX_BURST_MIN 16
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
+    uint32_t txadaptive;
     char *tx;
     bool macvtap_rhel620_compat;
 } virtio_net_conf;
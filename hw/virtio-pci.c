@@ -97,6 +97,12 @@
 #define VIRTIO_PCI_FLAG_RHEL620_BIT 3
 #define VIRTIO_PCI_FLAG_RHEL620 (1 << VIRTIO_PCI_FLAG_RHEL620_BIT)
 
+/* Raise virtqueue interrupts by signalling the guest notifier, so that with
+ * MSI-X they are injected by kvm through irqfd rather than by an ioctl from
+ * the thread that completed the request. */
+#define VIRTIO_PCI_FLAG_USE_IRQFD_BIT 4
+#define VIRTIO_PCI_FLAG_USE_IRQFD   (1 << VIRTIO_PCI_FLAG_USE_IRQFD_BIT)
+
 
 /* QEMU doesn't strictly need write barriers since everything runs in
  * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
@@ -106,7 +112,7 @@
 
 /* PCI bindings.  */
 
-typedef struct {
+typedef struct VirtIOPCIProxy {
     PCIDevice pci_dev;
     VirtIODevice *vdev;
     uint32_t flags;
@@ -121,8 +127,20 @@ typedef struct {
     virtio_net_conf net;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
+    /* kvm lacks ioeventfds; kicks reach the notifiers from userspace */
+    bool ioeventfd_userspace;
+    /* QUEUE_NOTIFY port served without qemu_mutex, and its queues */
+    uint32_t kick_unlocked_port;
+    uint64_t kick_unlocked_queues;
+    bool irqfd_started;
+    /* irqfd mode, vhost and dataplane may share the guest notifiers */
+    int guest_notifier_users;
+    QLIST_ENTRY(VirtIOPCIProxy) next;
 } VirtIOPCIProxy;
 
+static QLIST_HEAD(, VirtIOPCIProxy) virtio_pci_proxies =
+    QLIST_HEAD_INITIALIZER(virtio_pci_proxies);
+
 /* virtio device */
 
 static void virtio_pci_notify(void *opaque, uint16_t vector)
@@ -187,11 +205,13 @@ static int virtio_pci_load_queue(void * opaque, int n, QEMUFile *f)
 }
 
 static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
-                                                 int n, bool assign)
+                                                 int n, bool assign,
+                                                 bool in_kernel)
 {
     VirtQueue *vq = virtio_get_queue(proxy->vdev, n);
     EventNotifier *notifier = virtio_queue_get_host_notifier(vq);
-    int r;
+    uint64_t kicks;
+    int r = 0;
     if (assign) {
         r = event_notifier_init(notifier, 1);
         if (r < 0) {
@@ -199,18 +219,24 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
                          __func__, r);
             return r;
         }
-        r = kvm_set_ioeventfd_pio_word(event_notifier_get_fd(notifier),
-                                       proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY,
-                                       n, assign);
+        if (in_kernel) {
+            r = kvm_set_ioeventfd_pio_word(event_notifier_get_fd(notifier),
+                                           proxy->addr +
+                                           VIRTIO_PCI_QUEUE_NOTIFY,
+                                           n, assign);
+        }
         if (r < 0) {
             error_report("%s: unable to map ioeventfd: %d",
                          __func__, r);
             event_notifier_cleanup(notifier);
         }
     } else {
-        r = kvm_set_ioeventfd_pio_word(event_notifier_get_fd(notifier),
-                                       proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY,
-                                       n, assign);
+        if (in_kernel) {
+            r = kvm_set_ioeventfd_pio_word(event_notifier_get_fd(notifier),
+                                           proxy->addr +
+                                           VIRTIO_PCI_QUEUE_NOTIFY,
+                                           n, assign);
+        }
         if (r < 0) {
             error_report("%s: unable to unmap ioeventfd: %d",
                          __func__, r);
@@ -220,8 +246,9 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
         /* Handle the race condition where the guest kicked and we deassigned
          * before we got around to handling the kick.
          */
-        if (event_notifier_test_and_clear(notifier)) {
-            virtio_queue_notify_vq(vq);
+        kicks = event_notifier_test_and_clear_count(notifier);
+        if (kicks) {
+            virtio_queue_notify_kicks(vq, kicks);
         }
 
         event_notifier_cleanup(notifier);
@@ -233,8 +260,9 @@ static void virtio_pci_host_notifier_read(void *opaque)
 {
     VirtQueue *vq = opaque;
     EventNotifier *n = virtio_queue_get_host_notifier(vq);
-    if (event_notifier_test_and_clear(n)) {
-        virtio_queue_notify_vq(vq);
+    uint64_t kicks = event_notifier_test_and_clear_count(n);
+    if (kicks) {
+        virtio_queue_notify_kicks(vq, kicks);
     }
 }
 
@@ -252,6 +280,38 @@ static void virtio_pci_set_host_notifier_fd_handler(VirtIOPCIProxy *proxy,
     }
 }
 
+/* Forward a kick to the queue's host notifier, which is serviced by the
+ * iothread, instead of taking qemu_mutex in the vcpu */
+static int virtio_pci_kick_unlocked(void *opaque, uint64_t addr,
+                                    uint64_t *data, unsigned size,
+                                    bool is_write)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    uint64_t n = *data;
+    VirtQueue *vq;
+
+    if (!is_write || size != 2 || n >= VIRTIO_PCI_QUEUE_MAX ||
+        !(proxy->kick_unlocked_queues & (1ULL << n))) {
+        return -1;
+    }
+    vq = virtio_get_queue(proxy->vdev, n);
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    return 0;
+}
+
+static void virtio_pci_set_kick_unlocked(VirtIOPCIProxy *proxy, bool assign)
+{
+    if (proxy->kick_unlocked_port) {
+        kvm_unregister_unlocked_io(true, proxy->kick_unlocked_port, proxy);
+        proxy->kick_unlocked_port = 0;
+    }
+    if (assign &&
+        kvm_register_unlocked_io(true, proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY,
+                                 2, virtio_pci_kick_unlocked, proxy) == 0) {
+        proxy->kick_unlocked_port = proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY;
+    }
+}
+
 static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
 {
     int n, r;
@@ -267,14 +327,19 @@ static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
             continue;
         }
 
-        r = virtio_pci_set_host_notifier_internal(proxy, n, true);
+        r = virtio_pci_set_host_notifier_internal(proxy, n, true,
+                                                  !proxy->ioeventfd_userspace);
         if (r < 0) {
             goto assign_error;
         }
 
         virtio_pci_set_host_notifier_fd_handler(proxy, n, true);
+        proxy->kick_unlocked_queues |= 1ULL << n;
     }
     proxy->ioeventfd_started = true;
+    /* Kicks the kernel does not swallow through an ioeventfd still exit;
+     * let the vcpu signal the notifier without taking qemu_mutex. */
+    virtio_pci_set_kick_unlocked(proxy, true);
     return;
 
 assign_error:
@@ -284,10 +349,21 @@ assign_error:
         }
 
         virtio_pci_set_host_notifier_fd_handler(proxy, n, false);
-        r = virtio_pci_set_host_notifier_internal(proxy, n, false);
+        r = virtio_pci_set_host_notifier_internal(proxy, n, false,
+                                                  !proxy->ioeventfd_userspace);
         assert(r >= 0);
     }
+    proxy->kick_unlocked_queues = 0;
     proxy->ioeventfd_started = false;
+
+    /* Out of kernel ioeventfds, e.g. for a device with many queues: keep the
+     * notifiers and let the vcpu signal them */
+    if (!proxy->ioeventfd_userspace &&
+        kvm_enabled() && kvm_irqchip_in_kernel()) {
+        proxy->ioeventfd_userspace = true;
+        virtio_pci_start_ioeventfd(proxy);
+        return;
+    }
     error_report("%s: failed. Fallback to a userspace (slower).", __func__);
 }
 
@@ -300,22 +376,66 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         return;
     }
 
+    virtio_pci_set_kick_unlocked(proxy, false);
+    proxy->kick_unlocked_queues = 0;
+
     for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
         if (!virtio_queue_get_num(proxy->vdev, n)) {
             continue;
         }
 
         virtio_pci_set_host_notifier_fd_handler(proxy, n, false);
-        r = virtio_pci_set_host_notifier_internal(proxy, n, false);
+        r = virtio_pci_set_host_notifier_internal(proxy, n, false,
+                                                  !proxy->ioeventfd_userspace);
         assert(r >= 0);
     }
     proxy->ioeventfd_started = false;
 }
 
+static int virtio_pci_set_guest_notifiers(void *opaque, bool assign);
+
+static void virtio_pci_start_irqfd(VirtIOPCIProxy *proxy)
+{
+    int r;
+
+    if (!(proxy->flags & VIRTIO_PCI_FLAG_USE_IRQFD) ||
+        proxy->irqfd_started ||
+        !(proxy->vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+        !proxy->vdev->vm_running ||
+        !msix_enabled(&proxy->pci_dev)) {
+        return;
+    }
+
+    r = virtio_pci_set_guest_notifiers(proxy, true);
+    if (r < 0) {
+        error_report("%s %02x:%02x.%x: x-irqfd setup failed (%s), "
+                     "interrupts will be injected from userspace",
+                     proxy->vdev->name, pci_bus_num(proxy->pci_dev.bus),
+                     PCI_SLOT(proxy->pci_dev.devfn),
+                     PCI_FUNC(proxy->pci_dev.devfn), strerror(-r));
+        proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IRQFD;
+        return;
+    }
+    proxy->irqfd_started = true;
+}
+
+static void virtio_pci_stop_irqfd(VirtIOPCIProxy *proxy)
+{
+    int r;
+
+    if (!proxy->irqfd_started) {
+        return;
+    }
+    r = virtio_pci_set_guest_notifiers(proxy, false);
+    assert(r >= 0);
+    proxy->irqfd_started = false;
+}
+
 static void virtio_pci_reset(DeviceState *d)
 {
     VirtIOPCIProxy *proxy = container_of(d, VirtIOPCIProxy, pci_dev.qdev);
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_reset(proxy->vdev);
     msix_reset(&proxy->pci_dev);
     proxy->flags &= ~VIRTIO_PCI_FLAG_BUS_MASTER_BUG;
@@ -344,6 +464,7 @@ static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
         pa = (target_phys_addr_t)val << VIRTIO_PCI_QUEUE_ADDR_SHIFT;
         if (pa == 0) {
             virtio_pci_stop_ioeventfd(proxy);
+            virtio_pci_stop_irqfd(proxy);
             virtio_reset(proxy->vdev);
             msix_unuse_all_vectors(&proxy->pci_dev);
         }
@@ -362,12 +483,14 @@ static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
     case VIRTIO_PCI_STATUS:
         if (!(val & VIRTIO_CONFIG_S_DRIVER_OK)) {
             virtio_pci_stop_ioeventfd(proxy);
+            virtio_pci_stop_irqfd(proxy);
         }
 
         virtio_set_status(vdev, val & 0xFF);
 
         if (val & VIRTIO_CONFIG_S_DRIVER_OK) {
             virtio_pci_start_ioeventfd(proxy);
+            virtio_pci_start_irqfd(proxy);
         }
 
         if (vdev->status == 0) {
@@ -384,19 +507,24 @@ static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
         }
         break;
     case VIRTIO_MSI_CONFIG_VECTOR:
+        /* irqfds are bound per vector: rebind around the change. */
+        virtio_pci_stop_irqfd(proxy);
         msix_vector_unuse(&proxy->pci_dev, vdev->config_vector);
         /* Make it possible for guest to discover an error took place. */
         if (msix_vector_use(&proxy->pci_dev, val) < 0)
             val = VIRTIO_NO_VECTOR;
         vdev->config_vector = val;
+        virtio_pci_start_irqfd(proxy);
         break;
     case VIRTIO_MSI_QUEUE_VECTOR:
+        virtio_pci_stop_irqfd(proxy);
         msix_vector_unuse(&proxy->pci_dev,
                           virtio_queue_vector(vdev, vdev->queue_sel));
         /* Make it possible for guest to discover an error took place. */
         if (msix_vector_use(&proxy->pci_dev, val) < 0)
             val = VIRTIO_NO_VECTOR;
         virtio_queue_set_vector(vdev, vdev->queue_sel, val);
+        virtio_pci_start_irqfd(proxy);
         break;
     default:
         fprintf(stderr, "%s: unexpected address 0x%x value 0x%x\n",
@@ -529,6 +657,9 @@ static void virtio_map(PCIDevice *pci_dev, int region_num,
     unsigned config_len = VIRTIO_PCI_REGION_SIZE(pci_dev) + vdev->config_len;
 
     proxy->addr = addr;
+    if (proxy->kick_unlocked_port) {
+        virtio_pci_set_kick_unlocked(proxy, true);
+    }
 
     register_ioport_write(addr, config_len, 1, virtio_pci_config_writeb, proxy);
     register_ioport_write(addr, config_len, 2, virtio_pci_config_writew, proxy);
@@ -558,6 +689,12 @@ static void virtio_write_config(PCIDevice *pci_dev, uint32_t address,
 
     pci_default_write_config(pci_dev, address, val, len);
     msix_write_config(pci_dev, address, val, len);
+
+    if (!msix_enabled(pci_dev)) {
+        virtio_pci_stop_irqfd(proxy);
+    } else {
+        virtio_pci_start_irqfd(proxy);
+    }
 }
 
 static unsigned virtio_pci_get_features(void *opaque)
@@ -645,7 +782,9 @@ static int virtio_pci_set_guest_notifier(void *opaque, int n, bool assign)
         }
         qemu_set_fd_handler(event_notifier_get_fd(notifier),
                             virtio_pci_guest_notifier_read, NULL, vq);
+        virtio_queue_use_guest_notifier(vq, true);
     } else {
+        virtio_queue_use_guest_notifier(vq, false);
         qemu_set_fd_handler(event_notifier_get_fd(notifier),
                             NULL, NULL, NULL);
         /* Test and clear notifier before closing it,
@@ -669,6 +808,17 @@ static int virtio_pci_set_guest_notifiers(void *opaque, bool assign)
     VirtIODevice *vdev = proxy->vdev;
     int r, n;
 
+    /* Only the first user assigns and the last one releases. */
+    if (assign && proxy->guest_notifier_users++) {
+        return 0;
+    }
+    if (!assign) {
+        assert(proxy->guest_notifier_users > 0);
+        if (--proxy->guest_notifier_users) {
+            return 0;
+        }
+    }
+
     /* Must unset mask notifier while guest notifier
      * is still assigned */
     if (!assign) {
@@ -709,6 +859,7 @@ assign_error:
         msix_set_mask_notifier(&proxy->pci_dev,
                                virtio_pci_mask_notifier);
     }
+    proxy->guest_notifier_users += assign ? -1 : 1;
     return r;
 }
 
@@ -727,7 +878,7 @@ static int virtio_pci_set_host_notifier(void *opaque, int n, bool assign)
      * currently only stops on status change away from ok,
      * reset, vmstop and such. If we do add code to start here,
      * need to check vmstate, device state etc. */
-    return virtio_pci_set_host_notifier_internal(proxy, n, assign);
+    return virtio_pci_set_host_notifier_internal(proxy, n, assign, true);
 }
 
 static void virtio_pci_vmstate_change(void *opaque, bool running)
@@ -742,8 +893,10 @@ static void virtio_pci_vmstate_change(void *opaque, bool running)
             proxy->flags |= VIRTIO_PCI_FLAG_BUS_MASTER_BUG;
         }
         virtio_pci_start_ioeventfd(proxy);
+        virtio_pci_start_irqfd(proxy);
     } else {
         virtio_pci_stop_ioeventfd(proxy);
+        virtio_pci_stop_irqfd(proxy);
     }
 }
 
@@ -804,10 +957,20 @@ static void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
                            virtio_map);
 
     if (!kvm_has_many_ioeventfds()) {
-        proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
+        /* Without kernel ioeventfds the vcpu can still hand kicks to the
+         * iothread, provided it does not need qemu_mutex for interrupts */
+        if (kvm_enabled() && kvm_irqchip_in_kernel()) {
+            proxy->ioeventfd_userspace = true;
+        } else {
+            proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
+        }
+    }
+    if (!kvm_enabled() || !kvm_irqchip_in_kernel()) {
+        proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IRQFD;
     }
 
     virtio_bind_device(vdev, &virtio_pci_bindings, proxy);
+    QLIST_INSERT_HEAD(&virtio_pci_proxies, proxy, next);
     proxy->host_features |= 0x1 << VIRTIO_F_NOTIFY_ON_EMPTY;
     proxy->host_features |= 0x1 << VIRTIO_F_BAD_FEATURE;
     proxy->host_features = vdev->get_features(vdev, proxy->host_features);
@@ -840,14 +1003,60 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
 
 static int virtio_exit_pci(PCIDevice *pci_dev)
 {
+    VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
+
+    QLIST_REMOVE(proxy, next);
     return msix_uninit(pci_dev);
 }
 
+void virtio_pci_info(Monitor *mon)
+{
+    VirtIOPCIProxy *proxy;
+    int n;
+
+    QLIST_FOREACH(proxy, &virtio_pci_proxies, next) {
+        PCIDevice *d = &proxy->pci_dev;
+        const char *kick;
+
+        if (proxy->ioeventfd_disabled) {
+            kick = "backend";
+        } else if (!proxy->ioeventfd_started) {
+            kick = "vcpu";
+        } else if (proxy->ioeventfd_userspace) {
+            kick = proxy->kick_unlocked_port ? "userspace eventfd, unlocked" :
+                                               "userspace eventfd";
+        } else {
+            kick = "ioeventfd";
+        }
+        monitor_printf(mon, "%s \"%s\" %02x:%02x.%x: kick %s\n",
+                       proxy->vdev->name, d->qdev.id ? d->qdev.id : "",
+                       pci_bus_num(d->bus), PCI_SLOT(d->devfn),
+                       PCI_FUNC(d->devfn), kick);
+
+        for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
+            uint64_t kicks, batches;
+
+            if (!virtio_queue_get_num(proxy->vdev, n)) {
+                continue;
+            }
+            virtio_queue_get_kick_stats(virtio_get_queue(proxy->vdev, n),
+                                        &kicks, &batches);
+            if (!kicks) {
+                continue;
+            }
+            monitor_printf(mon, "  queue %d: kicks %" PRIu64 " handler runs %"
+                           PRIu64 " (%" PRIu64 "%% coalesced)\n", n, kicks,
+                           batches, (kicks - batches) * 100 / kicks);
+        }
+    }
+}
+
 static int virtio_blk_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_blk_exit(proxy->vdev);
     blockdev_mark_auto_del(proxy->blk.conf.bs);
     return virtio_exit_pci(pci_dev);
@@ -882,6 +1091,8 @@ static int virtio_serial_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
+    virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_serial_exit(proxy->vdev);
     return virtio_exit_pci(pci_dev);
 }
@@ -915,6 +1126,7 @@ static int virtio_net_exit_pci(PCIDevice *pci_dev)
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_net_exit(proxy->vdev);
     return virtio_exit_pci(pci_dev);
 }
@@ -941,6 +1153,7 @@ static int virtio_balloon_exit_pci(PCIDevice *pci_dev)
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
     virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_balloon_exit(proxy->vdev);
     return virtio_exit_pci(pci_dev);
 }
@@ -971,6 +1184,8 @@ static int virtio_scsi_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
+    virtio_pci_stop_ioeventfd(proxy);
+    virtio_pci_stop_irqfd(proxy);
     virtio_scsi_exit(proxy->vdev);
     return virtio_exit_pci(pci_dev);
 }
@@ -992,6 +1207,9 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane, 0,
                             false),
 #endif
+            DEFINE_PROP_STRING("x-vhost-user", VirtIOPCIProxy, blk.vhost),
+            DEFINE_PROP_BIT("x-irqfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IRQFD_BIT, true),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
@@ -1005,7 +1223,9 @@ static PCIDeviceInfo virtio_info[] = {
         .romfile    = "pxe-virtio.bin",
         .qdev.props = (Property[]) {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
-                            VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, false),
+                            VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+            DEFINE_PROP_BIT("x-irqfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IRQFD_BIT, true),
             DEFINE_PROP_BIT("__com_redhat_macvtap_compat", VirtIOPCIProxy,
                             flags, VIRTIO_PCI_FLAG_MACVTAP_BIT, false),
             DEFINE_PROP_BIT("x-__com_redhat_rhel620_compat", VirtIOPCIProxy,
@@ -1018,6 +1238,8 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_INT32("x-txburst", VirtIOPCIProxy,
                               net.txburst, TX_BURST),
             DEFINE_PROP_STRING("tx", VirtIOPCIProxy, net.tx),
+            DEFINE_PROP_BIT("x-txadaptive", VirtIOPCIProxy,
+                            net.txadaptive, 0, false),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
@@ -1036,6 +1258,10 @@ static PCIDeviceInfo virtio_info[] = {
                                serial.max_virtserial_ports, 31),
             DEFINE_PROP_UINT32("flow_control", VirtIOPCIProxy,
                                serial.flow_control, 1),
+            DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+            DEFINE_PROP_BIT("x-irqfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IRQFD_BIT, true),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
@@ -1045,6 +1271,10 @@ static PCIDeviceInfo virtio_info[] = {
         .init      = virtio_balloon_init_pci,
         .exit      = virtio_balloon_exit_pci,
         .qdev.props = (Property[]) {
+            DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+            DEFINE_PROP_BIT("x-irqfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IRQFD_BIT, true),
             DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
         },
@@ -1058,6 +1288,10 @@ static PCIDeviceInfo virtio_info[] = {
         .qdev.props = (Property[]) {
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
             DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOPCIProxy, host_features, scsi),
+            DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
+            DEFINE_PROP_BIT("x-irqfd", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_USE_IRQFD_BIT, true),
             DEFINE_PROP_END_OF_LIST(),
         },
     }, {
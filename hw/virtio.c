@@ -88,6 +88,11 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* Raise interrupts by signalling guest_notifier */
+    bool use_guest_notifier;
+    /* Guest notifications, and the handler runs that served them */
+    uint64_t kicks;
+    uint64_t kick_batches;
 };
 
 /* virt queue functions */
@@ -265,6 +270,30 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_ring_len(vq, idx, len);
 }
 
+/* Return an element obtained from virtqueue_pop() to the available ring
+ * without using it.  Elements must be discarded in the reverse order in
+ * which they were popped. */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->in_num; i++) {
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len, 1, 0);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len, 0, 0);
+    }
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+    /* virtqueue_pop() published the avail index it saw as consumed */
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_avail_event(vq, vq->last_avail_idx);
+    }
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
@@ -636,9 +665,26 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     }
 }
 
+/* Serve @kicks guest notifications with one run of the queue handler.  Kicks
+ * that pile up in a host notifier while the handler is busy end up here
+ * together. */
+void virtio_queue_notify_kicks(VirtQueue *vq, uint64_t kicks)
+{
+    vq->kicks += kicks;
+    vq->kick_batches++;
+    virtio_queue_notify_vq(vq);
+}
+
 void virtio_queue_notify(VirtIODevice *vdev, int n)
 {
-    virtio_queue_notify_vq(&vdev->vq[n]);
+    virtio_queue_notify_kicks(&vdev->vq[n], 1);
+}
+
+void virtio_queue_get_kick_stats(VirtQueue *vq, uint64_t *kicks,
+                                 uint64_t *batches)
+{
+    *kicks = vq->kicks;
+    *batches = vq->kick_batches;
 }
 
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n)
@@ -722,6 +768,12 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     trace_virtio_notify(vdev, vq);
+    if (vq->use_guest_notifier) {
+        /* kvm injects it through irqfd, or the binding's fd handler
+         * calls virtio_irq() while the vector is masked. */
+        event_notifier_set(&vq->guest_notifier);
+        return;
+    }
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -957,6 +1009,12 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
 }
+
+/* Called by the binding while the guest notifier is assigned. */
+void virtio_queue_use_guest_notifier(VirtQueue *vq, bool use)
+{
+    vq->use_guest_notifier = use;
+}
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 {
     return &vq->host_notifier;
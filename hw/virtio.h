@@ -149,6 +149,7 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem);
 
 void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
     size_t num_sg, int is_write);
@@ -231,7 +232,13 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
+void virtio_queue_use_guest_notifier(VirtQueue *vq, bool use);
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq);
 void virtio_queue_notify_vq(VirtQueue *vq);
+void virtio_queue_notify_kicks(VirtQueue *vq, uint64_t kicks);
+void virtio_queue_get_kick_stats(VirtQueue *vq, uint64_t *kicks,
+                                 uint64_t *batches);
 void virtio_irq(VirtQueue *vq);
+
+void virtio_pci_info(Monitor *mon);
 #endif
@@ -1159,6 +1159,7 @@ static void vmsvga_init(struct vmsvga_state_s *s, int vga_ram_size)
                                      vmsvga_invalidate_display,
                                      vmsvga_screen_dump,
                                      vmsvga_text_update, s);
+    vga_init_idle(&s->vga);
 
 
     s->fifo_size = SVGA_FIFO_SIZE;
@@ -36,42 +36,46 @@ int kvm_irqchip_in_kernel(void)
     return kvm_state->irqchip_in_kernel;
 }
 
-int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
+static int kvm_coalesce_zone(unsigned long ioctl, uint64_t start,
+                             uint64_t size, bool pio)
 {
     int ret = -ENOSYS;
 #ifdef KVM_CAP_COALESCED_MMIO
     KVMState *s = kvm_state;
 
-    if (s->coalesced_mmio) {
+    if (s->coalesced_mmio && (!pio || s->coalesced_pio)) {
         struct kvm_coalesced_mmio_zone zone;
 
         zone.addr = start;
         zone.size = size;
+        zone.pio = pio;
 
-        ret = kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+        ret = kvm_vm_ioctl(s, ioctl, &zone);
     }
 #endif
 
     return ret;
 }
 
-int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
+int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
 {
-    int ret = -ENOSYS;
-#ifdef KVM_CAP_COALESCED_MMIO
-    KVMState *s = kvm_state;
-
-    if (s->coalesced_mmio) {
-        struct kvm_coalesced_mmio_zone zone;
+    return kvm_coalesce_zone(KVM_REGISTER_COALESCED_MMIO, start, size, false);
+}
 
-        zone.addr = start;
-        zone.size = size;
+int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size)
+{
+    return kvm_coalesce_zone(KVM_UNREGISTER_COALESCED_MMIO, start, size,
+                             false);
+}
 
-        ret = kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
-    }
-#endif
+int kvm_coalesce_pio_region(pio_addr_t start, pio_addr_t size)
+{
+    return kvm_coalesce_zone(KVM_REGISTER_COALESCED_MMIO, start, size, true);
+}
 
-    return ret;
+int kvm_uncoalesce_pio_region(pio_addr_t start, pio_addr_t size)
+{
+    return kvm_coalesce_zone(KVM_UNREGISTER_COALESCED_MMIO, start, size, true);
 }
 
 int kvm_check_extension(KVMState *s, unsigned int extension)
@@ -49,6 +49,35 @@ int kvm_check_many_ioeventfds(void)
 }
 #endif
 
+/* Port I/O or MMIO handler run by the vcpu thread straight after the exit,
+ * without taking qemu_mutex.  It may only touch state that is safe against
+ * the iothread and other vcpus, either lock-free or under a lock of the
+ * device's own; cpu_single_env is not set and coalesced MMIO has not been
+ * flushed.  @data holds the value written, or receives the value read.
+ * Returning nonzero hands the access on to the normal, locked dispatch. */
+typedef int KVMUnlockedIOFunc(void *opaque, uint64_t addr, uint64_t *data,
+                              unsigned size, bool is_write);
+
+#ifdef CONFIG_KVM
+/* Both must be called with qemu_mutex held.  Unregistering waits until no
+ * vcpu is still running a handler, so it must not be done while holding a
+ * lock that the handler takes. */
+int kvm_register_unlocked_io(bool pio, uint64_t addr, uint64_t len,
+                             KVMUnlockedIOFunc *func, void *opaque);
+void kvm_unregister_unlocked_io(bool pio, uint64_t addr, void *opaque);
+#else
+static inline
+int kvm_register_unlocked_io(bool pio, uint64_t addr, uint64_t len,
+                             KVMUnlockedIOFunc *func, void *opaque)
+{
+    return -ENOSYS;
+}
+static inline
+void kvm_unregister_unlocked_io(bool pio, uint64_t addr, void *opaque)
+{
+}
+#endif
+
 #if defined(KVM_IRQFD) && defined(CONFIG_KVM)
 int kvm_set_irqfd(int gsi, int fd, bool assigned);
 #else
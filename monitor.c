@@ -28,6 +28,7 @@
 #include "hw/pcmcia.h"
 #include "hw/pc.h"
 #include "hw/pci.h"
+#include "hw/virtio.h"
 #include "hw/watchdog.h"
 #include "hw/loader.h"
 #ifdef CONFIG_SPICE
@@ -61,6 +62,8 @@
 #include "osdep.h"
 #include "exec-all.h"
 #include "qemu-kvm.h"
+#include "qemu-prof.h"
+#include "qemu-prealloc.h"
 #include "trace.h"
 #include "ui/qemu-spice.h"
 #include "qmp-commands.h"
@@ -468,6 +471,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_DUMP_COMPLETED] = "DUMP_COMPLETED",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -2465,6 +2469,120 @@ static void do_info_kvm(Monitor *mon, QObject **ret_data)
 #endif
 }
 
+static void print_prof_hist(Monitor *mon, const char *name, QDict *hist)
+{
+    int64_t count = qdict_get_int(hist, "count");
+
+    monitor_printf(mon, " %s %" PRId64, name, count);
+    if (count) {
+        monitor_printf(mon, " avg %" PRId64 " max %" PRId64 " ns",
+                       qdict_get_int(hist, "total-ns") / count,
+                       qdict_get_int(hist, "max-ns"));
+    }
+}
+
+static void do_info_mainloop_profile_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    QListEntry *entry;
+
+    monitor_printf(mon, "dispatch:");
+    print_prof_hist(mon, "wakeups", qdict_get_qdict(qdict, "dispatch"));
+    monitor_printf(mon, "\n");
+
+    if (qdict_haskey(qdict, "locks")) {
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "locks"), entry) {
+            QDict *lock = qobject_to_qdict(qlist_entry_obj(entry));
+
+            monitor_printf(mon, "%s", qdict_get_str(lock, "thread"));
+            if (qdict_haskey(lock, "cpu")) {
+                monitor_printf(mon, " %" PRId64, qdict_get_int(lock, "cpu"));
+            }
+            monitor_printf(mon, ": contended %" PRId64 ",",
+                           qdict_get_int(lock, "contended"));
+            print_prof_hist(mon, "waits", qdict_get_qdict(lock, "wait"));
+            monitor_printf(mon, ",");
+            print_prof_hist(mon, "holds", qdict_get_qdict(lock, "hold"));
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    monitor_printf(mon, "top handlers:\n");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "handlers"), entry) {
+        QDict *handler = qobject_to_qdict(qlist_entry_obj(entry));
+        QDict *time = qdict_get_qdict(handler, "time");
+
+        monitor_printf(mon, "  %-8s %-18s total %" PRId64 " ns,",
+                       qdict_get_str(handler, "kind"),
+                       qdict_get_str(handler, "function"),
+                       qdict_get_int(time, "total-ns"));
+        print_prof_hist(mon, "calls", time);
+        monitor_printf(mon, "\n");
+    }
+}
+
+static void do_info_mainloop_profile(Monitor *mon, QObject **ret_data)
+{
+    QDict *qdict = qdict_new();
+
+    qdict_put_obj(qdict, "dispatch",
+                  qemu_prof_hist_to_qobject(&qemu_prof_dispatch));
+    qdict_put(qdict, "handlers", qemu_prof_top_handlers(10));
+#ifdef CONFIG_KVM
+    if (kvm_enabled()) {
+        qdict_put(qdict, "locks", kvm_lock_profile());
+    }
+#endif
+    *ret_data = QOBJECT(qdict);
+}
+
+#ifdef CONFIG_KVM
+static void do_info_vcpu_stats_print(Monitor *mon, const QObject *data)
+{
+    QListEntry *entry;
+
+    if (qlist_empty(qobject_to_qlist(data))) {
+        monitor_printf(mon, "kvm not enabled\n");
+        return;
+    }
+
+    QLIST_FOREACH_ENTRY(qobject_to_qlist(data), entry) {
+        QDict *cpu = qobject_to_qdict(qlist_entry_obj(entry));
+        QDict *exits = qdict_get_qdict(cpu, "exits");
+        const QDictEntry *e;
+
+        monitor_printf(mon, "CPU #%" PRId64 ": exits",
+                       qdict_get_int(cpu, "cpu"));
+        for (e = qdict_first(exits); e; e = qdict_next(exits, e)) {
+            monitor_printf(mon, " %s %" PRId64, qdict_entry_key(e),
+                           qdict_get_int(exits, qdict_entry_key(e)));
+        }
+        monitor_printf(mon, ", %" PRId64 " unlocked\n",
+                       qdict_get_int(cpu, "unlocked-exits"));
+        if (qdict_haskey(cpu, "guest-ns")) {
+            monitor_printf(mon, "        guest %" PRId64 " ms, userspace %"
+                           PRId64 " ms\n",
+                           qdict_get_int(cpu, "guest-ns") / 1000000,
+                           qdict_get_int(cpu, "user-ns") / 1000000);
+        }
+        monitor_printf(mon, "        halt polls %" PRId64 ", %" PRId64
+                       " woken while polling\n",
+                       qdict_get_int(cpu, "halt-polls"),
+                       qdict_get_int(cpu, "halt-poll-wakeups"));
+        monitor_printf(mon, "       ");
+        print_prof_hist(mon, "sleeps", qdict_get_qdict(cpu, "halt"));
+        monitor_printf(mon, ",");
+        print_prof_hist(mon, "wakeups", qdict_get_qdict(cpu, "wakeup"));
+        monitor_printf(mon, "\n");
+    }
+}
+
+static void do_info_vcpu_stats(Monitor *mon, QObject **ret_data)
+{
+    *ret_data = QOBJECT(kvm_enabled() ? kvm_vcpu_stats() : qlist_new());
+}
+#endif
+
 static void do_info_numa(Monitor *mon)
 {
     int i;
@@ -2481,9 +2599,52 @@ static void do_info_numa(Monitor *mon)
         monitor_printf(mon, "\n");
         monitor_printf(mon, "node %d size: %" PRId64 " MB\n", i,
             node_mem[i] >> 20);
+        if (node_mem_policy[i] != NUMA_POLICY_DEFAULT) {
+            int n;
+
+            monitor_printf(mon, "node %d policy: %s host nodes:", i,
+                           numa_policy_names[node_mem_policy[i]]);
+            for (n = 0; n < MAX_HOST_NODES; n++) {
+                if (test_bit(n, node_host_nodes[i])) {
+                    monitor_printf(mon, " %d", n);
+                }
+            }
+            monitor_printf(mon, "\n");
+        }
     }
 }
 
+static void do_info_mem_prealloc_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    if (!qdict_get_int(qdict, "total")) {
+        monitor_printf(mon, "no memory preallocated\n");
+        return;
+    }
+    monitor_printf(mon, "%s %" PRId64 " of %" PRId64 " MB with %" PRId64
+                   " threads in %" PRId64 " ms\n",
+                   qdict_get_bool(qdict, "active") ? "preallocating" :
+                   "preallocated",
+                   qdict_get_int(qdict, "done") >> 20,
+                   qdict_get_int(qdict, "total") >> 20,
+                   qdict_get_int(qdict, "threads"),
+                   qdict_get_int(qdict, "time-ns") / 1000000);
+}
+
+static void do_info_mem_prealloc(Monitor *mon, QObject **ret_data)
+{
+    QEMUPreallocInfo info;
+
+    qemu_prealloc_get_info(&info);
+    *ret_data = qobject_from_jsonf("{ 'active': %i, 'threads': %d, "
+                                   "'total': %" PRId64 ", "
+                                   "'done': %" PRId64 ", "
+                                   "'time-ns': %" PRId64 " }",
+                                   info.active, info.threads, info.total,
+                                   info.done, info.elapsed_ns);
+}
+
 #ifdef CONFIG_PROFILER
 
 int64_t qemu_time;
@@ -2942,6 +3103,13 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show PCI info",
         .mhandler.info = pci_info,
     },
+    {
+        .name       = "virtio",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show virtio-pci kick statistics per queue",
+        .mhandler.info = virtio_pci_info,
+    },
 #if defined(TARGET_I386) || defined(TARGET_SH4)
     {
         .name       = "tlb",
@@ -2975,6 +3143,31 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_kvm_print,
         .mhandler.info_new = do_info_kvm,
     },
+#if defined(CONFIG_KVM)
+    {
+        .name       = "lockstats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show qemu_mutex contention and unlocked exits",
+        .mhandler.info = do_info_lockstats,
+    },
+    {
+        .name       = "vcpu-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show vcpu exits, halt polling and wakeup latency",
+        .user_print = do_info_vcpu_stats_print,
+        .mhandler.info_new = do_info_vcpu_stats,
+    },
+#endif
+    {
+        .name       = "mainloop-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show main loop handler and qemu_mutex timings",
+        .user_print = do_info_mainloop_profile_print,
+        .mhandler.info_new = do_info_mainloop_profile,
+    },
     {
         .name       = "numa",
         .args_type  = "",
@@ -2982,6 +3175,22 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show NUMA information",
         .mhandler.info = do_info_numa,
     },
+    {
+        .name       = "mem-prealloc",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show guest memory preallocation progress",
+        .user_print = do_info_mem_prealloc_print,
+        .mhandler.info_new = do_info_mem_prealloc,
+    },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show guest memory dump status",
+        .user_print = do_info_dump_print,
+        .mhandler.info_new = do_info_dump,
+    },
     {
         .name       = "usb",
         .args_type  = "",
@@ -3057,6 +3266,13 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_spice_print,
         .mhandler.info_new = do_info_spice,
     },
+    {
+        .name       = "qxl",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show qxl io times and command batching",
+        .mhandler.info = qxl_io_info,
+    },
 #endif
     {
         .name       = "name",
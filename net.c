@@ -497,6 +497,32 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
     return ret;
 }
 
+/* Let the peer of sender hold on to the packets that sender passes it
+ * through qemu_sendv_packet_async() until qemu_net_batch_end(), so that
+ * it can hand them to the host together.  The peer keeps references to
+ * the iovecs' data rather than copies, so the sender must leave the
+ * buffers of the packets that were accepted alone until the batch ends.
+ * Only peers with a flush handler batch; packets sent over a VLAN or
+ * through the queue are never held. */
+void qemu_net_batch_begin(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (peer && peer->info->flush) {
+        peer->batching = 1;
+    }
+}
+
+void qemu_net_batch_end(VLANClientState *sender)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (peer && peer->batching) {
+        peer->batching = 0;
+        peer->info->flush(peer);
+    }
+}
+
 void qemu_purge_queued_packets(VLANClientState *vc)
 {
     NetQueue *queue;
@@ -572,6 +598,26 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size)
     qemu_send_packet_async(vc, buf, size, NULL);
 }
 
+/* Let the peer read the next packet from fd straight into its own
+ * buffers.  Only possible for a NIC peered directly with the sender,
+ * and only when nothing is queued towards it, so that ordering is kept.
+ * Returns 0 if the caller has to read and send the packet itself. */
+ssize_t qemu_send_packet_from_fd(VLANClientState *sender, int fd)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (sender->link_down || !peer || !peer->info->receive_fd) {
+        return 0;
+    }
+
+    if (peer->link_down || peer->receive_disabled ||
+        !qemu_net_queue_empty(peer->send_queue)) {
+        return 0;
+    }
+
+    return peer->info->receive_fd(peer, fd);
+}
+
 ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async_with_flags(vc, QEMU_NET_PACKET_FLAG_RAW,
@@ -613,16 +659,27 @@ static ssize_t qemu_deliver_packet_iov(VLANClientState *sender,
                                        void *opaque)
 {
     VLANClientState *vc = opaque;
+    ssize_t ret;
 
     if (vc->link_down) {
         return calc_iov_length(iov, iovcnt);
     }
 
+    if (vc->receive_disabled) {
+        return 0;
+    }
+
     if (vc->info->receive_iov) {
-        return vc->info->receive_iov(vc, iov, iovcnt);
+        ret = vc->info->receive_iov(vc, iov, iovcnt);
     } else {
-        return vc_sendv_compat(vc, iov, iovcnt);
+        ret = vc_sendv_compat(vc, iov, iovcnt);
     }
+
+    if (ret == 0) {
+        vc->receive_disabled = 1;
+    }
+
+    return ret;
 }
 
 static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
@@ -647,6 +704,11 @@ static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
             continue;
         }
 
+        if (vc->receive_disabled) {
+            ret = 0;
+            continue;
+        }
+
         assert(!(flags & QEMU_NET_PACKET_FLAG_RAW));
 
         if (vc->info->receive_iov) {
@@ -655,6 +717,10 @@ static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
             len = vc_sendv_compat(vc, iov, iovcnt);
         }
 
+        if (len == 0) {
+            vc->receive_disabled = 1;
+        }
+
         ret = (ret >= 0) ? ret : len;
     }
 
@@ -1291,6 +1357,9 @@ void do_info_network(Monitor *mon)
 
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
             monitor_printf(mon, "  %s: %s\n", vc->name, vc->info_str);
+            if (vc->info->print_info) {
+                vc->info->print_info(vc, mon);
+            }
         }
     }
     monitor_printf(mon, "Devices not on any VLAN:\n");
@@ -1300,6 +1369,9 @@ void do_info_network(Monitor *mon)
             monitor_printf(mon, " peer=%s", vc->peer->name);
         }
         monitor_printf(mon, "\n");
+        if (vc->info->print_info) {
+            vc->info->print_info(vc, mon);
+        }
     }
 }
 
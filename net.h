@@ -42,8 +42,11 @@ typedef void (NetPoll)(VLANClientState *, bool enable);
 typedef int (NetCanReceive)(VLANClientState *);
 typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
+typedef ssize_t (NetReceiveFd)(VLANClientState *, int);
 typedef void (NetCleanup) (VLANClientState *);
+typedef void (NetFlush)(VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
+typedef void (NetPrintInfo)(VLANClientState *, Monitor *);
 
 typedef struct NetClientInfo {
     net_client_type type;
@@ -51,10 +54,13 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveFd *receive_fd;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    NetPrintInfo *print_info;
+    NetFlush *flush;
 } NetClientInfo;
 
 struct VLANClientState {
@@ -68,6 +74,7 @@ struct VLANClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    unsigned batching : 1;
 };
 
 typedef struct NICState {
@@ -107,9 +114,12 @@ ssize_t qemu_sendv_packet(VLANClientState *vc, const struct iovec *iov,
 ssize_t qemu_sendv_packet_async(VLANClientState *vc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
 void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size);
+ssize_t qemu_send_packet_from_fd(VLANClientState *vc, int fd);
 ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_net_batch_begin(VLANClientState *sender);
+void qemu_net_batch_end(VLANClientState *sender);
 void qemu_purge_queued_packets(VLANClientState *vc);
 void qemu_flush_queued_packets(VLANClientState *vc);
 void qemu_format_nic_info_str(VLANClientState *vc, uint8_t macaddr[6]);
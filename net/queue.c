@@ -36,14 +36,23 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Packets that fit in NET_QUEUE_SLOT_SIZE bytes are stored in slots from
+ * a per-queue pool, which is allocated the first time a packet has to be
+ * queued.  Only larger (GSO) packets, or packets queued while the pool
+ * is exhausted, are allocated individually.
  */
 
+#define NET_QUEUE_SLOT_SIZE  2048
+#define NET_QUEUE_NUM_SLOTS  64
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     VLANClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    unsigned pooled : 1;
     uint8_t data[0];
 };
 
@@ -54,9 +63,51 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    uint8_t *slots;
+    NetPacket *free_slots[NET_QUEUE_NUM_SLOTS];
+    int nb_free_slots;
+
     unsigned delivering : 1;
 };
 
+#define NET_QUEUE_SLOT_STRIDE \
+    ((sizeof(NetPacket) + NET_QUEUE_SLOT_SIZE + 15) & ~15)
+
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int i;
+
+    if (size <= NET_QUEUE_SLOT_SIZE) {
+        if (!queue->slots) {
+            queue->slots = qemu_malloc(NET_QUEUE_NUM_SLOTS *
+                                       NET_QUEUE_SLOT_STRIDE);
+            for (i = NET_QUEUE_NUM_SLOTS - 1; i >= 0; i--) {
+                queue->free_slots[queue->nb_free_slots++] =
+                    (NetPacket *)(queue->slots + i * NET_QUEUE_SLOT_STRIDE);
+            }
+        }
+        if (queue->nb_free_slots) {
+            packet = queue->free_slots[--queue->nb_free_slots];
+            packet->pooled = 1;
+            return packet;
+        }
+    }
+
+    packet = qemu_malloc(sizeof(NetPacket) + size);
+    packet->pooled = 0;
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->pooled) {
+        queue->free_slots[queue->nb_free_slots++] = packet;
+    } else {
+        qemu_free(packet);
+    }
+}
+
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
                              NetPacketDeliverIOV *deliver_iov,
                              void *opaque)
@@ -82,9 +133,10 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        qemu_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
 
+    qemu_free(queue->slots);
     qemu_free(queue);
 }
 
@@ -97,7 +149,7 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = qemu_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -124,7 +176,7 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = qemu_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -227,11 +279,16 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            qemu_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
 
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return QTAILQ_EMPTY(&queue->packets);
+}
+
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
@@ -255,7 +312,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        qemu_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
     return 1;
 }
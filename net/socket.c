@@ -32,6 +32,9 @@
 #include "qemu-option.h"
 #include "qemu_socket.h"
 
+/* Most frames held for one writev() or sendmmsg() */
+#define NET_SOCKET_BATCH_MAX 64
+
 typedef struct NetSocketState {
     VLANClientState nc;
     int fd;
@@ -40,6 +43,19 @@ typedef struct NetSocketState {
     unsigned int packet_len;
     uint8_t buf[4096];
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
+    /* frames accepted but not written yet, see net_socket_flush() */
+    struct iovec tx_iov[IOV_MAX];
+    int tx_iovcnt;
+    int tx_frames;
+    uint32_t tx_len[NET_SOCKET_BATCH_MAX]; /* stream length prefixes */
+#ifdef CONFIG_SENDMMSG
+    struct mmsghdr tx_msg[NET_SOCKET_BATCH_MAX];
+#endif
+    /* the part of a flush the socket did not take, written once the
+     * socket is writable again */
+    uint8_t *tx_pending;
+    size_t tx_pending_size;
+    size_t tx_pending_offset;
 } NetSocketState;
 
 typedef struct NetSocketListenState {
@@ -49,6 +65,155 @@ typedef struct NetSocketListenState {
     int fd;
 } NetSocketListenState;
 
+#ifndef _WIN32
+static void net_socket_send(void *opaque);
+
+/* The socket has room again: write what the last flush left over, then
+ * send what the net queue held back meanwhile */
+static void net_socket_writable(void *opaque)
+{
+    NetSocketState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = write(s->fd, s->tx_pending + s->tx_pending_offset,
+                    s->tx_pending_size - s->tx_pending_offset);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (ret >= 0) {
+        s->tx_pending_offset += ret;
+        if (s->tx_pending_offset < s->tx_pending_size) {
+            return;
+        }
+    }
+
+    qemu_free(s->tx_pending);
+    s->tx_pending = NULL;
+    qemu_set_fd_handler(s->fd, net_socket_send, NULL, s);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* Write the frames gathered so far, each a length prefix followed by the
+ * payload, with a single writev().  The senders reuse their buffers once
+ * this returns, so what the socket does not take is copied and written
+ * when it becomes writable; until then, new packets are left in the net
+ * queue. */
+static void net_socket_flush(VLANClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct iovec *iov = s->tx_iov;
+    int iovcnt = s->tx_iovcnt;
+    size_t size;
+    ssize_t ret;
+    int i;
+
+    s->tx_iovcnt = s->tx_frames = 0;
+    if (!iovcnt) {
+        return;
+    }
+
+    do {
+        ret = writev(s->fd, iov, iovcnt);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        if (errno != EAGAIN) {
+            return;
+        }
+        ret = 0;
+    }
+
+    while (iovcnt > 0 && ret >= iov->iov_len) {
+        ret -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt == 0) {
+        return;
+    }
+
+    size = 0;
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    s->tx_pending_size = size - ret;
+    s->tx_pending_offset = 0;
+    s->tx_pending = qemu_malloc(s->tx_pending_size);
+    memcpy(s->tx_pending, (uint8_t *)iov->iov_base + ret, iov->iov_len - ret);
+    size = iov->iov_len - ret;
+    for (i = 1; i < iovcnt; i++) {
+        memcpy(s->tx_pending + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    qemu_set_fd_handler(s->fd, net_socket_send, net_socket_writable, s);
+}
+
+/* Queue a frame for net_socket_flush().  Returns 0 if the socket is still
+ * busy with an earlier flush, in which case the net queue holds the
+ * packet and delivers it again once net_socket_writable() is done. */
+static ssize_t net_socket_gather(NetSocketState *s,
+                                 const struct iovec *iov, int iovcnt)
+{
+    size_t size = 0;
+    int i;
+
+    if (iovcnt + 1 > IOV_MAX) {
+        return -1;
+    }
+    if (s->tx_frames == NET_SOCKET_BATCH_MAX ||
+        s->tx_iovcnt + iovcnt + 1 > IOV_MAX) {
+        net_socket_flush(&s->nc);
+    }
+    if (s->tx_pending) {
+        return 0;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+
+    s->tx_len[s->tx_frames] = htonl(size);
+    s->tx_iov[s->tx_iovcnt].iov_base = &s->tx_len[s->tx_frames];
+    s->tx_iov[s->tx_iovcnt].iov_len = sizeof(uint32_t);
+    memcpy(&s->tx_iov[s->tx_iovcnt + 1], iov, iovcnt * sizeof(*iov));
+    s->tx_iovcnt += iovcnt + 1;
+    s->tx_frames++;
+    return size;
+}
+
+/* Inside a batch (see qemu_net_batch_begin()), frames are only gathered
+ * and the sender's flush writes them all at once; otherwise each one is
+ * written right away. */
+static ssize_t net_socket_receive_iov(VLANClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    ssize_t ret;
+
+    ret = net_socket_gather(s, iov, iovcnt);
+    if (!nc->batching) {
+        net_socket_flush(nc);
+    }
+    return ret;
+}
+
+/* Packets coming from the net queue are freed when this returns, so they
+ * are never held for a batch */
+static ssize_t net_socket_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+    ssize_t ret;
+
+    ret = net_socket_gather(s, &iov, 1);
+    net_socket_flush(nc);
+    return ret;
+}
+#else
 /* XXX: we consider we can send the whole packet without blocking */
 static ssize_t net_socket_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -59,15 +224,81 @@ static ssize_t net_socket_receive(VLANClientState *nc, const uint8_t *buf, size_
     send_all(NULL, s->fd, (const uint8_t *)&len, sizeof(len));
     return send_all(NULL, s->fd, buf, size);
 }
+#endif
+
+#ifdef CONFIG_SENDMMSG
+/* Send the datagrams gathered so far with sendmmsg().  Like any datagram
+ * that does not fit in the socket buffer, those that are not taken are
+ * dropped. */
+static void net_socket_flush_dgram(VLANClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    int sent = 0;
+    int ret;
+
+    while (sent < s->tx_frames) {
+        ret = sendmmsg(s->fd, s->tx_msg + sent, s->tx_frames - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += ret;
+    }
+    s->tx_iovcnt = s->tx_frames = 0;
+}
+#endif
 
 static ssize_t net_socket_receive_dgram(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
 
+#ifdef CONFIG_SENDMMSG
+    net_socket_flush_dgram(nc);
+#endif
     return sendto(s->fd, (const void *)buf, size, 0,
                   (struct sockaddr *)&s->dgram_dst, sizeof(s->dgram_dst));
 }
 
+#ifndef _WIN32
+static ssize_t net_socket_receive_iov_dgram(VLANClientState *nc,
+                                            const struct iovec *iov,
+                                            int iovcnt)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct msghdr msg = {
+        .msg_name = &s->dgram_dst,
+        .msg_namelen = sizeof(s->dgram_dst),
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+#ifdef CONFIG_SENDMMSG
+    size_t size = 0;
+    int i;
+
+    if (nc->batching && iovcnt <= IOV_MAX) {
+        if (s->tx_frames == NET_SOCKET_BATCH_MAX ||
+            s->tx_iovcnt + iovcnt > IOV_MAX) {
+            net_socket_flush_dgram(nc);
+        }
+        for (i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        memcpy(&s->tx_iov[s->tx_iovcnt], iov, iovcnt * sizeof(*iov));
+        msg.msg_iov = &s->tx_iov[s->tx_iovcnt];
+        s->tx_msg[s->tx_frames].msg_hdr = msg;
+        s->tx_iovcnt += iovcnt;
+        s->tx_frames++;
+        return size;
+    }
+    net_socket_flush_dgram(nc);
+#endif
+
+    return sendmsg(s->fd, &msg, 0);
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -214,12 +445,19 @@ static void net_socket_cleanup(VLANClientState *nc)
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
     close(s->fd);
+    qemu_free(s->tx_pending);
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_TYPE_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifndef _WIN32
+    .receive_iov = net_socket_receive_iov_dgram,
+#endif
+#ifdef CONFIG_SENDMMSG
+    .flush = net_socket_flush_dgram,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -294,6 +532,10 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_TYPE_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+#ifndef _WIN32
+    .receive_iov = net_socket_receive_iov,
+    .flush = net_socket_flush,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
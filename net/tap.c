@@ -197,6 +197,18 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
+        /* Try to have the peer read the packet into its own buffers first;
+         * this is only possible if it wants the packet exactly as the tap
+         * device delivers it. */
+        if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+            size = qemu_send_packet_from_fd(&s->nc, s->fd);
+            if (size < 0) {
+                break;
+            } else if (size > 0) {
+                continue;
+            }
+        }
+
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
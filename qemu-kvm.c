@@ -18,6 +18,12 @@
 #include "compatfd.h"
 #include "gdbstub.h"
 #include "monitor.h"
+#include "qemu-timer.h"
+#include "qemu-prof.h"
+#include "qdict.h"
+#include "qint.h"
+#include "qlist.h"
+#include "qstring.h"
 
 #include "qemu-kvm.h"
 #include "libkvm.h"
@@ -54,6 +60,8 @@ int kvm_irqchip = 1;
 int kvm_pit = 1;
 int kvm_pit_reinject = 1;
 int kvm_nested = 0;
+int64_t kvm_halt_poll_ns;
+int kvm_exit_timing;
 
 
 KVMState *kvm_state;
@@ -66,6 +74,40 @@ pthread_cond_t qemu_pause_cond = PTHREAD_COND_INITIALIZER;
 pthread_cond_t qemu_work_cond = PTHREAD_COND_INITIALIZER;
 __thread CPUState *current_env;
 
+/* Threads other than the iothread and vcpus, e.g. spice, share one entry.
+ * The statistics are only updated with qemu_mutex held. */
+static __thread struct KVMLockStats *thread_lock_stats;
+static struct KVMLockStats iothread_lock_stats, other_lock_stats;
+
+static struct KVMLockStats *kvm_lock_stats_self(void)
+{
+    return thread_lock_stats ? thread_lock_stats : &other_lock_stats;
+}
+
+static void kvm_lock_qemu_mutex(void)
+{
+    struct KVMLockStats *stats = kvm_lock_stats_self();
+    int64_t wait = 0;
+
+    if (pthread_mutex_trylock(&qemu_mutex)) {
+        int64_t start = get_clock();
+
+        pthread_mutex_lock(&qemu_mutex);
+        wait = get_clock() - start;
+        stats->contended++;
+    }
+    qemu_prof_hist_add(&stats->wait, wait);
+    stats->locked_at = get_clock();
+}
+
+static void kvm_unlock_qemu_mutex(void)
+{
+    struct KVMLockStats *stats = kvm_lock_stats_self();
+
+    qemu_prof_hist_add(&stats->hold, get_clock() - stats->locked_at);
+    pthread_mutex_unlock(&qemu_mutex);
+}
+
 /* minovotn: Copied from hw/pc.h since file excluded because of conflicts */
 void apic_deliver_nmi(struct APICState *d);
 
@@ -349,6 +391,119 @@ int kvm_dirty_pages_log_reset(kvm_context_t kvm)
 }
 
 
+static const char *const kvm_exit_names[KVM_EXIT_STATS] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_STATS - 1] = "other",
+};
+
+/*
+ * Per-vcpu statistics live in one array of struct KVMCPUStats.  With
+ * -kvm-stats-file the array is in a shared file mapping, so that tools
+ * such as kvm_stat can read the counters of this VM without asking QEMU
+ * anything.  The file starts with a KVMStatsHeader describing the layout;
+ * all fields are in host byte order.
+ */
+typedef struct KVMStatsHeader {
+    char magic[8];              /* "QEMUKVMS" */
+    uint32_t version;
+    uint32_t header_size;       /* offset of the first vcpu's stats */
+    uint32_t vcpu_size;         /* sizeof(struct KVMCPUStats) */
+    uint32_t nr_vcpus;
+    uint32_t nr_exits;          /* entries of KVMCPUStats.exits */
+    uint32_t pid;
+    char exit_names[KVM_EXIT_STATS][32];
+} KVMStatsHeader;
+
+#define KVM_STATS_VERSION       1
+#define KVM_STATS_HEADER_SIZE   ALIGN(sizeof(KVMStatsHeader), 64)
+
+const char *kvm_stats_path;
+static struct KVMCPUStats *kvm_stats_area;
+static int kvm_stats_nr_vcpus;
+
+/*
+ * A statistics file that cannot be set up only costs kvm_stat -q its data:
+ * warn and keep the counters in anonymous memory rather than failing
+ * kvm_init(), which would drop the guest to TCG.
+ */
+static void kvm_stats_init(int nr_vcpus)
+{
+    size_t size = nr_vcpus * sizeof(struct KVMCPUStats);
+    KVMStatsHeader *hdr;
+    void *map;
+    int fd, i;
+
+    kvm_stats_nr_vcpus = nr_vcpus;
+    if (!kvm_stats_path) {
+        goto anonymous;
+    }
+
+    fd = open(kvm_stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "kvm: cannot create %s: %s\n", kvm_stats_path,
+                strerror(errno));
+        goto no_file;
+    }
+    if (ftruncate(fd, size + KVM_STATS_HEADER_SIZE) < 0) {
+        fprintf(stderr, "kvm: cannot size %s: %s\n", kvm_stats_path,
+                strerror(errno));
+        close(fd);
+        goto no_file;
+    }
+    map = mmap(NULL, size + KVM_STATS_HEADER_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "kvm: cannot map %s: %s\n", kvm_stats_path,
+                strerror(errno));
+        goto no_file;
+    }
+
+    hdr = map;
+    hdr->version = KVM_STATS_VERSION;
+    hdr->header_size = KVM_STATS_HEADER_SIZE;
+    hdr->vcpu_size = sizeof(struct KVMCPUStats);
+    hdr->nr_vcpus = nr_vcpus;
+    hdr->nr_exits = KVM_EXIT_STATS;
+    hdr->pid = getpid();
+    for (i = 0; i < KVM_EXIT_STATS; i++) {
+        if (kvm_exit_names[i]) {
+            pstrcpy(hdr->exit_names[i], sizeof(hdr->exit_names[i]),
+                    kvm_exit_names[i]);
+        }
+    }
+    kvm_stats_area = (void *)((uint8_t *)map + KVM_STATS_HEADER_SIZE);
+
+    /* Readers check the magic last, once the rest is valid */
+    __sync_synchronize();
+    memcpy(hdr->magic, "QEMUKVMS", sizeof(hdr->magic));
+    return;
+
+  no_file:
+    fprintf(stderr, "kvm: continuing without -kvm-stats-file\n");
+  anonymous:
+    kvm_stats_area = qemu_memalign(64, size);
+    memset(kvm_stats_area, 0, size);
+}
+
 static int kvm_create_context(void);
 
 int kvm_init(int smp_cpus)
@@ -409,7 +564,10 @@ int kvm_init(int smp_cpus)
             set_gsi(kvm_context, i);
     }
 
-    pthread_mutex_lock(&qemu_mutex);
+    kvm_stats_init(max_cpus);
+
+    thread_lock_stats = &iothread_lock_stats;
+    kvm_lock_qemu_mutex();
     return kvm_create_context();
 
   out_close:
@@ -896,6 +1054,334 @@ static int handle_mmio(CPUState *env)
     return 0;
 }
 
+/* Exit handlers that run without qemu_mutex.  The table is replaced rather
+ * than modified, so vcpus look it up without a lock; the old table is freed
+ * once no vcpu can be inside a handler found through it. */
+typedef struct KVMUnlockedIORange {
+    bool pio;
+    uint64_t addr;
+    uint64_t len;
+    KVMUnlockedIOFunc *func;
+    void *opaque;
+} KVMUnlockedIORange;
+
+typedef struct KVMUnlockedIOTable {
+    int nranges;
+    KVMUnlockedIORange ranges[];
+} KVMUnlockedIOTable;
+
+static KVMUnlockedIOTable *volatile kvm_unlocked_io;
+
+static void kvm_unlocked_io_publish(KVMUnlockedIOTable *table)
+{
+    KVMUnlockedIOTable *old = kvm_unlocked_io;
+    CPUState *env;
+
+    __sync_synchronize();
+    kvm_unlocked_io = table;
+    __sync_synchronize();
+
+    /* A vcpu that entered before the switch may still use the old table */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        unsigned int seq = env->kvm_cpu_state.unlocked_io_seq;
+
+        while ((seq & 1) && env->kvm_cpu_state.unlocked_io_seq == seq) {
+            sched_yield();
+        }
+    }
+    qemu_free(old);
+}
+
+int kvm_register_unlocked_io(bool pio, uint64_t addr, uint64_t len,
+                             KVMUnlockedIOFunc *func, void *opaque)
+{
+    KVMUnlockedIOTable *old = kvm_unlocked_io, *table;
+    KVMUnlockedIORange *r;
+    int i, n = old ? old->nranges : 0;
+
+    if (!kvm_enabled()) {
+        return -ENOSYS;
+    }
+    for (i = 0; i < n; i++) {
+        r = &old->ranges[i];
+        if (r->pio == pio && addr < r->addr + r->len && r->addr < addr + len) {
+            return -EBUSY;
+        }
+    }
+
+    table = qemu_malloc(sizeof(*table) + (n + 1) * sizeof(table->ranges[0]));
+    if (n) {
+        memcpy(table->ranges, old->ranges, n * sizeof(table->ranges[0]));
+    }
+    r = &table->ranges[n];
+    r->pio = pio;
+    r->addr = addr;
+    r->len = len;
+    r->func = func;
+    r->opaque = opaque;
+    table->nranges = n + 1;
+
+    kvm_unlocked_io_publish(table);
+    return 0;
+}
+
+void kvm_unregister_unlocked_io(bool pio, uint64_t addr, void *opaque)
+{
+    KVMUnlockedIOTable *old = kvm_unlocked_io, *table = NULL;
+    int i, j, n = old ? old->nranges : 0;
+
+    for (i = 0; i < n; i++) {
+        KVMUnlockedIORange *r = &old->ranges[i];
+
+        if (r->pio == pio && r->addr == addr && r->opaque == opaque) {
+            break;
+        }
+    }
+    if (i == n) {
+        return;
+    }
+
+    if (n > 1) {
+        table = qemu_malloc(sizeof(*table) + (n - 1) * sizeof(table->ranges[0]));
+        for (j = 0; j < n - 1; j++) {
+            table->ranges[j] = old->ranges[j < i ? j : j + 1];
+        }
+        table->nranges = n - 1;
+    }
+    kvm_unlocked_io_publish(table);
+}
+
+static int kvm_unlocked_io_load(const uint8_t *data, unsigned size,
+                                uint64_t *val)
+{
+    switch (size) {
+    case 1:
+        *val = ldub_p(data);
+        return 0;
+    case 2:
+        *val = lduw_p(data);
+        return 0;
+    case 4:
+        *val = ldl_p(data);
+        return 0;
+    case 8:
+        *val = ldq_p(data);
+        return 0;
+    }
+    return -1;
+}
+
+static void kvm_unlocked_io_store(uint8_t *data, unsigned size, uint64_t val)
+{
+    switch (size) {
+    case 1:
+        stb_p(data, val);
+        break;
+    case 2:
+        stw_p(data, val);
+        break;
+    case 4:
+        stl_p(data, val);
+        break;
+    case 8:
+        stq_p(data, val);
+        break;
+    }
+}
+
+/* Try to complete a port I/O or MMIO exit before taking qemu_mutex.
+ * Returns nonzero if a handler took care of it. */
+static int kvm_handle_exit_unlocked(CPUState *env, struct kvm_run *run)
+{
+    struct KVMCPUState *cs = &env->kvm_cpu_state;
+    KVMUnlockedIOTable *table;
+    uint64_t addr, val = 0;
+    uint8_t *data;
+    unsigned size;
+    bool pio, is_write;
+    int i, handled = 0;
+
+    if (!kvm_unlocked_io) {
+        return 0;
+    }
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->io.count != 1) {
+            return 0;
+        }
+        pio = true;
+        addr = run->io.port;
+        size = run->io.size;
+        is_write = run->io.direction == KVM_EXIT_IO_OUT;
+        data = (uint8_t *)run + run->io.data_offset;
+        break;
+    case KVM_EXIT_MMIO:
+        pio = false;
+        addr = run->mmio.phys_addr;
+        size = run->mmio.len;
+        is_write = run->mmio.is_write;
+        data = run->mmio.data;
+        break;
+    default:
+        return 0;
+    }
+    if (kvm_unlocked_io_load(data, size, &val) < 0) {
+        return 0;
+    }
+
+    cs->unlocked_io_seq++;
+    __sync_synchronize();
+
+    table = kvm_unlocked_io;
+    for (i = 0; table && i < table->nranges; i++) {
+        KVMUnlockedIORange *r = &table->ranges[i];
+
+        if (r->pio == pio && addr >= r->addr &&
+            addr + size <= r->addr + r->len) {
+            handled = !r->func(r->opaque, addr, &val, size, is_write);
+            break;
+        }
+    }
+
+    __sync_synchronize();
+    cs->unlocked_io_seq++;
+
+    if (handled) {
+        if (!is_write) {
+            kvm_unlocked_io_store(data, size, val);
+        }
+        cs->unlocked_exits++;
+    }
+    return handled;
+}
+
+static void kvm_show_lock_stats(Monitor *mon, struct KVMLockStats *stats)
+{
+    uint64_t acquired = stats->wait.count;
+
+    monitor_printf(mon, " lock acquired %" PRIu64 " contended %" PRIu64
+                   " (%" PRIu64 "%%) wait %" PRIu64 " us max %" PRIu64
+                   " us held %" PRIu64 " us max %" PRIu64 " us\n",
+                   acquired, stats->contended,
+                   acquired ? stats->contended * 100 / acquired : 0,
+                   stats->wait.total_ns / 1000, stats->wait.max_ns / 1000,
+                   stats->hold.total_ns / 1000, stats->hold.max_ns / 1000);
+}
+
+static QDict *kvm_lock_stats_to_qdict(const char *thread,
+                                      struct KVMLockStats *stats)
+{
+    QDict *dict = qdict_new();
+
+    qdict_put(dict, "thread", qstring_from_str(thread));
+    qdict_put(dict, "contended", qint_from_int(stats->contended));
+    qdict_put_obj(dict, "wait", qemu_prof_hist_to_qobject(&stats->wait));
+    qdict_put_obj(dict, "hold", qemu_prof_hist_to_qobject(&stats->hold));
+    return dict;
+}
+
+QList *kvm_lock_profile(void)
+{
+    QList *list = qlist_new();
+    CPUState *env;
+
+    qlist_append(list, kvm_lock_stats_to_qdict("iothread",
+                                               &iothread_lock_stats));
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        QDict *dict = kvm_lock_stats_to_qdict("vcpu",
+                                              &env->kvm_cpu_state.lock_stats);
+
+        qdict_put(dict, "cpu", qint_from_int(env->cpu_index));
+        qlist_append(list, dict);
+    }
+    if (other_lock_stats.wait.count) {
+        qlist_append(list, kvm_lock_stats_to_qdict("other",
+                                                   &other_lock_stats));
+    }
+    return list;
+}
+
+QList *kvm_vcpu_stats(void)
+{
+    QList *list = qlist_new();
+    CPUState *env;
+    int i;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        struct KVMCPUStats *stats = env->kvm_cpu_state.stats;
+        QDict *dict, *exits;
+
+        if (!stats) {
+            continue;
+        }
+        dict = qdict_new();
+        exits = qdict_new();
+
+        for (i = 0; i < KVM_EXIT_STATS; i++) {
+            if (stats->exits[i]) {
+                qdict_put(exits, kvm_exit_names[i],
+                          qint_from_int(stats->exits[i]));
+            }
+        }
+
+        qdict_put(dict, "cpu", qint_from_int(env->cpu_index));
+        qdict_put(dict, "exits", exits);
+        qdict_put(dict, "unlocked-exits",
+                  qint_from_int(env->kvm_cpu_state.unlocked_exits));
+        if (kvm_exit_timing) {
+            qdict_put(dict, "guest-ns", qint_from_int(stats->guest_ns));
+            qdict_put(dict, "user-ns", qint_from_int(stats->user_ns));
+        }
+        qdict_put(dict, "halt-polls", qint_from_int(stats->halt_polls));
+        qdict_put(dict, "halt-poll-wakeups",
+                  qint_from_int(stats->halt_poll_wakeups));
+        qdict_put_obj(dict, "halt", qemu_prof_hist_to_qobject(&stats->halt));
+        qdict_put_obj(dict, "wakeup",
+                      qemu_prof_hist_to_qobject(&stats->wakeup));
+        qlist_append(list, dict);
+    }
+    return list;
+}
+
+void do_info_lockstats(Monitor *mon)
+{
+    KVMUnlockedIOTable *table = kvm_unlocked_io;
+    CPUState *env;
+    int i;
+
+    if (!kvm_enabled()) {
+        monitor_printf(mon, "kvm not enabled\n");
+        return;
+    }
+
+    monitor_printf(mon, "iothread:");
+    kvm_show_lock_stats(mon, &iothread_lock_stats);
+    if (other_lock_stats.wait.count) {
+        monitor_printf(mon, "other threads:");
+        kvm_show_lock_stats(mon, &other_lock_stats);
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        struct KVMCPUState *cs = &env->kvm_cpu_state;
+
+        monitor_printf(mon, "CPU #%d: exits %" PRIu64 " unlocked %" PRIu64
+                       "\n       ", env->cpu_index, cs->exits,
+                       cs->unlocked_exits);
+        kvm_show_lock_stats(mon, &cs->lock_stats);
+    }
+    monitor_printf(mon, "coalesced writes %" PRIu64 " in %" PRIu64
+                   " flushes%s\n", kvm_state->coalesced_writes,
+                   kvm_state->coalesced_batches,
+                   kvm_state->coalesced_pio ? "" : " (mmio only)");
+    for (i = 0; table && i < table->nranges; i++) {
+        KVMUnlockedIORange *r = &table->ranges[i];
+
+        monitor_printf(mon, "unlocked %s 0x%" PRIx64 "-0x%" PRIx64 "\n",
+                       r->pio ? "pio" : "mmio", r->addr,
+                       r->addr + r->len - 1);
+    }
+}
+
 int handle_io_window(kvm_context_t kvm)
 {
     return 1;
@@ -919,8 +1405,13 @@ static inline void push_nmi(kvm_context_t kvm)
 
 void post_kvm_run(kvm_context_t kvm, CPUState *env)
 {
-    pthread_mutex_lock(&qemu_mutex);
-    kvm_arch_post_run(env, env->kvm_run);
+    struct kvm_run *run = env->kvm_run;
+
+    kvm_lock_qemu_mutex();
+    kvm_arch_post_run(env, run);
+    env->kvm_cpu_state.post_run_if_flag = run->if_flag;
+    env->kvm_cpu_state.post_run_cr8 = run->cr8;
+    env->kvm_cpu_state.post_run_apic_base = run->apic_base;
     cpu_single_env = env;
 
     kvm_flush_coalesced_mmio_buffer();
@@ -935,7 +1426,7 @@ int pre_kvm_run(kvm_context_t kvm, CPUState *env)
         env->kvm_cpu_state.regs_modified = 0;
     }
 
-    pthread_mutex_unlock(&qemu_mutex);
+    kvm_unlock_qemu_mutex();
     return 0;
 }
 
@@ -978,25 +1469,71 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
     if (kvm_state->coalesced_mmio) {
         struct kvm_coalesced_mmio_ring *ring = kvm_state->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
-            cpu_physical_memory_rw(ring->coalesced_mmio[ring->first].phys_addr,
-                           &ring->coalesced_mmio[ring->first].data[0],
-                           ring->coalesced_mmio[ring->first].len, 1);
-            smp_wmb();
-            ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+        uint32_t first = ring->first, last = ring->last;
+
+        /* Replay everything queued so far, then give the slots back to the
+         * kernel at once rather than bouncing ring->first per entry */
+        if (first != last) {
+            __sync_synchronize();
+            kvm_state->coalesced_batches++;
+        }
+        while (first != last) {
+            struct kvm_coalesced_mmio *ent = &ring->coalesced_mmio[first];
+
+            if (ent->pio) {
+                kvm_handle_io(ent->phys_addr, ent->data, KVM_EXIT_IO_OUT,
+                              ent->len, 1);
+            } else {
+                cpu_physical_memory_rw(ent->phys_addr, ent->data, ent->len, 1);
+            }
+            kvm_state->coalesced_writes++;
+            first = (first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+        smp_wmb();
+        ring->first = first;
     }
 
     kvm_state->coalesced_flush_in_progress = false;
 #endif
 }
 
+static int kvm_coalesced_mmio_pending(void)
+{
+#if defined(KVM_CAP_COALESCED_MMIO)
+    struct kvm_coalesced_mmio_ring *ring = kvm_state->coalesced_mmio_ring;
+
+    return kvm_state->coalesced_mmio && ring->first != ring->last;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * An exit handled without qemu_mutex skips post_kvm_run() and the next
+ * pre_kvm_run().  That is only right while they have nothing to do: the
+ * interrupt flag, TPR and APIC base are as the last locked exit saw them
+ * and no register state is waiting to be written back.  (With the irqchip
+ * in the kernel, kvm_arch_pre_run() only acts on update_vapic, which is
+ * set by this vcpu's own locked exits.)
+ */
+static int kvm_run_state_unchanged(CPUState *env, struct kvm_run *run)
+{
+    struct KVMCPUState *cs = &env->kvm_cpu_state;
+
+    return run->if_flag == cs->post_run_if_flag &&
+           run->cr8 == cs->post_run_cr8 &&
+           run->apic_base == cs->post_run_apic_base &&
+           !cs->regs_modified;
+}
+
 int kvm_run(CPUState *env)
 {
     int r;
     kvm_context_t kvm = &env->kvm_state->kvm_context;
     struct kvm_run *run = env->kvm_run;
     int fd = env->kvm_fd;
+    struct KVMCPUStats *stats = env->kvm_cpu_state.stats;
+    int64_t entered = 0, exited = 0;
 
   again:
     push_nmi(kvm);
@@ -1008,11 +1545,39 @@ int kvm_run(CPUState *env)
     r = pre_kvm_run(kvm, env);
     if (r)
         return r;
+  again_unlocked:
     if (env->exit_request) {
         env->exit_request = 0;
         pthread_kill(env->kvm_cpu_state.thread, SIG_IPI);
     }
+    if (kvm_exit_timing) {
+        entered = qemu_prof_now();
+        if (exited) {
+            stats->user_ns += entered - exited;
+        }
+    }
     r = ioctl(fd, KVM_RUN, 0);
+    if (kvm_exit_timing) {
+        exited = qemu_prof_now();
+        stats->guest_ns += exited - entered;
+    }
+    env->kvm_cpu_state.exits++;
+    stats->exits[MIN(r == 0 ? run->exit_reason : KVM_EXIT_INTR,
+                     KVM_EXIT_STATS - 1)]++;
+
+    /* Interrupt injection needs the lock unless the irqchip is in the
+     * kernel; a pending SIG_IPI makes the next KVM_RUN return at once.
+     * Coalesced writes queued before this exit must reach their devices
+     * first, which takes the lock too. */
+    if (r == 0 && kvm->irqchip_in_kernel && !kvm_coalesced_mmio_pending() &&
+        kvm_handle_exit_unlocked(env, run)) {
+        if (kvm_run_state_unchanged(env, run)) {
+            goto again_unlocked;
+        }
+        /* the exit is complete, only the bookkeeping needs the lock */
+        post_kvm_run(kvm, env);
+        goto again;
+    }
 
     if (r == -1 && errno != EINTR && errno != EAGAIN) {
         r = -errno;
@@ -1146,6 +1711,10 @@ int kvm_init_coalesced_mmio(kvm_context_t kvm)
     r = kvm_ioctl(kvm_state, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
     if (r > 0) {
         kvm_state->coalesced_mmio = r;
+#ifdef KVM_CAP_COALESCED_PIO
+        kvm_state->coalesced_pio =
+            kvm_check_extension(kvm_state, KVM_CAP_COALESCED_PIO) > 0;
+#endif
         return 0;
     }
 #endif
@@ -1522,8 +2091,11 @@ static inline unsigned long kvm_get_thread_id(void)
 static void qemu_cond_wait(pthread_cond_t *cond)
 {
     CPUState *env = cpu_single_env;
+    struct KVMLockStats *stats = kvm_lock_stats_self();
 
+    qemu_prof_hist_add(&stats->hold, get_clock() - stats->locked_at);
     pthread_cond_wait(cond, &qemu_mutex);
+    stats->locked_at = get_clock();
     cpu_single_env = env;
 }
 
@@ -1600,6 +2172,19 @@ static void sigbus_handler(int n, struct qemu_signalfd_siginfo *siginfo,
     }
 }
 
+/* Get @env out of KVM_RUN or of kvm_main_loop_wait() */
+static void kvm_vcpu_kick(CPUState *env)
+{
+    struct KVMCPUState *cs = &env->kvm_cpu_state;
+
+    if (!cs->kicked) {
+        cs->kicked_at = qemu_prof_now();
+        __sync_synchronize();
+        cs->kicked = 1;
+    }
+    pthread_kill(cs->thread, SIG_IPI);
+}
+
 static void on_vcpu(CPUState *env, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -1619,7 +2204,7 @@ static void on_vcpu(CPUState *env, void (*func)(void *data), void *data)
     wi.next = NULL;
     wi.done = false;
 
-    pthread_kill(env->kvm_cpu_state.thread, SIG_IPI);
+    kvm_vcpu_kick(env);
     while (!wi.done)
         qemu_cond_wait(&qemu_work_cond);
 }
@@ -1675,7 +2260,7 @@ void kvm_update_interrupt_request(CPUState *env)
         if (signal) {
             env->kvm_cpu_state.signalled = 1;
             if (env->kvm_cpu_state.thread)
-                pthread_kill(env->kvm_cpu_state.thread, SIG_IPI);
+                kvm_vcpu_kick(env);
         }
     }
 }
@@ -1851,13 +2436,48 @@ static void kvm_on_sigbus(CPUState *env, siginfo_t *siginfo)
     }
 }
 
+static inline void kvm_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    asm volatile("pause" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+/* Spin for up to kvm_halt_poll_ns before sleeping, so that a kick arriving
+ * soon after the vcpu went idle does not pay for a reschedule.  The kick's
+ * SIG_IPI stays pending and is collected by the sigtimedwait() below. */
+static void kvm_halt_poll(CPUState *env)
+{
+    struct KVMCPUState *cs = &env->kvm_cpu_state;
+    int64_t start = qemu_prof_now();
+
+    cs->stats->halt_polls++;
+    do {
+        if (cs->kicked) {
+            cs->stats->halt_poll_wakeups++;
+            return;
+        }
+        kvm_cpu_relax();
+    } while (qemu_prof_now() - start < kvm_halt_poll_ns);
+}
+
 static void kvm_main_loop_wait(CPUState *env, int timeout)
 {
+    struct KVMCPUState *cs = &env->kvm_cpu_state;
     struct timespec ts;
     int r, e;
     siginfo_t siginfo;
     sigset_t waitset;
     sigset_t chkset;
+    int64_t start = 0;
+    bool poll = false;
+
+    if (timeout) {
+        start = qemu_prof_now();
+        poll = kvm_halt_poll_ns > 0 && !cs->kicked;
+    }
 
     ts.tv_sec = timeout / 1000;
     ts.tv_nsec = (timeout % 1000) * 1000000;
@@ -1866,12 +2486,16 @@ static void kvm_main_loop_wait(CPUState *env, int timeout)
     sigaddset(&waitset, SIGBUS);
 
     do {
-        pthread_mutex_unlock(&qemu_mutex);
+        kvm_unlock_qemu_mutex();
 
+        if (poll) {
+            kvm_halt_poll(env);
+            poll = false;
+        }
         r = sigtimedwait(&waitset, &siginfo, &ts);
         e = errno;
 
-        pthread_mutex_lock(&qemu_mutex);
+        kvm_lock_qemu_mutex();
 
         if (r == -1 && !(e == EAGAIN || e == EINTR)) {
             printf("sigtimedwait: %s\n", strerror(e));
@@ -1893,6 +2517,17 @@ static void kvm_main_loop_wait(CPUState *env, int timeout)
         }
     } while (sigismember(&chkset, SIG_IPI) || sigismember(&chkset, SIGBUS));
 
+    if (timeout) {
+        int64_t now = qemu_prof_now();
+
+        qemu_prof_hist_add(&cs->stats->halt, now - start);
+        if (cs->kicked) {
+            qemu_prof_hist_add(&cs->stats->wakeup,
+                               now - MAX(cs->kicked_at, start));
+        }
+    }
+    cs->kicked = 0;
+
     cpu_single_env = env;
     flush_queued_work(env);
 
@@ -1925,7 +2560,7 @@ void kvm_pause_all_threads(void)
     while (penv) {
         if (penv != cpu_single_env) {
             penv->stop = 1;
-            pthread_kill(penv->kvm_cpu_state.thread, SIG_IPI);
+            kvm_vcpu_kick(penv);
         } else {
             penv->stop = 0;
             penv->stopped = 1;
@@ -1947,7 +2582,7 @@ void kvm_resume_all_threads(void)
     while (penv) {
         penv->stop = 0;
         penv->stopped = 0;
-        pthread_kill(penv->kvm_cpu_state.thread, SIG_IPI);
+        kvm_vcpu_kick(penv);
         penv = (CPUState *) penv->next_cpu;
     }
 }
@@ -2007,7 +2642,7 @@ static int kvm_main_loop_cpu(CPUState *env)
             kvm_main_loop_wait(env, 1000);
         }
     }
-    pthread_mutex_unlock(&qemu_mutex);
+    kvm_unlock_qemu_mutex();
     return 0;
 }
 
@@ -2033,7 +2668,8 @@ static void *ap_main_loop(void *_env)
 
     setup_kernel_sigmask(env);
 
-    pthread_mutex_lock(&qemu_mutex);
+    thread_lock_stats = &env->kvm_cpu_state.lock_stats;
+    kvm_lock_qemu_mutex();
     cpu_single_env = env;
 
 #ifdef KVM_CAP_COALESCED_MMIO
@@ -2063,6 +2699,13 @@ static void *ap_main_loop(void *_env)
 
 void kvm_init_vcpu(CPUState *env)
 {
+    if (env->cpu_index < kvm_stats_nr_vcpus) {
+        env->kvm_cpu_state.stats = &kvm_stats_area[env->cpu_index];
+    } else {
+        env->kvm_cpu_state.stats = qemu_memalign(64,
+                                                 sizeof(struct KVMCPUStats));
+        memset(env->kvm_cpu_state.stats, 0, sizeof(struct KVMCPUStats));
+    }
     pthread_create(&env->kvm_cpu_state.thread, NULL, ap_main_loop, env);
 
     while (env->created == 0)
@@ -2272,7 +2915,7 @@ int kvm_main_loop(void)
 
     bdrv_close_all();
     kvm_pause_all_threads();
-    pthread_mutex_unlock(&qemu_mutex);
+    kvm_unlock_qemu_mutex();
 
     return 0;
 }
@@ -2661,12 +3304,12 @@ int qemu_kvm_get_dirty_pages(unsigned long phys_addr, void *buf)
 void kvm_mutex_unlock(void)
 {
     assert(!cpu_single_env);
-    pthread_mutex_unlock(&qemu_mutex);
+    kvm_unlock_qemu_mutex();
 }
 
 void kvm_mutex_lock(void)
 {
-    pthread_mutex_lock(&qemu_mutex);
+    kvm_lock_qemu_mutex();
     cpu_single_env = NULL;
 }
 
@@ -1027,6 +1027,12 @@ void qemu_kvm_aio_wait_end(void);
 
 void qemu_kvm_notify_work(void);
 
+struct Monitor;
+void do_info_lockstats(struct Monitor *mon);
+struct QList;
+struct QList *kvm_lock_profile(void);
+struct QList *kvm_vcpu_stats(void);
+
 #ifndef QEMU_KVM_NO_CPU
 void kvm_tpr_opt_setup(void);
 void kvm_tpr_access_report(CPUState *env, uint64_t rip, int is_write);
@@ -1036,6 +1042,8 @@ void kvm_tpr_vcpu_start(CPUState *env);
 int qemu_kvm_get_dirty_pages(unsigned long phys_addr, void *buf);
 int kvm_coalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
 int kvm_uncoalesce_mmio_region(target_phys_addr_t start, ram_addr_t size);
+int kvm_coalesce_pio_region(pio_addr_t start, pio_addr_t size);
+int kvm_uncoalesce_pio_region(pio_addr_t start, pio_addr_t size);
 
 int kvm_arch_init_irq_routing(void);
 
@@ -1064,6 +1072,9 @@ extern int kvm_irqchip;
 extern int kvm_pit;
 extern int kvm_pit_reinject;
 extern int kvm_nested;
+extern int64_t kvm_halt_poll_ns;
+extern int kvm_exit_timing;
+extern const char *kvm_stats_path;
 extern kvm_context_t kvm_context;
 
 struct ioperm_data {
@@ -1174,10 +1185,13 @@ typedef struct KVMState {
     int fd;
     int vmfd;
     int coalesced_mmio;
+    bool coalesced_pio;
 #ifdef KVM_CAP_COALESCED_MMIO
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
 #endif
     bool coalesced_flush_in_progress;
+    uint64_t coalesced_writes;
+    uint64_t coalesced_batches;
     int broken_set_mem_region;
     int migration_log;
     int vcpu_events;
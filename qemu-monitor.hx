@@ -349,6 +349,10 @@ Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+If the guest is running, its RAM is saved while it keeps running, as in
+migration, and it is only stopped for the final pass; the monitor returns
+once the snapshot is complete.
 ETEXI
 
     {
@@ -1196,8 +1200,9 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,length:i?,format:s?,"
+                      "live:b?,detach:b?,threads:i?",
+        .params     = "-p protocol [begin] [length] [format]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -1218,24 +1223,49 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": "elf" (default), or one of the kdump-compressed formats
+            "kdump-zlib", "kdump-lzo" and "kdump-snappy", which leave out
+            zero pages and compress the others (json-string, optional)
+- "live": dump while the guest runs, and stop it only for the last pass
+          over the pages it wrote meanwhile; needs a kdump format
+          (json-bool, optional)
+- "detach": return at once and dump in the background; needs a kdump
+            format (json-bool, optional)
+- "threads": number of compression threads for the kdump formats
+             (json-int, optional)
 
 Example:
 
 -> { "execute": "dump-guest-memory", "arguments": { "protocol": "fd:dump" } }
 <- { "return": {} }
 
+-> { "execute": "dump-guest-memory",
+     "arguments": { "paging": false, "protocol": "file:/tmp/vmcore",
+                    "format": "kdump-zlib", "live": true } }
+<- { "return": {} }
+
 Notes:
 
 (1) All boolean arguments default to false
+(2) The kdump formats need a seekable file, and cannot be used with paging,
+    begin or length
+(3) A live or detached dump emits DUMP_COMPLETED when it ends; use
+    query-dump to follow it
 
 EQMP
 
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,zlib:-z,lzo:-l,snappy:-s,live:-L,detach:-d,"
+                      "filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-z|-l|-s] [-L] [-d] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -p: do paging to get guest's memory mapping"
+                      "\n\t\t\t -z|-l|-s: kdump-compressed format, with"
+                      " zlib, lzo or snappy"
+                      "\n\t\t\t -L: dump while the guest runs (kdump only)"
+                      "\n\t\t\t -d: return at once (kdump only)"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -1243,12 +1273,17 @@ EQMP
     },
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-z|-l|-s] [-L] [-d] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+  -z|-l|-s: write the kdump-compressed format, with pages compressed by
+            zlib, lzo or snappy. Zero pages are left out.
+        -L: live dump: the guest keeps running, pages it writes are dumped
+            again, and it is only stopped for the last pass
+        -d: return at once, and dump in the background; see info dump
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -2780,6 +2815,13 @@ ETEXI
 STEXI
 @item info pci
 show emulated PCI device info
+@item info virtio
+show how each virtio-pci device receives queue notifications, and for each
+kicked queue how many guest kicks were served by how many handler runs
+@item info qxl
+show for each qxl device how many commands the spice server took in how many
+batches, and per io port how long the vcpu spent in the write and, for async
+ports, how long the io took to complete
 @item info tlb
 show virtual to physical memory mappings (i386 only)
 @item info mem
@@ -2817,6 +2859,179 @@ Example:
 
 EQMP
 
+STEXI
+@item info lockstats
+show how often each vcpu and the iothread had to wait for the global mutex,
+how many vcpu exits were handled without it, the handlers doing so, and how
+many coalesced MMIO/PIO writes were replayed in how many flushes
+ETEXI
+
+STEXI
+@item info vcpu-stats
+show each vcpu's exits by reason, its time in the guest and handling exits
+(with @option{-kvm-exit-timing}), halt polling (@option{-kvm-halt-poll})
+and how long idle vcpus took to run after being kicked
+ETEXI
+SQMP
+query-vcpu-stats
+----------------
+
+Return KVM statistics for each vcpu as a json-array of json-objects with:
+
+- "cpu": CPU index (json-int)
+- "exits": json-object mapping exit reasons ("io", "mmio", "hlt", "intr",
+           ...) to how many exits they caused; reasons that never occurred
+           are omitted
+- "unlocked-exits": exits handled without the global mutex (json-int)
+- "guest-ns": time spent in KVM_RUN, only with -kvm-exit-timing (json-int)
+- "user-ns": time spent handling exits, only with -kvm-exit-timing
+             (json-int)
+- "halt-polls": idle waits that spun first (json-int)
+- "halt-poll-wakeups": idle waits ended by a kick while spinning (json-int)
+- "halt": durations of idle waits, a histogram as in query-mainloop-profile
+- "wakeup": time from a kick until an idle vcpu ran again (histogram)
+
+The array is empty without KVM.
+
+Example:
+
+-> { "execute": "query-vcpu-stats" }
+<- { "return": [
+       { "cpu": 0, "exits": { "io": 5412, "mmio": 981, "intr": 77 },
+         "unlocked-exits": 3120, "halt-polls": 0, "halt-poll-wakeups": 0,
+         "halt": { "count": 0, "total-ns": 0, "max-ns": 0, "buckets": [] },
+         "wakeup": { "count": 0, "total-ns": 0, "max-ns": 0,
+                     "buckets": [] } } ] }
+
+EQMP
+
+STEXI
+@item info mainloop-profile
+show how long the main loop stays busy once woken up, the callbacks it
+spends that time in, and (with KVM) how long each thread waits for and holds
+the global mutex
+ETEXI
+SQMP
+query-mainloop-profile
+----------------------
+
+Return main loop and global mutex timings accumulated since startup.
+
+Durations are reported as a json-object "histogram" with:
+
+- "count": number of samples (json-int)
+- "total-ns": sum of all samples in nanoseconds (json-int)
+- "max-ns": longest sample in nanoseconds (json-int)
+- "buckets": json-array of json-int; element i counts samples shorter than
+             2^i microseconds that do not fit an earlier element, the last
+             one also counts longer samples; trailing zeroes are omitted
+
+The returned json-object contains:
+
+- "dispatch": time from each main loop wakeup until it waits again
+              (histogram)
+- "handlers": json-array of the ten callbacks with the most total time, each
+              a json-object with:
+    - "kind": "fd-read", "fd-write", "timer" or "bh" (json-string)
+    - "function": address of the callback, or "other" for callbacks that
+                  did not fit the table (json-string)
+    - "time": time spent in the callback (histogram)
+- "locks": only with KVM enabled, a json-array with a json-object per
+           thread taking the global mutex:
+    - "thread": "iothread", "vcpu" or "other" (json-string)
+    - "cpu": CPU index, only for "vcpu" (json-int)
+    - "contended": acquisitions that had to wait (json-int)
+    - "wait": time spent waiting, zero when uncontended (histogram)
+    - "hold": time the mutex was held (histogram)
+
+Function addresses can be resolved with addr2line or gdb's "info symbol".
+
+Example:
+
+-> { "execute": "query-mainloop-profile" }
+<- { "return": {
+       "dispatch": { "count": 5120, "total-ns": 40960000, "max-ns": 2100000,
+                     "buckets": [ 310, 1024, 2210, 1400, 170, 5, 1 ] },
+       "handlers": [
+         { "kind": "fd-read", "function": "0x4f2a10",
+           "time": { "count": 812, "total-ns": 9120000, "max-ns": 96000,
+                     "buckets": [ 0, 0, 0, 412, 380, 20 ] } } ],
+       "locks": [
+         { "thread": "iothread", "contended": 12,
+           "wait": { "count": 5200, "total-ns": 880000, "max-ns": 41000,
+                     "buckets": [ 5188, 0, 3, 5, 2, 1, 1 ] },
+           "hold": { "count": 5200, "total-ns": 41000000, "max-ns": 2100000,
+                     "buckets": [ 300, 1030, 2210, 1480, 170, 9, 1 ] } },
+         { "thread": "vcpu", "cpu": 0, "contended": 3,
+           "wait": { "count": 90, "total-ns": 12000, "max-ns": 6000,
+                     "buckets": [ 87, 0, 1, 2 ] },
+           "hold": { "count": 90, "total-ns": 450000, "max-ns": 30000,
+                     "buckets": [ 0, 10, 40, 30, 8, 2 ] } } ] } }
+
+EQMP
+
+STEXI
+@item info mem-prealloc
+show the progress of guest memory preallocation (@option{-mem-prealloc});
+the VM starts once it is complete, so use @option{-S} to follow it
+ETEXI
+SQMP
+query-mem-prealloc
+------------------
+
+Show the progress of guest memory preallocation.
+
+Return a json-object with the following information:
+
+- "active": true while memory is being preallocated (json-bool)
+- "threads": number of threads started to preallocate (json-int)
+- "total": bytes to preallocate (json-int)
+- "done": bytes preallocated so far (json-int)
+- "time-ns": time spent so far, or until preallocation completed (json-int)
+
+All values are zero if no memory is preallocated.
+
+Example:
+
+-> { "execute": "query-mem-prealloc" }
+<- { "return": { "active": true, "threads": 16, "total": 68719476736,
+                 "done": 21474836480, "time-ns": 2150000000 } }
+
+EQMP
+
+STEXI
+@item info dump
+show the progress of the running or last guest memory dump
+ETEXI
+SQMP
+query-dump
+----------
+
+Show the progress of the running or last guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "format": format of the dump, see dump-guest-memory (json-string)
+- "live": true if the guest keeps running during the dump (json-bool)
+- "passes": passes over guest memory so far; a live dump makes one more
+            for each round of pages written by the guest (json-int)
+- "total": bytes of guest memory to dump, including the pages that are
+           dumped again (json-int)
+- "completed": bytes of guest memory dumped so far (json-int)
+- "written": size of the dump file so far (json-int)
+
+Only "status" is present if no dump was started.
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "format": "kdump-zlib", "live": true,
+                 "passes": 2, "total": 8858370048, "completed": 8640266240,
+                 "written": 1718407168 } }
+
+EQMP
+
 STEXI
 @item info usb
 show USB devices plugged on the virtual USB hub
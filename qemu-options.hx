@@ -59,11 +59,19 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n")
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "          [,host-nodes=node[-node]][,policy=default|preferred|bind|interleave]\n")
 STEXI
 @item -numa @var{opts}
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
 are split equally.
+
+@option{host-nodes} and @option{policy} place the memory of the node on the
+given host NUMA nodes, as with @code{numactl}: @code{bind} allocates only
+from them, @code{preferred} tries the (single) node first and
+@code{interleave} spreads pages across them.  @option{host-nodes} alone
+means @code{bind}.  The memory is bound before it is preallocated, so with
+@option{-mem-path} every huge page comes from the right node.
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -849,6 +857,14 @@ everybody else.  'ignore' completely ignores the shared flag and
 allows everybody connect unconditionally.  Doesn't conform to the rfb
 spec but is traditional qemu behavior.
 
+@item rate=@var{fps}
+
+Send each client at most @var{fps} framebuffer updates per second.
+Clients whose connection cannot keep up are sent updates less often
+automatically; the limit caps the rate for all clients, which lowers the
+CPU used by busy displays.  Areas sent as lossy JPEG are sent again
+losslessly once the screen has not changed for two seconds.
+
 @end table
 ETEXI
 
@@ -2205,6 +2221,15 @@ DEF("no-kvm-pit", 0, QEMU_OPTION_no_kvm_pit,
     "-no-kvm-pit     disable KVM kernel mode PIT\n")
 DEF("no-kvm-pit-reinjection", 0, QEMU_OPTION_no_kvm_pit_reinjection,
     "-no-kvm-pit-reinjection disable KVM kernel mode PIT interrupt reinjection\n")
+DEF("kvm-halt-poll", HAS_ARG, QEMU_OPTION_kvm_halt_poll,
+    "-kvm-halt-poll NS\n"
+    "                spin up to NS nanoseconds for a wakeup before an idle\n"
+    "                vcpu thread sleeps (userspace irqchip only)\n")
+DEF("kvm-exit-timing", 0, QEMU_OPTION_kvm_exit_timing,
+    "-kvm-exit-timing account vcpu time in the guest and handling exits\n")
+DEF("kvm-stats-file", HAS_ARG, QEMU_OPTION_kvm_stats_file,
+    "-kvm-stats-file FILE\n"
+    "                keep per-vcpu exit statistics in FILE for kvm_stat -q\n")
 #if defined(TARGET_I386) || defined(TARGET_X86_64) || defined(TARGET_IA64) || defined(__linux__)
 DEF("pcidevice", HAS_ARG, QEMU_OPTION_pcidevice,
     "-pcidevice host=bus:dev.func[,dma=none][,name=string]\n"
@@ -2225,6 +2250,10 @@ DEF("mem-path", HAS_ARG, QEMU_OPTION_mempath,
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
     "-mem-prealloc        preallocate guest memory (use with -mempath)\n")
+DEF("mem-prealloc-threads", HAS_ARG, QEMU_OPTION_mem_prealloc_threads,
+    "-mem-prealloc-threads N\n"
+    "                     preallocate guest memory with N threads\n"
+    "                     (default: one per host CPU, at most 16)\n")
 #endif
 
 #ifdef CONFIG_FAKE_MACHINE
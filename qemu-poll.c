@@ -0,0 +1,359 @@
+/*
+ * Persistent file descriptor sets for the main loop and aio
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-poll.h"
+
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef CONFIG_PPOLL
+#include <poll.h>
+#endif
+
+#define NS_PER_US   1000LL
+#define NS_PER_MS   1000000LL
+#define NS_PER_SEC  1000000000LL
+
+typedef struct QEMUPollEntry {
+    int events;
+    bool always_ready;
+    void *opaque;
+} QEMUPollEntry;
+
+struct QEMUPoll {
+    QEMUPollEntry *entries;     /* indexed by fd */
+    int nentries;
+#ifdef CONFIG_EPOLL
+    int epfd;
+    int nalways;                /* fds epoll refuses, i.e. regular files */
+    int nready;
+    struct epoll_event ready[QEMU_POLL_MAX_EVENTS];
+#else
+    int max_fd;
+    bool ready_valid;
+    fd_set rfds, wfds;          /* registered interest */
+    fd_set ready_rfds, ready_wfds;
+#endif
+};
+
+static QEMUPollEntry *qemu_poll_entry(QEMUPoll *qpoll, int fd)
+{
+    if (fd >= qpoll->nentries) {
+        int n = MAX(fd + 1, qpoll->nentries * 2);
+
+        qpoll->entries = qemu_realloc(qpoll->entries,
+                                      n * sizeof(*qpoll->entries));
+        memset(qpoll->entries + qpoll->nentries, 0,
+               (n - qpoll->nentries) * sizeof(*qpoll->entries));
+        qpoll->nentries = n;
+    }
+    return &qpoll->entries[fd];
+}
+
+static void qemu_poll_add_event(QEMUPollEvent *events, int *n, void *opaque,
+                                int revents)
+{
+    events[*n].opaque = opaque;
+    events[*n].revents = revents;
+    (*n)++;
+}
+
+static int qemu_poll_select(int nfds, fd_set *rfds, fd_set *wfds,
+                            fd_set *xfds, int64_t timeout_ns)
+{
+    struct timeval tv, *tvp = NULL;
+
+    if (timeout_ns >= 0) {
+        int64_t timeout_us = (timeout_ns + NS_PER_US - 1) / NS_PER_US;
+
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        tvp = &tv;
+    }
+    return select(nfds, rfds, wfds, xfds, tvp);
+}
+
+#ifdef CONFIG_EPOLL
+
+QEMUPoll *qemu_poll_new(void)
+{
+    QEMUPoll *qpoll;
+    int epfd;
+
+    epfd = epoll_create(QEMU_POLL_MAX_EVENTS);
+    if (epfd < 0) {
+        return NULL;
+    }
+    qemu_set_cloexec(epfd);
+
+    qpoll = qemu_mallocz(sizeof(*qpoll));
+    qpoll->epfd = epfd;
+    return qpoll;
+}
+
+void qemu_poll_free(QEMUPoll *qpoll)
+{
+    close(qpoll->epfd);
+    qemu_free(qpoll->entries);
+    qemu_free(qpoll);
+}
+
+void qemu_poll_set(QEMUPoll *qpoll, int fd, int events, void *opaque)
+{
+    QEMUPollEntry *e = qemu_poll_entry(qpoll, fd);
+    struct epoll_event ev;
+    int op, r;
+
+    if (e->always_ready) {
+        if (!events) {
+            e->always_ready = false;
+            qpoll->nalways--;
+        }
+        goto out;
+    }
+    if (!e->events && !events) {
+        goto out;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & QEMU_POLL_IN ? EPOLLIN : 0) |
+                (events & QEMU_POLL_OUT ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    op = !events ? EPOLL_CTL_DEL : !e->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    /* The fd may have been closed and reused without being unregistered,
+     * which silently drops it from the epoll set; so even an unchanged
+     * registration is pushed again. */
+    r = epoll_ctl(qpoll->epfd, op, fd, &ev);
+    if (r < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        r = epoll_ctl(qpoll->epfd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (r < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        r = epoll_ctl(qpoll->epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    /* Regular files cannot be polled; like select(), report them ready */
+    if (r < 0 && events && errno == EPERM) {
+        e->always_ready = true;
+        qpoll->nalways++;
+    }
+
+out:
+    e->events = events;
+    e->opaque = opaque;
+}
+
+static int qemu_poll_epoll(QEMUPoll *qpoll, int64_t timeout_ns)
+{
+    int timeout_ms;
+
+#ifdef CONFIG_PPOLL
+    /* epoll_wait() only takes milliseconds; wait on the epoll fd itself
+     * for anything finer. */
+    if (timeout_ns > 0 && timeout_ns % NS_PER_MS) {
+        struct pollfd pfd = { .fd = qpoll->epfd, .events = POLLIN };
+        struct timespec ts;
+        int r;
+
+        ts.tv_sec = timeout_ns / NS_PER_SEC;
+        ts.tv_nsec = timeout_ns % NS_PER_SEC;
+        r = ppoll(&pfd, 1, &ts, NULL);
+        if (r <= 0) {
+            return r;
+        }
+        timeout_ns = 0;
+    }
+#endif
+
+    if (timeout_ns < 0) {
+        timeout_ms = -1;
+    } else {
+        timeout_ms = MIN((timeout_ns + NS_PER_MS - 1) / NS_PER_MS, INT_MAX);
+    }
+    return epoll_wait(qpoll->epfd, qpoll->ready, QEMU_POLL_MAX_EVENTS,
+                      timeout_ms);
+}
+
+int qemu_poll_wait(QEMUPoll *qpoll, int nfds, fd_set *rfds, fd_set *wfds,
+                   fd_set *xfds, int64_t timeout_ns)
+{
+    int ret, n = 0;
+
+    qpoll->nready = 0;
+    if (qpoll->nalways) {
+        timeout_ns = 0;
+    }
+
+    if (nfds > 0) {
+        FD_SET(qpoll->epfd, rfds);
+        ret = qemu_poll_select(MAX(nfds, qpoll->epfd + 1), rfds, wfds, xfds,
+                               timeout_ns);
+        if (ret > 0 && FD_ISSET(qpoll->epfd, rfds)) {
+            FD_CLR(qpoll->epfd, rfds);
+            ret--;
+            n = epoll_wait(qpoll->epfd, qpoll->ready, QEMU_POLL_MAX_EVENTS, 0);
+        }
+    } else {
+        ret = 0;
+        n = qemu_poll_epoll(qpoll, timeout_ns);
+    }
+    if (ret < 0 || n < 0) {
+        return -1;
+    }
+
+    qpoll->nready = n;
+    return ret + n + qpoll->nalways;
+}
+
+int qemu_poll_get_events(QEMUPoll *qpoll, QEMUPollEvent *events,
+                         int max_events)
+{
+    int i, n = 0;
+
+    for (i = 0; i < qpoll->nready && n < max_events; i++) {
+        uint32_t ev = qpoll->ready[i].events;
+        int fd = qpoll->ready[i].data.fd;
+        QEMUPollEntry *e;
+        int revents = 0;
+
+        if (fd >= qpoll->nentries) {
+            continue;
+        }
+        e = &qpoll->entries[fd];
+        if ((e->events & QEMU_POLL_IN) &&
+            (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            revents |= QEMU_POLL_IN;
+        }
+        if ((e->events & QEMU_POLL_OUT) &&
+            (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            revents |= QEMU_POLL_OUT;
+        }
+        if (revents && !e->always_ready) {
+            qemu_poll_add_event(events, &n, e->opaque, revents);
+        }
+    }
+
+    if (qpoll->nalways) {
+        for (i = 0; i < qpoll->nentries && n < max_events; i++) {
+            QEMUPollEntry *e = &qpoll->entries[i];
+
+            if (e->always_ready) {
+                qemu_poll_add_event(events, &n, e->opaque, e->events);
+            }
+        }
+    }
+
+    return n;
+}
+
+#else /* !CONFIG_EPOLL */
+
+QEMUPoll *qemu_poll_new(void)
+{
+    QEMUPoll *qpoll = qemu_mallocz(sizeof(*qpoll));
+
+    qpoll->max_fd = -1;
+    FD_ZERO(&qpoll->rfds);
+    FD_ZERO(&qpoll->wfds);
+    return qpoll;
+}
+
+void qemu_poll_free(QEMUPoll *qpoll)
+{
+    qemu_free(qpoll->entries);
+    qemu_free(qpoll);
+}
+
+void qemu_poll_set(QEMUPoll *qpoll, int fd, int events, void *opaque)
+{
+    QEMUPollEntry *e = qemu_poll_entry(qpoll, fd);
+
+    if (events & QEMU_POLL_IN) {
+        FD_SET(fd, &qpoll->rfds);
+    } else {
+        FD_CLR(fd, &qpoll->rfds);
+    }
+    if (events & QEMU_POLL_OUT) {
+        FD_SET(fd, &qpoll->wfds);
+    } else {
+        FD_CLR(fd, &qpoll->wfds);
+    }
+    if (events && fd > qpoll->max_fd) {
+        qpoll->max_fd = fd;
+    }
+    e->events = events;
+    e->opaque = opaque;
+}
+
+int qemu_poll_wait(QEMUPoll *qpoll, int nfds, fd_set *rfds, fd_set *wfds,
+                   fd_set *xfds, int64_t timeout_ns)
+{
+    int fd, max_fd = qpoll->max_fd;
+    int ret;
+
+    qpoll->ready_valid = false;
+    if (nfds <= 0) {
+        FD_ZERO(&qpoll->ready_rfds);
+        FD_ZERO(&qpoll->ready_wfds);
+        rfds = &qpoll->ready_rfds;
+        wfds = &qpoll->ready_wfds;
+        xfds = NULL;
+        nfds = 0;
+    }
+
+    for (fd = 0; fd <= max_fd; fd++) {
+        if (FD_ISSET(fd, &qpoll->rfds)) {
+            FD_SET(fd, rfds);
+            nfds = MAX(nfds, fd + 1);
+        }
+        if (FD_ISSET(fd, &qpoll->wfds)) {
+            FD_SET(fd, wfds);
+            nfds = MAX(nfds, fd + 1);
+        }
+    }
+
+    ret = qemu_poll_select(nfds, rfds, wfds, xfds, timeout_ns);
+    if (ret > 0) {
+        if (rfds != &qpoll->ready_rfds) {
+            qpoll->ready_rfds = *rfds;
+            qpoll->ready_wfds = *wfds;
+        }
+        qpoll->ready_valid = true;
+    }
+    return ret;
+}
+
+int qemu_poll_get_events(QEMUPoll *qpoll, QEMUPollEvent *events,
+                         int max_events)
+{
+    int fd, max_fd, n = 0;
+
+    if (!qpoll->ready_valid) {
+        return 0;
+    }
+
+    max_fd = MIN(qpoll->max_fd, qpoll->nentries - 1);
+    for (fd = 0; fd <= max_fd && n < max_events; fd++) {
+        QEMUPollEntry *e = &qpoll->entries[fd];
+        int revents = 0;
+
+        if ((e->events & QEMU_POLL_IN) && FD_ISSET(fd, &qpoll->ready_rfds)) {
+            revents |= QEMU_POLL_IN;
+        }
+        if ((e->events & QEMU_POLL_OUT) && FD_ISSET(fd, &qpoll->ready_wfds)) {
+            revents |= QEMU_POLL_OUT;
+        }
+        if (revents) {
+            qemu_poll_add_event(events, &n, e->opaque, revents);
+        }
+    }
+
+    return n;
+}
+
+#endif /* CONFIG_EPOLL */
@@ -0,0 +1,60 @@
+/*
+ * Persistent file descriptor sets for the main loop and aio
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POLL_H
+#define QEMU_POLL_H
+
+#include "qemu-common.h"
+
+/*
+ * A QEMUPoll remembers which events each file descriptor is waited for, so
+ * a wait costs time proportional to the number of ready descriptors rather
+ * than to the number of registered ones.  With epoll the registrations live
+ * in the kernel; elsewhere a pair of fd_sets is kept up to date and copied
+ * for each select().
+ *
+ * qemu_poll_set() may be called while another thread is blocked in
+ * qemu_poll_wait(); qemu_poll_get_events() must not race with
+ * qemu_poll_set().
+ */
+
+#define QEMU_POLL_IN    0x1
+#define QEMU_POLL_OUT   0x2
+
+/* Events returned by one wait at most, a reasonable size for callers' arrays */
+#define QEMU_POLL_MAX_EVENTS    64
+
+typedef struct QEMUPoll QEMUPoll;
+
+typedef struct QEMUPollEvent {
+    void *opaque;
+    int revents;            /* QEMU_POLL_IN and/or QEMU_POLL_OUT */
+} QEMUPollEvent;
+
+QEMUPoll *qemu_poll_new(void);
+void qemu_poll_free(QEMUPoll *qpoll);
+
+/* Wait for @events on @fd from now on, or stop waiting if @events is 0.
+ * @opaque is handed back with the events of @fd. */
+void qemu_poll_set(QEMUPoll *qpoll, int fd, int events, void *opaque);
+
+/* Wait until a registered fd is ready or @timeout_ns (-1 for no timeout)
+ * has passed.  If @nfds > 0, the descriptors in @rfds/@wfds/@xfds below
+ * @nfds are waited for as well, and the sets are updated as by select().
+ * Returns the number of ready descriptors, 0 on timeout or -1 on error. */
+int qemu_poll_wait(QEMUPoll *qpoll, int nfds, fd_set *rfds, fd_set *wfds,
+                   fd_set *xfds, int64_t timeout_ns);
+
+/* Copy up to @max_events events found by the last qemu_poll_wait() into
+ * @events, skipping fds that have been unregistered since.  Events that do
+ * not fit are reported again by the next wait.  The copy lets handlers run
+ * a nested wait on the same set. */
+int qemu_poll_get_events(QEMUPoll *qpoll, QEMUPollEvent *events,
+                         int max_events);
+
+#endif
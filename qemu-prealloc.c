@@ -0,0 +1,204 @@
+/*
+ * Multi-threaded preallocation of guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "bitops.h"
+#include "qemu-prealloc.h"
+
+#include <signal.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/* Progress is published once per chunk */
+#define PREALLOC_CHUNK  (64 * 1024 * 1024)
+
+typedef struct PreallocJob {
+    char *start;
+    char *end;
+    size_t pagesize;
+#ifdef __linux__
+    bool has_cpus;
+    cpu_set_t cpus;
+#endif
+} PreallocJob;
+
+int mem_prealloc_threads;
+
+static QemuMutex prealloc_lock;
+static QemuCond prealloc_cond;
+static int prealloc_running;
+static int prealloc_threads_started;
+static uint64_t prealloc_total;
+static unsigned long prealloc_done;     /* updated atomically */
+static int64_t prealloc_start_ns;
+static int64_t prealloc_end_ns;
+
+int qemu_prealloc_threads(void)
+{
+    long n;
+
+    if (mem_prealloc_threads > 0) {
+        return mem_prealloc_threads;
+    }
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? MIN(n, QEMU_PREALLOC_DEFAULT_THREADS) : 1;
+}
+
+#ifdef __linux__
+/* Parse a sysfs CPU list such as "0-3,8-11" into @cpus */
+static bool prealloc_node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64], buf[1024], *p, *end;
+    unsigned long first, last;
+    ssize_t len;
+    bool found = false;
+    int fd;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    buf[len] = '\0';
+
+    for (p = buf; *p >= '0' && *p <= '9'; p = end + (*end == ',')) {
+        first = last = strtoul(p, &end, 10);
+        if (*end == '-') {
+            last = strtoul(end + 1, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+            found = true;
+        }
+    }
+    return found;
+}
+#endif
+
+static void *prealloc_thread(void *opaque)
+{
+    PreallocJob *job = opaque;
+    char *p, *chunk_end;
+    sigset_t set;
+
+    pthread_detach(pthread_self());
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+#ifdef __linux__
+    if (job->has_cpus) {
+        sched_setaffinity(0, sizeof(job->cpus), &job->cpus);
+    }
+#endif
+
+    for (p = job->start; p < job->end; ) {
+        char *chunk_start = p;
+
+        chunk_end = MIN(p + MAX(PREALLOC_CHUNK, job->pagesize), job->end);
+        for (; p < chunk_end; p += job->pagesize) {
+            /* An atomic no-op rather than a plain store, so that a write
+             * by the guest or a device in the meantime is kept */
+            __sync_fetch_and_add((int *)p, 0);
+        }
+        __sync_fetch_and_add(&prealloc_done, chunk_end - chunk_start);
+    }
+
+    qemu_mutex_lock(&prealloc_lock);
+    if (--prealloc_running == 0) {
+        prealloc_end_ns = get_clock();
+        qemu_cond_broadcast(&prealloc_cond);
+    }
+    qemu_mutex_unlock(&prealloc_lock);
+    qemu_free(job);
+    return NULL;
+}
+
+void qemu_prealloc(void *host, size_t size, size_t pagesize, int nthreads,
+                   const unsigned long *host_nodes, int max_host_nodes)
+{
+    size_t pages = size / pagesize, first = 0, n;
+    QemuThread thread;
+    int i;
+
+    if (!pages) {
+        return;
+    }
+    if (!prealloc_total) {
+        qemu_mutex_init(&prealloc_lock);
+        qemu_cond_init(&prealloc_cond);
+        prealloc_start_ns = get_clock();
+    }
+    nthreads = MAX(1, MIN(nthreads,
+                          DIV_ROUND_UP(size, MAX(PREALLOC_CHUNK, pagesize))));
+
+    qemu_mutex_lock(&prealloc_lock);
+    prealloc_total += pages * pagesize;
+    prealloc_running += nthreads;
+    prealloc_threads_started += nthreads;
+    qemu_mutex_unlock(&prealloc_lock);
+
+    for (i = 0; i < nthreads; i++) {
+        PreallocJob *job = qemu_mallocz(sizeof(*job));
+
+        n = pages / nthreads + (i < pages % nthreads);
+        job->start = (char *)host + first * pagesize;
+        job->end = job->start + n * pagesize;
+        job->pagesize = pagesize;
+        first += n;
+#ifdef __linux__
+        if (host_nodes) {
+            int node;
+
+            CPU_ZERO(&job->cpus);
+            for (node = 0; node < max_host_nodes; node++) {
+                if (test_bit(node, host_nodes) &&
+                    prealloc_node_cpus(node, &job->cpus)) {
+                    job->has_cpus = true;
+                }
+            }
+        }
+#endif
+        qemu_thread_create(&thread, prealloc_thread, job);
+    }
+}
+
+void qemu_prealloc_wait(void)
+{
+    if (!prealloc_total) {
+        return;
+    }
+    qemu_mutex_lock(&prealloc_lock);
+    while (prealloc_running) {
+        qemu_cond_wait(&prealloc_cond, &prealloc_lock);
+    }
+    qemu_mutex_unlock(&prealloc_lock);
+}
+
+void qemu_prealloc_get_info(QEMUPreallocInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    if (!prealloc_total) {
+        return;
+    }
+    qemu_mutex_lock(&prealloc_lock);
+    info->active = prealloc_running > 0;
+    info->threads = prealloc_threads_started;
+    info->total = prealloc_total;
+    info->done = prealloc_done;
+    info->elapsed_ns = (info->active ? get_clock() : prealloc_end_ns) -
+                       prealloc_start_ns;
+    qemu_mutex_unlock(&prealloc_lock);
+}
@@ -0,0 +1,43 @@
+/*
+ * Multi-threaded preallocation of guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PREALLOC_H
+#define QEMU_PREALLOC_H
+
+#include "qemu-common.h"
+
+/* Threads touching guest RAM in total; 0 means one per host CPU, up to
+ * QEMU_PREALLOC_DEFAULT_THREADS. */
+#define QEMU_PREALLOC_DEFAULT_THREADS   16
+#define QEMU_PREALLOC_MAX_THREADS       256
+extern int mem_prealloc_threads;
+
+typedef struct QEMUPreallocInfo {
+    bool active;
+    int threads;            /* started so far */
+    uint64_t total;         /* bytes */
+    uint64_t done;
+    int64_t elapsed_ns;
+} QEMUPreallocInfo;
+
+int qemu_prealloc_threads(void);
+
+/* Fault in every page of [@host, @host + @size) from @nthreads background
+ * threads, each taking a contiguous part.  If @host_nodes is not NULL, the
+ * threads run on the CPUs of those host nodes (a bitmap of @max_host_nodes
+ * bits), so that the memory is cleared by local CPUs.  Concurrent writes
+ * to the range are not lost, so devices and the guest may use it at once. */
+void qemu_prealloc(void *host, size_t size, size_t pagesize, int nthreads,
+                   const unsigned long *host_nodes, int max_host_nodes);
+
+/* Return once every range passed to qemu_prealloc() is populated */
+void qemu_prealloc_wait(void);
+
+void qemu_prealloc_get_info(QEMUPreallocInfo *info);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Main loop and global mutex profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
+#include "qemu-prof.h"
+#include "qdict.h"
+#include "qint.h"
+#include "qlist.h"
+#include "qstring.h"
+
+/* Callbacks are told apart by their address; a device model normally has one
+ * function per fd, timer or bottom half, so that is enough to name it. */
+#define QEMU_PROF_HANDLERS  512
+
+typedef struct QEMUProfHandler {
+    QEMUProfKind kind;
+    void *func;                 /* NULL for an unused slot */
+    QEMUProfHist hist;
+} QEMUProfHandler;
+
+static const char *const qemu_prof_kind_names[QEMU_PROF_MAX] = {
+    [QEMU_PROF_FD_READ] = "fd-read",
+    [QEMU_PROF_FD_WRITE] = "fd-write",
+    [QEMU_PROF_TIMER] = "timer",
+    [QEMU_PROF_BH] = "bh",
+};
+
+QEMUProfHist qemu_prof_dispatch;
+
+static QEMUProfHandler *qemu_prof_handlers;
+static QEMUProfHist qemu_prof_overflow[QEMU_PROF_MAX];
+
+int64_t qemu_prof_now(void)
+{
+    return get_clock();
+}
+
+void qemu_prof_hist_add(QEMUProfHist *hist, int64_t ns)
+{
+    uint64_t us;
+    int i;
+
+    if (ns < 0) {
+        ns = 0;
+    }
+    us = ns / 1000;
+    i = us ? 64 - clz64(us) : 0;
+
+    hist->count++;
+    hist->total_ns += ns;
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    hist->buckets[MIN(i, QEMU_PROF_HIST_BUCKETS - 1)]++;
+}
+
+static QEMUProfHist *qemu_prof_lookup(QEMUProfKind kind, void *func)
+{
+    unsigned int h, i;
+
+    if (!qemu_prof_handlers) {
+        qemu_prof_handlers = qemu_mallocz(QEMU_PROF_HANDLERS *
+                                          sizeof(*qemu_prof_handlers));
+    }
+
+    h = ((uintptr_t)func >> 4) * 31 + kind;
+    for (i = 0; i < QEMU_PROF_HANDLERS; i++) {
+        QEMUProfHandler *p = &qemu_prof_handlers[(h + i) % QEMU_PROF_HANDLERS];
+
+        if (!p->func) {
+            p->kind = kind;
+            p->func = func;
+            return &p->hist;
+        }
+        if (p->func == func && p->kind == kind) {
+            return &p->hist;
+        }
+    }
+    return &qemu_prof_overflow[kind];
+}
+
+void qemu_prof_handler(QEMUProfKind kind, void *func, int64_t start)
+{
+    qemu_prof_hist_add(qemu_prof_lookup(kind, func), qemu_prof_now() - start);
+}
+
+QObject *qemu_prof_hist_to_qobject(const QEMUProfHist *hist)
+{
+    QDict *dict = qdict_new();
+    QList *buckets = qlist_new();
+    int i, n;
+
+    /* Trailing empty buckets carry no information */
+    for (n = QEMU_PROF_HIST_BUCKETS; n > 0 && !hist->buckets[n - 1]; n--) {
+        /* nothing */
+    }
+    for (i = 0; i < n; i++) {
+        qlist_append(buckets, qint_from_int(hist->buckets[i]));
+    }
+
+    qdict_put(dict, "count", qint_from_int(hist->count));
+    qdict_put(dict, "total-ns", qint_from_int(hist->total_ns));
+    qdict_put(dict, "max-ns", qint_from_int(hist->max_ns));
+    qdict_put(dict, "buckets", buckets);
+    return QOBJECT(dict);
+}
+
+static QDict *qemu_prof_handler_to_qdict(QEMUProfKind kind, void *func,
+                                         const QEMUProfHist *hist)
+{
+    QDict *dict = qdict_new();
+    char buf[32];
+
+    if (func) {
+        snprintf(buf, sizeof(buf), "%p", func);
+    } else {
+        pstrcpy(buf, sizeof(buf), "other");
+    }
+    qdict_put(dict, "kind", qstring_from_str(qemu_prof_kind_names[kind]));
+    qdict_put(dict, "function", qstring_from_str(buf));
+    qdict_put_obj(dict, "time", qemu_prof_hist_to_qobject(hist));
+    return dict;
+}
+
+static int qemu_prof_cmp_total(const void *a, const void *b)
+{
+    const QEMUProfHandler *pa = *(QEMUProfHandler * const *)a;
+    const QEMUProfHandler *pb = *(QEMUProfHandler * const *)b;
+
+    if (pa->hist.total_ns != pb->hist.total_ns) {
+        return pa->hist.total_ns < pb->hist.total_ns ? 1 : -1;
+    }
+    return 0;
+}
+
+QList *qemu_prof_top_handlers(int n)
+{
+    QList *list = qlist_new();
+    QEMUProfHandler **sorted;
+    int i, count = 0;
+
+    if (qemu_prof_handlers) {
+        sorted = qemu_malloc(QEMU_PROF_HANDLERS * sizeof(*sorted));
+        for (i = 0; i < QEMU_PROF_HANDLERS; i++) {
+            if (qemu_prof_handlers[i].func) {
+                sorted[count++] = &qemu_prof_handlers[i];
+            }
+        }
+        qsort(sorted, count, sizeof(*sorted), qemu_prof_cmp_total);
+
+        for (i = 0; i < count && i < n; i++) {
+            qlist_append(list, qemu_prof_handler_to_qdict(sorted[i]->kind,
+                                                          sorted[i]->func,
+                                                          &sorted[i]->hist));
+        }
+        qemu_free(sorted);
+    }
+
+    for (i = 0; i < QEMU_PROF_MAX; i++) {
+        if (qemu_prof_overflow[i].count) {
+            qlist_append(list,
+                         qemu_prof_handler_to_qdict(i, NULL,
+                                                    &qemu_prof_overflow[i]));
+        }
+    }
+    return list;
+}
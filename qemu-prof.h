@@ -0,0 +1,51 @@
+/*
+ * Main loop and global mutex profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PROF_H
+#define QEMU_PROF_H
+
+#include <stdint.h>
+
+/* Bucket i counts durations below 2^i microseconds (and not in bucket i-1);
+ * the last one also takes everything longer. */
+#define QEMU_PROF_HIST_BUCKETS  24
+
+typedef struct QEMUProfHist {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[QEMU_PROF_HIST_BUCKETS];
+} QEMUProfHist;
+
+typedef enum QEMUProfKind {
+    QEMU_PROF_FD_READ,
+    QEMU_PROF_FD_WRITE,
+    QEMU_PROF_TIMER,
+    QEMU_PROF_BH,
+    QEMU_PROF_MAX
+} QEMUProfKind;
+
+/* Time spent by each main_loop_wait() between waking up and going back to
+ * sleep, i.e. how long the loop was unresponsive */
+extern QEMUProfHist qemu_prof_dispatch;
+
+int64_t qemu_prof_now(void);
+void qemu_prof_hist_add(QEMUProfHist *hist, int64_t ns);
+
+/* Account a callback of @kind that started at @start, as returned by
+ * qemu_prof_now(), to @func.  Callers hold the global mutex. */
+void qemu_prof_handler(QEMUProfKind kind, void *func, int64_t start);
+
+struct QObject;
+struct QList;
+
+struct QObject *qemu_prof_hist_to_qobject(const QEMUProfHist *hist);
+/* The @n callbacks that took the most time in total, longest first */
+struct QList *qemu_prof_top_handlers(int n);
+
+#endif
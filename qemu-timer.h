@@ -28,6 +28,7 @@ extern QEMUClock *vm_clock;
 extern QEMUClock *host_clock;
 
 int64_t qemu_get_clock(QEMUClock *clock);
+int qemu_get_vm_clock_unlocked(int64_t *now);
 
 void qemu_register_clock_reset_notifier(QEMUClock *clock, Notifier *notifier);
 void qemu_unregister_clock_reset_notifier(QEMUClock *clock,
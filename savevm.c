@@ -82,6 +82,7 @@
 #include "migration.h"
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "block_int.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -377,29 +378,223 @@ fail:
     return NULL;
 }
 
+/* VM state is moved to and from the image in chunks of VMSTATE_CHUNK_SIZE,
+ * each written or read ahead by a coroutine so that up to
+ * VMSTATE_MAX_INFLIGHT requests overlap with producing or parsing the
+ * stream. */
+#define VMSTATE_CHUNK_SIZE      (1 << 20)
+#define VMSTATE_MAX_INFLIGHT    4
+#define VMSTATE_ALIGN(n)        (DIV_ROUND_UP(n, BDRV_SECTOR_SIZE) * \
+                                 BDRV_SECTOR_SIZE)
+
+typedef struct BlockVMStateFile BlockVMStateFile;
+
+typedef struct BlockVMStateChunk {
+    BlockVMStateFile *s;
+    uint8_t *buf;
+    int64_t pos;
+    int size;               /* bytes filled (write) or requested (read) */
+    int len;                /* bytes read */
+    bool busy;
+} BlockVMStateChunk;
+
+struct BlockVMStateFile {
+    BlockDriverState *bs;
+    int is_write;
+    int64_t end;            /* end of the VM state when reading, or -1 */
+    int64_t next_pos;       /* next position to read ahead */
+    BlockVMStateChunk chunks[VMSTATE_MAX_INFLIGHT];
+    int cur;
+    int inflight;
+    int error;
+    /* When set, rate limiting reports all chunks busy instead of waiting
+     * and this is called as soon as one is free again */
+    void (*put_ready)(void *opaque);
+    void *ready_opaque;
+};
+
+static void coroutine_fn block_vmstate_co_rw(void *opaque)
+{
+    BlockVMStateChunk *c = opaque;
+    BlockVMStateFile *s = c->s;
+    int ret;
+
+    if (s->is_write) {
+        ret = bdrv_save_vmstate(s->bs, c->buf, c->pos, c->size);
+    } else {
+        ret = bdrv_load_vmstate(s->bs, c->buf, c->pos, c->size);
+        c->len = ret < 0 ? 0 : MIN(ret, c->size);
+        if (s->end >= 0) {
+            c->len = MIN(c->len, s->end - c->pos);
+        }
+    }
+    if (ret < 0 && !s->error) {
+        s->error = ret;
+    }
+    c->busy = false;
+    s->inflight--;
+    if (s->put_ready) {
+        s->put_ready(s->ready_opaque);
+    }
+}
+
+static void block_vmstate_submit(BlockVMStateChunk *c)
+{
+    Coroutine *co;
+
+    c->busy = true;
+    c->s->inflight++;
+    co = qemu_coroutine_create(block_vmstate_co_rw);
+    qemu_coroutine_enter(co, c);
+}
+
+static void block_vmstate_wait(BlockVMStateChunk *c)
+{
+    while (c->busy) {
+        qemu_aio_wait();
+    }
+}
+
+static void block_vmstate_flush(BlockVMStateFile *s)
+{
+    BlockVMStateChunk *c = &s->chunks[s->cur];
+
+    /* Keep requests sector aligned so that drivers can skip the
+     * read-modify-write; the padding lies past the end of the state */
+    memset(c->buf + c->size, 0, VMSTATE_ALIGN(c->size) - c->size);
+    c->size = VMSTATE_ALIGN(c->size);
+    block_vmstate_submit(c);
+    s->cur = (s->cur + 1) % VMSTATE_MAX_INFLIGHT;
+}
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
+    BlockVMStateFile *s = opaque;
+    int done = 0;
+
+    while (!s->error && done < size) {
+        BlockVMStateChunk *c = &s->chunks[s->cur];
+        int l;
+
+        block_vmstate_wait(c);
+        if (c->size == 0) {
+            c->pos = pos + done;
+        }
+        l = MIN(size - done, VMSTATE_CHUNK_SIZE - c->size);
+        memcpy(c->buf + c->size, buf + done, l);
+        c->size += l;
+        done += l;
+        if (c->size == VMSTATE_CHUNK_SIZE) {
+            block_vmstate_flush(s);
+            c = &s->chunks[s->cur];
+            block_vmstate_wait(c);
+            c->size = 0;
+        }
+    }
+    return s->error ? s->error : size;
+}
+
+static int block_rate_limit(void *opaque)
+{
+    BlockVMStateFile *s = opaque;
+
+    if (s->error) {
+        return s->error;
+    }
+    return s->put_ready && s->inflight >= VMSTATE_MAX_INFLIGHT - 1;
+}
+
+static void block_vmstate_read_ahead(BlockVMStateChunk *c)
+{
+    BlockVMStateFile *s = c->s;
+    int64_t size = VMSTATE_CHUNK_SIZE;
+
+    if (s->end >= 0) {
+        size = MIN(size, VMSTATE_ALIGN(s->end - s->next_pos));
+    }
+    c->pos = s->next_pos;
+    c->len = 0;
+    if (size <= 0) {
+        return;
+    }
+    c->size = size;
+    s->next_pos += size;
+    block_vmstate_submit(c);
 }
 
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    return bdrv_load_vmstate(opaque, buf, pos, size);
+    BlockVMStateFile *s = opaque;
+    BlockVMStateChunk *c = &s->chunks[s->cur];
+    int i, l;
+
+    block_vmstate_wait(c);
+    if (s->error) {
+        return s->error;
+    }
+    if (pos < c->pos || pos > c->pos + c->len || s->next_pos == 0) {
+        /* First read, or not sequential: restart the read-ahead at the
+         * sector containing pos */
+        for (i = 0; i < VMSTATE_MAX_INFLIGHT; i++) {
+            block_vmstate_wait(&s->chunks[i]);
+        }
+        s->next_pos = pos & ~(int64_t)(BDRV_SECTOR_SIZE - 1);
+        for (i = 0; i < VMSTATE_MAX_INFLIGHT; i++) {
+            block_vmstate_read_ahead(&s->chunks[(s->cur + i) %
+                                                VMSTATE_MAX_INFLIGHT]);
+        }
+        block_vmstate_wait(c);
+        if (s->error) {
+            return s->error;
+        }
+    }
+
+    l = MIN(size, c->pos + c->len - pos);
+    memcpy(buf, c->buf + (pos - c->pos), l);
+    if (l > 0 && pos + l == c->pos + c->len) {
+        block_vmstate_read_ahead(c);
+        s->cur = (s->cur + 1) % VMSTATE_MAX_INFLIGHT;
+    }
+    return l;
 }
 
 static int bdrv_fclose(void *opaque)
 {
-    return 0;
+    BlockVMStateFile *s = opaque;
+    int i, ret;
+
+    if (s->is_write && !s->error && s->chunks[s->cur].size) {
+        block_vmstate_flush(s);
+    }
+    for (i = 0; i < VMSTATE_MAX_INFLIGHT; i++) {
+        block_vmstate_wait(&s->chunks[i]);
+        qemu_vfree(s->chunks[i].buf);
+    }
+    ret = s->error;
+    qemu_free(s);
+    return ret;
 }
 
-static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
+/* @size is the length of the VM state to be read, or -1 if unknown */
+static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable,
+                                 int64_t size)
 {
+    BlockVMStateFile *s = qemu_mallocz(sizeof(*s));
+    int i;
+
+    s->bs = bs;
+    s->is_write = is_writable;
+    s->end = size;
+    for (i = 0; i < VMSTATE_MAX_INFLIGHT; i++) {
+        s->chunks[i].s = s;
+        s->chunks[i].buf = qemu_blockalign(bs, VMSTATE_CHUNK_SIZE);
+    }
+
     if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
+        return qemu_fopen_ops(s, block_put_buffer, NULL, bdrv_fclose,
+			      block_rate_limit, NULL, NULL);
+    return qemu_fopen_ops(s, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
@@ -1477,6 +1672,15 @@ bool qemu_savevm_state_blocked(Monitor *mon)
 {
     SaveStateEntry *se;
 
+    if (dump_in_progress()) {
+        monitor_printf(mon, "state blocked by guest memory dump in progress\n");
+        return true;
+    }
+    if (savevm_in_progress()) {
+        monitor_printf(mon, "state blocked by snapshot in progress\n");
+        return true;
+    }
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->no_migrate) {
             monitor_printf(mon, "state blocked by non-migratable device '%s'\n",
@@ -1932,21 +2136,183 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* A running guest keeps running while RAM is saved, as in migration; it is
+ * stopped for the last dirty pages and the device state once the remaining
+ * RAM fits in the migration downtime, or after RAM has been written
+ * SAVEVM_LIVE_MAX_COPIES times over. */
+#define SAVEVM_LIVE_MAX_COPIES  3
+
+typedef struct SaveVMState {
+    /* Only resumed once the snapshot exists; the live stages run from a
+     * bottom half after the command returned and report through
+     * error_report() */
+    Monitor *suspended_mon;
+    BlockDriverState *bs;
+    QEMUFile *file;
+    QEMUSnapshotInfo sn;
+    QEMUBH *bh;
+    bool iterating;
+} SaveVMState;
+
+static SaveVMState *savevm_state;
+
+bool savevm_in_progress(void)
+{
+    return savevm_state != NULL;
+}
+
+static void savevm_fill_snapshot_info(QEMUSnapshotInfo *sn)
+{
+#ifdef _WIN32
+    struct _timeb tb;
+
+    _ftime(&tb);
+    sn->date_sec = tb.time;
+    sn->date_nsec = tb.millitm * 1000000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+#endif
+    sn->vm_clock_nsec = qemu_get_clock(vm_clock);
+}
+
+static void savevm_create_snapshots(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                    uint32_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+static void savevm_live_finish(SaveVMState *s, int ret)
+{
+    BlockVMStateFile *bf = s->file->opaque;
+    int saved_vm_running = runstate_is_running();
+    uint32_t vm_state_size;
+
+    bf->put_ready = NULL;
+    qemu_bh_delete(s->bh);
+    if (ret >= 0) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        bdrv_flush_all();
+        savevm_fill_snapshot_info(&s->sn);
+        ret = qemu_savevm_state_complete(NULL, s->file);
+    } else {
+        qemu_savevm_state_cancel(NULL, s->file);
+    }
+    vm_state_size = qemu_ftell(s->file);
+    /* waits for the last chunks to reach the image */
+    if (qemu_fclose(s->file) < 0 && ret >= 0) {
+        ret = -EIO;
+    }
+    if (ret < 0) {
+        error_report("Error %d while writing VM", ret);
+    } else {
+        savevm_create_snapshots(s->bs, &s->sn, vm_state_size);
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+    monitor_resume(s->suspended_mon);
+    savevm_state = NULL;
+    qemu_free(s);
+}
+
+static void savevm_live_iterate(void *opaque)
+{
+    SaveVMState *s = opaque;
+    int ret;
+
+    /* Waiting for a free chunk polls bottom halves */
+    if (s->iterating) {
+        return;
+    }
+    s->iterating = true;
+    ret = qemu_savevm_state_iterate(NULL, s->file);
+    s->iterating = false;
+    if (ret == 0 &&
+        ram_bytes_transferred() < SAVEVM_LIVE_MAX_COPIES * ram_bytes_total()) {
+        /* When all chunks are being written, the first one to complete
+         * reschedules us */
+        if (qemu_file_rate_limit(s->file) == 0) {
+            qemu_bh_schedule(s->bh);
+        }
+        return;
+    }
+    savevm_live_finish(s, ret);
+}
+
+static void savevm_live_put_ready(void *opaque)
+{
+    SaveVMState *s = opaque;
+
+    qemu_bh_schedule(s->bh);
+}
+
+/* @mon has been suspended by the caller and is resumed when done */
+static void savevm_start_live(Monitor *mon, BlockDriverState *bs,
+                              QEMUSnapshotInfo *sn)
+{
+    SaveVMState *s;
+    BlockVMStateFile *bf;
+    int ret;
+
+    bdrv_flush_all();
+    if (qemu_savevm_state_blocked(mon)) {
+        monitor_resume(mon);
+        return;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->suspended_mon = mon;
+    s->bs = bs;
+    s->sn = *sn;
+    s->file = qemu_fopen_bdrv(bs, 1, -1);
+    bf = s->file->opaque;
+    bf->put_ready = savevm_live_put_ready;
+    bf->ready_opaque = s;
+    s->bh = qemu_bh_new(savevm_live_iterate, s);
+    savevm_state = s;
+
+    ret = qemu_savevm_state_begin(mon, s->file, 0, 0);
+    if (ret < 0) {
+        savevm_live_finish(s, ret);
+        return;
+    }
+    qemu_bh_schedule(s->bh);
+}
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
-    BlockDriverState *bs, *bs1;
+    BlockDriverState *bs;
     QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint32_t vm_state_size;
-#ifdef _WIN32
-    struct _timeb tb;
-#else
-    struct timeval tv;
-#endif
     const char *name = qdict_get_try_str(qdict, "name");
 
+    if (savevm_state) {
+        monitor_printf(mon, "A snapshot is already being saved\n");
+        return;
+    }
+
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -1970,9 +2336,6 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     /* ??? Should this occur after vm_stop?  */
     bdrv_drain_all();
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
-
     memset(sn, 0, sizeof(*sn));
     if (name) {
         ret = bdrv_snapshot_find(bs, old_sn, name);
@@ -1984,17 +2347,24 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         }
     }
 
+    /* A live save finishes after the command returned, so the monitor has
+     * to wait for it.  Monitors that cannot, such as the one behind QMP's
+     * human-monitor-command, save with the guest stopped throughout. */
+    saved_vm_running = runstate_is_running();
+    if (saved_vm_running && monitor_suspend(mon) == 0) {
+        /* Delete old snapshots of the same name */
+        if (name && del_existing_snapshots(mon, name) < 0) {
+            monitor_resume(mon);
+            return;
+        }
+        savevm_start_live(mon, bs, sn);
+        return;
+    }
+
+    vm_stop(RUN_STATE_SAVE_VM);
+
     /* fill auxiliary fields */
-#ifdef _WIN32
-    _ftime(&tb);
-    sn->date_sec = tb.time;
-    sn->date_nsec = tb.millitm * 1000000;
-#else
-    gettimeofday(&tv, NULL);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-#endif
-    sn->vm_clock_nsec = qemu_get_clock(vm_clock);
+    savevm_fill_snapshot_info(sn);
 
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
@@ -2002,33 +2372,23 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* save the VM state */
-    f = qemu_fopen_bdrv(bs, 1);
+    f = qemu_fopen_bdrv(bs, 1, -1);
     if (!f) {
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
     ret = qemu_savevm_state(mon, f);
     vm_state_size = qemu_ftell(f);
-    qemu_fclose(f);
+    if (qemu_fclose(f) < 0 && ret >= 0) {
+        ret = -EIO;
+    }
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2042,6 +2402,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_in_progress()) {
+        error_report("A snapshot is being saved");
+        return -EBUSY;
+    }
+
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -2104,7 +2469,7 @@ int load_vmstate(const char *name)
     }
 
     /* restore the VM state */
-    f = qemu_fopen_bdrv(bs, 0);
+    f = qemu_fopen_bdrv(bs, 0, ret >= 0 ? sn.vm_state_size : -1);
     if (!f) {
         error_report("Could not open VM state file");
         return -EINVAL;
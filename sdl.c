@@ -724,11 +724,11 @@ static void sdl_refresh(DisplayState *ds)
                 if (ev->active.gain) {
                     /* Back to default interval */
                     dcl->gui_timer_interval = 0;
-                    dcl->idle = 0;
+                    dpy_set_idle(ds, dcl, 0);
                 } else {
                     /* Sleeping interval */
                     dcl->gui_timer_interval = 500;
-                    dcl->idle = 1;
+                    dpy_set_idle(ds, dcl, 1);
                 }
             }
             break;
@@ -110,6 +110,8 @@ void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
+/* True while a live savevm writes RAM with the guest running */
+bool savevm_in_progress(void);
 
 void qemu_announce_self(void);
 
@@ -123,6 +125,11 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
+/* True while dump-guest-memory runs, which blocks migration and savevm */
+bool dump_in_progress(void);
+void do_info_dump_print(Monitor *mon, const QObject *data);
+void do_info_dump(Monitor *mon, QObject **ret_data);
+
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
 
@@ -182,6 +189,19 @@ extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
 
+/* Host placement of each node's memory; the values are those of mbind() */
+#define MAX_HOST_NODES 128
+enum {
+    NUMA_POLICY_DEFAULT,
+    NUMA_POLICY_PREFERRED,
+    NUMA_POLICY_BIND,
+    NUMA_POLICY_INTERLEAVE,
+    NUMA_POLICY_MAX
+};
+extern const char *const numa_policy_names[NUMA_POLICY_MAX];
+extern int node_mem_policy[MAX_NODES];
+extern unsigned long *node_host_nodes[MAX_NODES];
+
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
     const char *name;
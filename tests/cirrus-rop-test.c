@@ -0,0 +1,250 @@
+/*
+ * Cirrus VGA blitter ROP test
+ *
+ * Instantiates hw/cirrus_vga_rop.h twice: as the source copy ROP, which has
+ * the memmove, pattern fill and SSE2 colour expansion fast paths, and as
+ * the same operation without them.  Random blits, including overlapping
+ * copies, odd widths and every skipleft value, must leave identical video
+ * memory; the time spent by both versions is printed at the end.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <time.h>
+#include <getopt.h>
+
+#include "qemu-common.h"
+
+#define CIRRUS_BLTMODEEXT_COLOREXPINV      0x02
+
+/* The fields of the device state that the ROP templates use */
+typedef struct CirrusVGAState {
+    struct {
+        uint8_t gr[256];
+    } vga;
+    uint32_t cirrus_blt_fgcol;
+    uint32_t cirrus_blt_bgcol;
+    uint32_t cirrus_blt_srcaddr;
+    uint8_t cirrus_blt_modeext;
+} CirrusVGAState;
+
+#define ROP_NAME src
+#define ROP_OP(d, s) d = s
+#define ROP_COPY
+#include "cirrus_vga_rop.h"
+
+#define ROP_NAME ref
+#define ROP_OP(d, s) d = s
+#include "cirrus_vga_rop.h"
+
+typedef void cirrus_bitblt_rop_t(CirrusVGAState *s,
+                                 uint8_t *dst, const uint8_t *src,
+                                 int dstpitch, int srcpitch,
+                                 int bltwidth, int bltheight);
+typedef void cirrus_fill_t(CirrusVGAState *s,
+                           uint8_t *dst, int dst_pitch,
+                           int width, int height);
+
+#define VRAM_SIZE   (4 * 1024 * 1024)
+#define MAX_PITCH   4096
+#define MAX_HEIGHT  64
+
+enum { OP_FWD, OP_BKWD, OP_FILL, OP_EXPAND, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {
+    "copy forward", "copy backward", "fill", "colour expand",
+};
+
+static cirrus_fill_t *const fill_src[4] = {
+    cirrus_fill_src_8, cirrus_fill_src_16,
+    cirrus_fill_src_24, cirrus_fill_src_32,
+};
+static cirrus_fill_t *const fill_ref[4] = {
+    cirrus_fill_ref_8, cirrus_fill_ref_16,
+    cirrus_fill_ref_24, cirrus_fill_ref_32,
+};
+static cirrus_bitblt_rop_t *const expand_src[4] = {
+    cirrus_colorexpand_transp_src_8, cirrus_colorexpand_transp_src_16,
+    cirrus_colorexpand_transp_src_24, cirrus_colorexpand_transp_src_32,
+};
+static cirrus_bitblt_rop_t *const expand_ref[4] = {
+    cirrus_colorexpand_transp_ref_8, cirrus_colorexpand_transp_ref_16,
+    cirrus_colorexpand_transp_ref_24, cirrus_colorexpand_transp_ref_32,
+};
+
+static uint8_t *vram_src, *vram_ref, *glyphs;
+static int64_t time_src[OP_COUNT], time_ref[OP_COUNT];
+static int runs[OP_COUNT];
+
+static int64_t cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fill_random(uint8_t *p, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        p[i] = random();
+    }
+}
+
+/* Widths are mostly whole pixels, sometimes any number of bytes */
+static int random_width(int bpp, int max)
+{
+    int w = 1 + random() % max;
+
+    if (random() % 4) {
+        w = MAX(w / bpp * bpp, bpp);
+    }
+    return w;
+}
+
+/* Run one blit with both implementations on identical video memory */
+static int run_blit(int op, int depth, CirrusVGAState *s)
+{
+    int bpp = depth / 8;
+    int width = random_width(bpp, 1024 + 64);
+    int height = 1 + random() % MAX_HEIGHT;
+    int dstpitch = width + random() % (MAX_PITCH - width + 1);
+    int srcpitch = width + random() % (MAX_PITCH - width + 1);
+    int span = MAX(dstpitch, srcpitch) * height;
+    int dst = random() % (VRAM_SIZE - span);
+    int src = dst;
+    int64_t t;
+
+    /* Overlapping copies are what scrolling and window moves produce */
+    switch (random() % 3) {
+    case 0:
+        src = random() % (VRAM_SIZE - span);
+        break;
+    case 1:
+        src = dst + random() % (2 * width + 1) - width;
+        break;
+    case 2:
+        srcpitch = dstpitch;
+        src = dst + (random() % 5 - 2) * dstpitch + random() % 17 - 8;
+        break;
+    }
+    src = MIN(MAX(src, 0), VRAM_SIZE - span);
+
+    memcpy(vram_ref, vram_src, VRAM_SIZE);
+
+    t = cpu_now();
+    switch (op) {
+    case OP_FWD:
+        cirrus_bitblt_rop_fwd_src(s, vram_src + dst, vram_src + src,
+                                  dstpitch, srcpitch, width, height);
+        break;
+    case OP_BKWD:
+        /* the blit starts from the last byte of the last row */
+        cirrus_bitblt_rop_bkwd_src(s, vram_src + dst + span - 1,
+                                   vram_src + src + span - 1,
+                                   -dstpitch, -srcpitch, width, height);
+        break;
+    case OP_FILL:
+        fill_src[bpp - 1](s, vram_src + dst, dstpitch, width, height);
+        break;
+    case OP_EXPAND:
+        expand_src[bpp - 1](s, vram_src + dst, glyphs, dstpitch, 0,
+                            width, height);
+        break;
+    }
+    time_src[op] += cpu_now() - t;
+
+    t = cpu_now();
+    switch (op) {
+    case OP_FWD:
+        cirrus_bitblt_rop_fwd_ref(s, vram_ref + dst, vram_ref + src,
+                                  dstpitch, srcpitch, width, height);
+        break;
+    case OP_BKWD:
+        cirrus_bitblt_rop_bkwd_ref(s, vram_ref + dst + span - 1,
+                                   vram_ref + src + span - 1,
+                                   -dstpitch, -srcpitch, width, height);
+        break;
+    case OP_FILL:
+        fill_ref[bpp - 1](s, vram_ref + dst, dstpitch, width, height);
+        break;
+    case OP_EXPAND:
+        expand_ref[bpp - 1](s, vram_ref + dst, glyphs, dstpitch, 0,
+                            width, height);
+        break;
+    }
+    time_ref[op] += cpu_now() - t;
+    runs[op]++;
+
+    if (memcmp(vram_src, vram_ref, VRAM_SIZE)) {
+        fprintf(stderr, "%s at %d bpp differs: dst %d src %d "
+                "pitch %d/%d, %dx%d, skipleft %d, modeext %d\n",
+                op_names[op], depth, dst, src, dstpitch, srcpitch,
+                width, height, s->vga.gr[0x2f], s->cirrus_blt_modeext);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int depths[4] = { 8, 16, 24, 32 };
+    CirrusVGAState s;
+    int iterations = 2000, seed = time(NULL), errors = 0;
+    int i, c, op;
+
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = MAX(atoi(optarg), 1);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            printf("usage: cirrus-rop-test [-n iterations] [-s seed]\n");
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    vram_src = malloc(VRAM_SIZE);
+    vram_ref = malloc(VRAM_SIZE);
+    /* one bit per pixel, rows rounded up to bytes, plus the skipleft */
+    glyphs = malloc(MAX_HEIGHT * (1024 + 64 + 15) / 8 + 1);
+    if (!vram_src || !vram_ref || !glyphs) {
+        return 1;
+    }
+
+    printf("seed %d\n", seed);
+    srandom(seed);
+    fill_random(vram_src, VRAM_SIZE);
+    memset(&s, 0, sizeof(s));
+
+    for (i = 0; i < iterations && !errors; i++) {
+        int depth = depths[random() % 4];
+
+        s.cirrus_blt_fgcol = random();
+        s.cirrus_blt_bgcol = random();
+        s.cirrus_blt_modeext = random() % 2 ? CIRRUS_BLTMODEEXT_COLOREXPINV
+                                            : 0;
+        /* skipleft: bytes at 24 bpp, pixels otherwise */
+        s.vga.gr[0x2f] = random() % 4 ? 0 : random() & 0x1f;
+        fill_random(glyphs, MAX_HEIGHT * (1024 + 64 + 15) / 8 + 1);
+
+        for (op = 0; op < OP_COUNT && !errors; op++) {
+            errors += run_blit(op, depth, &s);
+        }
+    }
+
+    printf("%-16s %10s %10s %8s\n", "", "fast us", "scalar us", "speedup");
+    for (op = 0; op < OP_COUNT; op++) {
+        printf("%-16s %10.1f %10.1f %8.2f\n", op_names[op],
+               time_src[op] / 1e3 / MAX(runs[op], 1),
+               time_ref[op] / 1e3 / MAX(runs[op], 1),
+               (double)time_ref[op] / MAX(time_src[op], 1));
+    }
+    return errors ? 1 : 0;
+}
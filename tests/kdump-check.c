@@ -0,0 +1,281 @@
+/*
+ * kdump-compressed dump checker
+ *
+ * Parses a file written by dump-guest-memory -z/-l/-s back: the disk dump
+ * header and kdump sub header, both page bitmaps and one descriptor per
+ * page marked in them, and decompresses the page data.  With a second
+ * file holding guest-physical memory from address 0, as saved by
+ * "pmemsave 0 <size> <file>" while the guest is stopped, every dumped page
+ * that it covers is compared as well, which checks that page frame numbers
+ * are guest-physical.
+ *
+ * Header fields are read in host byte order, so check dumps of guests
+ * with the host's endianness.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
+
+#include "dump.h"
+
+static int fd;
+static off_t file_size;
+
+static void fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "kdump-check: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void read_at(void *buf, size_t size, off_t offset)
+{
+    ssize_t ret;
+
+    if (offset < 0 || offset + (off_t)size > file_size) {
+        fail("%zu bytes at %lld are past the end of the file",
+             size, (long long)offset);
+    }
+    ret = pread(fd, buf, size, offset);
+    if (ret != (ssize_t)size) {
+        fail("short read at %lld", (long long)offset);
+    }
+}
+
+/* Returns 0 if the data does not decompress to exactly one page */
+static int uncompress_page(uint32_t flags, const uint8_t *in, size_t size,
+                           uint8_t *out, size_t block_size)
+{
+    switch (flags) {
+    case DUMP_DH_COMPRESSED_ZLIB: {
+        uLongf len = block_size;
+
+        return uncompress(out, &len, in, size) == Z_OK && len == block_size;
+    }
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO: {
+        lzo_uint len = block_size;
+
+        return lzo1x_decompress_safe(in, size, out, &len, NULL) == LZO_E_OK &&
+               len == block_size;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY: {
+        size_t len = block_size;
+
+        return snappy_uncompress((const char *)in, size, (char *)out,
+                                 &len) == SNAPPY_OK && len == block_size;
+    }
+#endif
+    default:
+        fail("cannot decompress pages with flags %#x", flags);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    DiskDumpHeader64 dh64;
+    DiskDumpHeader32 dh32;
+    KdumpSubHeader64 kh64;
+    KdumpSubHeader32 kh32;
+    uint32_t status, block_size, sub_hdr_size, bitmap_blocks;
+    uint64_t max_mapnr, note_offset, note_size;
+    uint64_t pfn, nr_pages = 0, nr_zero = 0, nr_compressed = 0, nr_compared = 0;
+    off_t offset_bitmap, offset_page, zero_offset = -1;
+    size_t len_bitmap;
+    uint8_t *bitmap1, *bitmap2, *data, *page, *ram_page;
+    struct stat st;
+    int is_64, ram_fd = -1;
+    off_t ram_size = 0;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s vmcore [guest-physical-memory]\n", argv[0]);
+        return 2;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    file_size = st.st_size;
+    if (argc == 3) {
+        ram_fd = open(argv[2], O_RDONLY);
+        if (ram_fd < 0 || fstat(ram_fd, &st) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        ram_size = st.st_size;
+    }
+
+    /* The header layout depends on the guest word size, which only the
+     * machine name tells */
+    read_at(&dh64, sizeof(dh64), 0);
+    if (memcmp(dh64.signature, KDUMP_SIGNATURE, SIG_LEN)) {
+        fail("bad signature");
+    }
+    is_64 = strcmp(dh64.utsname.machine, "i386") != 0;
+    if (is_64) {
+        status = dh64.status;
+        block_size = dh64.block_size;
+        sub_hdr_size = dh64.sub_hdr_size;
+        bitmap_blocks = dh64.bitmap_blocks;
+        if (dh64.header_version != KDUMP_HEADER_VERSION) {
+            fail("header version %u", dh64.header_version);
+        }
+    } else {
+        read_at(&dh32, sizeof(dh32), 0);
+        status = dh32.status;
+        block_size = dh32.block_size;
+        sub_hdr_size = dh32.sub_hdr_size;
+        bitmap_blocks = dh32.bitmap_blocks;
+        if (dh32.header_version != KDUMP_HEADER_VERSION) {
+            fail("header version %u", dh32.header_version);
+        }
+    }
+    if (block_size < 512 || (block_size & (block_size - 1))) {
+        fail("block size %u", block_size);
+    }
+    if (status != DUMP_DH_COMPRESSED_ZLIB && status != DUMP_DH_COMPRESSED_LZO &&
+        status != DUMP_DH_COMPRESSED_SNAPPY) {
+        fail("status %#x", status);
+    }
+    if (!bitmap_blocks || (bitmap_blocks & 1)) {
+        fail("%u bitmap blocks", bitmap_blocks);
+    }
+
+    if (is_64) {
+        read_at(&kh64, sizeof(kh64), DISKDUMP_HEADER_BLOCKS * block_size);
+        max_mapnr = kh64.max_mapnr_64;
+        note_offset = kh64.offset_note;
+        note_size = kh64.note_size;
+    } else {
+        read_at(&kh32, sizeof(kh32), DISKDUMP_HEADER_BLOCKS * block_size);
+        max_mapnr = kh32.max_mapnr_64;
+        note_offset = kh32.offset_note;
+        note_size = kh32.note_size;
+    }
+    if (note_offset < DISKDUMP_HEADER_BLOCKS * block_size ||
+        note_offset + note_size >
+        (uint64_t)(DISKDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size) {
+        fail("notes at %#llx+%#llx are outside the sub header",
+             (unsigned long long)note_offset, (unsigned long long)note_size);
+    }
+
+    len_bitmap = (size_t)bitmap_blocks / 2 * block_size;
+    if (max_mapnr > (uint64_t)len_bitmap * 8) {
+        fail("max_mapnr %llu does not fit in the bitmaps",
+             (unsigned long long)max_mapnr);
+    }
+    offset_bitmap = (off_t)(DISKDUMP_HEADER_BLOCKS + sub_hdr_size) * block_size;
+    bitmap1 = malloc(len_bitmap);
+    bitmap2 = malloc(len_bitmap);
+    read_at(bitmap1, len_bitmap, offset_bitmap);
+    read_at(bitmap2, len_bitmap, offset_bitmap + len_bitmap);
+    offset_page = offset_bitmap + 2 * len_bitmap;
+
+    data = malloc(block_size);
+    page = malloc(block_size);
+    ram_page = malloc(block_size);
+    for (pfn = 0; pfn < (uint64_t)len_bitmap * 8; pfn++) {
+        int in1 = bitmap1[pfn / 8] & (1 << (pfn % 8));
+        int in2 = bitmap2[pfn / 8] & (1 << (pfn % 8));
+        PageDescriptor pd;
+
+        if (!in2) {
+            continue;
+        }
+        if (!in1) {
+            fail("pfn %#llx is dumpable but not in memory",
+                 (unsigned long long)pfn);
+        }
+        if (pfn >= max_mapnr) {
+            fail("pfn %#llx is past max_mapnr", (unsigned long long)pfn);
+        }
+
+        read_at(&pd, sizeof(pd), offset_page + nr_pages * sizeof(pd));
+        nr_pages++;
+        if (pd.size == 0 || pd.size > block_size) {
+            fail("pfn %#llx: %u bytes of data", (unsigned long long)pfn,
+                 pd.size);
+        }
+        read_at(data, pd.size, pd.offset);
+        if (pd.flags) {
+            if (pd.flags != status) {
+                fail("pfn %#llx: flags %#x in a dump with status %#x",
+                     (unsigned long long)pfn, pd.flags, status);
+            }
+            if (!uncompress_page(pd.flags, data, pd.size, page, block_size)) {
+                fail("pfn %#llx does not decompress", (unsigned long long)pfn);
+            }
+            nr_compressed++;
+        } else {
+            if (pd.size != block_size) {
+                fail("pfn %#llx: raw page of %u bytes",
+                     (unsigned long long)pfn, pd.size);
+            }
+            memcpy(page, data, block_size);
+        }
+
+        /* zero pages share one copy of the data */
+        if (zero_offset < 0 && !pd.flags) {
+            uint32_t i;
+
+            for (i = 0; i < block_size && !page[i]; i++) {
+            }
+            if (i == block_size) {
+                zero_offset = pd.offset;
+            }
+        }
+        if (pd.offset == zero_offset) {
+            nr_zero++;
+        }
+
+        if ((off_t)((pfn + 1) * block_size) <= ram_size) {
+            if (pread(ram_fd, ram_page, block_size,
+                      (off_t)(pfn * block_size)) != (ssize_t)block_size) {
+                fail("short read from %s", argv[2]);
+            }
+            if (memcmp(ram_page, page, block_size)) {
+                fail("pfn %#llx differs from guest memory",
+                     (unsigned long long)pfn);
+            }
+            nr_compared++;
+        }
+    }
+
+    printf("%s: %s, %u byte pages, max_mapnr %llu, %llu pages dumped "
+           "(%llu zero, %llu compressed)",
+           argv[1], is_64 ? "64-bit" : "32-bit", block_size,
+           (unsigned long long)max_mapnr, (unsigned long long)nr_pages,
+           (unsigned long long)nr_zero, (unsigned long long)nr_compressed);
+    if (ram_fd >= 0) {
+        printf(", %llu compared", (unsigned long long)nr_compared);
+    }
+    printf("\n");
+    return 0;
+}
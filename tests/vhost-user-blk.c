@@ -0,0 +1,636 @@
+/*
+ * Reference vhost-user backend for virtio-blk
+ *
+ * Serves the request queue of a virtio-blk-pci device started with
+ * x-vhost-user=<socket> from a raw image file, in a separate process:
+ *
+ *   vhost-user-blk [-r] /tmp/vblk.sock disk.img &
+ *   qemu -mem-path /dev/hugepages -mem-prealloc \
+ *        -drive file=disk.img,if=none,id=d0,format=raw \
+ *        -device virtio-blk-pci,drive=d0,x-vhost-user=/tmp/vblk.sock
+ *
+ * qemu keeps serving config space from its own view of the drive, so the
+ * same image must be given to both.  Guest RAM must be shared (-mem-path
+ * with -mem-prealloc) for this process to map it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/vhost.h>
+#include <linux/virtio_ring.h>
+
+#include "vhost_user.h"
+
+/* from Linux's linux/virtio_blk.h, as in hw/virtio-blk.h */
+#define VIRTIO_BLK_F_WCACHE     9
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_BARRIER    0x80000000
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_F_NOTIFY_ON_EMPTY 24
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+#define LOG_PAGE        0x1000
+#define MAX_VRINGS      1
+#define MAX_IOV         1024
+
+#define smp_mb()        __sync_synchronize()
+
+typedef struct Region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint8_t *mmap_addr;
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} Region;
+
+typedef struct Vring {
+    unsigned int num;
+    uint16_t last_avail_idx;
+    VhostUserVringAddr addr;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    int kick_fd;
+    int call_fd;
+} Vring;
+
+typedef struct Backend {
+    int image_fd;
+    bool read_only;
+    uint64_t features;
+    int nregions;
+    Region regions[VHOST_USER_MEMORY_MAX_NREGIONS];
+    uint8_t *log;
+    uint64_t log_size;
+    Vring vrings[MAX_VRINGS];
+} Backend;
+
+static void *gpa_to_va(Backend *b, uint64_t addr, uint64_t len)
+{
+    int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        Region *r = &b->regions[i];
+        if (addr >= r->guest_phys_addr &&
+            addr - r->guest_phys_addr + len <= r->memory_size) {
+            return r->mmap_addr + r->mmap_offset +
+                (addr - r->guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+static void *uva_to_va(Backend *b, uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        Region *r = &b->regions[i];
+        if (addr >= r->userspace_addr &&
+            addr - r->userspace_addr < r->memory_size) {
+            return r->mmap_addr + r->mmap_offset +
+                (addr - r->userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+static void log_write(Backend *b, uint64_t addr, uint64_t len)
+{
+    uint64_t page;
+
+    if (!b->log || !(b->features & (1ULL << VHOST_F_LOG_ALL)) || !len) {
+        return;
+    }
+    for (page = addr / LOG_PAGE; page <= (addr + len - 1) / LOG_PAGE;
+         page++) {
+        if (page / 8 < b->log_size) {
+            __sync_fetch_and_or(&b->log[page / 8], 1 << (page % 8));
+        }
+    }
+}
+
+static void vring_translate(Backend *b, Vring *vq)
+{
+    vq->desc = uva_to_va(b, vq->addr.desc_user_addr);
+    vq->avail = uva_to_va(b, vq->addr.avail_user_addr);
+    vq->used = uva_to_va(b, vq->addr.used_user_addr);
+}
+
+static void vring_push(Backend *b, Vring *vq, unsigned int head,
+                       uint32_t len)
+{
+    uint16_t idx = vq->used->idx;
+    struct vring_used_elem *elem = &vq->used->ring[idx % vq->num];
+
+    elem->id = head;
+    elem->len = len;
+    smp_mb();
+    vq->used->idx = idx + 1;
+    if (vq->addr.flags & (1 << VHOST_VRING_F_LOG)) {
+        log_write(b, vq->addr.log_guest_addr +
+                  ((uint8_t *)elem - (uint8_t *)vq->used), sizeof *elem);
+        log_write(b, vq->addr.log_guest_addr +
+                  offsetof(struct vring_used, idx), sizeof vq->used->idx);
+    }
+}
+
+/* Copy len bytes from the start of iov, consuming them. */
+static size_t iov_pull(struct iovec *iov, int *cnt, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (*cnt && done < len) {
+        size_t n = len - done < iov->iov_len ? len - done : iov->iov_len;
+        memcpy((uint8_t *)buf + done, iov->iov_base, n);
+        done += n;
+        iov->iov_base = (uint8_t *)iov->iov_base + n;
+        iov->iov_len -= n;
+        if (!iov->iov_len) {
+            memmove(iov, iov + 1, --*cnt * sizeof *iov);
+        }
+    }
+    return done;
+}
+
+static uint8_t blk_request(Backend *b, struct iovec *out, int out_num,
+                           struct iovec *in, int in_num, uint32_t *len)
+{
+    struct virtio_blk_outhdr hdr;
+    struct iovec *status;
+    ssize_t r;
+
+    /* The status byte is the last byte of the last in buffer. */
+    if (iov_pull(out, &out_num, &hdr, sizeof hdr) != sizeof hdr ||
+        !in_num || !in[in_num - 1].iov_len) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+    status = &in[in_num - 1];
+    status->iov_len--;
+    if (!status->iov_len) {
+        in_num--;
+    }
+
+    switch (hdr.type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        r = preadv(b->image_fd, in, in_num, hdr.sector * 512);
+        if (r < 0) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        *len = r;
+        return VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_OUT:
+        if (b->read_only) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        r = pwritev(b->image_fd, out, out_num, hdr.sector * 512);
+        return r < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+    case VIRTIO_BLK_T_FLUSH:
+        return fdatasync(b->image_fd) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+    default:
+        return VIRTIO_BLK_S_UNSUPP;
+    }
+}
+
+static int vring_process_one(Backend *b, Vring *vq, unsigned int head)
+{
+    struct iovec out[MAX_IOV], in[MAX_IOV];
+    uint64_t in_addr[MAX_IOV];
+    int out_num = 0, in_num = 0, i;
+    unsigned int idx = head, steps = 0;
+    uint32_t len = 0, left;
+    uint64_t status_addr;
+    uint8_t *status_ptr;
+
+    do {
+        struct vring_desc *d;
+        void *va;
+
+        if (idx >= vq->num) {
+            fprintf(stderr, "vhost-user-blk: bad descriptor index\n");
+            return -1;
+        }
+        d = &vq->desc[idx];
+        va = gpa_to_va(b, d->addr, d->len);
+        if (!va || ++steps > vq->num || in_num == MAX_IOV ||
+            out_num == MAX_IOV) {
+            fprintf(stderr, "vhost-user-blk: bad descriptor chain\n");
+            return -1;
+        }
+        if (d->flags & VRING_DESC_F_WRITE) {
+            in_addr[in_num] = d->addr;
+            in[in_num].iov_base = va;
+            in[in_num++].iov_len = d->len;
+        } else {
+            out[out_num].iov_base = va;
+            out[out_num++].iov_len = d->len;
+        }
+        idx = d->next;
+        if (!(d->flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+    } while (1);
+
+    if (!in_num || !in[in_num - 1].iov_len) {
+        fprintf(stderr, "vhost-user-blk: request without status byte\n");
+        return -1;
+    }
+    status_ptr = (uint8_t *)in[in_num - 1].iov_base +
+        in[in_num - 1].iov_len - 1;
+    status_addr = in_addr[in_num - 1] + in[in_num - 1].iov_len - 1;
+    *status_ptr = blk_request(b, out, out_num, in, in_num, &len);
+
+    /* Log what the guest can see changed: read data and the status. */
+    for (i = 0, left = len; i < in_num && left; i++) {
+        uint32_t n = left < in[i].iov_len ? left : in[i].iov_len;
+        log_write(b, in_addr[i], n);
+        left -= n;
+    }
+    log_write(b, status_addr, 1);
+
+    vring_push(b, vq, head, len + 1);
+    return 0;
+}
+
+static void vring_process(Backend *b, Vring *vq)
+{
+    bool done = false;
+
+    if (!vq->desc || !vq->avail || !vq->used) {
+        return;
+    }
+    while (vq->last_avail_idx != vq->avail->idx) {
+        unsigned int head;
+
+        smp_mb();
+        head = vq->avail->ring[vq->last_avail_idx % vq->num];
+        if (head >= vq->num || vring_process_one(b, vq, head) < 0) {
+            break;
+        }
+        vq->last_avail_idx++;
+        done = true;
+    }
+    smp_mb();
+    if (done && vq->call_fd >= 0 &&
+        (!(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT) ||
+         (b->features & (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY)))) {
+        uint64_t one = 1;
+        if (write(vq->call_fd, &one, sizeof one) < 0) {
+            perror("vhost-user-blk: call");
+        }
+    }
+}
+
+static void unmap_regions(Backend *b)
+{
+    int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        munmap(b->regions[i].mmap_addr, b->regions[i].mmap_size);
+    }
+    b->nregions = 0;
+}
+
+static int set_mem_table(Backend *b, VhostUserMemory *mem, int *fds,
+                         int fd_num)
+{
+    int i;
+
+    unmap_regions(b);
+    for (i = 0; i < mem->nregions && i < fd_num; i++) {
+        Region *r = &b->regions[i];
+        r->guest_phys_addr = mem->regions[i].guest_phys_addr;
+        r->memory_size = mem->regions[i].memory_size;
+        r->userspace_addr = mem->regions[i].userspace_addr;
+        r->mmap_offset = mem->regions[i].mmap_offset;
+        /* The offset need not be aligned to the fd's page size, so map
+         * from the start of the file. */
+        r->mmap_size = r->mmap_offset + r->memory_size;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[i], 0);
+        if (r->mmap_addr == MAP_FAILED) {
+            perror("vhost-user-blk: mmap guest memory");
+            b->nregions = i;
+            return -errno;
+        }
+        b->nregions = i + 1;
+    }
+    for (i = 0; i < MAX_VRINGS; i++) {
+        vring_translate(b, &b->vrings[i]);
+    }
+    return 0;
+}
+
+static int set_log_base(Backend *b, VhostUserLog *log, int *fds, int fd_num)
+{
+    if (b->log) {
+        munmap(b->log, b->log_size);
+        b->log = NULL;
+        b->log_size = 0;
+    }
+    if (!fd_num || !log->size) {
+        return 0;
+    }
+    b->log = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fds[0], log->offset);
+    if (b->log == MAP_FAILED) {
+        b->log = NULL;
+        return -errno;
+    }
+    b->log_size = log->size;
+    return 0;
+}
+
+static void close_fds(int *fds, int fd_num)
+{
+    while (fd_num--) {
+        close(fds[fd_num]);
+    }
+}
+
+static int read_msg(int sock, VhostUserMsg *msg, int *fds, int *fd_num)
+{
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MEMORY_MAX_NREGIONS)];
+    struct iovec iov = { msg, VHOST_USER_HDR_SIZE };
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control,
+    };
+    struct cmsghdr *cmsg;
+    size_t got;
+    ssize_t r;
+
+    *fd_num = 0;
+    r = recvmsg(sock, &msgh, MSG_WAITALL);
+    if (r != VHOST_USER_HDR_SIZE) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg;
+         cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_num * sizeof(int));
+        }
+    }
+    if (msg->size > sizeof msg->payload) {
+        close_fds(fds, *fd_num);
+        return -1;
+    }
+    for (got = 0; got < msg->size; got += r) {
+        r = read(sock, (uint8_t *)&msg->payload + got, msg->size - got);
+        if (r <= 0) {
+            close_fds(fds, *fd_num);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int reply(int sock, VhostUserMsg *msg, size_t size)
+{
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+    msg->size = size;
+    size += VHOST_USER_HDR_SIZE;
+    return write(sock, msg, size) == size ? 0 : -1;
+}
+
+static int reply_u64(int sock, VhostUserMsg *msg, uint64_t val)
+{
+    msg->payload.u64 = val;
+    return reply(sock, msg, sizeof msg->payload.u64);
+}
+
+static int handle_msg(Backend *b, int sock)
+{
+    VhostUserMsg msg;
+    int fds[VHOST_USER_MEMORY_MAX_NREGIONS];
+    int fd_num;
+    Vring *vq;
+    unsigned int index;
+
+    if (read_msg(sock, &msg, fds, &fd_num) < 0) {
+        return -1;
+    }
+    if ((msg.flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION) {
+        fprintf(stderr, "vhost-user-blk: bad version 0x%x\n", msg.flags);
+        close_fds(fds, fd_num);
+        return -1;
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        return reply_u64(sock, &msg, (1ULL << VIRTIO_BLK_F_WCACHE) |
+                         (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) |
+                         (1ULL << VHOST_F_LOG_ALL));
+    case VHOST_USER_SET_FEATURES:
+        b->features = msg.payload.u64;
+        return 0;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        return 0;
+    case VHOST_USER_SET_MEM_TABLE: {
+        int r = set_mem_table(b, &msg.payload.memory, fds, fd_num);
+        close_fds(fds, fd_num);
+        return reply_u64(sock, &msg, r);
+    }
+    case VHOST_USER_SET_LOG_BASE: {
+        int r = set_log_base(b, &msg.payload.log, fds, fd_num);
+        close_fds(fds, fd_num);
+        return reply_u64(sock, &msg, r);
+    }
+    default:
+        break;
+    }
+
+    /* Per-ring requests */
+    if (msg.request == VHOST_USER_SET_VRING_KICK ||
+        msg.request == VHOST_USER_SET_VRING_CALL) {
+        index = msg.payload.u64 & VHOST_USER_VRING_IDX_MASK;
+    } else {
+        index = msg.payload.state.index;
+    }
+    if (index >= MAX_VRINGS) {
+        fprintf(stderr, "vhost-user-blk: bad ring %u\n", index);
+        close_fds(fds, fd_num);
+        return -1;
+    }
+    vq = &b->vrings[index];
+
+    switch (msg.request) {
+    case VHOST_USER_SET_VRING_NUM:
+        vq->num = msg.payload.state.num;
+        return 0;
+    case VHOST_USER_SET_VRING_BASE:
+        vq->last_avail_idx = msg.payload.state.num;
+        return 0;
+    case VHOST_USER_SET_VRING_ADDR:
+        vq->addr = msg.payload.addr;
+        vring_translate(b, vq);
+        return 0;
+    case VHOST_USER_GET_VRING_BASE:
+        /* Stop the ring; qemu takes over from last_avail_idx. */
+        if (vq->kick_fd >= 0) {
+            close(vq->kick_fd);
+            vq->kick_fd = -1;
+        }
+        msg.payload.state.num = vq->last_avail_idx;
+        return reply(sock, &msg, sizeof msg.payload.state);
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL: {
+        int *fdp = msg.request == VHOST_USER_SET_VRING_KICK ?
+            &vq->kick_fd : &vq->call_fd;
+        if (*fdp >= 0) {
+            close(*fdp);
+        }
+        *fdp = (msg.payload.u64 & VHOST_USER_VRING_NOFD) || !fd_num ?
+            -1 : fds[0];
+        if (msg.request == VHOST_USER_SET_VRING_KICK && *fdp >= 0) {
+            /* Requests may have been queued before we took over. */
+            vring_process(b, vq);
+        }
+        return 0;
+    }
+    default:
+        fprintf(stderr, "vhost-user-blk: unknown request %u\n", msg.request);
+        close_fds(fds, fd_num);
+        return -1;
+    }
+}
+
+static void reset(Backend *b)
+{
+    int i;
+
+    unmap_regions(b);
+    set_log_base(b, NULL, NULL, 0);
+    for (i = 0; i < MAX_VRINGS; i++) {
+        Vring *vq = &b->vrings[i];
+        if (vq->kick_fd >= 0) {
+            close(vq->kick_fd);
+        }
+        if (vq->call_fd >= 0) {
+            close(vq->call_fd);
+        }
+        memset(vq, 0, sizeof *vq);
+        vq->kick_fd = vq->call_fd = -1;
+    }
+    b->features = 0;
+}
+
+static void serve(Backend *b, int sock)
+{
+    struct pollfd pfd[1 + MAX_VRINGS];
+    uint64_t val;
+    int i;
+
+    for (;;) {
+        pfd[0].fd = sock;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < MAX_VRINGS; i++) {
+            pfd[1 + i].fd = b->vrings[i].kick_fd;
+            pfd[1 + i].events = POLLIN;
+        }
+        if (poll(pfd, 1 + MAX_VRINGS, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (handle_msg(b, sock) < 0) {
+                break;
+            }
+            /* The message may have replaced the kick fds. */
+            continue;
+        }
+        for (i = 0; i < MAX_VRINGS; i++) {
+            if (pfd[1 + i].revents & POLLIN) {
+                if (read(pfd[1 + i].fd, &val, sizeof val) < 0 &&
+                    errno != EAGAIN) {
+                    perror("vhost-user-blk: kick");
+                }
+                vring_process(b, &b->vrings[i]);
+            }
+        }
+    }
+    reset(b);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un un;
+    Backend b;
+    int listen_fd, sock, argi = 1;
+
+    memset(&b, 0, sizeof b);
+    if (argc > 1 && !strcmp(argv[1], "-r")) {
+        b.read_only = true;
+        argi++;
+    }
+    if (argc - argi != 2) {
+        fprintf(stderr, "usage: %s [-r] socket-path image\n", argv[0]);
+        return 1;
+    }
+
+    b.image_fd = open(argv[argi + 1], b.read_only ? O_RDONLY : O_RDWR);
+    if (b.image_fd < 0) {
+        perror(argv[argi + 1]);
+        return 1;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&un, 0, sizeof un);
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof un.sun_path, "%s", argv[argi]);
+    unlink(un.sun_path);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&un, sizeof un) < 0 ||
+        listen(listen_fd, 1) < 0) {
+        perror(argv[argi]);
+        return 1;
+    }
+
+    b.vrings[0].kick_fd = b.vrings[0].call_fd = -1;
+    reset(&b);
+    for (;;) {
+        sock = accept(listen_fd, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+        serve(&b, sock);
+        close(sock);
+    }
+    return 0;
+}
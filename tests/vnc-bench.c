@@ -0,0 +1,839 @@
+/*
+ * VNC encoder benchmark
+ *
+ * Replays a sequence of frames through the raw, zlib, tight and ZRLE
+ * encoders and reports the bytes sent and the CPU time spent per frame.
+ * Frames are PPM images as written by the monitor's screendump command,
+ * e.g. recorded from a running guest with
+ *
+ *   for i in $(seq 100); do echo "screendump /tmp/f$i.ppm"; sleep 0.1; done |
+ *       socat - UNIX-CONNECT:/tmp/mon.sock
+ *   vnc-bench /tmp/f*.ppm
+ *
+ * Without arguments a synthetic desktop is used: a scrolling terminal, a
+ * video window and a static gradient.  Like vnc_update_client(), each frame
+ * only sends the 16x16 blocks that differ from the previous one.  The "auto"
+ * row is a client that supports both tight and ZRLE, for which
+ * vnc_select_encoding() picks one per rectangle.
+ *
+ * The output of the lossless encoders is decoded as a client would and
+ * must reproduce every frame exactly.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "vnc.h"
+
+#define BLOCK   16
+
+typedef struct Frame {
+    int width, height;
+    uint32_t *data;             /* xRGB */
+} Frame;
+
+typedef struct Encoder {
+    const char *name;
+    int encoding;
+    int quality;
+    VncState *vs;
+    z_stream zlib;              /* for plain zlib */
+    Buffer raw, out;
+    uint64_t bytes;
+    uint64_t rects;
+    int64_t cpu_ns;
+    /* client side */
+    uint32_t *fb;
+    z_stream zlib_in, tight_in[4], zrle_in;
+    Buffer inflated;
+} Encoder;
+
+/* Reads a frame's worth of encoder output */
+typedef struct Reader {
+    const uint8_t *p, *end;
+    const char *name;
+} Reader;
+
+static VncDisplay display;
+static DisplaySurface server;
+
+/* The parts of vnc.c the encoders use */
+
+void *qemu_malloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void *qemu_mallocz(size_t size)
+{
+    void *p = qemu_malloc(size);
+
+    memset(p, 0, size);
+    return p;
+}
+
+void *qemu_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size ? size : 1);
+
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void qemu_free(void *ptr)
+{
+    free(ptr);
+}
+
+void buffer_reserve(Buffer *buffer, size_t len)
+{
+    if ((buffer->capacity - buffer->offset) < len) {
+        buffer->capacity += (len + 1024);
+        buffer->buffer = qemu_realloc(buffer->buffer, buffer->capacity);
+    }
+}
+
+void buffer_reset(Buffer *buffer)
+{
+    buffer->offset = 0;
+}
+
+void buffer_append(Buffer *buffer, const void *data, size_t len)
+{
+    memcpy(buffer->buffer + buffer->offset, data, len);
+    buffer->offset += len;
+}
+
+void vnc_write(VncState *vs, const void *data, size_t len)
+{
+    buffer_reserve(&vs->output, len);
+    buffer_append(&vs->output, data, len);
+}
+
+void vnc_write_u32(VncState *vs, uint32_t value)
+{
+    uint8_t buf[4] = { value >> 24, value >> 16, value >> 8, value };
+
+    vnc_write(vs, buf, 4);
+}
+
+void vnc_write_u16(VncState *vs, uint16_t value)
+{
+    uint8_t buf[2] = { value >> 8, value };
+
+    vnc_write(vs, buf, 2);
+}
+
+void vnc_write_u8(VncState *vs, uint8_t value)
+{
+    vnc_write(vs, &value, 1);
+}
+
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding)
+{
+    vnc_write_u16(vs, x);
+    vnc_write_u16(vs, y);
+    vnc_write_u16(vs, w);
+    vnc_write_u16(vs, h);
+    vnc_write_u32(vs, encoding);
+}
+
+/* Client and server formats are the same here */
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
+{
+    memcpy(buf, &v, 4);
+}
+
+void vnc_client_error(VncState *vs)
+{
+    fprintf(stderr, "vnc-bench: encoder error\n");
+    exit(1);
+}
+
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
+{
+}
+
+static int64_t cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void set_format(PixelFormat *pf)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->bits_per_pixel = 32;
+    pf->bytes_per_pixel = 4;
+    pf->depth = 24;
+    pf->rmask = 0xff0000;
+    pf->gmask = 0x00ff00;
+    pf->bmask = 0x0000ff;
+    pf->rshift = 16;
+    pf->gshift = 8;
+    pf->bshift = 0;
+    pf->rmax = pf->gmax = pf->bmax = 255;
+    pf->rbits = pf->gbits = pf->bbits = 8;
+}
+
+static int read_ppm(const char *filename, Frame *f)
+{
+    FILE *file = fopen(filename, "rb");
+    int maxval, i;
+    uint8_t *rgb;
+
+    if (!file) {
+        perror(filename);
+        return -1;
+    }
+    if (fscanf(file, "P6 %d %d %d", &f->width, &f->height, &maxval) != 3 ||
+        maxval != 255 || fgetc(file) == EOF) {
+        fprintf(stderr, "%s: not a PPM file\n", filename);
+        fclose(file);
+        return -1;
+    }
+    rgb = qemu_malloc(f->width * f->height * 3);
+    if (fread(rgb, 3, f->width * f->height, file) != f->width * f->height) {
+        fprintf(stderr, "%s: short file\n", filename);
+        fclose(file);
+        qemu_free(rgb);
+        return -1;
+    }
+    fclose(file);
+
+    f->data = qemu_malloc(f->width * f->height * 4);
+    for (i = 0; i < f->width * f->height; i++) {
+        f->data[i] = rgb[i * 3] << 16 | rgb[i * 3 + 1] << 8 | rgb[i * 3 + 2];
+    }
+    qemu_free(rgb);
+    return 0;
+}
+
+/* Synthetic desktop: gradient title bar, terminal scrolling a line per
+ * frame and a 320x240 video */
+static void synth_frame(Frame *f, int width, int height, int n)
+{
+    int tx = 32, ty = 64, tw = MIN(640, width - 64), th = MIN(400, height - 96);
+    int vx = width - 352, vy = height - 272;
+    int x, y;
+
+    f->width = width;
+    f->height = height;
+    f->data = qemu_malloc(width * height * 4);
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t v = 0x3a6ea5;
+
+            if (y < 24) {
+                v = (x * 255 / width) << 16 | 0x20 << 8 | (255 - y * 4);
+            } else if (x >= tx && x < tx + tw && y >= ty && y < ty + th) {
+                int row = (y - ty) / 16 + n, col = (x - tx) / 8;
+                uint32_t h = (row * 7919 + col * 104729) * 2654435761U;
+
+                /* a glyph is a random 6x12 bit pattern in an 8x16 cell;
+                 * some cells are blank as between words */
+                v = 0xffffff;
+                if ((h >> 28) > 2 && (x - tx) % 8 < 6 && (y - ty) % 16 >= 2 &&
+                    (y - ty) % 16 < 14 &&
+                    ((h >> (((y - ty) % 16) + (x - tx) % 8)) & 1)) {
+                    v = 0x000000;
+                }
+            } else if (x >= vx && x < vx + 320 && y >= vy && y < vy + 240) {
+                double fx = (x - vx) / 32.0, fy = (y - vy) / 24.0, t = n / 8.0;
+                int r = 128 + 127 * sin(fx + t);
+                int g = 128 + 127 * sin(fy - t);
+                int b = 128 + 127 * sin((fx + fy) / 2 + t * 1.5);
+
+                v = r << 16 | g << 8 | b;
+            }
+            f->data[y * width + x] = v;
+        }
+    }
+}
+
+static void send_raw(Encoder *e, int x, int y, int w, int h)
+{
+    VncState *vs = e->vs;
+    int dy;
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_RAW);
+    for (dy = 0; dy < h; dy++) {
+        vnc_write(vs, server.data + (y + dy) * server.linesize + x * 4, w * 4);
+    }
+}
+
+/* As send_framebuffer_update_zlib(): raw data through one zlib stream */
+static void send_zlib(Encoder *e, int x, int y, int w, int h)
+{
+    VncState *vs = e->vs;
+    size_t len = w * h * 4;
+    int dy;
+
+    buffer_reset(&e->raw);
+    buffer_reserve(&e->raw, len);
+    for (dy = 0; dy < h; dy++) {
+        buffer_append(&e->raw, server.data + (y + dy) * server.linesize + x * 4,
+                      w * 4);
+    }
+
+    buffer_reset(&e->out);
+    buffer_reserve(&e->out, len + len / 100 + 64);
+    e->zlib.next_in = e->raw.buffer;
+    e->zlib.avail_in = len;
+    e->zlib.next_out = e->out.buffer;
+    e->zlib.avail_out = e->out.capacity;
+    deflate(&e->zlib, Z_SYNC_FLUSH);
+    e->out.offset = e->out.capacity - e->zlib.avail_out;
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_ZLIB);
+    vnc_write_u32(vs, e->out.offset);
+    vnc_write(vs, e->out.buffer, e->out.offset);
+}
+
+static void check_fail(Reader *r, const char *what)
+{
+    fprintf(stderr, "vnc-bench: %s: bad output: %s\n", r->name, what);
+    exit(1);
+}
+
+static const uint8_t *get_bytes(Reader *r, size_t len)
+{
+    const uint8_t *p = r->p;
+
+    if (len > r->end - r->p) {
+        check_fail(r, "truncated");
+    }
+    r->p += len;
+    return p;
+}
+
+static uint8_t get_u8(Reader *r)
+{
+    return *get_bytes(r, 1);
+}
+
+static uint16_t get_u16(Reader *r)
+{
+    const uint8_t *p = get_bytes(r, 2);
+
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t get_u32(Reader *r)
+{
+    const uint8_t *p = get_bytes(r, 4);
+
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Inflate @len input bytes through @zs into @out, which must fill exactly
+ * @size bytes, or all that the input holds if @size is 0 */
+static void get_inflate(Reader *r, z_stream *zs, size_t len, Buffer *out,
+                         size_t size)
+{
+    zs->next_in = (uint8_t *)get_bytes(r, len);
+    zs->avail_in = len;
+    buffer_reset(out);
+    do {
+        int ret;
+
+        buffer_reserve(out, size ? size : len * 4 + 4096);
+        zs->next_out = out->buffer + out->offset;
+        zs->avail_out = size ? size : out->capacity - out->offset;
+        ret = inflate(zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            check_fail(r, "corrupt zlib data");
+        }
+        out->offset = zs->next_out - out->buffer;
+    } while (!size && zs->avail_in);
+    if (zs->avail_in || (size && out->offset != size)) {
+        check_fail(r, "zlib data of the wrong size");
+    }
+}
+
+static void decode_tight(Encoder *e, Reader *r, int x, int y, int w, int h)
+{
+    uint32_t *fb = e->fb + y * server.width + x;
+    uint32_t palette[256];
+    uint8_t ctl = get_u8(r), filter = VNC_TIGHT_FILTER_COPY;
+    const uint8_t *data;
+    size_t len;
+    int i, n = 0, dx, dy, c;
+
+    for (i = 0; i < 4; i++) {
+        if (ctl & (1 << i)) {
+            inflateReset(&e->tight_in[i]);
+        }
+    }
+    ctl &= VNC_TIGHT_CCB_TYPE_MASK;
+    if (ctl == VNC_TIGHT_CCB_TYPE_FILL) {
+        data = get_bytes(r, 3);
+        for (dy = 0; dy < h; dy++) {
+            for (dx = 0; dx < w; dx++) {
+                fb[dy * server.width + dx] =
+                    data[0] << 16 | data[1] << 8 | data[2];
+            }
+        }
+        return;
+    }
+    if (ctl > VNC_TIGHT_CCB_BASIC_MAX) {
+        check_fail(r, "unexpected tight compression type");
+    }
+
+    if (ctl & VNC_TIGHT_CCB_BASIC_FILTER) {
+        filter = get_u8(r);
+    }
+    switch (filter) {
+    case VNC_TIGHT_FILTER_PALETTE:
+        n = get_u8(r) + 1;
+        data = get_bytes(r, n * 3);
+        for (i = 0; i < n; i++) {
+            palette[i] = data[i * 3] << 16 | data[i * 3 + 1] << 8 |
+                         data[i * 3 + 2];
+        }
+        len = n == 2 ? (w + 7) / 8 * h : w * h;
+        break;
+    case VNC_TIGHT_FILTER_COPY:
+    case VNC_TIGHT_FILTER_GRADIENT:
+        len = w * h * 3;
+        break;
+    default:
+        check_fail(r, "unknown tight filter");
+    }
+
+    if (len < VNC_TIGHT_MIN_TO_COMPRESS) {
+        data = get_bytes(r, len);
+    } else {
+        size_t zlen = get_u8(r);
+
+        if (zlen & 0x80) {
+            zlen = (zlen & 0x7f) | get_u8(r) << 7;
+            if (zlen & (0x80 << 7)) {
+                zlen = (zlen & 0x3fff) | get_u8(r) << 14;
+            }
+        }
+        get_inflate(r, &e->tight_in[(ctl >> 4) & 3], zlen, &e->inflated,
+                     len);
+        data = e->inflated.buffer;
+    }
+
+    for (dy = 0; dy < h; dy++) {
+        uint32_t *row = fb + dy * server.width;
+
+        for (dx = 0; dx < w; dx++) {
+            const uint8_t *p = data + (dy * w + dx) * 3;
+            int idx;
+
+            switch (filter) {
+            case VNC_TIGHT_FILTER_PALETTE:
+                if (n == 2) {
+                    idx = (data[dy * ((w + 7) / 8) + dx / 8] >>
+                           (7 - dx % 8)) & 1;
+                } else {
+                    idx = data[dy * w + dx];
+                }
+                if (idx >= n) {
+                    check_fail(r, "tight palette index out of range");
+                }
+                row[dx] = palette[idx];
+                break;
+            case VNC_TIGHT_FILTER_GRADIENT: {
+                uint32_t v = 0;
+
+                for (c = 0; c < 3; c++) {
+                    int shift = 16 - c * 8;
+                    int left = dx ? (row[dx - 1] >> shift) & 0xff : 0;
+                    int above = dy ? (row[dx - server.width] >> shift) & 0xff
+                                   : 0;
+                    int upleft = dx && dy ?
+                        (row[dx - 1 - server.width] >> shift) & 0xff : 0;
+                    int pred = MIN(MAX(left + above - upleft, 0), 255);
+
+                    v |= ((pred + p[c]) & 0xff) << shift;
+                }
+                row[dx] = v;
+                break;
+            }
+            default:
+                row[dx] = p[0] << 16 | p[1] << 8 | p[2];
+            }
+        }
+    }
+}
+
+/* ZRLE CPIXELs are the low three bytes of the (little endian) pixel */
+static uint32_t get_cpixel(Reader *r)
+{
+    const uint8_t *p = get_bytes(r, 3);
+
+    return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static int get_run(Reader *r)
+{
+    int len = 1, b;
+
+    do {
+        b = get_u8(r);
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+static void decode_zrle(Encoder *e, Reader *r, int x, int y, int w, int h)
+{
+    uint32_t palette[128];
+    Reader tiles;
+    int tx, ty, i, n;
+
+    get_inflate(r, &e->zrle_in, get_u32(r), &e->inflated, 0);
+    tiles.p = e->inflated.buffer;
+    tiles.end = e->inflated.buffer + e->inflated.offset;
+    tiles.name = r->name;
+
+    for (ty = 0; ty < h; ty += VNC_ZRLE_TILE) {
+        int th = MIN(VNC_ZRLE_TILE, h - ty);
+
+        for (tx = 0; tx < w; tx += VNC_ZRLE_TILE) {
+            int tw = MIN(VNC_ZRLE_TILE, w - tx);
+            uint32_t *fb = e->fb + (y + ty) * server.width + x + tx;
+            uint8_t sub = get_u8(&tiles);
+            int dx, dy;
+
+            n = sub & 127;
+            for (i = 0; i < n; i++) {
+                palette[i] = get_cpixel(&tiles);
+            }
+            if (sub == 0 || sub == 1 || (sub >= 2 && sub <= 16)) {
+                int bits = n <= 2 ? 1 : n <= 4 ? 2 : 4;
+
+                for (dy = 0; dy < th; dy++) {
+                    const uint8_t *p = NULL;
+
+                    if (sub >= 2) {
+                        p = get_bytes(&tiles, (tw * bits + 7) / 8);
+                    }
+                    for (dx = 0; dx < tw; dx++) {
+                        uint32_t v;
+
+                        if (sub == 0) {
+                            v = get_cpixel(&tiles);
+                        } else if (sub == 1) {
+                            v = palette[0];
+                        } else {
+                            int idx = (p[dx * bits / 8] >>
+                                       (8 - bits - dx * bits % 8)) &
+                                      ((1 << bits) - 1);
+
+                            if (idx >= n) {
+                                check_fail(r, "ZRLE palette index out of "
+                                           "range");
+                            }
+                            v = palette[idx];
+                        }
+                        fb[dy * server.width + dx] = v;
+                    }
+                }
+            } else if (sub == 128 || sub >= 130) {
+                for (i = 0; i < tw * th; ) {
+                    uint32_t v;
+                    int len = 1;
+
+                    if (sub == 128) {
+                        v = get_cpixel(&tiles);
+                        len = get_run(&tiles);
+                    } else {
+                        int idx = get_u8(&tiles);
+
+                        if (idx & 128) {
+                            len = get_run(&tiles);
+                        }
+                        if ((idx & 127) >= n) {
+                            check_fail(r, "ZRLE palette index out of range");
+                        }
+                        v = palette[idx & 127];
+                    }
+                    if (len > tw * th - i) {
+                        check_fail(r, "ZRLE run past the end of the tile");
+                    }
+                    for (; len; len--, i++) {
+                        fb[i / tw * server.width + i % tw] = v;
+                    }
+                }
+            } else {
+                check_fail(r, "unknown ZRLE subencoding");
+            }
+        }
+    }
+    if (tiles.p != tiles.end) {
+        check_fail(r, "trailing ZRLE data");
+    }
+}
+
+/* Apply the output of a frame to the client's framebuffer, which must then
+ * match the frame */
+static void decode_frame(Encoder *e, const Frame *cur)
+{
+    Reader r;
+    int dy;
+
+    r.p = e->vs->output.buffer;
+    r.end = e->vs->output.buffer + e->vs->output.offset;
+    r.name = e->name;
+    while (r.p < r.end) {
+        int x = get_u16(&r), y = get_u16(&r);
+        int w = get_u16(&r), h = get_u16(&r);
+        int32_t encoding = get_u32(&r);
+        const uint8_t *p;
+
+        if (x + w > server.width || y + h > server.height) {
+            check_fail(&r, "rectangle outside the screen");
+        }
+        switch (encoding) {
+        case VNC_ENCODING_RAW:
+            p = get_bytes(&r, w * h * 4);
+            for (dy = 0; dy < h; dy++) {
+                memcpy(e->fb + (y + dy) * server.width + x, p + dy * w * 4,
+                       w * 4);
+            }
+            break;
+        case VNC_ENCODING_ZLIB:
+            get_inflate(&r, &e->zlib_in, get_u32(&r), &e->inflated,
+                         w * h * 4);
+            for (dy = 0; dy < h; dy++) {
+                memcpy(e->fb + (y + dy) * server.width + x,
+                       e->inflated.buffer + dy * w * 4, w * 4);
+            }
+            break;
+        case VNC_ENCODING_TIGHT:
+            decode_tight(e, &r, x, y, w, h);
+            break;
+        case VNC_ENCODING_ZRLE:
+            decode_zrle(e, &r, x, y, w, h);
+            break;
+        default:
+            check_fail(&r, "unexpected encoding");
+        }
+    }
+
+    if (memcmp(e->fb, cur->data, server.width * server.height * 4)) {
+        fprintf(stderr, "vnc-bench: %s: decoded frame differs\n", e->name);
+        exit(1);
+    }
+}
+
+static void encode_rect(Encoder *e, int x, int y, int w, int h)
+{
+    switch (vnc_select_encoding(e->vs, x, y, w, h)) {
+    case VNC_ENCODING_RAW:
+        send_raw(e, x, y, w, h);
+        e->rects++;
+        break;
+    case VNC_ENCODING_ZLIB:
+        send_zlib(e, x, y, w, h);
+        e->rects++;
+        break;
+    case VNC_ENCODING_TIGHT:
+        e->rects += vnc_tight_send_framebuffer_update(e->vs, x, y, w, h);
+        break;
+    case VNC_ENCODING_ZRLE:
+        e->rects += vnc_zrle_send_framebuffer_update(e->vs, x, y, w, h);
+        break;
+    }
+}
+
+/* Send the blocks that changed from @prev (NULL for a full update) */
+static void encode_frame(Encoder *e, const Frame *prev, const Frame *cur)
+{
+    int64_t start = cpu_now();
+    int bx, by, nbx = (cur->width + BLOCK - 1) / BLOCK;
+
+    for (by = 0; by < cur->height; by += BLOCK) {
+        int h = MIN(BLOCK, cur->height - by);
+        int run = -1;
+
+        for (bx = 0; bx <= nbx; bx++) {
+            bool dirty = false;
+            int dy;
+
+            if (bx < nbx) {
+                int x = bx * BLOCK, w = MIN(BLOCK, cur->width - x);
+
+                dirty = !prev;
+                for (dy = 0; dy < h && !dirty; dy++) {
+                    int off = (by + dy) * cur->width + x;
+
+                    dirty = memcmp(prev->data + off, cur->data + off, w * 4);
+                }
+            }
+            if (dirty && run < 0) {
+                run = bx;
+            } else if (!dirty && run >= 0) {
+                int x = run * BLOCK;
+
+                encode_rect(e, x, by, MIN(bx * BLOCK, cur->width) - x, h);
+                run = -1;
+            }
+        }
+    }
+
+    e->cpu_ns += cpu_now() - start;
+    e->bytes += e->vs->output.offset;
+    if (e->fb) {
+        decode_frame(e, cur);
+    }
+    buffer_reset(&e->vs->output);
+}
+
+/* @features are the client's VNC_FEATURE_*_MASK bits that matter to
+ * vnc_select_encoding() */
+static void encoder_init(Encoder *e, const char *name, int encoding,
+                         uint32_t features, int compression, int quality)
+{
+    VncState *vs = qemu_mallocz(sizeof(*vs));
+    int i;
+
+    set_format(&vs->clientds.pf);
+    vs->vd = &display;
+    vs->vnc_encoding = encoding;
+    vs->features = features;
+    vs->tight_compression = compression;
+    vs->tight_quality = quality;
+
+    memset(e, 0, sizeof(*e));
+    e->name = name;
+    e->encoding = encoding;
+    e->quality = quality;
+    e->vs = vs;
+    if (encoding == VNC_ENCODING_ZLIB) {
+        deflateInit(&e->zlib, compression);
+    }
+
+    /* JPEG is lossy, everything else must decode to the frame */
+    if (quality < 0) {
+        e->fb = qemu_mallocz(server.width * server.height * 4);
+        inflateInit(&e->zlib_in);
+        inflateInit(&e->zrle_in);
+        for (i = 0; i < ARRAY_SIZE(e->tight_in); i++) {
+            inflateInit(&e->tight_in[i]);
+        }
+    }
+}
+
+static void usage(void)
+{
+    printf("Usage: vnc-bench [-c level] [-q quality] [-n frames] "
+           "[-s WxH] [frame.ppm...]\n"
+           "  -c level    zlib/tight/ZRLE compression level 0-9 (default 6)\n"
+           "  -q quality  tight JPEG quality level 0-9 (default 7)\n"
+           "  -n frames   number of synthetic frames (default 100)\n"
+           "  -s WxH      size of synthetic frames (default 1024x768)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int compression = 6, quality = 7, nframes = 100;
+    int width = 1024, height = 768;
+    Encoder enc[6];
+    int nenc = 0, i, j, c;
+    Frame *frames;
+
+    while ((c = getopt(argc, argv, "c:q:n:s:h")) != -1) {
+        switch (c) {
+        case 'c':
+            compression = MIN(MAX(atoi(optarg), 0), 9);
+            break;
+        case 'q':
+            quality = MIN(MAX(atoi(optarg), 0), 9);
+            break;
+        case 'n':
+            nframes = MAX(atoi(optarg), 1);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 ||
+                width < 400 || height < 300) {
+                fprintf(stderr, "vnc-bench: bad size %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind < argc) {
+        nframes = argc - optind;
+        frames = qemu_malloc(nframes * sizeof(*frames));
+        for (i = 0; i < nframes; i++) {
+            if (read_ppm(argv[optind + i], &frames[i]) < 0) {
+                return 1;
+            }
+            if (frames[i].width != frames[0].width ||
+                frames[i].height != frames[0].height) {
+                fprintf(stderr, "%s: size differs from the first frame\n",
+                        argv[optind + i]);
+                return 1;
+            }
+        }
+    } else {
+        frames = qemu_malloc(nframes * sizeof(*frames));
+        for (i = 0; i < nframes; i++) {
+            synth_frame(&frames[i], width, height, i);
+        }
+    }
+
+    set_format(&server.pf);
+    server.width = frames[0].width;
+    server.height = frames[0].height;
+    server.linesize = server.width * 4;
+    display.server = &server;
+
+    encoder_init(&enc[nenc++], "raw", VNC_ENCODING_RAW, 0, compression, -1);
+    encoder_init(&enc[nenc++], "zlib", VNC_ENCODING_ZLIB, 0, compression, -1);
+    encoder_init(&enc[nenc++], "tight", VNC_ENCODING_TIGHT, 0, compression,
+                 -1);
+#ifdef CONFIG_VNC_JPEG
+    encoder_init(&enc[nenc++], "tight+jpeg", VNC_ENCODING_TIGHT, 0,
+                 compression, quality);
+#endif
+    encoder_init(&enc[nenc++], "zrle", VNC_ENCODING_ZRLE, 0, compression, -1);
+    encoder_init(&enc[nenc++], "auto", VNC_ENCODING_TIGHT,
+                 VNC_FEATURE_TIGHT_MASK | VNC_FEATURE_ZRLE_MASK,
+                 compression, -1);
+
+    for (i = 0; i < nframes; i++) {
+        server.data = (uint8_t *)frames[i].data;
+        for (j = 0; j < nenc; j++) {
+            encode_frame(&enc[j], i ? &frames[i - 1] : NULL, &frames[i]);
+        }
+    }
+
+    printf("%d frames of %dx%d, compression %d, quality %d\n\n",
+           nframes, server.width, server.height, compression, quality);
+    printf("%-12s %10s %12s %12s %8s\n",
+           "encoding", "rects", "KB/frame", "ms/frame", "ratio");
+    for (j = 0; j < nenc; j++) {
+        printf("%-12s %10" PRIu64 " %12.1f %12.3f %8.2f\n",
+               enc[j].name, enc[j].rects,
+               enc[j].bytes / 1024.0 / nframes,
+               enc[j].cpu_ns / 1e6 / nframes,
+               (double)enc[0].bytes / enc[j].bytes);
+    }
+    return 0;
+}
@@ -146,6 +146,9 @@ int main(int argc, char **argv)
 #include "sysemu.h"
 #include "gdbstub.h"
 #include "qemu-timer.h"
+#include "qemu-poll.h"
+#include "qemu-prof.h"
+#include "qemu-prealloc.h"
 #include "qemu-char.h"
 #include "cache-utils.h"
 #include "block.h"
@@ -283,6 +286,14 @@ QTAILQ_HEAD(, FWBootEntry) fw_boot_order = QTAILQ_HEAD_INITIALIZER(fw_boot_order
 int nb_numa_nodes;
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
+int node_mem_policy[MAX_NODES];
+unsigned long *node_host_nodes[MAX_NODES];
+const char *const numa_policy_names[NUMA_POLICY_MAX] = {
+    [NUMA_POLICY_DEFAULT] = "default",
+    [NUMA_POLICY_PREFERRED] = "preferred",
+    [NUMA_POLICY_BIND] = "bind",
+    [NUMA_POLICY_INTERLEAVE] = "interleave",
+};
 
 static CPUState *cur_cpu;
 static CPUState *next_cpu;
@@ -943,6 +954,47 @@ static int64_t cpu_get_clock(void)
     }
 }
 
+/* The vm_clock state for readers without qemu_mutex, republished under a
+ * sequence count whenever timers_state changes it */
+static struct {
+    volatile unsigned int seq;
+    int64_t clock_offset;
+    int32_t ticks_enabled;
+} vm_clock_snapshot;
+
+static void vm_clock_publish(void)
+{
+    vm_clock_snapshot.seq++;
+    __sync_synchronize();
+    vm_clock_snapshot.clock_offset = timers_state.cpu_clock_offset;
+    vm_clock_snapshot.ticks_enabled = timers_state.cpu_ticks_enabled;
+    __sync_synchronize();
+    vm_clock_snapshot.seq++;
+}
+
+/* qemu_get_clock(vm_clock) for callers that do not hold qemu_mutex.
+ * Returns -1 if the clock cannot be read that way, as with -icount. */
+int qemu_get_vm_clock_unlocked(int64_t *now)
+{
+    unsigned int seq;
+    int64_t offset;
+    int32_t enabled;
+
+    if (use_icount) {
+        return -1;
+    }
+    do {
+        seq = vm_clock_snapshot.seq;
+        __sync_synchronize();
+        offset = vm_clock_snapshot.clock_offset;
+        enabled = vm_clock_snapshot.ticks_enabled;
+        __sync_synchronize();
+    } while ((seq & 1) || seq != vm_clock_snapshot.seq);
+
+    *now = enabled ? get_clock() + offset : offset;
+    return 0;
+}
+
 /* enable cpu_get_ticks() */
 void cpu_enable_ticks(void)
 {
@@ -950,6 +1002,7 @@ void cpu_enable_ticks(void)
         timers_state.cpu_ticks_offset -= cpu_get_real_ticks();
         timers_state.cpu_clock_offset -= get_clock();
         timers_state.cpu_ticks_enabled = 1;
+        vm_clock_publish();
     }
 }
 
@@ -961,6 +1014,7 @@ void cpu_disable_ticks(void)
         timers_state.cpu_ticks_offset = cpu_get_ticks();
         timers_state.cpu_clock_offset = cpu_get_clock();
         timers_state.cpu_ticks_enabled = 0;
+        vm_clock_publish();
     }
 }
 
@@ -984,9 +1038,20 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    uint64_t seq;               /* orders timers with equal expire_time */
+    int heap_index;             /* -1 if not pending */
 };
 
+/* Pending timers of one clock, as a binary min-heap on expire_time */
+typedef struct QEMUTimerHeap {
+    QEMUTimer **timers;
+    int n;
+    int size;
+    /* expire_time of timers[0], or INT64_MAX; the only field that the
+       alarm signal handler reads */
+    volatile int64_t expire;
+} QEMUTimerHeap;
+
 struct qemu_alarm_timer {
     char const *name;
     unsigned int flags;
@@ -999,6 +1064,7 @@ struct qemu_alarm_timer {
 
 #define ALARM_FLAG_DYNTICKS  0x1
 #define ALARM_FLAG_EXPIRED   0x2
+#define ALARM_FLAG_DEADLINE  0x4    /* no host timer, see deadline_start_timer */
 
 static inline int alarm_has_dynticks(struct qemu_alarm_timer *t)
 {
@@ -1018,6 +1084,9 @@ static void qemu_rearm_alarm_timer(struct qemu_alarm_timer *t)
 
 static struct qemu_alarm_timer *alarm_timer;
 
+/* Set while the main loop sleeps in main_loop_wait, under the global lock */
+static int main_loop_waiting;
+
 #ifdef _WIN32
 
 struct qemu_alarm_win32 {
@@ -1031,6 +1100,10 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t);
 
 #else
 
+static int deadline_start_timer(struct qemu_alarm_timer *t);
+static void deadline_stop_timer(struct qemu_alarm_timer *t);
+static void deadline_rearm_timer(struct qemu_alarm_timer *t);
+
 static int unix_start_timer(struct qemu_alarm_timer *t);
 static void unix_stop_timer(struct qemu_alarm_timer *t);
 
@@ -1117,6 +1190,9 @@ static void init_icount_adjust(void)
 
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
+    /* Preferred whenever vcpus do not run in the main loop thread */
+    {"deadline", ALARM_FLAG_DYNTICKS | ALARM_FLAG_DEADLINE,
+     deadline_start_timer, deadline_stop_timer, deadline_rearm_timer, NULL},
 #ifdef __linux__
     {"dynticks", ALARM_FLAG_DYNTICKS, dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
@@ -1205,7 +1281,8 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
-static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
+static QEMUTimerHeap timer_heaps[QEMU_NUM_CLOCKS];
+static uint64_t timer_seq;
 
 static QEMUClock *qemu_new_clock(int type)
 {
@@ -1218,6 +1295,7 @@ static QEMUClock *qemu_new_clock(int type)
     if (type == QEMU_CLOCK_HOST) {
         clock->last = get_clock_realtime();
     }
+    timer_heaps[type].expire = INT64_MAX;
     return clock;
 }
 
@@ -1229,60 +1307,121 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->heap_index = -1;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
     qemu_free(ts);
 }
 
-/* stop a timer, but do not dealloc it */
-void qemu_del_timer(QEMUTimer *ts)
+static inline int timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!timer_before(ts, h->timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
     }
+    timer_heap_set(h, i, ts);
 }
 
-/* modify the current timer so that it will be fired when current_time
-   >= expire_time. The corresponding callback will be called. */
-void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_down(QEMUTimerHeap *h, QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    int i = ts->heap_index;
 
-    qemu_del_timer(ts);
+    for (;;) {
+        int child = 2 * i + 1;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
+        if (child >= h->n) {
             break;
-        if (t->expire_time > expire_time)
+        }
+        if (child + 1 < h->n &&
+            timer_before(h->timers[child + 1], h->timers[child])) {
+            child++;
+        }
+        if (!timer_before(h->timers[child], ts)) {
             break;
-        pt = &t->next;
+        }
+        timer_heap_set(h, i, h->timers[child]);
+        i = child;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+static inline void timer_heap_update_expire(QEMUTimerHeap *h)
+{
+    h->expire = h->n ? h->timers[0]->expire_time : INT64_MAX;
+}
+
+/* true if a timer of the given clock is due at current_time */
+static inline int qemu_clock_expired(int type, int64_t current_time)
+{
+    return timer_heaps[type].expire <= current_time;
+}
+
+/* stop a timer, but do not dealloc it */
+void qemu_del_timer(QEMUTimer *ts)
+{
+    QEMUTimerHeap *h = &timer_heaps[ts->clock->type];
+    QEMUTimer *last;
+    int i = ts->heap_index;
+
+    if (i < 0) {
+        return;
+    }
+    ts->heap_index = -1;
+    last = h->timers[--h->n];
+    if (last != ts) {
+        timer_heap_set(h, i, last);
+        timer_heap_up(h, last);
+        timer_heap_down(h, last);
     }
+    timer_heap_update_expire(h);
+}
+
+/* modify the current timer so that it will be fired when current_time
+   >= expire_time. The corresponding callback will be called. */
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    QEMUTimerHeap *h = &timer_heaps[ts->clock->type];
+
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_seq++;
+    if (ts->heap_index >= 0) {
+        timer_heap_up(h, ts);
+        timer_heap_down(h, ts);
+    } else {
+        if (h->n == h->size) {
+            h->size = MAX(16, h->size * 2);
+            h->timers = qemu_realloc(h->timers, h->size * sizeof(*h->timers));
+        }
+        timer_heap_set(h, h->n++, ts);
+        timer_heap_up(h, ts);
+    }
+    timer_heap_update_expire(h);
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (ts->heap_index == 0) {
         if ((alarm_timer->flags & ALARM_FLAG_EXPIRED) == 0) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -1294,12 +1433,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index >= 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -1309,23 +1443,40 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
     return (timer_head->expire_time <= current_time);
 }
 
-static void qemu_run_timers(QEMUTimer **ptimer_head, int64_t current_time)
+static void qemu_run_timers(QEMUClock *clock)
 {
+    QEMUTimerHeap *h = &timer_heaps[clock->type];
+    int64_t current_time, start;
     QEMUTimer *ts;
+    QEMUTimerCB *cb;
 
-    for(;;) {
-        ts = *ptimer_head;
-        if (!ts || ts->expire_time > current_time)
+    if (!h->n) {
+        return;
+    }
+    current_time = qemu_get_clock(clock);
+    while (h->n) {
+        ts = h->timers[0];
+        if (ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
-        /* run the callback (the timer list can be modified) */
-        ts->cb(ts->opaque);
+        /* run the callback (the timer heap can be modified, and the
+           callback may free its own timer) */
+        cb = ts->cb;
+        start = qemu_prof_now();
+        cb(ts->opaque);
+        qemu_prof_handler(QEMU_PROF_TIMER, cb, start);
     }
 }
 
+static int qemu_timers_pending(void)
+{
+    return timer_heaps[QEMU_CLOCK_REALTIME].n ||
+           timer_heaps[QEMU_CLOCK_VIRTUAL].n ||
+           timer_heaps[QEMU_CLOCK_HOST].n;
+}
+
 int64_t qemu_get_clock(QEMUClock *clock)
 {
     int64_t now, last;
@@ -1396,11 +1547,18 @@ void qemu_get_timer(QEMUFile *f, QEMUTimer *ts)
     }
 }
 
+static int timers_post_load(void *opaque, int version_id)
+{
+    vm_clock_publish();
+    return 0;
+}
+
 static const VMStateDescription vmstate_timers = {
     .name = "timer",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = timers_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_INT64(cpu_ticks_offset, TimersState),
         VMSTATE_INT64(dummy, TimersState),
@@ -1450,12 +1608,10 @@ static void host_alarm_handler(int host_signum)
 #endif
     if (alarm_has_dynticks(alarm_timer) ||
         (!use_icount &&
-            qemu_timer_expired(active_timers[QEMU_CLOCK_VIRTUAL],
+            qemu_clock_expired(QEMU_CLOCK_VIRTUAL,
                                qemu_get_clock(vm_clock))) ||
-        qemu_timer_expired(active_timers[QEMU_CLOCK_REALTIME],
-                           qemu_get_clock(rt_clock)) ||
-        qemu_timer_expired(active_timers[QEMU_CLOCK_HOST],
-                           qemu_get_clock(host_clock))) {
+        qemu_clock_expired(QEMU_CLOCK_REALTIME, qemu_get_clock(rt_clock)) ||
+        qemu_clock_expired(QEMU_CLOCK_HOST, qemu_get_clock(host_clock))) {
         qemu_event_increment();
         if (alarm_timer) alarm_timer->flags |= ALARM_FLAG_EXPIRED;
 
@@ -1475,12 +1631,12 @@ static int64_t qemu_next_deadline(void)
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
 
-    if (active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
+    if (timer_heaps[QEMU_CLOCK_VIRTUAL].n) {
+        delta = timer_heaps[QEMU_CLOCK_VIRTUAL].expire -
                      qemu_get_clock(vm_clock);
     }
-    if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
+    if (timer_heaps[QEMU_CLOCK_HOST].n) {
+        int64_t hdelta = timer_heaps[QEMU_CLOCK_HOST].expire -
                  qemu_get_clock(host_clock);
         if (hdelta < delta)
             delta = hdelta;
@@ -1492,6 +1648,36 @@ static int64_t qemu_next_deadline(void)
     return delta;
 }
 
+/* Nanoseconds until the first timer of any clock is due, or -1 if no
+   timer can fire before something else wakes the main loop up. */
+static int64_t qemu_next_deadline_ns(void)
+{
+    int64_t delta = INT64_MAX;
+
+    if (timer_heaps[QEMU_CLOCK_VIRTUAL].n && !use_icount &&
+        runstate_is_running()) {
+        delta = timer_heaps[QEMU_CLOCK_VIRTUAL].expire -
+                qemu_get_clock(vm_clock);
+    }
+    if (timer_heaps[QEMU_CLOCK_HOST].n) {
+        delta = MIN(delta, timer_heaps[QEMU_CLOCK_HOST].expire -
+                           qemu_get_clock(host_clock));
+    }
+    if (timer_heaps[QEMU_CLOCK_REALTIME].n) {
+        /* rt_clock counts milliseconds; get_clock() has the rest */
+        int64_t expire = timer_heaps[QEMU_CLOCK_REALTIME].expire;
+
+        if (expire < INT64_MAX / 1000000) {
+            delta = MIN(delta, expire * 1000000 - get_clock());
+        }
+    }
+
+    if (delta == INT64_MAX) {
+        return -1;
+    }
+    return MAX(delta, 0);
+}
+
 #if defined(__linux__)
 static uint64_t qemu_next_deadline_dyntick(void)
 {
@@ -1503,8 +1689,8 @@ static uint64_t qemu_next_deadline_dyntick(void)
     else
         delta = (qemu_next_deadline() + 999) / 1000;
 
-    if (active_timers[QEMU_CLOCK_REALTIME]) {
-        rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time -
+    if (timer_heaps[QEMU_CLOCK_REALTIME].n) {
+        rtdelta = (timer_heaps[QEMU_CLOCK_REALTIME].expire -
                  qemu_get_clock(rt_clock))*1000;
         if (rtdelta < delta)
             delta = rtdelta;
@@ -1671,9 +1857,7 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     int64_t nearest_delta_us = INT64_MAX;
     int64_t current_us;
 
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!qemu_timers_pending())
         return;
 
     nearest_delta_us = qemu_next_deadline_dyntick();
@@ -1701,6 +1885,31 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
 
 #endif /* defined(__linux__) */
 
+/* The main loop sleeps exactly until the first timer is due (see
+   main_loop_wait), so there is no host timer and no signal.  This only
+   works if vcpus run in threads of their own; a TCG cpu executing in the
+   main loop thread can only be interrupted by a signal. */
+static int deadline_start_timer(struct qemu_alarm_timer *t)
+{
+#ifdef CONFIG_IOTHREAD
+    return 0;
+#else
+    return kvm_enabled() ? 0 : -1;
+#endif
+}
+
+static void deadline_stop_timer(struct qemu_alarm_timer *t)
+{
+}
+
+static void deadline_rearm_timer(struct qemu_alarm_timer *t)
+{
+    /* an earlier first timer must cut the current sleep short */
+    if (main_loop_waiting) {
+        qemu_notify_event();
+    }
+}
+
 static int unix_start_timer(struct qemu_alarm_timer *t)
 {
     struct sigaction act;
@@ -1788,9 +1997,7 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t)
 {
     struct qemu_alarm_win32 *data = t->priv;
 
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!qemu_timers_pending())
         return;
 
     timeKillEvent(data->timerId);
@@ -2412,6 +2619,43 @@ static void numa_add(const char *optarg)
 
             bitmap_set(node_cpumask[nodenr], value, endvalue-value+1);
         }
+        if (get_param_value(option, 128, "host-nodes", optarg) != 0) {
+            value = strtoull(option, &endptr, 10);
+            if (*endptr == '-') {
+                endvalue = strtoull(endptr+1, &endptr, 10);
+            } else {
+                endvalue = value;
+            }
+            if (*endptr || endvalue < value || endvalue >= MAX_HOST_NODES) {
+                fprintf(stderr, "qemu: invalid numa host-nodes: %s\n",
+                        option);
+                exit(1);
+            }
+            bitmap_set(node_host_nodes[nodenr], value, endvalue-value+1);
+            node_mem_policy[nodenr] = NUMA_POLICY_BIND;
+        }
+        if (get_param_value(option, 128, "policy", optarg) != 0) {
+            int policy;
+
+            for (policy = 0; policy < NUMA_POLICY_MAX; policy++) {
+                if (!strcmp(option, numa_policy_names[policy])) {
+                    break;
+                }
+            }
+            if (policy == NUMA_POLICY_MAX) {
+                fprintf(stderr, "qemu: invalid numa policy: %s\n", option);
+                exit(1);
+            }
+            node_mem_policy[nodenr] = policy;
+        }
+        if ((node_mem_policy[nodenr] == NUMA_POLICY_DEFAULT) !=
+            bitmap_empty(node_host_nodes[nodenr], MAX_HOST_NODES)) {
+            fprintf(stderr, "qemu: numa policy %s %s host-nodes\n",
+                    numa_policy_names[node_mem_policy[nodenr]],
+                    node_mem_policy[nodenr] == NUMA_POLICY_DEFAULT ?
+                    "does not take" : "requires");
+            exit(1);
+        }
         nb_numa_nodes++;
     }
     return;
@@ -2633,15 +2877,61 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_read;
     IOHandler *fd_write;
     int deleted;
+    /* the fd was readable while fd_read_poll refused data */
+    int read_disabled;
     void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
+    int events;                 /* registered with io_poll, -1 if stale */
     QLIST_ENTRY(IOHandlerRecord) next;
+    QLIST_ENTRY(IOHandlerRecord) poll_next;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/*
+ * Handlers with an fd_read_poll callback.  Their fd stays registered for
+ * reading whatever fd_read_poll says, and is filtered when it fires;
+ * only if it fires while fd_read_poll refuses data is it taken out of
+ * the set (read_disabled), since it would otherwise be reported ready on
+ * every wait.  Disabled handlers are checked again on every iteration.
+ */
+static QLIST_HEAD(, IOHandlerRecord) io_poll_handlers =
+    QLIST_HEAD_INITIALIZER(io_poll_handlers);
+
+static QEMUPoll *io_poll;
+static int io_handlers_deleted;
+
+static QEMUPoll *iohandler_poll(void)
+{
+    if (!io_poll) {
+        io_poll = qemu_poll_new();
+        if (!io_poll) {
+            perror("qemu_poll_new");
+            exit(1);
+        }
+    }
+    return io_poll;
+}
+
+/* Tell io_poll about the events ioh waits for, if they changed */
+static void iohandler_update(IOHandlerRecord *ioh)
+{
+    int events = 0;
+
+    if (!ioh->deleted) {
+        if (ioh->fd_read && !ioh->read_disabled) {
+            events |= QEMU_POLL_IN;
+        }
+        if (ioh->fd_write) {
+            events |= QEMU_POLL_OUT;
+        }
+    }
+    if (events != ioh->events) {
+        qemu_poll_set(iohandler_poll(), ioh->fd, events, ioh);
+        ioh->events = events;
+    }
+}
+
 static IOHandlerRecord *find_iohandler(int fd)
 {
     IOHandlerRecord *ioh;
@@ -2664,6 +2954,7 @@ void enable_write_fd_handler(int fd, IOHandler *fd_write)
     }
 
     ioh->fd_write = fd_write;
+    iohandler_update(ioh);
 }
 
 void disable_write_fd_handler(int fd)
@@ -2676,6 +2967,7 @@ void disable_write_fd_handler(int fd)
     }
 
     ioh->fd_write = NULL;
+    iohandler_update(ioh);
 }
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
@@ -2691,7 +2983,12 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
+                if (!ioh->deleted && ioh->fd_read_poll) {
+                    QLIST_REMOVE(ioh, poll_next);
+                }
                 ioh->deleted = 1;
+                io_handlers_deleted = 1;
+                iohandler_update(ioh);
                 break;
             }
         }
@@ -2701,14 +2998,26 @@ int qemu_set_fd_handler2(int fd,
                 goto found;
         }
         ioh = qemu_mallocz(sizeof(IOHandlerRecord));
+        ioh->deleted = 1;
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
+        if (!ioh->deleted && ioh->fd_read_poll) {
+            QLIST_REMOVE(ioh, poll_next);
+        }
         ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        ioh->read_disabled = 0;
+        /* Always push the registration: the fd may have been closed and
+         * reopened since it was last registered. */
+        ioh->events = -1;
+        if (fd_read_poll) {
+            QLIST_INSERT_HEAD(&io_poll_handlers, ioh, poll_next);
+        }
+        iohandler_update(ioh);
     }
     qemu_notify_event();
     return 0;
@@ -3130,17 +3439,31 @@ static QEMUMachine *find_default_machine(void)
 static void gui_update(void *opaque)
 {
     uint64_t interval = GUI_REFRESH_INTERVAL;
+    uint64_t idle_interval = 0;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl = ds->listeners;
 
     dpy_refresh(ds);
 
     while (dcl != NULL) {
-        if (dcl->gui_timer_interval &&
-            dcl->gui_timer_interval < interval)
+        if (dcl->idle) {
+            /* an idle listener that still has to poll (e.g. for its window
+               being restored) asks for it with its timer interval */
+            if (dcl->gui_timer_interval > idle_interval)
+                idle_interval = dcl->gui_timer_interval;
+        } else if (dcl->gui_timer_interval &&
+                   dcl->gui_timer_interval < interval) {
             interval = dcl->gui_timer_interval;
+        }
         dcl = dcl->next;
     }
+    if (dpy_is_idle(ds)) {
+        if (!idle_interval) {
+            /* restarted by dpy_set_idle() */
+            return;
+        }
+        interval = idle_interval;
+    }
     qemu_mod_timer(ds->gui_timer, interval + qemu_get_clock(rt_clock));
 }
 
@@ -3185,6 +3508,7 @@ static void vm_state_notify(int running, RunState state)
 void vm_start(void)
 {
     if (!runstate_is_running()) {
+        qemu_prealloc_wait();
         cpu_enable_ticks();
         runstate_set(RUN_STATE_RUNNING);
         vm_state_notify(1, RUN_STATE_RUNNING);
@@ -3927,10 +4251,11 @@ void vm_stop(RunState reason)
 
 void main_loop_wait(int timeout)
 {
-    IOHandlerRecord *ioh;
+    IOHandlerRecord *ioh, *pioh;
+    QEMUPollEvent events[QEMU_POLL_MAX_EVENTS];
     fd_set rfds, wfds, xfds;
-    int ret, nfds;
-    struct timeval tv;
+    int64_t timeout_ns, woken, start;
+    int ret, nfds, i, n;
 
     qemu_bh_update_timeout(&timeout);
 
@@ -3938,50 +4263,62 @@ void main_loop_wait(int timeout)
 
     /* poll any events */
     /* XXX: separate device handlers from system ones */
+    QLIST_FOREACH(ioh, &io_poll_handlers, poll_next) {
+        if (ioh->read_disabled && ioh->fd_read_poll(ioh->opaque) != 0) {
+            ioh->read_disabled = 0;
+            iohandler_update(ioh);
+        }
+    }
+
     nfds = -1;
     FD_ZERO(&rfds);
     FD_ZERO(&wfds);
     FD_ZERO(&xfds);
-    QLIST_FOREACH(ioh, &io_handlers, next) {
-        if (ioh->deleted)
-            continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-        if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-    }
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
+    timeout_ns = timeout < 0 ? -1 : timeout * 1000000LL;
+    if (alarm_timer && (alarm_timer->flags & ALARM_FLAG_DEADLINE)) {
+        int64_t deadline = qemu_next_deadline_ns();
 
-    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+        if (deadline >= 0 && (timeout_ns < 0 || deadline < timeout_ns)) {
+            timeout_ns = deadline;
+        }
+    }
 
+    main_loop_waiting = 1;
     qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    ret = qemu_poll_wait(iohandler_poll(), nfds + 1, &rfds, &wfds, &xfds,
+                         timeout_ns);
     qemu_mutex_lock_iothread();
+    main_loop_waiting = 0;
+    woken = qemu_prof_now();
     if (ret > 0) {
-        IOHandlerRecord *pioh;
-
-        QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
-                ioh->fd_read(ioh->opaque);
-                if (!(ioh->fd_read_poll && ioh->fd_read_poll(ioh->opaque)))
-                    FD_CLR(ioh->fd, &rfds);
+        n = qemu_poll_get_events(io_poll, events, ARRAY_SIZE(events));
+        for (i = 0; i < n; i++) {
+            ioh = events[i].opaque;
+            if (!ioh->deleted && ioh->fd_read &&
+                (events[i].revents & QEMU_POLL_IN)) {
+                if (ioh->fd_read_poll && ioh->fd_read_poll(ioh->opaque) == 0) {
+                    ioh->read_disabled = 1;
+                    iohandler_update(ioh);
+                } else {
+                    start = qemu_prof_now();
+                    ioh->fd_read(ioh->opaque);
+                    qemu_prof_handler(QEMU_PROF_FD_READ, ioh->fd_read, start);
+                }
             }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
+            if (!ioh->deleted && ioh->fd_write &&
+                (events[i].revents & QEMU_POLL_OUT)) {
+                start = qemu_prof_now();
                 ioh->fd_write(ioh->opaque);
+                qemu_prof_handler(QEMU_PROF_FD_WRITE, ioh->fd_write, start);
             }
         }
+    }
 
-	/* remove deleted IO handlers */
+    /* remove deleted IO handlers */
+    if (io_handlers_deleted) {
+        io_handlers_deleted = 0;
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
             if (ioh->deleted) {
                 QLIST_REMOVE(ioh, next);
@@ -4001,21 +4338,19 @@ void main_loop_wait(int timeout)
     /* vm time timers */
     if (runstate_is_running()) {
         if (!cur_cpu || likely(!(cur_cpu->singlestep_enabled & SSTEP_NOTIMER)))
-            qemu_run_timers(&active_timers[QEMU_CLOCK_VIRTUAL],
-                            qemu_get_clock(vm_clock));
+            qemu_run_timers(vm_clock);
     }
 
     /* real time timers */
-    qemu_run_timers(&active_timers[QEMU_CLOCK_REALTIME],
-                    qemu_get_clock(rt_clock));
+    qemu_run_timers(rt_clock);
 
-    qemu_run_timers(&active_timers[QEMU_CLOCK_HOST],
-                    qemu_get_clock(host_clock));
+    qemu_run_timers(host_clock);
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
     qemu_bh_poll();
 
+    qemu_prof_hist_add(&qemu_prof_dispatch, qemu_prof_now() - woken);
 }
 
 static int qemu_cpu_exec(CPUState *env)
@@ -5160,6 +5495,8 @@ int main(int argc, char **argv, char **envp)
     for (i = 0; i < MAX_NODES; i++) {
         node_mem[i] = 0;
         node_cpumask[i] = bitmap_new(MAX_CPUMASK_BITS);
+        node_mem_policy[i] = NUMA_POLICY_DEFAULT;
+        node_host_nodes[i] = bitmap_new(MAX_HOST_NODES);
     }
 
     assigned_devices_index = 0;
@@ -5746,6 +6083,23 @@ int main(int argc, char **argv, char **envp)
                 kvm_pit_reinject = 0;
                 break;
             }
+            case QEMU_OPTION_kvm_halt_poll: {
+                char *end;
+
+                kvm_halt_poll_ns = strtoll(optarg, &end, 10);
+                if (*end || kvm_halt_poll_ns < 0) {
+                    fprintf(stderr, "qemu: invalid halt polling time '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case QEMU_OPTION_kvm_exit_timing:
+                kvm_exit_timing = 1;
+                break;
+            case QEMU_OPTION_kvm_stats_file:
+                kvm_stats_path = optarg;
+                break;
 	    case QEMU_OPTION_enable_nesting: {
 		kvm_nested = 1;
 		break;
@@ -5878,6 +6232,18 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_mem_prealloc:
 		mem_prealloc = !mem_prealloc;
 		break;
+            case QEMU_OPTION_mem_prealloc_threads: {
+                char *end;
+
+                mem_prealloc_threads = strtol(optarg, &end, 10);
+                if (*end || mem_prealloc_threads < 1 ||
+                    mem_prealloc_threads > QEMU_PREALLOC_MAX_THREADS) {
+                    fprintf(stderr, "qemu: invalid -mem-prealloc-threads: "
+                            "%s\n", optarg);
+                    exit(1);
+                }
+                break;
+            }
 #endif
             case QEMU_OPTION_name:
                 qemu_name = qemu_strdup(optarg);
@@ -0,0 +1,146 @@
+/*
+ * QEMU VNC display driver: dirty map scanning
+ *
+ * Copyright (C) 2006 Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2006 Fabrice Bellard
+ * Copyright (C) 2009 Red Hat, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The dirty maps have one bit per VNC_DIRTY_PIXELS_PER_BIT pixels of a row.
+ * They are walked a word at a time with find_next_bit() and friends, so
+ * that clean parts of the screen cost one load per BITS_PER_LONG blocks.
+ */
+
+#include "vnc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* A block is VNC_DIRTY_PIXELS_PER_BIT pixels, i.e. 16, 32 or 64 bytes */
+static inline int vnc_block_equal(const uint8_t *a, const uint8_t *b,
+                                  int len)
+{
+#ifdef __SSE2__
+    __m128i diff;
+    int i;
+
+    if (len & 15) {
+        return memcmp(a, b, len) == 0;
+    }
+    /* Pixels that change usually change from the first one on, so test
+     * those early; the rest is checked without branches */
+    diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *)a),
+                         _mm_loadu_si128((const __m128i *)b));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+        != 0xffff) {
+        return 0;
+    }
+    for (i = 16; i < len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+        == 0xffff;
+#else
+    return memcmp(a, b, len) == 0;
+#endif
+}
+
+int vnc_dirty_refresh_row(unsigned long *dirty, unsigned long *changed,
+                          uint8_t *server, const uint8_t *guest,
+                          int bits, int block_bytes)
+{
+    int x, end, n = 0;
+
+    x = find_next_bit(dirty, bits, 0);
+    while (x < bits) {
+        int copy_from = -1;
+
+        end = find_next_zero_bit(dirty, bits, x);
+        bitmap_clear(dirty, x, end - x);
+        for (; x < end; x++) {
+            int offset = x * block_bytes;
+
+            if (vnc_block_equal(server + offset, guest + offset,
+                                block_bytes)) {
+                if (copy_from >= 0) {
+                    memcpy(server + copy_from, guest + copy_from,
+                           offset - copy_from);
+                    copy_from = -1;
+                }
+                continue;
+            }
+            /* Changed blocks are copied a run at a time */
+            if (copy_from < 0) {
+                copy_from = offset;
+            }
+            set_bit(x, changed);
+            n++;
+        }
+        if (copy_from >= 0) {
+            memcpy(server + copy_from, guest + copy_from,
+                   end * block_bytes - copy_from);
+        }
+        x = find_next_bit(dirty, bits, end);
+    }
+    return n;
+}
+
+int vnc_dirty_take_rect(unsigned long dirty[][BITS_TO_LONGS(VNC_DIRTY_BITS)],
+                        int width, int height, int *y,
+                        int *x, int *w, int *h)
+{
+    int bits = width / VNC_DIRTY_PIXELS_PER_BIT;
+
+    for (; *y < height; (*y)++) {
+        unsigned long *row = dirty[*y];
+        int first, last, i;
+
+        first = find_next_bit(row, bits, 0);
+        if (first >= bits) {
+            continue;
+        }
+
+        /* A single clean block between two runs costs less to send than
+         * a second rectangle header and encoder flush */
+        last = find_next_zero_bit(row, bits, first);
+        while (last + 1 < bits && test_bit(last + 1, row)) {
+            last = find_next_zero_bit(row, bits, last + 1);
+        }
+        bitmap_clear(row, first, last - first);
+
+        for (i = 1; *y + i < height; i++) {
+            if (!test_bit(first, dirty[*y + i])) {
+                break;
+            }
+            bitmap_clear(dirty[*y + i], first, last - first);
+        }
+
+        *x = first * VNC_DIRTY_PIXELS_PER_BIT;
+        *w = (last - first) * VNC_DIRTY_PIXELS_PER_BIT;
+        *h = i;
+        return 1;
+    }
+    return 0;
+}
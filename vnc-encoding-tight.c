@@ -0,0 +1,684 @@
+/*
+ * QEMU VNC display driver: tight encoding
+ *
+ * Copyright (C) 2006 Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2006 Fabrice Bellard
+ * Copyright (C) 2009 Red Hat, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "vnc.h"
+
+#ifdef CONFIG_VNC_JPEG
+#include <stdio.h>
+#include <jpeglib.h>
+#endif
+
+/* Largest rectangle sent with basic compression, in pixels */
+#define TIGHT_MAX_RECT_SIZE     65536
+
+/* Smallest rectangle worth a JPEG, in pixels */
+#define TIGHT_JPEG_MIN_SIZE     4096
+
+/* Mean prediction error per colour component below which an image is
+ * smooth enough for the gradient filter */
+#define TIGHT_GRADIENT_MAX_ERROR 8
+
+#define TIGHT_HASH_BITS         10
+#define TIGHT_HASH_SIZE         (1 << TIGHT_HASH_BITS)
+
+/* For each compression level: the deflate levels of the palette streams
+ * (two colours, more colours), of full-colour data and of gradient-filtered
+ * data, and the largest palette relative to the rectangle area. */
+static const struct {
+    int mono_level;
+    int idx_level;
+    int raw_level;
+    int gradient_level;
+    int palette_divisor;
+} tight_conf[10] = {
+    { 0, 0, 0, 0, 4 },
+    { 1, 1, 1, 1, 4 },
+    { 3, 3, 2, 2, 4 },
+    { 5, 5, 3, 4, 2 },
+    { 6, 6, 4, 5, 2 },
+    { 7, 7, 5, 6, 2 },
+    { 7, 7, 6, 7, 2 },
+    { 8, 8, 7, 8, 2 },
+    { 9, 9, 8, 9, 2 },
+    { 9, 9, 9, 9, 2 },
+};
+
+#ifdef CONFIG_VNC_JPEG
+static const int tight_jpeg_quality[10] = {
+    10, 20, 30, 40, 50, 60, 70, 80, 88, 95
+};
+#endif
+
+enum {
+    TIGHT_STREAM_RAW,
+    TIGHT_STREAM_MONO,
+    TIGHT_STREAM_INDEXED,
+    TIGHT_STREAM_GRADIENT,
+};
+
+typedef struct TightPalette {
+    int size;
+    int max;
+    uint32_t colors[256];
+    uint32_t keys[TIGHT_HASH_SIZE];
+    int16_t index[TIGHT_HASH_SIZE];     /* -1 for a free slot */
+} TightPalette;
+
+static inline uint32_t tight_get_pixel(const uint8_t *p, int bpp)
+{
+    switch (bpp) {
+    case 4:
+        return *(const uint32_t *)p;
+    case 2:
+        return *(const uint16_t *)p;
+    default:
+        return *p;
+    }
+}
+
+static inline uint8_t *tight_row(VncState *vs, int x, int y)
+{
+    DisplaySurface *server = vs->vd->server;
+
+    return server->data + y * server->linesize +
+           x * server->pf.bytes_per_pixel;
+}
+
+static inline void tight_pixel_rgb(const PixelFormat *pf, uint32_t v,
+                                   uint8_t *rgb)
+{
+    rgb[0] = ((v & pf->rmask) >> pf->rshift) << (8 - pf->rbits);
+    rgb[1] = ((v & pf->gmask) >> pf->gshift) << (8 - pf->gbits);
+    rgb[2] = ((v & pf->bmask) >> pf->bshift) << (8 - pf->bbits);
+}
+
+/* Clients with 24-bit colour in 32-bit pixels get 3-byte TPIXELs */
+static int tight_pixel24(VncState *vs)
+{
+    PixelFormat *pf = &vs->clientds.pf;
+
+    return pf->bytes_per_pixel == 4 && pf->depth == 24 &&
+           pf->rmax == 0xff && pf->gmax == 0xff && pf->bmax == 0xff;
+}
+
+static int tight_pixel_size(VncState *vs)
+{
+    return tight_pixel24(vs) ? 3 : vs->clientds.pf.bytes_per_pixel;
+}
+
+static void tight_write_pixel(VncState *vs, uint8_t *buf, uint32_t v)
+{
+    if (tight_pixel24(vs)) {
+        tight_pixel_rgb(&vs->vd->server->pf, v, buf);
+    } else {
+        vnc_convert_pixel(vs, buf, v);
+    }
+}
+
+static int tight_jpeg_ok(VncState *vs, int w, int h)
+{
+#ifdef CONFIG_VNC_JPEG
+    return vs->tight_quality >= 0 && vs->clientds.pf.bytes_per_pixel >= 2 &&
+           vs->vd->server->pf.bytes_per_pixel >= 2 &&
+           w * h >= TIGHT_JPEG_MIN_SIZE;
+#else
+    return 0;
+#endif
+}
+
+static void tight_palette_init(TightPalette *pal, int max)
+{
+    pal->size = 0;
+    pal->max = max;
+    memset(pal->index, -1, sizeof(pal->index));
+}
+
+static inline int tight_palette_slot(TightPalette *pal, uint32_t v)
+{
+    int i = (v * 2654435761U) >> (32 - TIGHT_HASH_BITS);
+
+    while (pal->index[i] >= 0 && pal->keys[i] != v) {
+        i = (i + 1) & (TIGHT_HASH_SIZE - 1);
+    }
+    return i;
+}
+
+/* Add @v to the palette; returns false once it would grow beyond max */
+static inline bool tight_palette_add(TightPalette *pal, uint32_t v)
+{
+    int i = tight_palette_slot(pal, v);
+
+    if (pal->index[i] < 0) {
+        if (pal->size == pal->max) {
+            return false;
+        }
+        pal->keys[i] = v;
+        pal->index[i] = pal->size;
+        pal->colors[pal->size++] = v;
+    }
+    return true;
+}
+
+static inline int tight_palette_index(TightPalette *pal, uint32_t v)
+{
+    return pal->index[tight_palette_slot(pal, v)];
+}
+
+/* Collect the colours of the area; returns false if there are more than
+ * the palette can hold */
+static bool tight_fill_palette(VncState *vs, TightPalette *pal,
+                               int x, int y, int w, int h)
+{
+    int bpp = vs->vd->server->pf.bytes_per_pixel;
+    int dx, dy;
+
+    for (dy = 0; dy < h; dy++) {
+        uint8_t *p = tight_row(vs, x, y + dy);
+        uint32_t last = tight_get_pixel(p, bpp);
+
+        if (!tight_palette_add(pal, last)) {
+            return false;
+        }
+        for (dx = 1, p += bpp; dx < w; dx++, p += bpp) {
+            uint32_t v = tight_get_pixel(p, bpp);
+
+            if (v != last) {
+                if (!tight_palette_add(pal, v)) {
+                    return false;
+                }
+                last = v;
+            }
+        }
+    }
+    return true;
+}
+
+static int tight_palette_max(VncState *vs, int w, int h)
+{
+    int divisor = tight_conf[vs->tight_compression].palette_divisor;
+
+    return MAX(2, MIN(256, w * h / divisor));
+}
+
+int vnc_tight_palette_size(VncState *vs, int x, int y, int w, int h)
+{
+    TightPalette pal;
+
+    tight_palette_init(&pal, tight_palette_max(vs, w, h));
+    return tight_fill_palette(vs, &pal, x, y, w, h) ? pal.size : 0;
+}
+
+/*
+ * Photos and video have many different colours close together, while text
+ * and drawings reuse a few.  Look at a grid of samples and call the area a
+ * photo if at least a quarter of them differ.
+ */
+int vnc_tight_is_photo(VncState *vs, int x, int y, int w, int h)
+{
+    int bpp = vs->vd->server->pf.bytes_per_pixel;
+    int step = w * h >= 256 * 256 ? 8 : 4;
+    int dx, dy, samples = 0;
+    TightPalette pal;
+
+    if (!tight_jpeg_ok(vs, w, h)) {
+        return 0;
+    }
+    tight_palette_init(&pal, 256);
+    for (dy = step / 2; dy < h; dy += step) {
+        uint8_t *row = tight_row(vs, x, y + dy);
+
+        for (dx = (dy / step) % step; dx < w; dx += step) {
+            tight_palette_add(&pal, tight_get_pixel(row + dx * bpp, bpp));
+            samples++;
+        }
+    }
+    return pal.size >= 64 && pal.size * 4 >= MIN(samples, 1024);
+}
+
+static void tight_send_compact_size(VncState *vs, size_t len)
+{
+    uint8_t buf[3];
+    int n = 0;
+
+    buf[n++] = len & 0x7f;
+    if (len > 0x7f) {
+        buf[n - 1] |= 0x80;
+        buf[n++] = (len >> 7) & 0x7f;
+        if (len > 0x3fff) {
+            buf[n - 1] |= 0x80;
+            buf[n++] = (len >> 14) & 0xff;
+        }
+    }
+    vnc_write(vs, buf, n);
+}
+
+/* Send the data in vs->tight.tight through zlib stream @stream_id */
+static int tight_compress_data(VncState *vs, int stream_id, int level)
+{
+    VncTight *tight = &vs->tight;
+    z_streamp zstream = &tight->stream[stream_id];
+    size_t bytes = tight->tight.offset;
+
+    if (bytes < VNC_TIGHT_MIN_TO_COMPRESS) {
+        vnc_write(vs, tight->tight.buffer, bytes);
+        return 0;
+    }
+
+    if (zstream->opaque != vs) {
+        memset(zstream, 0, sizeof(*zstream));
+        if (deflateInit2(zstream, level, Z_DEFLATED, MAX_WBITS,
+                         MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "VNC: error initializing tight zlib stream\n");
+            return -1;
+        }
+        zstream->opaque = vs;
+        tight->levels[stream_id] = level;
+    }
+
+    buffer_reset(&tight->zlib);
+    buffer_reserve(&tight->zlib, bytes + bytes / 100 + 64);
+    zstream->next_out = tight->zlib.buffer;
+    zstream->avail_out = tight->zlib.capacity;
+
+    if (tight->levels[stream_id] != level) {
+        if (deflateParams(zstream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        tight->levels[stream_id] = level;
+    }
+
+    zstream->next_in = tight->tight.buffer;
+    zstream->avail_in = bytes;
+    zstream->data_type = Z_BINARY;
+    if (deflate(zstream, Z_SYNC_FLUSH) != Z_OK || zstream->avail_in) {
+        fprintf(stderr, "VNC: error during tight compression\n");
+        return -1;
+    }
+
+    tight->zlib.offset = tight->zlib.capacity - zstream->avail_out;
+    tight_send_compact_size(vs, tight->zlib.offset);
+    vnc_write(vs, tight->zlib.buffer, tight->zlib.offset);
+    return 0;
+}
+
+static void tight_send_fill(VncState *vs, uint32_t color)
+{
+    uint8_t buf[4];
+
+    vnc_write_u8(vs, VNC_TIGHT_CCB_TYPE_FILL);
+    tight_write_pixel(vs, buf, color);
+    vnc_write(vs, buf, tight_pixel_size(vs));
+}
+
+static int tight_send_palette(VncState *vs, TightPalette *pal,
+                              int x, int y, int w, int h)
+{
+    int bpp = vs->vd->server->pf.bytes_per_pixel;
+    int psize = tight_pixel_size(vs);
+    Buffer *buf = &vs->tight.tight;
+    int stream_id, level, i, dx, dy;
+    uint8_t pixel[4];
+
+    if (pal->size == 2) {
+        stream_id = TIGHT_STREAM_MONO;
+        level = tight_conf[vs->tight_compression].mono_level;
+    } else {
+        stream_id = TIGHT_STREAM_INDEXED;
+        level = tight_conf[vs->tight_compression].idx_level;
+    }
+
+    vnc_write_u8(vs, (stream_id | VNC_TIGHT_CCB_BASIC_FILTER >> 4) << 4);
+    vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
+    vnc_write_u8(vs, pal->size - 1);
+    for (i = 0; i < pal->size; i++) {
+        tight_write_pixel(vs, pixel, pal->colors[i]);
+        vnc_write(vs, pixel, psize);
+    }
+
+    buffer_reset(buf);
+    if (pal->size == 2) {
+        int row_bytes = (w + 7) / 8;
+
+        buffer_reserve(buf, row_bytes * h);
+        memset(buf->buffer, 0, row_bytes * h);
+        for (dy = 0; dy < h; dy++) {
+            uint8_t *p = tight_row(vs, x, y + dy);
+            uint8_t *out = buf->buffer + dy * row_bytes;
+
+            for (dx = 0; dx < w; dx++, p += bpp) {
+                if (tight_get_pixel(p, bpp) == pal->colors[1]) {
+                    out[dx >> 3] |= 0x80 >> (dx & 7);
+                }
+            }
+        }
+        buf->offset = row_bytes * h;
+    } else {
+        buffer_reserve(buf, w * h);
+        for (dy = 0; dy < h; dy++) {
+            uint8_t *p = tight_row(vs, x, y + dy);
+            uint8_t *out = buf->buffer + dy * w;
+            uint32_t last = tight_get_pixel(p, bpp);
+            int idx = tight_palette_index(pal, last);
+
+            for (dx = 0; dx < w; dx++, p += bpp) {
+                uint32_t v = tight_get_pixel(p, bpp);
+
+                if (v != last) {
+                    last = v;
+                    idx = tight_palette_index(pal, v);
+                }
+                out[dx] = idx;
+            }
+        }
+        buf->offset = w * h;
+    }
+    return tight_compress_data(vs, stream_id, level);
+}
+
+/* Mean prediction error per component of the gradient filter, sampled on
+ * a few rows */
+static int tight_gradient_error(VncState *vs, int x, int y, int w, int h)
+{
+    PixelFormat *pf = &vs->vd->server->pf;
+    int bpp = pf->bytes_per_pixel;
+    uint64_t error = 0, samples = 0;
+    int dx, dy, c;
+
+    for (dy = 1; dy < h; dy += 8) {
+        uint8_t *up = tight_row(vs, x, y + dy - 1);
+        uint8_t *cur = tight_row(vs, x, y + dy);
+        uint8_t left[3], upleft[3], above[3], pix[3];
+
+        for (dx = 1; dx < w; dx++) {
+            tight_pixel_rgb(pf, tight_get_pixel(cur + (dx - 1) * bpp, bpp),
+                            left);
+            tight_pixel_rgb(pf, tight_get_pixel(up + (dx - 1) * bpp, bpp),
+                            upleft);
+            tight_pixel_rgb(pf, tight_get_pixel(up + dx * bpp, bpp), above);
+            tight_pixel_rgb(pf, tight_get_pixel(cur + dx * bpp, bpp), pix);
+            for (c = 0; c < 3; c++) {
+                int pred = left[c] + above[c] - upleft[c];
+
+                pred = MIN(MAX(pred, 0), 255);
+                error += abs(pix[c] - pred);
+            }
+            samples += 3;
+        }
+    }
+    return samples ? error / samples : INT_MAX;
+}
+
+/* Whether tight would send the area through the gradient filter */
+static int tight_is_smooth(VncState *vs, int x, int y, int w, int h)
+{
+    return tight_pixel24(vs) &&
+           tight_gradient_error(vs, x, y, w, h) < TIGHT_GRADIENT_MAX_ERROR;
+}
+
+static int tight_send_gradient(VncState *vs, int x, int y, int w, int h)
+{
+    PixelFormat *pf = &vs->vd->server->pf;
+    int bpp = pf->bytes_per_pixel;
+    Buffer *buf = &vs->tight.tight;
+    uint8_t *prev, *cur, *out;
+    int dx, dy, c;
+
+    vnc_write_u8(vs, (TIGHT_STREAM_GRADIENT |
+                      VNC_TIGHT_CCB_BASIC_FILTER >> 4) << 4);
+    vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
+
+    prev = qemu_mallocz(w * 3);
+    cur = qemu_malloc(w * 3);
+    buffer_reset(buf);
+    buffer_reserve(buf, w * h * 3);
+    out = buf->buffer;
+    for (dy = 0; dy < h; dy++) {
+        uint8_t *p = tight_row(vs, x, y + dy);
+        uint8_t *tmp;
+
+        for (dx = 0; dx < w; dx++, p += bpp) {
+            tight_pixel_rgb(pf, tight_get_pixel(p, bpp), cur + dx * 3);
+        }
+        for (dx = 0; dx < w; dx++) {
+            for (c = 0; c < 3; c++) {
+                int left = dx ? cur[(dx - 1) * 3 + c] : 0;
+                int upleft = dx ? prev[(dx - 1) * 3 + c] : 0;
+                int pred = left + prev[dx * 3 + c] - upleft;
+
+                pred = MIN(MAX(pred, 0), 255);
+                *out++ = cur[dx * 3 + c] - pred;
+            }
+        }
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    buf->offset = w * h * 3;
+    qemu_free(prev);
+    qemu_free(cur);
+
+    return tight_compress_data(vs, TIGHT_STREAM_GRADIENT,
+                   tight_conf[vs->tight_compression].gradient_level);
+}
+
+static int tight_send_full_color(VncState *vs, int x, int y, int w, int h)
+{
+    int bpp = vs->vd->server->pf.bytes_per_pixel;
+    int psize = tight_pixel_size(vs);
+    Buffer *buf = &vs->tight.tight;
+    uint8_t *out;
+    int dx, dy;
+
+    vnc_write_u8(vs, TIGHT_STREAM_RAW << 4);
+
+    buffer_reset(buf);
+    buffer_reserve(buf, w * h * psize);
+    out = buf->buffer;
+    for (dy = 0; dy < h; dy++) {
+        uint8_t *p = tight_row(vs, x, y + dy);
+
+        for (dx = 0; dx < w; dx++, p += bpp, out += psize) {
+            tight_write_pixel(vs, out, tight_get_pixel(p, bpp));
+        }
+    }
+    buf->offset = w * h * psize;
+
+    return tight_compress_data(vs, TIGHT_STREAM_RAW,
+                               tight_conf[vs->tight_compression].raw_level);
+}
+
+#ifdef CONFIG_VNC_JPEG
+
+static void tight_jpeg_init_destination(j_compress_ptr cinfo)
+{
+    VncState *vs = cinfo->client_data;
+    Buffer *buffer = &vs->tight.jpeg;
+
+    cinfo->dest->next_output_byte = buffer->buffer + buffer->offset;
+    cinfo->dest->free_in_buffer = buffer->capacity - buffer->offset;
+}
+
+static boolean tight_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    VncState *vs = cinfo->client_data;
+    Buffer *buffer = &vs->tight.jpeg;
+
+    buffer->offset = buffer->capacity;
+    buffer_reserve(buffer, 2048);
+    tight_jpeg_init_destination(cinfo);
+    return TRUE;
+}
+
+static void tight_jpeg_term_destination(j_compress_ptr cinfo)
+{
+    VncState *vs = cinfo->client_data;
+    Buffer *buffer = &vs->tight.jpeg;
+
+    buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
+}
+
+static int tight_send_jpeg(VncState *vs, int x, int y, int w, int h)
+{
+    PixelFormat *pf = &vs->vd->server->pf;
+    int bpp = pf->bytes_per_pixel;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_destination_mgr manager;
+    JSAMPROW row[1];
+    uint8_t *buf;
+    int dx, dy;
+
+    buffer_reset(&vs->tight.jpeg);
+    buffer_reserve(&vs->tight.jpeg, 2048);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.client_data = vs;
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, tight_jpeg_quality[vs->tight_quality], TRUE);
+
+    manager.init_destination = tight_jpeg_init_destination;
+    manager.empty_output_buffer = tight_jpeg_empty_output_buffer;
+    manager.term_destination = tight_jpeg_term_destination;
+    cinfo.dest = &manager;
+
+    buf = qemu_malloc(w * 3);
+    row[0] = buf;
+    jpeg_start_compress(&cinfo, TRUE);
+    for (dy = 0; dy < h; dy++) {
+        uint8_t *p = tight_row(vs, x, y + dy);
+
+        for (dx = 0; dx < w; dx++, p += bpp) {
+            tight_pixel_rgb(pf, tight_get_pixel(p, bpp), buf + dx * 3);
+        }
+        jpeg_write_scanlines(&cinfo, row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    qemu_free(buf);
+
+    vnc_write_u8(vs, VNC_TIGHT_CCB_TYPE_JPEG);
+    tight_send_compact_size(vs, vs->tight.jpeg.offset);
+    vnc_write(vs, vs->tight.jpeg.buffer, vs->tight.jpeg.offset);
+    return 0;
+}
+
+#endif /* CONFIG_VNC_JPEG */
+
+static int tight_send_subrect(VncState *vs, int x, int y, int w, int h)
+{
+    TightPalette pal;
+
+    tight_palette_init(&pal, tight_palette_max(vs, w, h));
+    if (tight_fill_palette(vs, &pal, x, y, w, h)) {
+        if (pal.size == 1) {
+            tight_send_fill(vs, pal.colors[0]);
+            return 0;
+        }
+        return tight_send_palette(vs, &pal, x, y, w, h);
+    }
+
+#ifdef CONFIG_VNC_JPEG
+    if (vnc_tight_is_photo(vs, x, y, w, h)) {
+        vnc_sent_lossy_rect(vs, x, y, w, h);
+        return tight_send_jpeg(vs, x, y, w, h);
+    }
+#endif
+    if (tight_is_smooth(vs, x, y, w, h)) {
+        return tight_send_gradient(vs, x, y, w, h);
+    }
+    return tight_send_full_color(vs, x, y, w, h);
+}
+
+/*
+ * Clients that decode both tight and ZRLE, and prefer one of them, get each
+ * rectangle in whichever suits it: tight for areas with few colours (a fill
+ * or a palette), photos (JPEG) and smooth shading (the gradient filter),
+ * ZRLE for the rest, whose per-tile palettes and runs do better than tight's
+ * full-colour data.
+ */
+int vnc_select_encoding(VncState *vs, int x, int y, int w, int h)
+{
+    uint32_t both = VNC_FEATURE_TIGHT_MASK | VNC_FEATURE_ZRLE_MASK;
+
+    if ((vs->vnc_encoding != VNC_ENCODING_TIGHT &&
+         vs->vnc_encoding != VNC_ENCODING_ZRLE) ||
+        (vs->features & both) != both) {
+        return vs->vnc_encoding;
+    }
+    if (vnc_tight_palette_size(vs, x, y, w, h) ||
+        vnc_tight_is_photo(vs, x, y, w, h) ||
+        tight_is_smooth(vs, x, y, w, h)) {
+        return VNC_ENCODING_TIGHT;
+    }
+    return VNC_ENCODING_ZRLE;
+}
+
+int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    int dx, dy, n = 0;
+
+    for (dx = 0; dx < w; dx += VNC_TIGHT_MAX_RECT_WIDTH) {
+        int cw = MIN(VNC_TIGHT_MAX_RECT_WIDTH, w - dx);
+        int rows = MAX(1, TIGHT_MAX_RECT_SIZE / cw);
+
+        for (dy = 0; dy < h; dy += rows) {
+            int ch = MIN(rows, h - dy);
+
+            vnc_framebuffer_update(vs, x + dx, y + dy, cw, ch,
+                                   VNC_ENCODING_TIGHT);
+            if (tight_send_subrect(vs, x + dx, y + dy, cw, ch) < 0) {
+                vnc_client_error(vs);
+                return n;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+void vnc_tight_clear(VncState *vs)
+{
+    VncTight *tight = &vs->tight;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tight->stream); i++) {
+        if (tight->stream[i].opaque) {
+            deflateEnd(&tight->stream[i]);
+            tight->stream[i].opaque = NULL;
+        }
+    }
+    qemu_free(tight->tight.buffer);
+    qemu_free(tight->zlib.buffer);
+#ifdef CONFIG_VNC_JPEG
+    qemu_free(tight->jpeg.buffer);
+#endif
+    memset(tight, 0, sizeof(*tight));
+}
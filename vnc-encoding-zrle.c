@@ -0,0 +1,373 @@
+/*
+ * QEMU VNC display driver: ZRLE encoding
+ *
+ * Copyright (C) 2006 Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2006 Fabrice Bellard
+ * Copyright (C) 2009 Red Hat, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "vnc.h"
+
+/* Palette RLE allows up to 127 colours, packed palettes up to 16 */
+#define ZRLE_MAX_PALETTE        127
+#define ZRLE_MAX_PACKED         16
+
+#define ZRLE_HASH_BITS          8
+#define ZRLE_HASH_SIZE          (1 << ZRLE_HASH_BITS)
+
+enum {
+    ZRLE_RAW = 0,
+    ZRLE_SOLID = 1,
+    ZRLE_PLAIN_RLE = 128,
+};
+
+typedef struct ZrlePalette {
+    int size;
+    uint32_t colors[ZRLE_MAX_PALETTE];
+    uint32_t keys[ZRLE_HASH_SIZE];
+    int16_t index[ZRLE_HASH_SIZE];      /* -1 for a free slot */
+} ZrlePalette;
+
+/* How pixels go on the wire for this client */
+typedef struct ZrleFormat {
+    int size;                   /* CPIXEL size */
+    int offset;                 /* of the CPIXEL within a full pixel */
+    bool copy;                  /* client pixels are server pixels */
+} ZrleFormat;
+
+static inline uint32_t zrle_get_pixel(const uint8_t *p, int bpp)
+{
+    switch (bpp) {
+    case 4:
+        return *(const uint32_t *)p;
+    case 2:
+        return *(const uint16_t *)p;
+    default:
+        return *p;
+    }
+}
+
+static void zrle_init_format(VncState *vs, ZrleFormat *fmt)
+{
+    PixelFormat *pf = &vs->clientds.pf;
+    DisplaySurface *server = vs->vd->server;
+    bool big = vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG;
+
+    fmt->size = pf->bytes_per_pixel;
+    fmt->offset = 0;
+    fmt->copy = !memcmp(pf, &server->pf, sizeof(*pf)) &&
+        (vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG) ==
+        (server->flags & QEMU_BIG_ENDIAN_FLAG);
+
+    /* 24-bit colour in 32-bit pixels goes as three bytes */
+    if (pf->bytes_per_pixel == 4 && pf->depth <= 24) {
+        uint32_t mask = pf->rmask | pf->gmask | pf->bmask;
+
+        if (!(mask & 0xff000000)) {
+            fmt->size = 3;
+            fmt->offset = big ? 1 : 0;
+        } else if (!(mask & 0x000000ff)) {
+            fmt->size = 3;
+            fmt->offset = big ? 0 : 1;
+        }
+    }
+}
+
+static inline void zrle_put_pixel(VncState *vs, const ZrleFormat *fmt,
+                                  uint8_t *out, uint32_t v)
+{
+    uint8_t buf[4];
+
+    if (fmt->copy && fmt->size == 4) {
+        memcpy(out, &v, 4);
+        return;
+    } else if (fmt->copy && fmt->size == 3) {
+        memcpy(buf, &v, 4);
+    } else if (fmt->copy && fmt->size == 2) {
+        uint16_t v16 = v;
+
+        memcpy(out, &v16, 2);
+        return;
+    } else {
+        vnc_convert_pixel(vs, buf, v);
+    }
+    memcpy(out, buf + fmt->offset, fmt->size);
+}
+
+static void zrle_palette_init(ZrlePalette *pal)
+{
+    pal->size = 0;
+    memset(pal->index, -1, sizeof(pal->index));
+}
+
+static inline int zrle_palette_slot(ZrlePalette *pal, uint32_t v)
+{
+    int i = (v * 2654435761U) >> (32 - ZRLE_HASH_BITS);
+
+    while (pal->index[i] >= 0 && pal->keys[i] != v) {
+        i = (i + 1) & (ZRLE_HASH_SIZE - 1);
+    }
+    return i;
+}
+
+/* Returns false once the tile has too many colours for a palette */
+static inline bool zrle_palette_add(ZrlePalette *pal, uint32_t v)
+{
+    int i = zrle_palette_slot(pal, v);
+
+    if (pal->index[i] < 0) {
+        if (pal->size == ZRLE_MAX_PALETTE) {
+            return false;
+        }
+        pal->keys[i] = v;
+        pal->index[i] = pal->size;
+        pal->colors[pal->size++] = v;
+    }
+    return true;
+}
+
+static inline int zrle_palette_index(ZrlePalette *pal, uint32_t v)
+{
+    return pal->index[zrle_palette_slot(pal, v)];
+}
+
+static inline int zrle_run_bytes(int len)
+{
+    return (len - 1) / 255 + 1;
+}
+
+static inline uint8_t *zrle_put_run(uint8_t *out, int len)
+{
+    len--;
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = len;
+    return out;
+}
+
+static inline int zrle_packed_bits(int colors)
+{
+    return colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+}
+
+/* Encode one tile from @pix (w * h server pixels) into @out, choosing the
+ * smallest subencoding; returns the number of bytes written */
+static int zrle_encode_tile(VncState *vs, const ZrleFormat *fmt,
+                            const uint32_t *pix, int w, int h, uint8_t *out)
+{
+    int n = w * h, cs = fmt->size;
+    ZrlePalette pal;
+    bool palette = true;
+    int runs = 0, run_bytes = 0, single_runs = 0;
+    int raw_size, rle_size, prle_size = INT_MAX, packed_size = INT_MAX;
+    uint8_t *p = out;
+    int i, j;
+
+    zrle_palette_init(&pal);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && pix[j] == pix[i]; j++) {
+            /* nothing */
+        }
+        runs++;
+        run_bytes += zrle_run_bytes(j - i);
+        single_runs += (j - i == 1);
+        if (palette && !zrle_palette_add(&pal, pix[i])) {
+            palette = false;
+        }
+    }
+
+    if (palette && pal.size == 1) {
+        *p++ = ZRLE_SOLID;
+        zrle_put_pixel(vs, fmt, p, pix[0]);
+        return 1 + cs;
+    }
+
+    raw_size = n * cs;
+    rle_size = runs * cs + run_bytes;
+    if (palette) {
+        prle_size = pal.size * cs + runs + run_bytes - single_runs;
+        if (pal.size <= ZRLE_MAX_PACKED) {
+            packed_size = pal.size * cs +
+                (w * zrle_packed_bits(pal.size) + 7) / 8 * h;
+        }
+    }
+
+    if (packed_size <= prle_size && packed_size <= rle_size &&
+        packed_size <= raw_size) {
+        int bits = zrle_packed_bits(pal.size);
+        int x, y;
+
+        *p++ = pal.size;
+        for (i = 0; i < pal.size; i++, p += cs) {
+            zrle_put_pixel(vs, fmt, p, pal.colors[i]);
+        }
+        for (y = 0; y < h; y++) {
+            uint8_t byte = 0;
+            int shift = 8;
+
+            for (x = 0; x < w; x++) {
+                shift -= bits;
+                byte |= zrle_palette_index(&pal, pix[y * w + x]) << shift;
+                if (!shift) {
+                    *p++ = byte;
+                    byte = 0;
+                    shift = 8;
+                }
+            }
+            if (shift != 8) {
+                *p++ = byte;
+            }
+        }
+    } else if (prle_size <= rle_size && prle_size <= raw_size) {
+        *p++ = ZRLE_PLAIN_RLE + pal.size;
+        for (i = 0; i < pal.size; i++, p += cs) {
+            zrle_put_pixel(vs, fmt, p, pal.colors[i]);
+        }
+        for (i = 0; i < n; i = j) {
+            int idx = zrle_palette_index(&pal, pix[i]);
+
+            for (j = i + 1; j < n && pix[j] == pix[i]; j++) {
+                /* nothing */
+            }
+            if (j - i == 1) {
+                *p++ = idx;
+            } else {
+                *p++ = idx | 128;
+                p = zrle_put_run(p, j - i);
+            }
+        }
+    } else if (rle_size < raw_size) {
+        *p++ = ZRLE_PLAIN_RLE;
+        for (i = 0; i < n; i = j) {
+            for (j = i + 1; j < n && pix[j] == pix[i]; j++) {
+                /* nothing */
+            }
+            zrle_put_pixel(vs, fmt, p, pix[i]);
+            p = zrle_put_run(p + cs, j - i);
+        }
+    } else {
+        *p++ = ZRLE_RAW;
+        for (i = 0; i < n; i++, p += cs) {
+            zrle_put_pixel(vs, fmt, p, pix[i]);
+        }
+    }
+    return p - out;
+}
+
+static int zrle_compress_data(VncState *vs, int level)
+{
+    VncZrle *zrle = &vs->zrle;
+    z_streamp zstream = &zrle->stream;
+    size_t bytes = zrle->zrle.offset;
+
+    if (zstream->opaque != vs) {
+        memset(zstream, 0, sizeof(*zstream));
+        if (deflateInit2(zstream, level, Z_DEFLATED, MAX_WBITS,
+                         MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "VNC: error initializing ZRLE zlib stream\n");
+            return -1;
+        }
+        zstream->opaque = vs;
+        zrle->level = level;
+    }
+
+    buffer_reset(&zrle->zlib);
+    buffer_reserve(&zrle->zlib, bytes + bytes / 100 + 64);
+    zstream->next_out = zrle->zlib.buffer;
+    zstream->avail_out = zrle->zlib.capacity;
+
+    if (zrle->level != level) {
+        if (deflateParams(zstream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        zrle->level = level;
+    }
+
+    zstream->next_in = zrle->zrle.buffer;
+    zstream->avail_in = bytes;
+    zstream->data_type = Z_BINARY;
+    if (deflate(zstream, Z_SYNC_FLUSH) != Z_OK || zstream->avail_in) {
+        fprintf(stderr, "VNC: error during ZRLE compression\n");
+        return -1;
+    }
+
+    zrle->zlib.offset = zrle->zlib.capacity - zstream->avail_out;
+    vnc_write_u32(vs, zrle->zlib.offset);
+    vnc_write(vs, zrle->zlib.buffer, zrle->zlib.offset);
+    return 0;
+}
+
+int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    DisplaySurface *server = vs->vd->server;
+    int bpp = server->pf.bytes_per_pixel;
+    uint32_t pix[VNC_ZRLE_TILE * VNC_ZRLE_TILE];
+    Buffer *buf = &vs->zrle.zrle;
+    ZrleFormat fmt;
+    int tx, ty, dx, dy;
+
+    zrle_init_format(vs, &fmt);
+    buffer_reset(buf);
+
+    for (ty = 0; ty < h; ty += VNC_ZRLE_TILE) {
+        int th = MIN(VNC_ZRLE_TILE, h - ty);
+
+        for (tx = 0; tx < w; tx += VNC_ZRLE_TILE) {
+            int tw = MIN(VNC_ZRLE_TILE, w - tx);
+            uint32_t *q = pix;
+
+            for (dy = 0; dy < th; dy++) {
+                uint8_t *p = server->data + (y + ty + dy) * server->linesize +
+                             (x + tx) * bpp;
+
+                for (dx = 0; dx < tw; dx++, p += bpp) {
+                    *q++ = zrle_get_pixel(p, bpp);
+                }
+            }
+
+            /* Worst case is a raw tile */
+            buffer_reserve(buf, 1 + tw * th * fmt.size);
+            buf->offset += zrle_encode_tile(vs, &fmt, pix, tw, th,
+                                            buf->buffer + buf->offset);
+        }
+    }
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_ZRLE);
+    if (zrle_compress_data(vs, vs->tight_compression) < 0) {
+        vnc_client_error(vs);
+    }
+    return 1;
+}
+
+void vnc_zrle_clear(VncState *vs)
+{
+    VncZrle *zrle = &vs->zrle;
+
+    if (zrle->stream.opaque) {
+        deflateEnd(&zrle->stream);
+    }
+    qemu_free(zrle->zrle.buffer);
+    qemu_free(zrle->zlib.buffer);
+    memset(zrle, 0, sizeof(*zrle));
+}
@@ -0,0 +1,326 @@
+/*
+ * QEMU VNC display driver: encoding jobs
+ *
+ * Copyright (C) 2006 Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2006 Fabrice Bellard
+ * Copyright (C) 2009 Red Hat, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Framebuffer updates are encoded by a small pool of threads, so that the
+ * iothread only has to find the dirty rectangles and copy their pixels.
+ *
+ * A client has at most one job in flight.  The job is encoded with the
+ * client's VncShadow: a copy of the parameters that affect encoding, the
+ * encoders' own state (zlib streams and buffers), and a snapshot of the
+ * job's rectangles taken when it was queued.  Finished jobs are handed
+ * back through a pipe and their output is appended to the client's output
+ * buffer by the iothread, which also waits for the job in flight whenever
+ * something has to be sent after it (vnc_jobs_join()).
+ */
+
+#include "vnc.h"
+#include "qemu-thread.h"
+
+#include <signal.h>
+
+#define VNC_JOBS_MAX_THREADS    4
+
+typedef struct VncRect {
+    int x, y, w, h;
+} VncRect;
+
+struct VncJob {
+    VncState *vs;
+    VncRect *rects;
+    int nrects;
+    int max_rects;
+    bool done;
+    QTAILQ_ENTRY(VncJob) next;
+};
+
+typedef struct VncJobQueue {
+    QemuMutex lock;
+    QemuCond cond;              /* a job was queued */
+    QemuCond done_cond;         /* a job was encoded */
+    QTAILQ_HEAD(, VncJob) jobs;
+    QTAILQ_HEAD(, VncJob) done;
+    int notify[2];
+} VncJobQueue;
+
+static VncJobQueue *queue;
+
+static void vnc_job_encode(VncJob *job)
+{
+    VncState *vs = &job->vs->shadow->vs;
+    int i, n = 0, saved_offset;
+
+    buffer_reset(&vs->output);
+    vnc_write_u8(vs, 0);  /* msg id */
+    vnc_write_u8(vs, 0);
+    saved_offset = vs->output.offset;
+    vnc_write_u16(vs, 0);
+
+    for (i = 0; i < job->nrects; i++) {
+        VncRect *r = &job->rects[i];
+
+        n += vnc_send_framebuffer_update(vs, r->x, r->y, r->w, r->h);
+    }
+    vs->output.buffer[saved_offset] = (n >> 8) & 0xFF;
+    vs->output.buffer[saved_offset + 1] = n & 0xFF;
+}
+
+static void *vnc_worker_thread(void *opaque)
+{
+    sigset_t set;
+    VncJob *job;
+    char c = 0;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        qemu_mutex_lock(&queue->lock);
+        while (QTAILQ_EMPTY(&queue->jobs)) {
+            qemu_cond_wait(&queue->cond, &queue->lock);
+        }
+        job = QTAILQ_FIRST(&queue->jobs);
+        QTAILQ_REMOVE(&queue->jobs, job, next);
+        qemu_mutex_unlock(&queue->lock);
+
+        vnc_job_encode(job);
+
+        qemu_mutex_lock(&queue->lock);
+        job->done = true;
+        QTAILQ_INSERT_TAIL(&queue->done, job, next);
+        qemu_cond_broadcast(&queue->done_cond);
+        qemu_mutex_unlock(&queue->lock);
+
+        if (write(queue->notify[1], &c, 1) < 0 && errno != EAGAIN) {
+            perror("vnc: notify");
+        }
+    }
+    return NULL;
+}
+
+/* Send the output of a finished job and drop it */
+static void vnc_job_finish(VncJob *job)
+{
+    VncState *vs = job->vs;
+    VncState *svs = &vs->shadow->vs;
+    Buffer *output = &svs->output;
+    int i;
+
+    /* The update is truncated after an encoder error, and would leave the
+     * client out of sync with the rectangle count */
+    if (svs->job_error) {
+        svs->job_error = 0;
+        vnc_client_error(vs);
+    } else if (vs->csock != -1) {
+        vnc_write(vs, output->buffer, output->offset);
+    }
+    buffer_reset(output);
+    if (svs->has_lossy) {
+        for (i = 0; i < ARRAY_SIZE(vs->lossy); i++) {
+            bitmap_or(vs->lossy[i], vs->lossy[i], svs->lossy[i],
+                      VNC_MAX_WIDTH / VNC_LOSSY_BLOCK);
+        }
+        memset(svs->lossy, 0, sizeof(svs->lossy));
+        svs->has_lossy = 0;
+        vs->has_lossy = 1;
+    }
+    vs->job = NULL;
+    qemu_free(job->rects);
+    qemu_free(job);
+    vnc_flush(vs);
+}
+
+static void vnc_jobs_read(void *opaque)
+{
+    char buf[64];
+    VncJob *job;
+
+    while (read(queue->notify[0], buf, sizeof(buf)) > 0) {
+        /* drain */
+    }
+
+    for (;;) {
+        qemu_mutex_lock(&queue->lock);
+        job = QTAILQ_FIRST(&queue->done);
+        if (job) {
+            QTAILQ_REMOVE(&queue->done, job, next);
+        }
+        qemu_mutex_unlock(&queue->lock);
+        if (!job) {
+            break;
+        }
+        vnc_job_finish(job);
+    }
+}
+
+void vnc_jobs_init(void)
+{
+    QemuThread thread;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (queue) {
+        return;
+    }
+
+    queue = qemu_mallocz(sizeof(*queue));
+    qemu_mutex_init(&queue->lock);
+    qemu_cond_init(&queue->cond);
+    qemu_cond_init(&queue->done_cond);
+    QTAILQ_INIT(&queue->jobs);
+    QTAILQ_INIT(&queue->done);
+
+    if (qemu_pipe(queue->notify) < 0) {
+        perror("vnc: pipe");
+        exit(1);
+    }
+    fcntl(queue->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(queue->notify[1], F_SETFL, O_NONBLOCK);
+    qemu_set_fd_handler(queue->notify[0], vnc_jobs_read, NULL, NULL);
+
+    for (i = 0; i < MIN(MAX(ncpus, 1), VNC_JOBS_MAX_THREADS); i++) {
+        qemu_thread_create(&thread, vnc_worker_thread, NULL);
+    }
+}
+
+VncJob *vnc_job_new(VncState *vs)
+{
+    VncShadow *shadow = vs->shadow;
+    VncState *svs = &shadow->vs;
+    DisplaySurface *server = vs->vd->server;
+    size_t size = server->linesize * server->height;
+    uint8_t *data = shadow->server.data;
+    VncJob *job;
+
+    /* Only the rectangles of the job are copied into the snapshot, the
+     * rest is left over from earlier jobs */
+    if (size > shadow->server_size) {
+        data = qemu_realloc(data, size);
+        shadow->server_size = size;
+    }
+    shadow->server = *server;
+    shadow->server.data = data;
+
+    svs->features = vs->features;
+    svs->vnc_encoding = vs->vnc_encoding;
+    svs->tight_quality = vs->lossless ? -1 : vs->tight_quality;
+    svs->tight_compression = vs->tight_compression;
+    svs->client_width = vs->client_width;
+    svs->client_height = vs->client_height;
+    svs->write_pixels = vs->write_pixels;
+    svs->send_hextile_tile = vs->send_hextile_tile;
+    svs->clientds = vs->clientds;
+
+    job = qemu_mallocz(sizeof(*job));
+    job->vs = vs;
+    return job;
+}
+
+void vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
+{
+    DisplaySurface *server = job->vs->vd->server;
+    DisplaySurface *snapshot = &job->vs->shadow->server;
+    size_t offset = y * server->linesize + x * server->pf.bytes_per_pixel;
+    int i;
+
+    for (i = 0; i < h; i++, offset += server->linesize) {
+        memcpy(snapshot->data + offset, server->data + offset,
+               w * server->pf.bytes_per_pixel);
+    }
+
+    if (job->nrects == job->max_rects) {
+        job->max_rects = MAX(16, job->max_rects * 2);
+        job->rects = qemu_realloc(job->rects,
+                                  job->max_rects * sizeof(*job->rects));
+    }
+    job->rects[job->nrects].x = x;
+    job->rects[job->nrects].y = y;
+    job->rects[job->nrects].w = w;
+    job->rects[job->nrects].h = h;
+    job->nrects++;
+}
+
+void vnc_job_push(VncJob *job)
+{
+    job->vs->job = job;
+
+    qemu_mutex_lock(&queue->lock);
+    QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+    qemu_cond_signal(&queue->cond);
+    qemu_mutex_unlock(&queue->lock);
+}
+
+void vnc_jobs_join(VncState *vs)
+{
+    VncJob *job = vs->job;
+
+    if (!job) {
+        return;
+    }
+
+    qemu_mutex_lock(&queue->lock);
+    while (!job->done) {
+        qemu_cond_wait(&queue->done_cond, &queue->lock);
+    }
+    QTAILQ_REMOVE(&queue->done, job, next);
+    qemu_mutex_unlock(&queue->lock);
+
+    vnc_job_finish(job);
+}
+
+void vnc_jobs_client_init(VncState *vs)
+{
+    VncShadow *shadow = qemu_mallocz(sizeof(*shadow));
+
+    shadow->vs.csock = -1;
+    shadow->vs.vd = &shadow->vd;
+    shadow->vs.ds = &shadow->ds;
+    shadow->vd.server = &shadow->server;
+    shadow->ds.surface = &shadow->server;
+    vs->shadow = shadow;
+}
+
+void vnc_jobs_client_cleanup(VncState *vs)
+{
+    VncShadow *shadow = vs->shadow;
+    int i;
+
+    vnc_jobs_join(vs);
+
+    for (i = 0; i < ARRAY_SIZE(shadow->vs.zlib_stream); i++) {
+        if (shadow->vs.zlib_stream[i].opaque) {
+            deflateEnd(&shadow->vs.zlib_stream[i]);
+        }
+    }
+    vnc_tight_clear(&shadow->vs);
+    vnc_zrle_clear(&shadow->vs);
+    qemu_free(shadow->vs.zlib.buffer);
+    qemu_free(shadow->vs.output.buffer);
+    qemu_free(shadow->server.data);
+    qemu_free(shadow);
+    vs->shadow = NULL;
+}
@@ -34,6 +34,9 @@
 #define VNC_REFRESH_INTERVAL_BASE 30
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  2000
+/* Areas sent with JPEG are sent again losslessly once the client has had
+ * no update for this long */
+#define VNC_REFRESH_LOSSY         2000
 
 #include "vnc_keysym.h"
 #include "d3des.h"
@@ -384,7 +387,7 @@ static inline uint32_t vnc_has_feature(VncState *vs, int feature) {
    3) resolutions > 1024
 */
 
-static int vnc_update_client(VncState *vs, int has_dirty);
+static int vnc_update_client(VncState *vs);
 static void vnc_disconnect_start(VncState *vs);
 static void vnc_disconnect_finish(VncState *vs);
 static void vnc_init_timer(VncDisplay *vd);
@@ -397,50 +400,8 @@ static void framebuffer_update_request(VncState *vs, int incremental,
 static void vnc_refresh(void *opaque);
 static int vnc_refresh_server_surface(VncDisplay *vd);
 
-static inline void vnc_set_bit(uint32_t *d, int k)
-{
-    d[k >> 5] |= 1 << (k & 0x1f);
-}
-
-static inline void vnc_clear_bit(uint32_t *d, int k)
-{
-    d[k >> 5] &= ~(1 << (k & 0x1f));
-}
-
-static inline void vnc_set_bits(uint32_t *d, int n, int nb_words)
-{
-    int j;
-
-    j = 0;
-    while (n >= 32) {
-        d[j++] = -1;
-        n -= 32;
-    }
-    if (n > 0)
-        d[j++] = (1 << n) - 1;
-    while (j < nb_words)
-        d[j++] = 0;
-}
-
-static inline int vnc_get_bit(const uint32_t *d, int k)
-{
-    return (d[k >> 5] >> (k & 0x1f)) & 1;
-}
-
-static inline int vnc_and_bits(const uint32_t *d1, const uint32_t *d2,
-                               int nb_words)
-{
-    int i;
-    for(i = 0; i < nb_words; i++) {
-        if ((d1[i] & d2[i]) != 0)
-            return 1;
-    }
-    return 0;
-}
-
 static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
 {
-    int i;
     VncDisplay *vd = ds->opaque;
     struct VncSurface *s = &vd->guest;
 
@@ -458,13 +419,14 @@ static void vnc_dpy_update(DisplayState *ds, int x, int y, int w, int h)
     w = MIN(x + w, s->ds->width) - x;
     h = MIN(h, s->ds->height);
 
-    for (; y < h; y++)
-        for (i = 0; i < w; i += 16)
-            vnc_set_bit(s->dirty[y], (x + i) / 16);
+    for (; y < h; y++) {
+        bitmap_set(s->dirty[y], x / VNC_DIRTY_PIXELS_PER_BIT,
+                   DIV_ROUND_UP(w, VNC_DIRTY_PIXELS_PER_BIT));
+    }
 }
 
-static void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
-                                   int32_t encoding)
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding)
 {
     vnc_write_u16(vs, x);
     vnc_write_u16(vs, y);
@@ -551,9 +513,13 @@ static void vnc_dpy_resize(DisplayState *ds)
     memset(vd->guest.dirty, 0xFF, sizeof(vd->guest.dirty));
 
     QTAILQ_FOREACH(vs, &vd->clients, next) {
+        vnc_jobs_join(vs);
         vnc_colordepth(vs);
         vnc_desktop_resize(vs);
         memset(vs->dirty, 0xFF, sizeof(vs->dirty));
+        vs->has_dirty++;
+        memset(vs->lossy, 0, sizeof(vs->lossy));
+        vs->has_lossy = 0;
     }
 }
 
@@ -564,7 +530,7 @@ static void vnc_write_pixels_copy(VncState *vs, void *pixels, int size)
 }
 
 /* slowest but generic code. */
-static void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v)
 {
     uint8_t r, g, b;
     VncDisplay *vd = vs->vd;
@@ -828,9 +794,10 @@ static void send_framebuffer_update_zlib(VncState *vs, int x, int y, int w, int
     vs->output.offset = new_offset;
 }
 
-static void send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+/* Returns the number of rectangles sent */
+int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
 {
-    switch(vs->vnc_encoding) {
+    switch(vnc_select_encoding(vs, x, y, w, h)) {
         case VNC_ENCODING_ZLIB:
             send_framebuffer_update_zlib(vs, x, y, w, h);
             break;
@@ -838,15 +805,23 @@ static void send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
             vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_HEXTILE);
             send_framebuffer_update_hextile(vs, x, y, w, h);
             break;
+        case VNC_ENCODING_TIGHT:
+            return vnc_tight_send_framebuffer_update(vs, x, y, w, h);
+        case VNC_ENCODING_ZRLE:
+            return vnc_zrle_send_framebuffer_update(vs, x, y, w, h);
         default:
             vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_RAW);
             send_framebuffer_update_raw(vs, x, y, w, h);
             break;
     }
+    return 1;
 }
 
 static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
 {
+    /* the update flushed by vnc_dpy_copy() must arrive first */
+    vnc_jobs_join(vs);
+
     /* send bitblit op to the vnc client */
     vnc_write_u8(vs, 0);  /* msg id */
     vnc_write_u8(vs, 0);
@@ -869,8 +844,9 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     vnc_refresh_server_surface(vd);
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            vnc_jobs_join(vs);
             vs->force_update = 1;
-            vnc_update_client(vs, 1);
+            vnc_update_client(vs);
             /* vs might be free()ed here */
         }
     }
@@ -913,7 +889,8 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
             memmove(dst_row, src_row, cmp_bytes);
             QTAILQ_FOREACH(vs, &vd->clients, next) {
                 if (!vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
-                    vnc_set_bit(vs->dirty[y], ((x + dst_x) / 16));
+                    set_bit((x + dst_x) / 16, vs->dirty[y]);
+                    vs->has_dirty++;
                 }
             }
         }
@@ -929,82 +906,119 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     }
 }
 
-static int find_and_clear_dirty_height(struct VncState *vs,
-                                       int y, int last_x, int x)
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
 {
-    int h;
-    VncDisplay *vd = vs->vd;
+    int first = x / VNC_LOSSY_BLOCK;
+    int last = (x + w - 1) / VNC_LOSSY_BLOCK;
+    int i;
 
-    for (h = 1; h < (vd->server->height - y); h++) {
-        int tmp_x;
-        if (!vnc_get_bit(vs->dirty[y + h], last_x))
-            break;
-        for (tmp_x = last_x; tmp_x < x; tmp_x++)
-            vnc_clear_bit(vs->dirty[y + h], tmp_x);
+    for (i = y / VNC_LOSSY_BLOCK; i <= (y + h - 1) / VNC_LOSSY_BLOCK; i++) {
+        bitmap_set(vs->lossy[i], first, last - first + 1);
     }
+    vs->has_lossy = 1;
+}
 
-    return h;
+/* Mark the areas that were sent lossily dirty again */
+static void vnc_refresh_lossy(VncState *vs)
+{
+    int bits = VNC_MAX_WIDTH / VNC_LOSSY_BLOCK;
+    int height = vs->vd->server->height;
+    int i, x, y;
+
+    for (i = 0; i * VNC_LOSSY_BLOCK < height; i++) {
+        x = find_next_bit(vs->lossy[i], bits, 0);
+        for (; x < bits; x = find_next_bit(vs->lossy[i], bits, x + 1)) {
+            for (y = i * VNC_LOSSY_BLOCK;
+                 y < MIN((i + 1) * VNC_LOSSY_BLOCK, height); y++) {
+                bitmap_set(vs->dirty[y],
+                           x * VNC_LOSSY_BLOCK / VNC_DIRTY_PIXELS_PER_BIT,
+                           VNC_LOSSY_BLOCK / VNC_DIRTY_PIXELS_PER_BIT);
+            }
+            vs->has_dirty++;
+        }
+    }
+    memset(vs->lossy, 0, sizeof(vs->lossy));
+    vs->has_lossy = 0;
 }
 
-static int vnc_update_client(VncState *vs, int has_dirty)
+/* Whether the client asked for an update and may be sent one now */
+static int vnc_client_ready(VncState *vs, int64_t now)
+{
+    if (!vs->need_update || vs->csock == -1 || vs->job) {
+        return 0;
+    }
+    if (vs->force_update) {
+        return 1;
+    }
+    return (!vs->output.offset || vs->audio_cap) &&
+        now - vs->last_update >= vs->update_interval;
+}
+
+static int vnc_update_client(VncState *vs)
 {
     if (vs->need_update && vs->csock != -1) {
         VncDisplay *vd = vs->vd;
-        int y;
+        VncJob *job;
+        int x, y, w, h;
         int n_rectangles;
-        int saved_offset;
         int width, height;
+        int64_t now = qemu_get_clock(rt_clock);
+
+        if (vs->output.offset && !vs->audio_cap && !vs->force_update) {
+            /* kernel send buffers are full -> drop frames to throttle,
+             * and space out the updates until the client keeps up */
+            vs->update_interval = MIN(vs->update_interval +
+                                      VNC_REFRESH_INTERVAL_BASE,
+                                      VNC_REFRESH_INTERVAL_MAX);
+            return 0;
+        }
 
-        if (vs->output.offset && !vs->audio_cap && !vs->force_update)
-            /* kernel send buffers are full -> drop frames to throttle */
+        if (!vnc_client_ready(vs, now))
+            /* previous update still being encoded or rate limited, the
+             * dirty map keeps collecting changes until the next pass */
             return 0;
 
-        if (!has_dirty && !vs->audio_cap && !vs->force_update)
+        if (!vs->has_dirty && vs->has_lossy &&
+            now - vs->last_update >= VNC_REFRESH_LOSSY) {
+            /* the screen settled, replace the JPEG areas */
+            vnc_refresh_lossy(vs);
+            vs->lossless = 1;
+        }
+
+        if (!vs->has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
         /*
          * Send screen updates to the vnc client using the server
          * surface and server dirty map.  guest surface updates
          * happening in parallel don't disturb us, the next pass will
-         * send them to the client.
+         * send them to the client.  The dirty rectangles are copied
+         * into a job and encoded by a worker thread.
          */
+        job = vnc_job_new(vs);
         n_rectangles = 0;
-        vnc_write_u8(vs, 0);  /* msg id */
-        vnc_write_u8(vs, 0);
-        saved_offset = vs->output.offset;
-        vnc_write_u16(vs, 0);
 
         width = MIN(vd->server->width, vs->client_width);
         height = MIN(vd->server->height, vs->client_height);
 
-        for (y = 0; y < height; y++) {
-            int x;
-            int last_x = -1;
-            for (x = 0; x < width / 16; x++) {
-                if (vnc_get_bit(vs->dirty[y], x)) {
-                    if (last_x == -1) {
-                        last_x = x;
-                    }
-                    vnc_clear_bit(vs->dirty[y], x);
-                } else {
-                    if (last_x != -1) {
-                        int h = find_and_clear_dirty_height(vs, y, last_x, x);
-                        send_framebuffer_update(vs, last_x * 16, y, (x - last_x) * 16, h);
-                        n_rectangles++;
-                    }
-                    last_x = -1;
-                }
-            }
-            if (last_x != -1) {
-                int h = find_and_clear_dirty_height(vs, y, last_x, x);
-                send_framebuffer_update(vs, last_x * 16, y, (x - last_x) * 16, h);
-                n_rectangles++;
-            }
+        y = 0;
+        while (vnc_dirty_take_rect(vs->dirty, width, height, &y,
+                                   &x, &w, &h)) {
+            vnc_job_add_rect(job, x, y, w, h);
+            n_rectangles++;
         }
-        vs->output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
-        vs->output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
-        vnc_flush(vs);
+        vnc_job_push(job);
+        /* the job sends one FramebufferUpdate, which answers the
+         * client's request: wait for the next one */
+        vs->need_update = 0;
         vs->force_update = 0;
+        vs->has_dirty = 0;
+        vs->lossless = 0;
+        if (n_rectangles) {
+            vs->last_update = now;
+            vs->update_interval = MAX(vs->update_interval / 2,
+                                      vd->rate_interval);
+        }
         return n_rectangles;
     }
 
@@ -1091,6 +1105,7 @@ static void vnc_disconnect_start(VncState *vs)
 
 static void vnc_disconnect_finish(VncState *vs)
 {
+    vnc_jobs_client_cleanup(vs);
     vnc_qmp_event(vs, QEVENT_VNC_DISCONNECTED);
 
     if (vs->input.buffer) {
@@ -1116,7 +1131,7 @@ static void vnc_disconnect_finish(VncState *vs)
     QTAILQ_REMOVE(&vs->vd->clients, vs, next);
 
     if (QTAILQ_EMPTY(&vs->vd->clients)) {
-        dcl->idle = 1;
+        dpy_set_idle(vs->vd->ds, dcl, 1);
     }
 
     qemu_remove_mouse_mode_change_notifier(&vs->mouse_mode_notifier);
@@ -1154,6 +1169,12 @@ int vnc_client_io_error(VncState *vs, int ret, int last_errno)
 void vnc_client_error(VncState *vs)
 {
     VNC_DEBUG("Closing down client sock: protocol error\n");
+    /* Only the worker's shadow state, which has no shadow of its own,
+       has no socket: vnc_job_finish() disconnects the client for it */
+    if (!vs->shadow) {
+        vs->job_error = 1;
+        return;
+    }
     vnc_disconnect_start(vs);
 }
 
@@ -1765,12 +1786,22 @@ static void framebuffer_update_request(VncState *vs, int incremental,
         h = ds_get_height(vs->ds) - y_position;
 
     int i;
+    if (!vs->need_update) {
+        /* the display may not have been polled for this client so far */
+        VncDisplay *vd = vs->vd;
+        int64_t now = qemu_get_clock(rt_clock);
+
+        if (vd->timer &&
+            !qemu_timer_expired(vd->timer, now + VNC_REFRESH_INTERVAL_BASE)) {
+            qemu_mod_timer(vd->timer, now + VNC_REFRESH_INTERVAL_BASE);
+        }
+    }
     vs->need_update = 1;
     if (!incremental) {
         vs->force_update = 1;
         for (i = 0; i < h; i++) {
-            vnc_set_bits(vs->dirty[y_position + i],
-                         (ds_get_width(vs->ds) / 16), VNC_DIRTY_WORDS);
+            bitmap_set(vs->dirty[y_position + i], 0,
+                       ds_get_width(vs->ds) / VNC_DIRTY_PIXELS_PER_BIT);
         }
     }
 }
@@ -1800,11 +1831,12 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
     int i;
     unsigned int enc = 0;
 
-    vnc_zlib_init(vs);
+    vnc_jobs_join(vs);
+    vnc_zlib_init(&vs->shadow->vs);
     vs->features = 0;
     vs->vnc_encoding = 0;
     vs->tight_compression = 9;
-    vs->tight_quality = 9;
+    vs->tight_quality = -1;
     vs->absolute = -1;
 
     for (i = n_encodings - 1; i >= 0; i--) {
@@ -1824,6 +1856,14 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_ZLIB_MASK;
             vs->vnc_encoding = enc;
             break;
+        case VNC_ENCODING_TIGHT:
+            vs->features |= VNC_FEATURE_TIGHT_MASK;
+            vs->vnc_encoding = enc;
+            break;
+        case VNC_ENCODING_ZRLE:
+            vs->features |= VNC_FEATURE_ZRLE_MASK;
+            vs->vnc_encoding = enc;
+            break;
         case VNC_ENCODING_DESKTOPRESIZE:
             vs->features |= VNC_FEATURE_RESIZE_MASK;
             break;
@@ -1899,6 +1939,7 @@ static void set_pixel_format(VncState *vs,
         return;
     }
 
+    vnc_jobs_join(vs);
     vs->clientds = *(vs->vd->guest.ds);
     vs->clientds.pf.rmax = red_max;
     count_bits(vs->clientds.pf.rbits, red_max);
@@ -2402,45 +2443,36 @@ static int protocol_version(VncState *vs, uint8_t *version, size_t len)
 
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
-    int y;
+    int y, bits;
     uint8_t *guest_row;
     uint8_t *server_row;
     int cmp_bytes;
-    uint32_t width_mask[VNC_DIRTY_WORDS];
+    DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
     VncState *vs;
     int has_dirty = 0;
 
     /*
      * Walk through the guest dirty map.
-     * Check and copy modified bits from guest to server surface.
+     * Check and copy modified blocks from guest to server surface.
      * Update server dirty map.
      */
-    vnc_set_bits(width_mask, (ds_get_width(vd->ds) / 16), VNC_DIRTY_WORDS);
-    cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
+    bits = ds_get_width(vd->ds) / VNC_DIRTY_PIXELS_PER_BIT;
+    cmp_bytes = VNC_DIRTY_PIXELS_PER_BIT * ds_get_bytes_per_pixel(vd->ds);
     guest_row  = vd->guest.ds->data;
     server_row = vd->server->data;
+    bitmap_zero(changed, VNC_DIRTY_BITS);
     for (y = 0; y < vd->guest.ds->height; y++) {
-        if (vnc_and_bits(vd->guest.dirty[y], width_mask, VNC_DIRTY_WORDS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
-
-            guest_ptr  = guest_row;
-            server_ptr = server_row;
-
-            for (x = 0; x + 15 < vd->guest.ds->width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!vnc_get_bit(vd->guest.dirty[y], (x / 16)))
-                    continue;
-                vnc_clear_bit(vd->guest.dirty[y], (x / 16));
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    vnc_set_bit(vs->dirty[y], (x / 16));
-                }
-                has_dirty++;
+        int n = vnc_dirty_refresh_row(vd->guest.dirty[y], changed,
+                                      server_row, guest_row,
+                                      bits, cmp_bytes);
+        if (n) {
+            QTAILQ_FOREACH(vs, &vd->clients, next) {
+                bitmap_or(vs->dirty[y], vs->dirty[y], changed,
+                          VNC_DIRTY_BITS);
+                vs->has_dirty += n;
             }
+            bitmap_zero(changed, VNC_DIRTY_BITS);
+            has_dirty += n;
         }
         guest_row  += ds_get_linesize(vd->ds);
         server_row += ds_get_linesize(vd->ds);
@@ -2452,14 +2484,23 @@ static void vnc_refresh(void *opaque)
 {
     VncDisplay *vd = opaque;
     VncState *vs, *vn;
-    int has_dirty, rects = 0;
+    int has_dirty = 0, rects = 0;
+    int64_t now = qemu_get_clock(rt_clock);
 
-    vga_hw_update();
-
-    has_dirty = vnc_refresh_server_surface(vd);
+    /* Don't poll the guest's framebuffer when no client can take an
+     * update: none asked for one, or all are busy or rate limited */
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_client_ready(vs, now)) {
+            break;
+        }
+    }
+    if (vs) {
+        vga_hw_update();
+        has_dirty = vnc_refresh_server_surface(vd);
+    }
 
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
-        rects += vnc_update_client(vs, has_dirty);
+        rects += vnc_update_client(vs);
         /* vs might be free()ed here */
     }
     /* vd->timer could be NULL now if the last client disconnected,
@@ -2504,7 +2545,7 @@ static void vnc_connect(VncDisplay *vd, int csock)
     vs->csock = csock;
 
     VNC_DEBUG("New client on socket %d\n", csock);
-    dcl->idle = 0;
+    dpy_set_idle(vd->ds, dcl, 0);
     socket_set_nonblock(vs->csock);
     qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, vs);
 
@@ -2513,7 +2554,9 @@ static void vnc_connect(VncDisplay *vd, int csock)
     vnc_set_share_mode(vs, VNC_SHARE_MODE_CONNECTING);
 
     vs->vd = vd;
+    vs->update_interval = vd->rate_interval;
     vs->ds = vd->ds;
+    vnc_jobs_client_init(vs);
     vs->last_x = -1;
     vs->last_y = -1;
 
@@ -2571,6 +2614,7 @@ void vnc_display_init(DisplayState *ds)
     vs->ds = ds;
     vs->expires = TIME_MAX;
     QTAILQ_INIT(&vs->clients);
+    vnc_jobs_init();
 
     if (keyboard_layout)
         vs->kbd_layout = init_keyboard_layout(name2keysym, keyboard_layout);
@@ -2670,6 +2714,7 @@ int vnc_display_open(DisplayState *ds, const char *display)
     if (!(vs->display = strdup(display)))
         return -1;
     vs->share_policy = VNC_SHARE_POLICY_ALLOW_EXCLUSIVE;
+    vs->rate_interval = 0;
 
     options = display;
     while ((options = strchr(options, ','))) {
@@ -2732,6 +2777,16 @@ int vnc_display_open(DisplayState *ds, const char *display)
                 vs->display = NULL;
                 return -1;
             }
+        } else if (strncmp(options, "rate=", 5) == 0) {
+            int rate = atoi(options + 5);
+
+            if (rate <= 0) {
+                fprintf(stderr, "vnc rate= must be a positive number\n");
+                g_free(vs->display);
+                vs->display = NULL;
+                return -1;
+            }
+            vs->rate_interval = 1000 / rate;
         }
     }
 
@@ -32,6 +32,7 @@
 #include "console.h"
 #include "monitor.h"
 #include "audio/audio.h"
+#include "bitmap.h"
 #include <zlib.h>
 
 #include "keymaps.h"
@@ -58,6 +59,8 @@ typedef struct Buffer
 } Buffer;
 
 typedef struct VncState VncState;
+typedef struct VncJob VncJob;
+typedef struct VncShadow VncShadow;
 
 typedef int VncReadEvent(VncState *vs, uint8_t *data, size_t len);
 
@@ -71,7 +74,13 @@ typedef void VncSendHextileTile(VncState *vs,
 
 #define VNC_MAX_WIDTH 2560
 #define VNC_MAX_HEIGHT 2048
-#define VNC_DIRTY_WORDS (VNC_MAX_WIDTH / (16 * 32))
+
+/* Each bit of a dirty map row covers this many pixels */
+#define VNC_DIRTY_PIXELS_PER_BIT 16
+#define VNC_DIRTY_BITS (VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT)
+
+/* Areas sent with a lossy encoding are remembered in blocks of this size */
+#define VNC_LOSSY_BLOCK 64
 
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
@@ -87,10 +96,29 @@ typedef struct VncDisplay VncDisplay;
 
 struct VncSurface
 {
-    uint32_t dirty[VNC_MAX_HEIGHT][VNC_DIRTY_WORDS];
+    DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
     DisplaySurface *ds;
 };
 
+/* Tight encoder state; stream 0 carries full-colour data, 1 two-colour
+ * palettes, 2 larger palettes and 3 gradient-filtered data */
+typedef struct VncTight {
+    Buffer tight;           /* filtered pixel data */
+    Buffer zlib;            /* ... once compressed */
+    z_stream stream[4];
+    int levels[4];
+#ifdef CONFIG_VNC_JPEG
+    Buffer jpeg;
+#endif
+} VncTight;
+
+typedef struct VncZrle {
+    Buffer zrle;            /* all tiles of a rectangle */
+    Buffer zlib;
+    z_stream stream;
+    int level;
+} VncZrle;
+
 typedef enum VncShareMode {
     VNC_SHARE_MODE_CONNECTING = 1,
     VNC_SHARE_MODE_SHARED,
@@ -111,6 +139,7 @@ struct VncDisplay
     VncSharePolicy share_policy;
     QEMUTimer *timer;
     int timer_interval;
+    int rate_interval;          /* minimum ms between updates to a client */
     int lsock;
     DisplayState *ds;
     kbd_layout_t *kbd_layout;
@@ -136,11 +165,18 @@ struct VncState
     int csock;
 
     DisplayState *ds;
-    uint32_t dirty[VNC_MAX_HEIGHT][VNC_DIRTY_WORDS];
+    DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
 
     VncDisplay *vd;
     int need_update;
     int force_update;
+    int has_dirty;              /* blocks changed since the last update */
+    int64_t last_update;        /* rt_clock time the last update was sent */
+    int update_interval;        /* minimum ms until the next one */
+    int lossless;               /* send the next update without JPEG */
+    int has_lossy;
+    DECLARE_BITMAP(lossy[VNC_MAX_HEIGHT / VNC_LOSSY_BLOCK],
+                   VNC_MAX_WIDTH / VNC_LOSSY_BLOCK);
     uint32_t features;
     int absolute;
     int last_x;
@@ -150,8 +186,8 @@ struct VncState
     VncShareMode share_mode;
 
     uint32_t vnc_encoding;
-    uint8_t tight_quality;
-    uint8_t tight_compression;
+    int tight_quality;          /* JPEG quality level, -1 for no JPEG */
+    int tight_compression;
 
     int major;
     int minor;
@@ -185,11 +221,31 @@ struct VncState
     Buffer zlib;
     Buffer zlib_tmp;
     z_stream zlib_stream[4];
+    VncTight tight;
+    VncZrle zrle;
+
+    /* Updates are encoded by a worker thread using the shadow */
+    VncShadow *shadow;
+    VncJob *job;                /* update being encoded, if any */
+    int job_error;              /* an encoder failed, on the shadow */
 
     Notifier mouse_mode_notifier;
     QTAILQ_ENTRY(VncState) next;
 };
 
+/* The client as seen by the thread encoding its updates: the encoding
+ * parameters are copied from the client for each job, the encoders' zlib
+ * streams and buffers live here, and the rectangles being sent are copied
+ * into the server surface snapshot */
+struct VncShadow
+{
+    VncState vs;
+    VncDisplay vd;
+    DisplayState ds;
+    DisplaySurface server;
+    size_t server_size;
+};
+
 
 /*****************************************************************************
  *
@@ -270,6 +326,16 @@ enum {
 #define VNC_TIGHT_CCB_BASIC_ZLIB   (0x03 << 4)
 #define VNC_TIGHT_CCB_BASIC_FILTER (0x04 << 4)
 
+#define VNC_TIGHT_FILTER_COPY      0x00
+#define VNC_TIGHT_FILTER_PALETTE   0x01
+#define VNC_TIGHT_FILTER_GRADIENT  0x02
+
+/* Basic data shorter than this is sent uncompressed */
+#define VNC_TIGHT_MIN_TO_COMPRESS  12
+#define VNC_TIGHT_MAX_RECT_WIDTH   2048
+
+#define VNC_ZRLE_TILE              64
+
 /*****************************************************************************
  *
  * Features
@@ -283,6 +349,7 @@ enum {
 #define VNC_FEATURE_TIGHT                    4
 #define VNC_FEATURE_ZLIB                     5
 #define VNC_FEATURE_COPYRECT                 6
+#define VNC_FEATURE_ZRLE                     7
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -291,6 +358,7 @@ enum {
 #define VNC_FEATURE_TIGHT_MASK               (1 << VNC_FEATURE_TIGHT)
 #define VNC_FEATURE_ZLIB_MASK                (1 << VNC_FEATURE_ZLIB)
 #define VNC_FEATURE_COPYRECT_MASK            (1 << VNC_FEATURE_COPYRECT)
+#define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 
 
 /*****************************************************************************
@@ -337,6 +405,50 @@ void buffer_reset(Buffer *buffer);
 void buffer_append(Buffer *buffer, const void *data, size_t len);
 
 
+/* Encodings */
+int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
+                            int32_t encoding);
+void vnc_convert_pixel(VncState *vs, uint8_t *buf, uint32_t v);
+/* Called by encoders for areas the client did not get exactly */
+void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
+
+/* Return the number of rectangles sent */
+int vnc_tight_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+/* Colours in the area if tight would send it with a palette or as a fill,
+ * else 0 */
+int vnc_tight_palette_size(VncState *vs, int x, int y, int w, int h);
+/* Whether tight would send the area as JPEG */
+int vnc_tight_is_photo(VncState *vs, int x, int y, int w, int h);
+/* The encoding for the area, tight or ZRLE for clients that support both */
+int vnc_select_encoding(VncState *vs, int x, int y, int w, int h);
+void vnc_tight_clear(VncState *vs);
+
+int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_zrle_clear(VncState *vs);
+
+/* Encoding jobs */
+void vnc_jobs_init(void);
+void vnc_jobs_client_init(VncState *vs);
+void vnc_jobs_client_cleanup(VncState *vs);
+VncJob *vnc_job_new(VncState *vs);
+void vnc_job_add_rect(VncJob *job, int x, int y, int w, int h);
+void vnc_job_push(VncJob *job);
+/* Wait for the client's job in flight, if any, and send its output */
+void vnc_jobs_join(VncState *vs);
+
+/* Dirty maps */
+/* Copy the blocks of a row marked in dirty that differ from the server
+ * surface and mark them in changed; returns the number of such blocks */
+int vnc_dirty_refresh_row(unsigned long *dirty, unsigned long *changed,
+                          uint8_t *server, const uint8_t *guest,
+                          int bits, int block_bytes);
+/* Remove the next dirty rectangle at or below row *y from the map and
+ * return it in pixels; returns 0 once the map is clean */
+int vnc_dirty_take_rect(unsigned long dirty[][BITS_TO_LONGS(VNC_DIRTY_BITS)],
+                        int width, int height, int *y,
+                        int *x, int *w, int *h);
+
 /* Misc helpers */
 
 char *vnc_socket_local_addr(const char *format, int fd);